@@ -3,6 +3,7 @@
 #include "Log.hpp"
 #include "Handler.hpp"
 #include "Socket.hpp"
+#include "Config.hpp"
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -18,14 +19,28 @@ class Acceptor
 public:
     static void Accept(Event<ChatMessage>& listen_event)
     {
-        //listen_sock就绪，代表可能有多个连接就绪，必须while循环保证所有连接都被accept
-        sockaddr_in peer;
-        socklen_t peer_len = sizeof(peer);
+        //listen_sock就绪，代表可能有多个连接就绪，ET模式下必须一直accept到EAGAIN
+        //但一次最多accept accept_budget个，达到上限时重新挂上listen_sock，让本轮其他就绪事件先处理，下一轮继续accept
+        //防止重连风暴时已有连接的读写事件得不到处理
+        static const int budget = Config::GetInstance()->GetInt("accept_budget");
+        int accepted = 0;
         while(true){
-            int sock = accept(listen_event.sock_, (sockaddr*)&peer, &peer_len);
-            if(sock > 0){
-                //设置sock为非阻塞读写
-                Sock::SetNonBlock(sock);
+            if(accepted >= budget){
+                listen_event.pr_->Rearm(listen_event);
+                break;
+            }
+
+            //accept4直接得到非阻塞且exec时关闭的socket，省掉两次fcntl
+            int sock = accept4(listen_event.sock_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if(sock >= 0){
+                accepted++;
+
+                //过载时不再接收新连接，已经建立的连接不受影响
+                if(ThreadPool<ChatMessage, Protocol>::GetInstance()->IsOverloaded()){
+                    ThreadPool<ChatMessage, Protocol>::GetInstance()->CountShed(true);
+                    close(sock);
+                    continue;
+                }
 
                 //给新的sock建立Event，绑定回调函数，并且加入Reactor模型
                 Event<ChatMessage> new_event(sock, listen_event.pr_);
@@ -37,8 +52,8 @@ public:
                 LOG(INFO, std::string("Add new socket to reactor: ")+std::to_string(sock));
             }
             else{
-                if(errno == EINTR){
-                    //accept被信号中断
+                if(errno == EINTR || errno == ECONNABORTED){
+                    //accept被信号中断，或者连接在accept之前已经被对端重置
                     continue;
                 }
                 else if(errno == EAGAIN || errno == EWOULDBLOCK){
@@ -47,10 +62,9 @@ public:
                     break;
                 }
                 else{
-                    //真出错
-                    std::cerr << "accept error!" << errno << std::endl;
+                    //真出错，例如文件描述符耗尽，继续循环只会空转，留在队列中的连接等下一次就绪再accept
                     LOG(ERROR, std::string("Accept error: ")+std::to_string(errno));
-                    continue;
+                    break;
                 }
             }
         }
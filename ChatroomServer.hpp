@@ -3,41 +3,241 @@
 #include "TCPServer.hpp"
 #include "Acceptor.hpp"
 #include "Protocol.hpp"
+#include "Snapshot.hpp"
+#include "Upgrade.hpp"
+#include "DiskIO.hpp"
+#include "Config.hpp"
 #include "Log.hpp"
+#include <sys/stat.h>
+#include <signal.h>
+#include <ctime>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 
-#define PORT 8081
-
 class ChatroomServer
 {
 private:
     uint16_t port_;
+    bool upgrade_; //为true表示以热升级模式启动，从旧进程接收连接
     Reactor<ChatMessage>* pr_;
+
+    static volatile sig_atomic_t stop_;    //收到SIGTERM后置1，由Loop写完快照后退出
+    static volatile sig_atomic_t handoff_; //收到SIGUSR2后置1，由Loop把连接交给新进程
+    static volatile sig_atomic_t reload_;  //收到SIGHUP后置1，由Loop重新加载配置
+    static volatile sig_atomic_t dump_;    //收到SIGUSR1后置1，由Loop输出运行状态
+    static std::atomic<bool> saving_;      //防止定期快照任务重叠执行
+
+    static void StopHandler(int)
+    {
+        stop_ = 1;
+    }
+
+    static void HandOffHandler(int)
+    {
+        handoff_ = 1;
+    }
+
+    static void ReloadHandler(int)
+    {
+        reload_ = 1;
+    }
+
+    static void DumpHandler(int)
+    {
+        dump_ = 1;
+    }
+
+    //按配置创建存储目录，已经存在则什么都不做
+    static void MakeDirs()
+    {
+        Config* pc = Config::GetInstance();
+        mkdir(pc->GetString("message_dir").c_str(), 0777);
+        mkdir(pc->GetString("files_dir").c_str(), 0777);
+        std::string snapshot_path = pc->GetString("snapshot_path");
+        size_t pos = snapshot_path.rfind('/');
+        if(pos != std::string::npos && pos > 0){
+            mkdir(snapshot_path.substr(0, pos).c_str(), 0777);
+        }
+    }
+
 public:
-    ChatroomServer(uint16_t port = PORT):port_(port)
+    ChatroomServer(uint16_t port, bool upgrade = false):port_(port), upgrade_(upgrade)
     {
-        pr_ = new Reactor<ChatMessage>();
+        pr_ = new Reactor<ChatMessage>(Config::GetInstance()->GetInt("epoll_batch"), std::max<long long>(0, Config::GetInstance()->GetInt("conn_pool_size")));
     }
 
     void Loop()
     {
-        //创建listen_sock并加入Reactor模型
-        int listen_sock = TcpServer::GetInstance(port_)->GetLinstenSocket();
-        LOG(INFO, std::string("Listen_sock is set: ")+std::to_string(listen_sock));
+        signal(SIGTERM, StopHandler);
+        signal(SIGUSR2, HandOffHandler);
+        signal(SIGHUP, ReloadHandler);
+        signal(SIGUSR1, DumpHandler);
+        //对端已经关闭的连接再写会收到SIGPIPE，默认处理是退出进程，过载时主动关闭连接后很容易出现
+        signal(SIGPIPE, SIG_IGN);
+        MakeDirs();
+
+        int listen_sock = -1;
+        if(upgrade_){
+            //热升级: listen_sock和所有连接都由旧进程交过来，快照也在其中加载
+            listen_sock = Upgrade::Receive(pr_);
+            if(listen_sock < 0){
+                exit(1);
+            }
+        }
+        else{
+            if(Replica::GetInstance()->IsStandby()){
+                //备机: 按复制日志重建Chatroom并跟随主机，主机失联后返回，接管服务
+                //跟随期间也响应SIGUSR1和SIGTERM，备机的数据都在复制日志中，退出时不需要写快照
+                bool takeover = Replica::GetInstance()->RunStandby([](const ReplicaOp& op){
+                    Protocol::ApplyReplica(op);
+                }, []{
+                    if(dump_){
+                        dump_ = 0;
+                        Log("STATS", Replica::GetInstance()->Stats(), __FILE__, __LINE__);
+                    }
+                    return !stop_;
+                });
+                if(!takeover){
+                    LOG(INFO, "SIGTERM received, standby exits");
+                    exit(0);
+                }
+            }
+            else{
+                //先从快照恢复Chatroom，再开始接收连接
+                Snapshot::Load();
+            }
+
+            //创建listen_sock并加入Reactor模型
+            listen_sock = TcpServer::GetInstance(port_)->GetLinstenSocket();
+            LOG(INFO, std::string("Listen_sock is set: ")+std::to_string(listen_sock));
+
+            //创建Event对象
+            Event<ChatMessage> ev(listen_sock, pr_);
+            //listen_sock只需要监测读就绪事件，并且回调函数为Acceptor
+            ev.RegisterRecv(Acceptor::Accept);
+
+            //将ev注册到reactor模型中
+            pr_->AddEvent(ev, EPOLLIN | EPOLLET); //监测读以及工作在ET模式下
+        }
+
+
+        //主机开始记录复制日志并接受备机连接
+        Replica::GetInstance()->Start();
 
-        //创建Event对象
-        Event<ChatMessage> ev(listen_sock, pr_);
-        //listen_sock只需要监测读就绪事件，并且回调函数为Acceptor
-        ev.RegisterRecv(Acceptor::Accept);
+        //创建历史目录并启动写历史的线程，历史块落盘之后由后台线程建立全文索引
+        History::GetInstance();
+        Search::GetInstance()->Start();
 
-        //将ev注册到reactor模型中
-        pr_->AddEvent(ev, EPOLLIN | EPOLLET); //监测读以及工作在ET模式下
+        //在线状态的变化按窗口合并之后通知订阅者
+        Reactor<ChatMessage>* pr = pr_;
+        Presence::GetInstance()->Start([pr](const std::string& name, const std::vector<std::string>& on, const std::vector<std::string>& off){
+            Protocol::PushPresence(name, on, off, pr);
+        });
 
+        //集群模式下建立到其他节点的链路，其他节点转发过来的消息交给Protocol处理，其他节点用户的上线下线交给Presence发布
+        Cluster::GetInstance()->Start([pr](ClusterFrame& frame){
+            Protocol::OnClusterFrame(frame, pr);
+        }, [](const std::string& name, bool online){
+            Presence::GetInstance()->Publish(name, online);
+        });
 
         //进入事件派发逻辑，服务器启动
         int timeout = 1000;
-        while(true){
+        time_t last_snapshot = time(nullptr);
+        const long long snapshot_interval = Config::GetInstance()->GetInt("snapshot_interval");
+        Config* pc = Config::GetInstance();
+        const long long adjust_ms = pc->GetInt("pool_adjust_ms");
+        const long long grow_wait_us = pc->GetInt("pool_grow_wait_ms") * 1000;
+        const int shrink_util = pc->GetInt("pool_shrink_util");
+        const long long block_us = pc->GetInt("pool_block_ms") * 1000;
+        auto last_adjust = std::chrono::steady_clock::now();
+        auto last_expire = last_adjust;
+        auto last_part_expire = last_adjust;
+        while(!stop_){
             pr_->Dispatcher(timeout);
+
+            //把连接交给新进程，成功则直接退出
+            if(handoff_){
+                handoff_ = 0;
+                if(Upgrade::HandOff(pr_, listen_sock)){
+                    exit(0);
+                }
+            }
+
+            //重新加载配置，线程数变化时调整线程池
+            if(reload_){
+                reload_ = 0;
+                if(Config::GetInstance()->Reload()){
+                    ThreadPool<ChatMessage, Protocol>::GetInstance()->Resize(Config::GetInstance()->GetInt("thread_num"));
+                }
+            }
+
+            //线程池自动伸缩
+            auto steady_now = std::chrono::steady_clock::now();
+            if(steady_now - last_adjust >= std::chrono::milliseconds(adjust_ms)){
+                last_adjust = steady_now;
+                ThreadPool<ChatMessage, Protocol>::GetInstance()->Adjust(grow_wait_us, shrink_util, block_us);
+            }
+
+            //关闭收报文超时的慢速连接
+            if(steady_now - last_expire >= std::chrono::seconds(1)){
+                last_expire = steady_now;
+                Handler::ExpireRequests(pr_);
+            }
+
+            //清理空闲的分块上传，要删文件，交给线程池完成
+            if(steady_now - last_part_expire >= std::chrono::seconds(60)){
+                last_part_expire = steady_now;
+                ThreadPool<ChatMessage, Protocol>::GetInstance()->AddTaskTo(LANE_BULK, []{
+                    Protocol::ExpireUploads();
+                });
+            }
+
+            //输出运行状态，不受日志级别限制
+            if(dump_){
+                dump_ = 0;
+                Log("STATS", ThreadPool<ChatMessage, Protocol>::GetInstance()->Stats(), __FILE__, __LINE__);
+                Log("STATS", DiskExecutor<ChatMessage, Protocol>::GetInstance()->Stats(), __FILE__, __LINE__);
+                Log("STATS", RateLimiter::GetInstance()->Stats(), __FILE__, __LINE__);
+                Log("STATS", RequestLimiter::GetInstance()->Stats(), __FILE__, __LINE__);
+                Log("STATS", Cluster::GetInstance()->Stats(), __FILE__, __LINE__);
+                Log("STATS", Replica::GetInstance()->Stats(), __FILE__, __LINE__);
+                Log("STATS", Presence::GetInstance()->Stats(), __FILE__, __LINE__);
+                Log("STATS", History::GetInstance()->Stats(), __FILE__, __LINE__);
+                Log("STATS", Search::GetInstance()->Stats(), __FILE__, __LINE__);
+                Log("STATS", Codec::GetInstance()->Stats(), __FILE__, __LINE__);
+                for(auto& line : Handler::MemoryStats(pr_, Config::GetInstance()->GetInt("mem_top_conns"))){
+                    Log("STATS", line, __FILE__, __LINE__);
+                }
+            }
+
+            //定期写快照，交给线程池完成，不阻塞reactor
+            time_t now = time(nullptr);
+            if(now - last_snapshot >= snapshot_interval && !saving_.exchange(true)){
+                last_snapshot = now;
+                ThreadPool<ChatMessage, Protocol>::GetInstance()->AddTaskTo(LANE_BULK, []{
+                    Snapshot::Save();
+                    saving_ = false;
+                });
+            }
+        }
+
+        //收到SIGTERM，reactor不再派发事件，不会再有新的请求进入线程池
+        //先等磁盘线程和线程池处理完手头的任务，再依次停止磁盘线程、消息线程和处理任务的线程
+        //所有任务都结束之后同步写一次完整快照，然后退出
+        LOG(INFO, "SIGTERM received, draining thread pool");
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(pc->GetInt("shutdown_drain_ms"));
+        while(!(DiskExecutor<ChatMessage, Protocol>::GetInstance()->IsIdle() && ThreadPool<ChatMessage, Protocol>::GetInstance()->IsIdle()) && std::chrono::steady_clock::now() < deadline){
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
         }
+        DiskExecutor<ChatMessage, Protocol>::GetInstance()->Stop();
+        ThreadPool<ChatMessage, Protocol>::GetInstance()->Stop();
+        LOG(INFO, "Thread pool stopped, saving snapshot");
+        Snapshot::Save();
+        Replica::GetInstance()->Flush();
+        History::GetInstance()->Flush();
+        Search::GetInstance()->Flush();
+        exit(0);
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,699 @@
+#pragma once
+#include "Log.hpp"
+#include "Config.hpp"
+#include "Socket.hpp"
+#include "Codec.hpp"
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <chrono>
+
+//集群中节点之间传递的一帧
+//编码: 4字节负载长度(网络序)，之后负载为若干个 4字节长度+内容 的字符串，依次为type_，body_，然后是fields_的key和value
+struct ClusterFrame
+{
+public:
+    std::string type_;
+    std::unordered_map<std::string, std::string> fields_;
+    std::string body_;
+
+    ClusterFrame() = default;
+    explicit ClusterFrame(const std::string& type):type_(type)
+    {}
+
+    //编码后追加到out中
+    void Encode(std::string& out) const
+    {
+        size_t begin = out.size();
+        out.append(4, '\0');
+        Put(out, type_);
+        Put(out, body_);
+        for(auto& f : fields_){
+            Put(out, f.first);
+            Put(out, f.second);
+        }
+        uint32_t len = htonl((uint32_t)(out.size() - begin - 4));
+        memcpy(&out[begin], &len, 4);
+    }
+
+    //从一帧的负载中解码，格式错误返回false
+    bool Decode(const char* data, size_t size)
+    {
+        std::vector<std::string> parts;
+        size_t pos = 0;
+        while(pos < size){
+            if(size - pos < 4){
+                return false;
+            }
+            uint32_t len;
+            memcpy(&len, data + pos, 4);
+            len = ntohl(len);
+            pos += 4;
+            if(size - pos < len){
+                return false;
+            }
+            parts.emplace_back(data + pos, len);
+            pos += len;
+        }
+        if(parts.size() < 2 || parts.size() % 2 != 0){
+            return false;
+        }
+        type_ = std::move(parts[0]);
+        body_ = std::move(parts[1]);
+        for(size_t i = 2;i < parts.size();i += 2){
+            fields_[parts[i]] = std::move(parts[i+1]);
+        }
+        return true;
+    }
+
+    const std::string& Get(const std::string& key) const
+    {
+        static const std::string empty;
+        auto it = fields_.find(key);
+        return it == fields_.end() ? empty : it->second;
+    }
+
+private:
+    static void Put(std::string& out, const std::string& s)
+    {
+        uint32_t len = htonl((uint32_t)s.size());
+        out.append((const char*)&len, 4);
+        out += s;
+    }
+};
+
+//多节点集群，每个节点拥有一段用户名哈希范围内的用户，这些用户只能在所属节点注册和登录
+//节点之间两两建立持久的TCP链路，每个方向一条: 本节点主动连接的链路只发送，对方连过来的链路只接收
+//发往同一节点的帧先进入该链路的发送队列，发送线程每次把队列中所有帧合并成一次写，负载越高每批越大
+//在线状态通过ON/OFF帧增量通知所有节点，并且每cluster_gossip_ms广播一次完整的在线列表(PRES)，链路重连后也能收敛
+//链路端口只绑定本节点的地址，只接受cluster_nodes中的地址连进来，连接后第一帧必须是HELLO(节点下标+共享密钥)
+//之后这条链路上的帧都认为来自这个节点: 在线状态只能是它的用户，转发的消息的发送者也必须属于它
+//cluster_nodes为空时是单节点模式，所有用户都属于本节点
+class Cluster
+{
+private:
+    struct Node
+    {
+        std::string host_;
+        uint16_t port_;     //客户端端口，用于把客户端重定向到所属节点
+        uint16_t linkPort_; //节点间链路端口
+    };
+
+    //到一个节点的发送链路
+    struct Link
+    {
+        std::mutex mtx_;
+        std::condition_variable cv_;
+        std::string queue_;   //已经编码，等待发送的帧
+        size_t frames_ = 0;   //queue_中的帧数
+        std::atomic<bool> up_{false};
+    };
+
+    //其他节点上在线的用户，由该节点的ON/OFF/PRES帧维护
+    struct RemotePresence
+    {
+        std::unordered_set<std::string> users_;
+        long long seen_ = 0; //最后一次收到PRES的时间(steady毫秒)，超过3个周期没有收到认为该节点离线
+        int codecs_ = 0;     //该节点在PRES中声明可以解压的正文编码，旧版本的节点没有声明
+    };
+
+    std::vector<Node> nodes_;
+    int self_;
+    size_t queueMax_;   //发送队列的上限，也是收到的一帧负载的上限
+    std::string secret_; //HELLO中校验的共享密钥
+    long long gossipMs_;
+    long long reconnectMs_;
+
+    std::vector<std::unique_ptr<Link>> links_;
+    std::function<void(ClusterFrame&)> handler_;
+    std::function<void(const std::string&, bool)> presenceHandler_; //其他节点用户的上线下线
+
+    std::mutex presMtx_;
+    std::unordered_set<std::string> local_;  //本节点在线的用户
+    std::vector<RemotePresence> remote_;
+
+    std::atomic<long long> framesOut_;
+    std::atomic<long long> batches_;
+    std::atomic<long long> framesIn_;
+    std::atomic<long long> dropped_;
+
+    static Cluster* pcl_;
+
+    Cluster(): self_(0), framesOut_(0), batches_(0), framesIn_(0), dropped_(0)
+    {
+        Config* pc = Config::GetInstance();
+        self_ = pc->GetInt("cluster_id");
+        queueMax_ = pc->GetInt("cluster_queue_max");
+        secret_ = pc->GetString("cluster_secret");
+        gossipMs_ = std::max<long long>(1, pc->GetInt("cluster_gossip_ms"));
+        reconnectMs_ = std::max<long long>(1, pc->GetInt("cluster_reconnect_ms"));
+
+        //cluster_nodes = host:port:link_port,host:port:link_port,...
+        std::string spec = pc->GetString("cluster_nodes");
+        size_t begin = 0;
+        while(begin < spec.size()){
+            size_t end = spec.find(',', begin);
+            if(end == std::string::npos){
+                end = spec.size();
+            }
+            std::string item = spec.substr(begin, end - begin);
+            begin = end + 1;
+            size_t p1 = item.find(':');
+            size_t p2 = item.rfind(':');
+            if(p1 == std::string::npos || p1 == p2){
+                LOG(FATAL, std::string("Cluster: bad node ")+item);
+                exit(1);
+            }
+            Node node;
+            node.host_ = item.substr(0, p1);
+            node.port_ = std::atoi(item.substr(p1 + 1, p2 - p1 - 1).c_str());
+            node.linkPort_ = std::atoi(item.substr(p2 + 1).c_str());
+            nodes_.push_back(node);
+        }
+        if(!nodes_.empty() && (self_ < 0 || self_ >= (int)nodes_.size())){
+            LOG(FATAL, std::string("Cluster: bad cluster_id ")+std::to_string(self_));
+            exit(1);
+        }
+        for(size_t i = 0;i < nodes_.size();i++){
+            links_.emplace_back(new Link);
+        }
+        remote_.resize(nodes_.size());
+    }
+
+    static long long NowMs()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    //32位FNV-1a，不同节点、不同编译结果都必须得到相同的值
+    static uint32_t Hash(const std::string& s)
+    {
+        uint32_t h = 2166136261u;
+        for(unsigned char c : s){
+            h ^= c;
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    static bool WriteAll(int sock, const std::string& data)
+    {
+        size_t total = 0;
+        while(total < data.size()){
+            ssize_t s = send(sock, data.data() + total, data.size() - total, MSG_NOSIGNAL);
+            if(s < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                return false;
+            }
+            total += s;
+        }
+        return true;
+    }
+
+    //长度不同时也比较完，耗时不随相同前缀的长度变化
+    static bool SameSecret(const std::string& a, const std::string& b)
+    {
+        unsigned char diff = (a.size() == b.size() ? 0 : 1);
+        for(size_t i = 0;i < a.size();i++){
+            diff |= (unsigned char)(a[i] ^ b[i % std::max<size_t>(1, b.size())]);
+        }
+        return diff == 0;
+    }
+
+    static std::string AddrString(const in_addr& addr)
+    {
+        char buf[INET_ADDRSTRLEN] = {0};
+        inet_ntop(AF_INET, &addr, buf, sizeof(buf));
+        return buf;
+    }
+
+    //addr是否为某个节点在cluster_nodes中的地址
+    bool IsNodeAddr(const in_addr& addr) const
+    {
+        for(auto& n : nodes_){
+            in_addr a;
+            if(inet_pton(AF_INET, n.host_.c_str(), &a) == 1 && a.s_addr == addr.s_addr){
+                return true;
+            }
+        }
+        return false;
+    }
+
+    int Connect(int node)
+    {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if(sock < 0){
+            return -1;
+        }
+        sockaddr_in peer;
+        memset(&peer, 0, sizeof(peer));
+        peer.sin_family = AF_INET;
+        peer.sin_port = htons(nodes_[node].linkPort_);
+        inet_pton(AF_INET, nodes_[node].host_.c_str(), &peer.sin_addr);
+        if(connect(sock, (sockaddr*)&peer, sizeof(peer)) < 0){
+            close(sock);
+            return -1;
+        }
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        //第一帧声明自己是哪个节点，对方校验地址和密钥之后才处理后面的帧
+        ClusterFrame hello("HELLO");
+        hello.fields_["Node"] = std::to_string(self_);
+        hello.fields_["Secret"] = secret_;
+        std::string data;
+        hello.Encode(data);
+        if(!WriteAll(sock, data)){
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    //发送线程，断开后每cluster_reconnect_ms重连一次，队列中的帧在重连后继续发送
+    void SendLoop(int node)
+    {
+        Link& link = *links_[node];
+        int sock = -1;
+        while(true){
+            if(sock < 0){
+                sock = Connect(node);
+                if(sock < 0){
+                    std::this_thread::sleep_for(std::chrono::milliseconds(reconnectMs_));
+                    continue;
+                }
+                link.up_ = true;
+                LOG(INFO, std::string("Cluster: link up to node ")+std::to_string(node));
+                {
+                    //对方可能换了版本，重新收到它的PRES之前不发压缩的正文
+                    std::unique_lock<std::mutex> u_mtx(presMtx_);
+                    remote_[node].codecs_ = 0;
+                }
+                //新链路上先补发一次完整的在线列表
+                Send(node, PresenceFrame());
+            }
+
+            std::string batch;
+            size_t frames;
+            {
+                std::unique_lock<std::mutex> u_mtx(link.mtx_);
+                link.cv_.wait(u_mtx, [&link]{ return !link.queue_.empty(); });
+                batch.swap(link.queue_);
+                frames = link.frames_;
+                link.frames_ = 0;
+            }
+            if(!WriteAll(sock, batch)){
+                LOG(WARNING, std::string("Cluster: link down to node ")+std::to_string(node));
+                close(sock);
+                sock = -1;
+                link.up_ = false;
+                dropped_ += frames;
+                continue;
+            }
+            framesOut_ += frames;
+            batches_++;
+        }
+    }
+
+    //HELLO帧是否来自peer地址上的合法节点，是则返回节点下标，否则返回-1
+    int Authenticate(const ClusterFrame& frame, const in_addr& peer)
+    {
+        if(frame.type_ != "HELLO"){
+            return -1;
+        }
+        const std::string& id = frame.Get("Node");
+        int node = std::atoi(id.c_str());
+        if(id.empty() || id != std::to_string(node) || node < 0 || node >= (int)nodes_.size() || node == self_){
+            return -1;
+        }
+        in_addr a;
+        if(inet_pton(AF_INET, nodes_[node].host_.c_str(), &a) != 1 || a.s_addr != peer.s_addr){
+            return -1;
+        }
+        if(!SameSecret(frame.Get("Secret"), secret_)){
+            return -1;
+        }
+        return node;
+    }
+
+    //接收线程，每个连进来的节点一个，按顺序处理该节点发来的帧
+    //第一帧必须是HELLO，长度超过queueMax_的帧或者认证失败都直接断开链路
+    void RecvLoop(int sock, in_addr peer)
+    {
+        std::string buffer;
+        std::vector<char> chunk(65536);
+        int node = -1;
+        bool ok = true;
+        while(ok){
+            ssize_t s = recv(sock, chunk.data(), chunk.size(), 0);
+            if(s < 0 && errno == EINTR){
+                continue;
+            }
+            if(s <= 0){
+                break;
+            }
+            buffer.append(chunk.data(), s);
+
+            size_t pos = 0;
+            while(buffer.size() - pos >= 4){
+                uint32_t len;
+                memcpy(&len, buffer.data() + pos, 4);
+                len = ntohl(len);
+                if(len > queueMax_){
+                    LOG(WARNING, std::string("Cluster: frame too large, len: ")+std::to_string(len));
+                    ok = false;
+                    break;
+                }
+                if(buffer.size() - pos - 4 < len){
+                    break;
+                }
+                ClusterFrame frame;
+                if(!frame.Decode(buffer.data() + pos + 4, len)){
+                    LOG(WARNING, "Cluster: bad frame");
+                }
+                else if(node == -1){
+                    node = Authenticate(frame, peer);
+                    if(node == -1){
+                        LOG(WARNING, std::string("Cluster: link rejected, peer: ")+AddrString(peer));
+                        ok = false;
+                        break;
+                    }
+                    LOG(INFO, std::string("Cluster: link accepted from node ")+std::to_string(node));
+                }
+                else{
+                    framesIn_++;
+                    Dispatch(frame, node);
+                }
+                pos += 4 + len;
+            }
+            buffer.erase(0, pos);
+        }
+        close(sock);
+    }
+
+    void AcceptLoop(int listen_sock)
+    {
+        while(true){
+            sockaddr_in peer;
+            socklen_t peer_len = sizeof(peer);
+            int sock = accept(listen_sock, (sockaddr*)&peer, &peer_len);
+            if(sock < 0){
+                if(errno == EINTR || errno == ECONNABORTED){
+                    continue;
+                }
+                LOG(ERROR, "Cluster: accept error");
+                std::this_thread::sleep_for(std::chrono::milliseconds(reconnectMs_));
+                continue;
+            }
+            if(peer.sin_family != AF_INET || !IsNodeAddr(peer.sin_addr)){
+                LOG(WARNING, std::string("Cluster: reject link from unknown address ")+AddrString(peer.sin_addr));
+                close(sock);
+                continue;
+            }
+            std::thread(&Cluster::RecvLoop, this, sock, peer.sin_addr).detach();
+        }
+    }
+
+    void GossipLoop()
+    {
+        while(true){
+            std::this_thread::sleep_for(std::chrono::milliseconds(gossipMs_));
+            Broadcast(PresenceFrame());
+        }
+    }
+
+    //在线状态帧由Cluster自己处理，其他帧交给handler_，node为发来这一帧的链路认证的节点
+    void Dispatch(ClusterFrame& frame, int node)
+    {
+        if(frame.type_ == "ON" || frame.type_ == "OFF" || frame.type_ == "PRES"){
+            if(std::atoi(frame.Get("Node").c_str()) != node){
+                LOG(WARNING, std::string("Cluster: presence of another node from node ")+std::to_string(node));
+                return;
+            }
+            //发生变化的用户，在锁外交给presenceHandler_
+            std::vector<std::pair<std::string, bool>> changed;
+            {
+                std::unique_lock<std::mutex> u_mtx(presMtx_);
+                RemotePresence& p = remote_[node];
+                if(frame.type_ == "ON"){
+                    if(p.users_.insert(frame.Get("User")).second){
+                        changed.emplace_back(frame.Get("User"), true);
+                    }
+                }
+                else if(frame.type_ == "OFF"){
+                    if(p.users_.erase(frame.Get("User")) > 0){
+                        changed.emplace_back(frame.Get("User"), false);
+                    }
+                }
+                else{
+                    //完整列表和已知的列表比较，丢失的ON/OFF帧在这里补上
+                    std::unordered_set<std::string> users;
+                    const std::string& body = frame.body_;
+                    size_t begin = 0;
+                    while(begin < body.size()){
+                        size_t end = body.find(' ', begin);
+                        if(end == std::string::npos){
+                            end = body.size();
+                        }
+                        if(end > begin){
+                            users.insert(body.substr(begin, end - begin));
+                        }
+                        begin = end + 1;
+                    }
+                    for(auto& user : p.users_){
+                        if(users.count(user) == 0){
+                            changed.emplace_back(user, false);
+                        }
+                    }
+                    for(auto& user : users){
+                        if(p.users_.count(user) == 0){
+                            changed.emplace_back(user, true);
+                        }
+                    }
+                    p.users_.swap(users);
+                    p.seen_ = NowMs();
+                    p.codecs_ = Codec::Parse(frame.Get("Codecs"));
+                }
+            }
+            if(presenceHandler_){
+                for(auto& c : changed){
+                    presenceHandler_(c.first, c.second);
+                }
+            }
+            return;
+        }
+        if((frame.type_ == "MSG" || frame.type_ == "GMSG") && OwnerOf(frame.Get("Sender")) != node){
+            //节点只转发在自己这里登录的用户发出的消息
+            LOG(WARNING, std::string("Cluster: forged sender from node ")+std::to_string(node));
+            return;
+        }
+        if(handler_){
+            handler_(frame);
+        }
+    }
+
+    ClusterFrame PresenceFrame()
+    {
+        ClusterFrame frame("PRES");
+        frame.fields_["Node"] = std::to_string(self_);
+        frame.fields_["Codecs"] = "deflate";
+        std::unique_lock<std::mutex> u_mtx(presMtx_);
+        for(auto& user : local_){
+            frame.body_ += user;
+            frame.body_ += ' ';
+        }
+        return frame;
+    }
+
+public:
+    Cluster(const Cluster&) = delete;
+    Cluster& operator=(const Cluster&) = delete;
+
+    static Cluster* GetInstance()
+    {
+        static std::mutex mtx;
+        if(pcl_ == nullptr){
+            {
+                std::unique_lock<std::mutex> u_mtx(mtx);
+                if(pcl_ == nullptr){
+                    pcl_ = new Cluster;
+                }
+            }
+        }
+        return pcl_;
+    }
+
+    bool Enabled() const
+    {
+        return nodes_.size() > 1;
+    }
+
+    int Self() const
+    {
+        return self_;
+    }
+
+    //用户所属的节点，哈希值按节点数等分成连续的范围
+    int OwnerOf(const std::string& name) const
+    {
+        if(!Enabled()){
+            return self_;
+        }
+        return (int)(((uint64_t)Hash(name) * nodes_.size()) >> 32);
+    }
+
+    bool IsLocal(const std::string& name) const
+    {
+        return OwnerOf(name) == self_;
+    }
+
+    //node能否解压codec编码的正文，MSG/GMSG帧的Encoding字段只对声明过的节点使用
+    bool Accepts(int node, int codec)
+    {
+        std::unique_lock<std::mutex> u_mtx(presMtx_);
+        return node >= 0 && node < (int)remote_.size() && (remote_[node].codecs_ & codec) != 0;
+    }
+
+    //节点的客户端地址 host:port
+    std::string Address(int node) const
+    {
+        return nodes_[node].host_ + std::string(":") + std::to_string(nodes_[node].port_);
+    }
+
+    //启动链路，handler在接收线程中执行，同一个节点发来的帧按发送顺序处理
+    //presence_handler在其他节点的用户上线或者下线时调用，也在接收线程中执行
+    void Start(std::function<void(ClusterFrame&)> handler, std::function<void(const std::string&, bool)> presence_handler = nullptr)
+    {
+        if(!Enabled()){
+            return;
+        }
+        handler_ = std::move(handler);
+        presenceHandler_ = std::move(presence_handler);
+
+        int listen_sock = Sock::Socket(1);
+        if(listen_sock < 0 || Sock::Bind(listen_sock, nodes_[self_].linkPort_, nodes_[self_].host_) < 0 || Sock::Listen(listen_sock, 128) < 0){
+            LOG(FATAL, std::string("Cluster: cannot listen on link port ")+std::to_string(nodes_[self_].linkPort_));
+            exit(1);
+        }
+        std::thread(&Cluster::AcceptLoop, this, listen_sock).detach();
+        for(int i = 0;i < (int)nodes_.size();i++){
+            if(i != self_){
+                std::thread(&Cluster::SendLoop, this, i).detach();
+            }
+        }
+        std::thread(&Cluster::GossipLoop, this).detach();
+        LOG(INFO, std::string("Cluster: node ")+std::to_string(self_)+std::string(" of ")+std::to_string(nodes_.size()));
+    }
+
+    //把一帧放入到node的发送队列，队列超过cluster_queue_max时丢弃并返回false
+    bool Send(int node, const ClusterFrame& frame)
+    {
+        std::string data;
+        frame.Encode(data);
+        Link& link = *links_[node];
+        {
+            std::unique_lock<std::mutex> u_mtx(link.mtx_);
+            if(link.queue_.size() + data.size() > queueMax_){
+                dropped_++;
+                LOG(WARNING, std::string("Cluster: queue full, drop frame to node ")+std::to_string(node));
+                return false;
+            }
+            link.queue_ += data;
+            link.frames_++;
+        }
+        link.cv_.notify_one();
+        return true;
+    }
+
+    void Broadcast(const ClusterFrame& frame)
+    {
+        for(int i = 0;i < (int)nodes_.size();i++){
+            if(i != self_){
+                Send(i, frame);
+            }
+        }
+    }
+
+    //本节点用户上线或下线，通知其他节点
+    void SetOnline(const std::string& name, bool online)
+    {
+        if(!Enabled()){
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> u_mtx(presMtx_);
+            if(online){
+                local_.insert(name);
+            }
+            else{
+                local_.erase(name);
+            }
+        }
+        ClusterFrame frame(online ? "ON" : "OFF");
+        frame.fields_["Node"] = std::to_string(self_);
+        frame.fields_["User"] = name;
+        Broadcast(frame);
+    }
+
+    //name是否在其所属节点上在线，所属节点超过3个周期没有消息时视为不在线
+    bool IsOnline(const std::string& name)
+    {
+        int node = OwnerOf(name);
+        std::unique_lock<std::mutex> u_mtx(presMtx_);
+        if(node == self_){
+            return local_.count(name) > 0;
+        }
+        const RemotePresence& p = remote_[node];
+        return NowMs() - p.seen_ <= 3 * gossipMs_ && p.users_.count(name) > 0;
+    }
+
+    std::string Stats()
+    {
+        if(!Enabled()){
+            return std::string("cluster disabled");
+        }
+        int up = 0;
+        for(int i = 0;i < (int)nodes_.size();i++){
+            if(i != self_ && links_[i]->up_){
+                up++;
+            }
+        }
+        size_t remote = 0;
+        size_t local = 0;
+        {
+            std::unique_lock<std::mutex> u_mtx(presMtx_);
+            local = local_.size();
+            for(auto& p : remote_){
+                remote += p.users_.size();
+            }
+        }
+        long long batches = batches_;
+        long long frames = framesOut_;
+        return std::string("cluster self=")+std::to_string(self_)
+            +std::string(" nodes=")+std::to_string(nodes_.size())
+            +std::string(" links_up=")+std::to_string(up)
+            +std::string(" frames_out=")+std::to_string(frames)
+            +std::string(" batches=")+std::to_string(batches)
+            +std::string(" frames_per_batch=")+std::to_string(batches > 0 ? frames / batches : 0)
+            +std::string(" frames_in=")+std::to_string(framesIn_)
+            +std::string(" dropped=")+std::to_string(dropped_)
+            +std::string(" online_local=")+std::to_string(local)
+            +std::string(" online_remote=")+std::to_string(remote);
+    }
+};
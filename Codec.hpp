@@ -0,0 +1,270 @@
+#pragma once
+#include "Log.hpp"
+#include "Config.hpp"
+#include <zlib.h>
+#include <cstring>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+//正文压缩，目前只支持deflate，即zlib格式(compress2/uncompress的格式)
+//客户端在任意请求中带上 Accept-Encoding: deflate 之后，发往该连接的较大正文都可能压缩，并带上 Content-Encoding: deflate
+//客户端发来的正文带 Content-Encoding: deflate 时先解压再处理，压缩的原文留下来用于转发和存储，不再重新压缩
+class Codec
+{
+public:
+    enum
+    {
+        IDENTITY = 0,
+        DEFLATE = 1
+    };
+
+    static const size_t PROBE = 1 << 20; //超过这个大小的正文先试压缩这么多，压不下来就不再压缩全部
+
+private:
+    size_t minBytes_;  //正文达到这个大小才压缩，为0表示不压缩
+
+    std::atomic<long long> deflated_;   //压缩的次数
+    std::atomic<long long> skipped_;    //压缩之后没有明显变小而放弃的次数
+    std::atomic<long long> rawBytes_;   //压缩后发送的正文压缩前的字节数
+    std::atomic<long long> wireBytes_;  //压缩后发送的正文实际的字节数
+    std::atomic<long long> inflated_;   //解压的次数
+    std::atomic<long long> badInput_;   //解压失败或者超过大小限制的次数
+
+    static Codec* pcd_;
+
+    Codec(): deflated_(0), skipped_(0), rawBytes_(0), wireBytes_(0), inflated_(0), badInput_(0)
+    {
+        minBytes_ = std::max<long long>(0, Config::GetInstance()->GetInt("compress_min_bytes"));
+    }
+
+public:
+    Codec(const Codec&) = delete;
+    Codec& operator=(const Codec&) = delete;
+
+    static Codec* GetInstance()
+    {
+        static std::mutex mtx;
+        if(pcd_ == nullptr){
+            {
+                std::unique_lock<std::mutex> u_mtx(mtx);
+                if(pcd_ == nullptr){
+                    pcd_ = new Codec;
+                }
+            }
+        }
+        return pcd_;
+    }
+
+    //解析以逗号分隔的编码列表，例如 "deflate, gzip;q=0.5"，返回支持的编码的位集合，不认识的忽略
+    static int Parse(const std::string& list)
+    {
+        int codecs = IDENTITY;
+        size_t begin = 0;
+        while(begin < list.size()){
+            size_t end = list.find(',', begin);
+            if(end == std::string::npos){
+                end = list.size();
+            }
+            std::string item = list.substr(begin, end - begin);
+            begin = end + 1;
+            item = item.substr(0, item.find(';'));
+            size_t b = item.find_first_not_of(' ');
+            size_t e = item.find_last_not_of(' ');
+            if(b != std::string::npos && item.compare(b, e - b + 1, "deflate") == 0){
+                codecs |= DEFLATE;
+            }
+        }
+        return codecs;
+    }
+
+    //压缩之后至少省下1/8才值得，否则接收方解压的开销不划算
+    static bool Worth(size_t raw, size_t packed)
+    {
+        return packed <= raw - raw / 8;
+    }
+
+    //正文大小是否值得尝试压缩
+    bool Wants(size_t size) const
+    {
+        return minBytes_ > 0 && size >= minBytes_;
+    }
+
+    //压缩data，不值得压缩时返回false
+    bool Deflate(const char* data, size_t size, std::string& out)
+    {
+        if(size > PROBE){
+            std::string probe;
+            if(!Compress(data, PROBE, probe) || !Worth(PROBE, probe.size())){
+                skipped_++;
+                return false;
+            }
+        }
+        if(!Compress(data, size, out) || !Worth(size, out.size())){
+            out.clear();
+            skipped_++;
+            return false;
+        }
+        deflated_++;
+        return true;
+    }
+
+    //解压data，结果超过max_bytes或者格式错误时返回false
+    bool Inflate(const char* data, size_t size, size_t max_bytes, std::string& out)
+    {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if(inflateInit(&zs) != Z_OK){
+            badInput_++;
+            return false;
+        }
+        out.clear();
+        zs.next_in = (Bytef*)data;
+        zs.avail_in = size;
+        int ret = Z_OK;
+        char buf[1 << 16];
+        while(ret == Z_OK){
+            zs.next_out = (Bytef*)buf;
+            zs.avail_out = sizeof(buf);
+            ret = inflate(&zs, Z_NO_FLUSH);
+            if(ret != Z_OK && ret != Z_STREAM_END){
+                break;
+            }
+            out.append(buf, sizeof(buf) - zs.avail_out);
+            if(out.size() > max_bytes){
+                ret = Z_BUF_ERROR;
+                break;
+            }
+            if(ret == Z_OK && zs.avail_in == 0 && zs.avail_out != 0){
+                //输入已经用完但压缩流没有结束
+                ret = Z_DATA_ERROR;
+            }
+        }
+        inflateEnd(&zs);
+        if(ret != Z_STREAM_END){
+            out.clear();
+            badInput_++;
+            return false;
+        }
+        inflated_++;
+        return true;
+    }
+
+    //记录一次压缩发送，raw为压缩前的大小，wire为实际发送的大小
+    void CountSent(size_t raw, size_t wire)
+    {
+        rawBytes_ += raw;
+        wireBytes_ += wire;
+    }
+
+    std::string Stats()
+    {
+        return std::string("codec deflated=")+std::to_string(deflated_)
+            +std::string(" skipped=")+std::to_string(skipped_)
+            +std::string(" sent_raw_bytes=")+std::to_string(rawBytes_)
+            +std::string(" sent_wire_bytes=")+std::to_string(wireBytes_)
+            +std::string(" inflated=")+std::to_string(inflated_)
+            +std::string(" bad_input=")+std::to_string(badInput_);
+    }
+
+private:
+    static bool Compress(const char* data, size_t size, std::string& out)
+    {
+        uLongf len = compressBound(size);
+        out.resize(len);
+        if(compress2((Bytef*)&out[0], &len, (const Bytef*)data, size, Z_BEST_SPEED) != Z_OK){
+            out.clear();
+            return false;
+        }
+        out.resize(len);
+        return true;
+    }
+};
+
+//一份正文的压缩结果，群发时所有通知和转发帧共享，第一个需要压缩的线程负责压缩，之后的直接使用
+//客户端或其他节点发来的压缩正文直接放进来，不再重新压缩
+class SharedDeflate
+{
+private:
+    std::once_flag once_;
+    std::string data_;
+    bool ok_;
+
+public:
+    SharedDeflate(): ok_(false)
+    {}
+
+    explicit SharedDeflate(std::string data): ok_(true)
+    {
+        data_ = std::move(data);
+        std::call_once(once_, []{});
+    }
+
+    //raw为压缩前的正文，不值得压缩时返回nullptr
+    const std::string* Get(const std::string& raw)
+    {
+        std::call_once(once_, [this, &raw]{
+            ok_ = Codec::GetInstance()->Deflate(raw.data(), raw.size(), data_);
+        });
+        return (ok_ && Codec::Worth(raw.size(), data_.size())) ? &data_ : nullptr;
+    }
+};
+
+//流式压缩，用于分块上传的文件收齐之后边算哈希边压缩
+//开头PROBE字节压不下来时放弃，不再压缩后面的部分
+class DeflateStream
+{
+private:
+    z_stream zs_;
+    bool ok_;
+
+public:
+    DeflateStream(): ok_(true)
+    {
+        memset(&zs_, 0, sizeof(zs_));
+        ok_ = (deflateInit(&zs_, Z_BEST_SPEED) == Z_OK);
+    }
+
+    ~DeflateStream()
+    {
+        deflateEnd(&zs_);
+    }
+
+    DeflateStream(const DeflateStream&) = delete;
+    DeflateStream& operator=(const DeflateStream&) = delete;
+
+    //还在压缩，没有出错也没有放弃
+    bool Ok() const
+    {
+        return ok_;
+    }
+
+    //压缩data，输出追加到out；finish为true时结束压缩流
+    void Update(const char* data, size_t size, std::string& out, bool finish)
+    {
+        if(!ok_){
+            return;
+        }
+        zs_.next_in = (Bytef*)data;
+        zs_.avail_in = size;
+        char buf[1 << 16];
+        int ret = Z_OK;
+        do{
+            zs_.next_out = (Bytef*)buf;
+            zs_.avail_out = sizeof(buf);
+            ret = deflate(&zs_, finish ? Z_FINISH : Z_NO_FLUSH);
+            if(ret == Z_STREAM_ERROR){
+                ok_ = false;
+                return;
+            }
+            out.append(buf, sizeof(buf) - zs_.avail_out);
+        }while(zs_.avail_out == 0 || (finish && ret != Z_STREAM_END));
+        if(zs_.total_in >= Codec::PROBE && !Codec::Worth(zs_.total_in, zs_.total_out)){
+            ok_ = false;
+        }
+        if(finish && ok_ && !Codec::Worth(zs_.total_in, zs_.total_out)){
+            ok_ = false;
+        }
+    }
+};
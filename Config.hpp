@@ -0,0 +1,260 @@
+#pragma once
+#include "Log.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <fstream>
+#include <mutex>
+#include <unordered_map>
+
+#define CONFIG_PATH "./chatroom.conf"
+
+//运行时配置，取代原来散落在各个头文件中的编译期宏
+//优先级: 命令行 --key=value > 配置文件(默认./chatroom.conf，可用--config=path指定) > 下面的默认值
+//配置文件每行一个 key = value，#开头为注释
+//收到SIGHUP时重新读取配置文件，其中只有thread_num和log_level会立即生效，其他配置修改后需要重启
+class Config
+{
+private:
+    std::mutex mtx_;
+    std::unordered_map<std::string, std::string> values_;    //当前生效的配置
+    std::unordered_map<std::string, std::string> overrides_; //命令行指定的配置，重新加载时保持不变
+    std::string path_;
+
+    static Config* pc_;
+
+    Config():path_(CONFIG_PATH)
+    {
+        values_ = Defaults();
+    }
+
+    static const std::unordered_map<std::string, std::string>& Defaults()
+    {
+        static const std::unordered_map<std::string, std::string> defaults = {
+            {"port", "8081"},
+            {"thread_num", "8"},            //线程池处理任务的初始线程数，可热加载
+            {"thread_min", "2"},            //线程池自动伸缩的下限
+            {"thread_max", "32"},           //线程池自动伸缩的上限
+            {"pool_adjust_ms", "1000"},     //自动伸缩的检查周期
+            {"pool_grow_wait_ms", "5"},     //排队时延超过该值时扩容
+            {"pool_shrink_util", "25"},     //线程利用率低于该百分比时缩容
+            {"pool_block_ms", "200"},       //任务执行超过该时间认为线程被阻塞，扩容时补足
+            {"lane_control_weight", "8"},   //control通道(注册登录退出)每轮出队的任务数
+            {"lane_chat_weight", "4"},      //chat通道(单聊群聊)每轮出队的任务数
+            {"lane_bulk_weight", "1"},      //bulk通道(文件传输)每轮出队的任务数
+            {"lane_bulk_max_pct", "50"},    //bulk通道最多同时占用的线程百分比，至少一个
+            {"lane_starve_ms", "500"},      //队首任务等待超过该时间的通道优先出队
+            {"codel_target_ms", "5"},       //control和chat通道可以接受的排队时延，0表示关闭过载保护
+            {"codel_interval_ms", "100"},   //排队时延持续高于target这么久才进入过载
+            {"max_iniline_bytes", "128"},   //请求初始行的最大字节数
+            {"max_header_count", "32"},     //请求报头的最多行数
+            {"max_header_bytes", "4096"},   //请求报头的最大字节数
+            {"max_body_control", "1024"},   //0xx请求正文的最大字节数
+            {"max_body_chat", "65536"},     //1xx/2xx请求正文的最大字节数
+            {"max_body_bulk", "67108864"},  //3xx请求正文的最大字节数，更大的文件用分块上传
+            {"request_deadline_ms", "10000"}, //一个请求从第一个字节到收完的期限，0表示不限制
+            {"body_min_rate", "16384"},     //正文最低接收速率(字节/秒)，按正文长度放宽期限
+            {"rate_conn_per_sec", "50"},    //每个连接每秒最多的聊天请求数，0表示不限制
+            {"rate_conn_burst", "100"},     //连接令牌桶的容量
+            {"rate_user_per_sec", "50"},    //每个用户每秒最多的聊天请求数，0表示不限制
+            {"rate_user_burst", "100"},     //用户令牌桶的容量
+            {"cluster_nodes", ""},          //集群所有节点 host:port:link_port，以逗号分隔，为空表示单节点
+            {"cluster_id", "0"},            //本节点在cluster_nodes中的下标
+            {"cluster_gossip_ms", "1000"},  //广播完整在线列表的周期
+            {"cluster_reconnect_ms", "200"}, //节点间链路断开后的重连间隔
+            {"cluster_queue_max", "67108864"}, //到每个节点的发送队列最大字节数，超过时丢弃，也是收到的一帧的上限
+            {"cluster_secret", ""},         //节点间链路握手时校验的共享密钥，所有节点必须相同
+            {"replica_listen", ""},         //主机等待备机连接的unix socket路径，为空表示不记录复制日志
+            {"replica_of", ""},             //不为空时以备机模式启动，值为主机的replica_listen
+            {"replica_log", "./replica/oplog"}, //复制日志路径
+            {"replica_takeover_ms", "1000"}, //备机和主机断开超过这个时间就接管服务
+            {"offline_page_msgs", "200"},   //登录确认和050响应中每页最多的离线消息条数
+            {"offline_page_bytes", "262144"}, //每页离线消息正文的最大字节数，至少一条
+            {"presence_batch_ms", "50"},    //在线状态变化合并通知的窗口
+            {"presence_max_subscriptions", "1000"}, //每个用户最多订阅的用户数
+            {"history_dir", "./history/"},  //消息历史目录
+            {"history_block_msgs", "128"},  //每个压缩块最多的消息条数
+            {"history_block_bytes", "65536"}, //每个压缩块压缩前最多的正文字节数
+            {"history_flush_ms", "2000"},   //没写满的块最多在内存中停留的时间
+            {"history_query_max", "200"},   //120请求一次最多返回的消息条数
+            {"history_query_bytes", "262144"}, //120响应正文的最大字节数，至少一条
+            {"search_dir", "./index/"},     //全文索引目录
+            {"search_segment_postings", "1000000"}, //内存表满这么多倒排项之后写成一个段
+            {"search_merge_factor", "4"},   //同一层的段满这么多个之后合并
+            {"search_max_results", "50"},   //130请求一次最多返回的消息条数
+            {"compress_min_bytes", "1024"}, //正文达到该字节数才压缩，0表示不压缩
+            {"mem_top_conns", "10"},        //SIGUSR1输出内存统计时列出占用最多的连接数，可热加载
+            {"message_thread_num", "2"},    //调度通知消息的线程数
+            {"disk_thread_num", "4"},       //磁盘IO线程数
+            {"epoll_batch", "128"},         //一次epoll_wait最多返回的事件数
+            {"listen_backlog", "4096"},     //实际生效的值不超过/proc/sys/net/core/somaxconn
+            {"defer_accept_secs", "0"},     //大于0时开启TCP_DEFER_ACCEPT
+            {"fastopen_qlen", "0"},         //大于0时开启TCP_FASTOPEN
+            {"accept_budget", "64"},        //每次派发最多accept的连接数
+            {"recv_buffer", "1024"},        //每次recv的缓冲区大小
+            {"recv_budget", "262144"},      //每次读事件最多读取的字节数，没读完的下一轮再读
+            {"conn_pool_size", "256"},      //关闭的连接最多保留多少份连接状态(Event和通知队列)给新连接复用，0表示不复用
+            {"file_chunk_max", "4194304"},  //分块上传每块以及分段下载每段的最大字节数
+            {"file_size_max", "1073741824"}, //分块上传的文件总大小上限，第一块到达时.part就会扩展到File-Size
+            {"file_part_idle_s", "3600"},   //分块上传超过这么久没有收到新的块就丢弃已收到的部分，0表示不清理
+            {"snapshot_interval", "60"},    //定期写快照的间隔，单位为秒
+            {"snapshot_path", "./snapshot/chatroom.snap"},
+            {"upgrade_path", "./upgrade.sock"},
+            {"upgrade_drain_ms", "2000"},   //热升级交接前等待线程池处理完手头任务的最长时间
+            {"shutdown_drain_ms", "5000"},  //收到SIGTERM后等待线程池空闲的最长时间，之后停止各线程并写快照
+            {"message_dir", "./message/"},  //离线消息和群聊日志目录
+            {"files_dir", "./files/"},      //上传文件目录
+            {"log_level", "INFO"}           //INFO/WARNING/ERROR/FATAL，可热加载
+        };
+        return defaults;
+    }
+
+    static bool IsHot(const std::string& key)
+    {
+        return key == "thread_num" || key == "log_level" || key == "mem_top_conns";
+    }
+
+    //读取配置文件到out中，文件不存在返回false
+    static bool ReadFile(const std::string& path, std::unordered_map<std::string, std::string>& out)
+    {
+        std::ifstream fin(path);
+        if(!fin.is_open()){
+            return false;
+        }
+        std::string line;
+        int line_num = 0;
+        while(std::getline(fin, line)){
+            line_num++;
+            size_t pos = line.find('#');
+            if(pos != std::string::npos){
+                line.resize(pos);
+            }
+            pos = line.find('=');
+            if(pos == std::string::npos){
+                if(line.find_first_not_of(" \t\r") != std::string::npos){
+                    LOG(WARNING, std::string("Config: bad line ")+std::to_string(line_num)+std::string(" in ")+path);
+                }
+                continue;
+            }
+            std::string key = Trim(line.substr(0, pos));
+            std::string value = Trim(line.substr(pos + 1));
+            if(Defaults().find(key) == Defaults().end()){
+                LOG(WARNING, std::string("Config: unknown key ")+key);
+                continue;
+            }
+            out[key] = value;
+        }
+        return true;
+    }
+
+    static std::string Trim(const std::string& s)
+    {
+        size_t begin = s.find_first_not_of(" \t\r");
+        if(begin == std::string::npos){
+            return std::string();
+        }
+        size_t end = s.find_last_not_of(" \t\r");
+        return s.substr(begin, end - begin + 1);
+    }
+
+    //调用者需持有mtx_
+    void ApplyLogLevel()
+    {
+        LogLevel() = LogLevelOf(values_["log_level"].c_str());
+    }
+
+public:
+    Config(const Config&) = delete;
+    Config& operator=(const Config&) = delete;
+
+    static Config* GetInstance()
+    {
+        static std::mutex mtx;
+        if(pc_ == nullptr){
+            {
+                std::unique_lock<std::mutex> u_mtx(mtx);
+                if(pc_ == nullptr){
+                    pc_ = new Config;
+                }
+            }
+        }
+        return pc_;
+    }
+
+    //启动时调用，解析命令行并读取配置文件，不认识的参数原样忽略(例如--upgrade)
+    void Init(int argc, char* argv[])
+    {
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        for(int i = 1;i < argc;i++){
+            if(strncmp(argv[i], "--", 2) != 0 || strchr(argv[i], '=') == nullptr){
+                continue;
+            }
+            std::string arg(argv[i] + 2);
+            size_t pos = arg.find('=');
+            std::string key = arg.substr(0, pos);
+            std::string value = arg.substr(pos + 1);
+            if(key == "config"){
+                path_ = value;
+            }
+            else if(Defaults().find(key) != Defaults().end()){
+                overrides_[key] = value;
+            }
+            else{
+                LOG(WARNING, std::string("Config: unknown option --")+key);
+            }
+        }
+
+        bool loaded = ReadFile(path_, values_);
+        for(auto& o : overrides_){
+            values_[o.first] = o.second;
+        }
+        ApplyLogLevel();
+        if(loaded){
+            LOG(INFO, std::string("Config loaded: ")+path_);
+        }
+    }
+
+    //SIGHUP时调用，重新读取配置文件，只有可热加载的配置会生效
+    //返回thread_num是否发生变化
+    bool Reload()
+    {
+        std::unordered_map<std::string, std::string> fresh = Defaults();
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        if(!ReadFile(path_, fresh)){
+            LOG(WARNING, std::string("Config: cannot reload ")+path_);
+            return false;
+        }
+        for(auto& o : overrides_){
+            fresh[o.first] = o.second;
+        }
+
+        bool pool_changed = false;
+        for(auto& f : fresh){
+            std::string& cur = values_[f.first];
+            if(cur == f.second){
+                continue;
+            }
+            if(!IsHot(f.first)){
+                LOG(WARNING, std::string("Config: ")+f.first+std::string(" changes only after restart"));
+                continue;
+            }
+            LOG(INFO, std::string("Config reloaded: ")+f.first+std::string(" = ")+f.second);
+            pool_changed = pool_changed || (f.first == "thread_num");
+            cur = f.second;
+        }
+        ApplyLogLevel();
+        return pool_changed;
+    }
+
+    std::string GetString(const std::string& key)
+    {
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        return values_[key];
+    }
+
+    long long GetInt(const std::string& key)
+    {
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        return std::atoll(values_[key].c_str());
+    }
+};
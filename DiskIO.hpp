@@ -0,0 +1,165 @@
+#pragma once
+#include "Log.hpp"
+#include "ThreadPool.hpp"
+#include "Config.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <vector>
+#include <string>
+
+//磁盘IO线程池，和处理报文的ThreadPool分开，线程数由配置disk_thread_num决定
+//所有阻塞的文件操作都在这里执行，大文件传输和离线消息落盘时不会占住转发聊天消息的线程
+//每个文件操作带一个key(一般为文件路径)，相同key的操作总是交给同一个线程并按提交顺序执行
+//一批操作全部完成后，完成回调再交回ThreadPool执行，例如发送响应
+template<class T, class P>
+class DiskExecutor
+{
+private:
+    struct Shard
+    {
+        std::vector<Task> ops_;
+        std::mutex mtx_;
+        std::condition_variable cv_;
+    };
+
+    std::atomic<bool> run_;
+    std::atomic<int> pending_; //已提交还没有执行完的操作个数
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::vector<std::thread> workers_;
+
+    static DiskExecutor<T, P>* pde_;
+
+    DiskExecutor(int num): run_(true), pending_(0)
+    {
+        for(int i = 0;i < num;i++){
+            shards_.emplace_back(new Shard);
+        }
+        for(int i = 0;i < num;i++){
+            Shard* shard = shards_[i].get();
+            workers_.emplace_back([this, shard]{
+                std::vector<Task> batch;
+                while(true){
+                    {
+                        std::unique_lock<std::mutex> u_mtx(shard->mtx_);
+                        shard->cv_.wait(u_mtx, [this, shard]{
+                            return !run_ || !shard->ops_.empty();
+                        });
+                        if(!run_ && shard->ops_.empty()){
+                            return;
+                        }
+                        //一次取走该线程所有排队的操作，减少加锁和唤醒的次数
+                        batch.swap(shard->ops_);
+                    }
+                    for(auto& op : batch){
+                        op();
+                        pending_--;
+                    }
+                    batch.clear();
+                }
+            });
+        }
+    }
+
+public:
+    DiskExecutor(const DiskExecutor&) = delete;
+    DiskExecutor& operator=(const DiskExecutor&) = delete;
+
+    static DiskExecutor* GetInstance()
+    {
+        static std::mutex mtx;
+        if(pde_ == nullptr){
+            {
+                std::unique_lock<std::mutex> u_mtx(mtx);
+                if(pde_ == nullptr){
+                    pde_ = new DiskExecutor(Config::GetInstance()->GetInt("disk_thread_num"));
+                }
+            }
+        }
+        return pde_;
+    }
+
+    ~DiskExecutor()
+    {
+        Stop();
+    }
+
+    //停止磁盘线程，各线程执行完已经提交的操作才退出，完成回调都交给了ThreadPool，所以要在ThreadPool之前停止
+    void Stop()
+    {
+        run_ = false;
+        for(auto& s : shards_){
+            s->cv_.notify_all();
+        }
+        for(auto& t : workers_){
+            if(t.joinable()){
+                t.join();
+            }
+        }
+    }
+
+    //提交一批文件操作，first为key，second为操作
+    //所有操作都执行完之后，done交给ThreadPool的lane通道执行；ops为空时直接交给ThreadPool
+    void Submit(std::vector<std::pair<std::string, Task>>&& ops, Task done = Task(), int lane = LANE_CHAT)
+    {
+        if(ops.empty()){
+            if(done){
+                ThreadPool<T, P>::GetInstance()->AddTaskTo(lane, done);
+            }
+            return;
+        }
+
+        auto left = std::make_shared<std::atomic<int>>(ops.size());
+        auto pdone = std::make_shared<Task>(std::move(done));
+        std::hash<std::string> h;
+        pending_ += ops.size();
+        for(auto& op : ops){
+            Shard* shard = shards_[h(op.first) % shards_.size()].get();
+            Task wrapped = [left, pdone, lane, fn = std::move(op.second)]{
+                fn();
+                if(--(*left) == 0 && *pdone){
+                    ThreadPool<T, P>::GetInstance()->AddTaskTo(lane, *pdone);
+                }
+            };
+            bool queued = false;
+            {
+                std::unique_lock<std::mutex> u_mtx(shard->mtx_);
+                //在锁内判断，磁盘线程只在停止并且队列为空时才退出
+                if(run_){
+                    shard->ops_.push_back(std::move(wrapped));
+                    queued = true;
+                }
+            }
+            if(!queued){
+                //磁盘线程已经停止(正在退出)，线程池中剩下的任务提交的操作直接在调用者线程中执行
+                wrapped();
+                pending_--;
+                continue;
+            }
+            shard->cv_.notify_one();
+        }
+    }
+
+    //只提交一个文件操作
+    void Submit(const std::string& key, Task op, Task done = Task(), int lane = LANE_CHAT)
+    {
+        std::vector<std::pair<std::string, Task>> ops;
+        ops.emplace_back(key, std::move(op));
+        Submit(std::move(ops), std::move(done), lane);
+    }
+
+    //没有正在执行或者等待执行的文件操作
+    bool IsIdle()
+    {
+        return pending_ == 0;
+    }
+
+    //当前磁盘线程状态，用于SIGUSR1时输出
+    std::string Stats()
+    {
+        return std::string("disk workers=")+std::to_string(workers_.size())+std::string(" pending=")+std::to_string(pending_);
+    }
+};
@@ -4,28 +4,44 @@
 #include "Util.hpp"
 #include "ThreadPool.hpp"
 #include "Protocol.hpp"
+#include "Config.hpp"
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <cerrno>
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+
+#define IOV_BATCH 64 //一次writev最多合并的报文个数
 
 
 class Handler
 {
 private:
-    //ET模式下轮询监测，完成读任务，正常返回0，出错返回-1
-    static int RecvHelper(int sock, std::string& out)
+    //ET模式下轮询监测，完成读任务，读完返回0，出错返回-1
+    //一次最多读budget字节，达到上限时返回1，由调用者重新挂上事件，下一轮继续读
+    //防止发送很快的客户端让reactor一直停在一个连接上，并且在解析线程发现报文超限之前就把数据全部读进内存
+    static int RecvHelper(int sock, std::string& out, size_t budget)
     {
+        //缓冲区大小由配置recv_buffer决定，每个线程一份
+        thread_local std::vector<char> buffer(Config::GetInstance()->GetInt("recv_buffer"));
+        size_t total = 0;
         while(true){
-            char buffer[1024];
-            ssize_t s = recv(sock, buffer, sizeof(buffer)-1, 0);
+            if(total >= budget){
+                return 1;
+            }
+            ssize_t s = recv(sock, buffer.data(), buffer.size(), 0);
             if(s > 0){
                 //当s大于0，认为还没读完，继续读
-                buffer[s] = '\0';
-                out += buffer;
+                //按长度追加，文件正文中可能有'\0'
+                out.append(buffer.data(), s);
+                total += s;
             }
             else if(s < 0){
                 if(errno == EINTR){
@@ -54,6 +70,9 @@ private:
     //ret <  0 : 发送失败
     static int SendHelper(int sock, std::string& send_string)
     {
+        if(send_string.empty()){
+            return 1;
+        }
         //send不一定一次把数据发完，因此采用经典total+size法多次发送
         const char* start = send_string.c_str();
         ssize_t total = 0; //表示已经发了多少
@@ -65,6 +84,7 @@ private:
                 if(total == send_string.size()){
                     //这次缓冲区大小足够，一次发完
                     send_string.clear();
+                    MemUsage::Trim(send_string);
                     return 1;
                 }
                 //如果send没发完，则继续循环
@@ -88,18 +108,119 @@ private:
         }
     }
 
+    //把多个报文用writev合并发送，没发完的部分(包括后面所有报文)追加到rest中
+    //返回值含义与SendHelper相同
+    static int WritevHelper(int sock, const std::vector<std::string>& frames, std::string& rest)
+    {
+        size_t idx = 0; //当前正在发送的报文
+        size_t off = 0; //当前报文已经发送的字节数
+        while(idx < frames.size()){
+            iovec iov[IOV_BATCH];
+            int n = 0;
+            for(size_t i = idx;i < frames.size() && n < IOV_BATCH;i++, n++){
+                size_t begin = (i == idx ? off : 0);
+                iov[n].iov_base = (void*)(frames[i].c_str() + begin);
+                iov[n].iov_len = frames[i].size() - begin;
+            }
+
+            ssize_t size = writev(sock, iov, n);
+            if(size < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                else if(errno == EAGAIN || errno == EWOULDBLOCK){
+                    break;
+                }
+                else{
+                    return -1;
+                }
+            }
+
+            //根据实际发送的字节数向后推进
+            while(size > 0){
+                size_t left = frames[idx].size() - off;
+                if((size_t)size >= left){
+                    size -= left;
+                    idx++;
+                    off = 0;
+                }
+                else{
+                    off += size;
+                    size = 0;
+                }
+            }
+        }
+
+        if(idx == frames.size()){
+            return 1;
+        }
+        rest.append(frames[idx], off, std::string::npos);
+        for(size_t i = idx+1;i < frames.size();i++){
+            rest += frames[i];
+        }
+        return 0;
+    }
+
+    //把解析任务投递到当前报文所在的通道，调用者已经把parsing_置为true
+    static void PostParse(Event<ChatMessage>& event)
+    {
+        event.pr_->Hold(event);
+        Task task([&event]{
+            Parse(event);
+            event.pr_->Release(event);
+        });
+        ThreadPool<ChatMessage, Protocol>::GetInstance()->AddTaskTo(event.lane_, task);
+    }
+
 public:
+    //将多个已经构建好的报文发给event对应的连接，调用者不能持有event.sendMtx_
+    //outbuffer_为空时先在当前线程直接发送，只有没发完的部分才放入outbuffer_并使能写事件，省掉一次epoll往返
+    //outbuffer_不为空说明前面还有数据在等待写事件，为了保证顺序只能追加在后面
+    //inform为true表示这是消息线程调度的批量通知，没发完时由Sender在发完后解除连接的占用
+    //返回值含义与SendHelper相同
+    static int SendFrames(Event<ChatMessage>& event, const std::vector<std::string>& frames, bool inform = false)
+    {
+        std::unique_lock<std::mutex> u_mtx(event.sendMtx_);
+        int ret = 0;
+        if(event.outbuffer_.empty()){
+            ret = WritevHelper(event.sock_, frames, event.outbuffer_);
+        }
+        else{
+            for(auto& f : frames){
+                event.outbuffer_ += f;
+            }
+        }
+        if(ret == 0){
+            //写事件已经使能时EnableReadWrite不会重复调用epoll_ctl
+            (event.pr_)->EnableReadWrite(event, true, true);
+            if(inform){
+                event.sendingInform_ = true;
+            }
+        }
+        return ret;
+    }
+
     //event对应读事件
     static void Receiver(Event<ChatMessage>& event)
     {
         //读任务直接交给RecvHelper处理，结果直接读到inbuffer里
         //如果返回值为-1说明读出错，交给异常处理回调，之后退出
-        if(RecvHelper(event.sock_, event.inbuffer_) == -1){
+        static const size_t budget = Config::GetInstance()->GetInt("recv_budget");
+        //读事件都在reactor线程中处理，读缓冲区每个线程一份，Deliver只拷贝其中的内容
+        thread_local std::string data;
+        data.clear();
+        MemUsage::Trim(data);
+        int ret = RecvHelper(event.sock_, data, budget);
+        if(ret == -1){
             if(event.errorCallback_){
                 event.errorCallback_(event);
             }
             return;
         }
+        if(ret == 1){
+            std::unique_lock<std::mutex> u_mtx(event.sendMtx_);
+            event.pr_->Rearm(event);
+        }
         LOG(INFO, std::string("Receive successfully, sock: ")+std::to_string(event.sock_));
 
         //for test
@@ -107,10 +228,70 @@ public:
         // event.inbuffer_.clear();
         // event.pr_->EnableReadWrite(event.sock_, true, true);
 
-        Task task([&]{
-            Protocol::GetPerseMessage(event);
-        });
-        ThreadPool<ChatMessage, Protocol>::GetInstance()->AddTask(task);
+        Deliver(event, data);
+    }
+
+    //把reactor线程读到的数据交给解析任务，已经有解析任务在排队或者执行时只追加数据
+    //一个报文可能分多次读事件到达，同一连接的解析任务必须串行，否则会同时修改inbuffer_和recvMessage_
+    static void Deliver(Event<ChatMessage>& event, const std::string& data)
+    {
+        {
+            std::unique_lock<std::mutex> u_mtx(event.recvMtx_);
+            event.pending_ += data;
+            if(event.parsing_){
+                return;
+            }
+            event.parsing_ = true;
+        }
+        PostParse(event);
+    }
+
+    //请求的响应发出后调用，继续解析客户端在等待响应期间发来的数据
+    //recvMessage_和sendMessage_每个连接只有一份，必须等前一个请求处理完，才能开始解析下一个
+    static void Resume(Event<ChatMessage>& event)
+    {
+        {
+            std::unique_lock<std::mutex> u_mtx(event.recvMtx_);
+            if(!event.handling_){
+                //当前线程中直接拒绝的请求，解析任务还在继续
+                return;
+            }
+            event.handling_ = false;
+            if(event.pending_.empty() && event.inbuffer_.empty()){
+                event.parsing_ = false;
+                return;
+            }
+        }
+        PostParse(event);
+    }
+
+    //解析任务，处理完pending_中已有的数据后，如果期间又有新数据到达就继续处理
+    //GetPerseMessage返回1时请求已经交给处理任务，解析暂停，由Resume继续
+    static void Parse(Event<ChatMessage>& event)
+    {
+        //inbuffer_中可能还有流水线发来的请求，第一次即使没有新数据也要解析
+        bool more = true;
+        while(true){
+            {
+                std::unique_lock<std::mutex> u_mtx(event.recvMtx_);
+                if(event.pending_.empty() && !more){
+                    event.parsing_ = false;
+                    return;
+                }
+                event.inbuffer_ += event.pending_;
+                event.pending_.clear();
+                MemUsage::Trim(event.pending_);
+            }
+            int ret = Protocol::GetPerseMessage(event);
+            if(ret == 1){
+                //请求已经交给处理任务，由它在ClearEvent时记下占用的内存
+                return;
+            }
+            MemUsage::Trim(event.inbuffer_);
+            event.inBytes_ = MemUsage::Str(event.inbuffer_);
+            event.msgBytes_ = event.recvMessage_.Bytes() + event.sendMessage_.Bytes();
+            more = (ret == 2);
+        }
     }
 
     //event对应写事件
@@ -118,27 +299,154 @@ public:
     {
         //写任务直接交给SendHelper处理，将outbuffer里的内容直接读走
         //如果返回值为-1说明写出错，交给异常处理回调，之后退出
+        std::unique_lock<std::mutex> u_mtx(event.sendMtx_);
         int ret = SendHelper(event.sock_, event.outbuffer_);
         if(ret == -1){
+            u_mtx.unlock();
             if(event.errorCallback_){
                 event.errorCallback_(event);
             }
             return;
         }
         else if (ret == 1){ //outbuffer发送完毕，关闭写
-            (event.pr_)->EnableReadWrite(event.sock_, true, false);
+            (event.pr_)->EnableReadWrite(event, true, false);
+            bool release = event.sendingInform_;
+            event.sendingInform_ = false;
+            u_mtx.unlock();
             LOG(INFO, std::string("Send successfully, sock: ")+std::to_string(event.sock_));
 
-            //设置长连接的占用为false，即设置当前长连接已不被占用
-            //如果为短链接，则不会有任何操作
-            ThreadPool<ChatMessage, Protocol>::GetInstance()->SetCurrSockFalse(event.sock_);
+            //批量通知已经全部发完，设置长连接的占用为false，即设置当前长连接已不被占用
+            //只有响应报文时不能解除占用，因为可能还有批量通知任务在线程池中等待执行
+            if(release){
+                ThreadPool<ChatMessage, Protocol>::GetInstance()->SetCurrSockFalse(event.sock_);
+            }
         }
         else if (ret == 0){ //outbuffer本轮发送完毕，等下一次写事件就绪，还要再发
-            (event.pr_)->EnableReadWrite(event.sock_, true, true);
+            (event.pr_)->EnableReadWrite(event, true, true);
         }
         else{}
     }
 
+    //关闭报文超过接收期限还没收完的连接，防止慢速客户端一直占着缓冲区，只能在reactor线程中调用
+    //先收集再关闭，关闭时会从eventsMap_中删除
+    static void ExpireRequests(Reactor<ChatMessage>* pr)
+    {
+        long long now = RequestLimiter::NowMs();
+        std::vector<int> expired;
+        for(auto& e : pr->GetEvents()){
+            long long deadline = e.second.deadline_;
+            if(deadline != 0 && now > deadline){
+                expired.push_back(e.first);
+            }
+        }
+        for(int sock : expired){
+            if(!pr->isExists(sock)){
+                continue;
+            }
+            Event<ChatMessage>& event = pr->GetEvent(sock);
+            LOG(WARNING, std::string("Request deadline exceeded, sock: ")+std::to_string(sock));
+            RequestLimiter::GetInstance()->CountTimeout();
+            event.deadline_ = 0;
+            if(event.errorCallback_){
+                event.errorCallback_(event);
+            }
+        }
+    }
+
+    //内存统计，返回要输出的几行，只能在reactor线程中调用(eventsMap_只在reactor线程中修改)
+    //第一行为各个子系统的总量，第二行为Chatroom各容器，之后为占用最多的top个连接
+    //pending_和outbuffer_在各自的锁内读取，inbuffer_和报文读取持有连接的任务记下的值
+    static std::vector<std::string> MemoryStats(Reactor<ChatMessage>* pr, size_t top)
+    {
+        struct ConnMem
+        {
+            int sock_;
+            size_t in_, pending_, out_, msgs_, inform_, total_;
+        };
+        std::unordered_map<int, size_t> queued;
+        size_t inform_num = ThreadPool<ChatMessage, Protocol>::GetInstance()->QueuedBytes(queued);
+
+        const auto& events = pr->GetEvents();
+        std::vector<ConnMem> conns;
+        conns.reserve(events.size());
+        size_t in = 0, pending = 0, out = 0, msgs = 0, inform = 0;
+        for(auto& e : events){
+            Event<ChatMessage>& ev = pr->GetEvent(e.first);
+            ConnMem c;
+            c.sock_ = e.first;
+            c.in_ = ev.inBytes_;
+            c.msgs_ = ev.msgBytes_;
+            {
+                std::unique_lock<std::mutex> u_mtx(ev.recvMtx_);
+                c.pending_ = MemUsage::Str(ev.pending_);
+            }
+            {
+                std::unique_lock<std::mutex> u_mtx(ev.sendMtx_);
+                c.out_ = MemUsage::Str(ev.outbuffer_);
+            }
+            auto it = queued.find(e.first);
+            c.inform_ = (it == queued.end() ? 0 : it->second);
+            c.total_ = c.in_ + c.pending_ + c.out_ + c.msgs_ + c.inform_;
+            in += c.in_;
+            pending += c.pending_;
+            out += c.out_;
+            msgs += c.msgs_;
+            inform += c.inform_;
+            conns.push_back(c);
+        }
+        //已经关闭的连接的通知消息还没来得及删除的也算上
+        for(auto& q : queued){
+            if(events.find(q.first) == events.end()){
+                inform += q.second;
+            }
+        }
+        size_t structs = MemUsage::Table(events);
+        //关闭的连接留给新连接复用的Event、通知队列和batch
+        size_t pooled_event_bytes = 0, pooled_msg_bytes = 0;
+        size_t pooled_events = pr->PooledEvents(pooled_event_bytes);
+        size_t pooled_msgs = ThreadPool<ChatMessage, Protocol>::GetInstance()->PooledBytes(pooled_msg_bytes);
+        size_t pooled = pooled_event_bytes + pooled_msg_bytes;
+
+        size_t chatroom = 0;
+        std::string chatroom_detail = Chatroom::GetInstance()->MemStats(chatroom);
+        size_t tracked = structs + in + pending + out + msgs + inform + pooled + chatroom;
+
+        std::vector<std::string> lines;
+        lines.push_back(std::string("memory conns=")+std::to_string(events.size())
+            +std::string(" conn_structs=")+std::to_string(structs)
+            +std::string(" inbuffer=")+std::to_string(in)
+            +std::string(" pending=")+std::to_string(pending)
+            +std::string(" outbuffer=")+std::to_string(out)
+            +std::string(" messages=")+std::to_string(msgs)
+            +std::string(" inform_queued=")+std::to_string(inform_num)
+            +std::string(" inform_bytes=")+std::to_string(inform)
+            +std::string(" pooled_events=")+std::to_string(pooled_events)
+            +std::string(" pooled_msg_slots=")+std::to_string(pooled_msgs)
+            +std::string(" pooled_bytes=")+std::to_string(pooled)
+            +std::string(" chatroom=")+std::to_string(chatroom)
+            +std::string(" tracked=")+std::to_string(tracked)
+            +std::string(" ")+MemUsage::Process());
+        lines.push_back(std::string("memory chatroom ")+chatroom_detail);
+
+        top = std::min(top, conns.size());
+        std::partial_sort(conns.begin(), conns.begin() + top, conns.end(), [](const ConnMem& a, const ConnMem& b){
+            return a.total_ > b.total_;
+        });
+        for(size_t i = 0;i < top && conns[i].total_ > 0;i++){
+            const ConnMem& c = conns[i];
+            std::string user = Chatroom::GetInstance()->SockUser(c.sock_);
+            lines.push_back(std::string("memory top sock=")+std::to_string(c.sock_)
+                +std::string(" user=")+(user.empty() ? std::string("-") : user)
+                +std::string(" total=")+std::to_string(c.total_)
+                +std::string(" inbuffer=")+std::to_string(c.in_)
+                +std::string(" pending=")+std::to_string(c.pending_)
+                +std::string(" outbuffer=")+std::to_string(c.out_)
+                +std::string(" messages=")+std::to_string(c.msgs_)
+                +std::string(" inform=")+std::to_string(c.inform_));
+        }
+        return lines;
+    }
+
     //event对应异常事件，直接关闭连接
     static void Errorer(Event<ChatMessage>& event)
     {
@@ -157,13 +465,18 @@ public:
             //  即长连接关闭，不需要同时也关闭短连接，短链接自己会关
             //并且还有心跳机制保证所有连接退出
             Chatroom::GetInstance()->OnlineErase(it2->second);
+            Cluster::GetInstance()->SetOnline(it2->second, false);
+            Presence::GetInstance()->Publish(it2->second, false);
             Chatroom::GetInstance()->LongSockErase(event.sock_);
         }
         else{
             //说明连接还没建立，直接退出
         }
 
-        event.pr_->DelEvent(event.sock_);
+        //在消息队列的锁内删除，消息线程检查连接存在和引用Event之间不会被打断
+        ThreadPool<ChatMessage, Protocol>::GetInstance()->EraseSock(event.sock_, [&event]{
+            event.pr_->DelEvent(event.sock_);
+        });
     }
 
 
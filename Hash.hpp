@@ -0,0 +1,129 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <algorithm>
+
+//流式SHA-256，正文每到达一部分就Update一次，收完后Final得到十六进制摘要
+//用于文件内容寻址，相同内容的文件只存一份
+class Sha256
+{
+private:
+    uint32_t state_[8];
+    uint64_t len_;          //已经输入的总字节数
+    unsigned char buf_[64]; //不足一块的剩余数据
+    size_t bufLen_;
+
+    static uint32_t Rotr(uint32_t x, int n)
+    {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    void Transform(const unsigned char* p)
+    {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+
+        uint32_t w[64];
+        for(int i = 0;i < 16;i++){
+            w[i] = (uint32_t)p[i*4] << 24 | (uint32_t)p[i*4+1] << 16 | (uint32_t)p[i*4+2] << 8 | (uint32_t)p[i*4+3];
+        }
+        for(int i = 16;i < 64;i++){
+            uint32_t s0 = Rotr(w[i-15], 7) ^ Rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+            uint32_t s1 = Rotr(w[i-2], 17) ^ Rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+
+        uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+        uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+        for(int i = 0;i < 64;i++){
+            uint32_t t1 = h + (Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state_[0] += a; state_[1] += b; state_[2] += c; state_[3] += d;
+        state_[4] += e; state_[5] += f; state_[6] += g; state_[7] += h;
+    }
+
+public:
+    Sha256()
+    {
+        Reset();
+    }
+
+    void Reset()
+    {
+        static const uint32_t init[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        memcpy(state_, init, sizeof(state_));
+        len_ = 0;
+        bufLen_ = 0;
+    }
+
+    void Update(const char* data, size_t n)
+    {
+        const unsigned char* p = (const unsigned char*)data;
+        len_ += n;
+        if(bufLen_ > 0){
+            size_t fill = std::min(n, 64 - bufLen_);
+            memcpy(buf_ + bufLen_, p, fill);
+            bufLen_ += fill;
+            p += fill;
+            n -= fill;
+            if(bufLen_ < 64){
+                return;
+            }
+            Transform(buf_);
+            bufLen_ = 0;
+        }
+        //整块直接从输入中计算，不经过buf_拷贝
+        for(;n >= 64;p += 64, n -= 64){
+            Transform(p);
+        }
+        memcpy(buf_, p, n);
+        bufLen_ = n;
+    }
+
+    void Update(const std::string& data)
+    {
+        Update(data.data(), data.size());
+    }
+
+    //结束计算，返回64个字符的小写十六进制摘要，之后需要Reset才能再次使用
+    std::string Final()
+    {
+        uint64_t bits = len_ * 8;
+        unsigned char pad[72] = {0x80};
+        size_t pad_len = (bufLen_ < 56) ? (56 - bufLen_) : (120 - bufLen_);
+        for(int i = 0;i < 8;i++){
+            pad[pad_len+i] = (unsigned char)(bits >> (56 - 8 * i));
+        }
+        Update((const char*)pad, pad_len + 8);
+
+        static const char hex[] = "0123456789abcdef";
+        std::string out;
+        out.reserve(64);
+        for(int i = 0;i < 8;i++){
+            for(int j = 28;j >= 0;j -= 4){
+                out += hex[(state_[i] >> j) & 0xf];
+            }
+        }
+        return out;
+    }
+};
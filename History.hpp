@@ -0,0 +1,615 @@
+#pragma once
+#include "Log.hpp"
+#include "Config.hpp"
+#include "Util.hpp"
+#include "Hash.hpp"
+#include <zlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+
+//一条历史消息，stamp_为服务器收到消息的时间(微秒)，同一个会话内严格递增，作为查询和翻页的位置
+struct HistoryEntry
+{
+    uint64_t stamp_;
+    std::string time_;   //客户端给出的Time
+    std::string sender_;
+    std::string body_;
+};
+
+//按会话保存的消息历史，会话是两个用户之间的单聊或者一个群聊，消息投递之后也不删除
+//每个会话一个数据文件(.jhist)，由按stamp排列的zlib压缩块组成，每块的块头记录条数和第一条、最后一条的stamp
+//每个块在索引文件(.jidx)中对应一项，内存中每个会话只保存块索引，查询时二分找到块再读出解压，不扫描整个会话
+//写入只追加到内存中的当前块，满history_block_msgs条或history_block_bytes字节后交给后台线程压缩落盘，发送消息的线程不碰磁盘
+//当前块超过history_flush_ms也会落盘，进程崩溃时最多丢失这段时间内的历史；SIGTERM和热升级时全部落盘
+//集群模式下每个节点保存本节点用户参与的会话，跨节点的单聊在双方节点各存一份；历史不写入复制日志
+class History
+{
+public:
+    typedef std::shared_ptr<const std::vector<HistoryEntry>> Sealed;
+    //块写入文件之后在写线程中调用，参数为会话key和块内的消息
+    typedef std::function<void(const std::string&, const Sealed&)> Sink;
+
+private:
+    //块索引的一项，在索引文件中按这个布局直接存储
+    struct Block
+    {
+        uint64_t first_;  //块内第一条消息的stamp
+        uint64_t last_;   //块内最后一条消息的stamp
+        uint64_t offset_; //块在数据文件中的偏移
+        uint32_t size_;   //块头加压缩数据的字节数
+        uint32_t count_;  //块内消息条数
+    };
+
+    //数据文件中的块头，后面紧跟comp_字节的压缩数据
+    struct BlockHeader
+    {
+        uint32_t magic_;
+        uint32_t count_;
+        uint64_t first_;
+        uint64_t last_;
+        uint32_t raw_;  //解压后的字节数
+        uint32_t comp_; //压缩数据的字节数
+    };
+
+    static const uint32_t MAGIC = 0x4842484a; //"JHBH"
+
+    struct Conv
+    {
+        bool loaded_;     //index_是否已经从磁盘加载
+        uint64_t last_;   //最后一条消息的stamp
+        std::vector<Block> index_;   //已经写入文件的块
+        std::deque<Sealed> sealed_;  //已经封块、还在等待写入文件的块
+        std::vector<HistoryEntry> tail_; //当前块
+        size_t tailBytes_;
+        std::chrono::steady_clock::time_point tailSince_; //当前块第一条消息的时间
+
+        Conv(): loaded_(false), last_(0), tailBytes_(0)
+        {}
+    };
+
+    std::mutex mtx_;   //保护convs_、queue_和dirty_
+    std::mutex ioMtx_; //写文件和加载索引互斥，保证加载到的索引和文件一致
+    std::condition_variable cv_;     //有块需要写入时通知写线程
+    std::condition_variable idleCv_; //写线程写完一批时通知Flush
+    std::unordered_map<std::string, Conv> convs_;
+    std::deque<std::pair<std::string, Sealed>> queue_; //等待写入的块，同一个会话的块按顺序排列
+    std::unordered_set<std::string> dirty_;            //当前块不为空的会话
+    bool writing_;
+    Sink sink_; //在ioMtx_内设置和调用
+
+    std::string dir_;
+    size_t blockMsgs_;
+    size_t blockBytes_;
+    long long flushMs_;
+
+    std::atomic<long long> appends_;   //追加的消息条数
+    std::atomic<long long> blocks_;    //写入文件的块数
+    std::atomic<long long> rawBytes_;  //写入的块压缩前的字节数
+    std::atomic<long long> diskBytes_; //写入的块压缩后的字节数
+    std::atomic<long long> queries_;   //查询次数
+    std::atomic<long long> readBlocks_; //查询读出并解压的块数
+
+    static History* phs_;
+
+    History(): writing_(false), appends_(0), blocks_(0), rawBytes_(0), diskBytes_(0), queries_(0), readBlocks_(0)
+    {
+        Config* pc = Config::GetInstance();
+        dir_ = pc->GetString("history_dir");
+        if(dir_.empty() || dir_.back() != '/'){
+            dir_ += '/';
+        }
+        blockMsgs_ = std::max<long long>(1, pc->GetInt("history_block_msgs"));
+        blockBytes_ = std::max<long long>(1, pc->GetInt("history_block_bytes"));
+        flushMs_ = std::max<long long>(1, pc->GetInt("history_flush_ms"));
+        mkdir(dir_.c_str(), 0777);
+        std::thread(&History::WriteLoop, this).detach();
+    }
+
+    static uint64_t NowUs()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    //会话key对应的文件名，用户名和群聊名可能含有任意字符，取摘要的前32位
+    std::string PathOf(const std::string& key, const char* ext)
+    {
+        Sha256 h;
+        h.Update(key);
+        return dir_ + h.Final().substr(0, 32) + ext;
+    }
+
+    //在mtx_内调用，把当前块封块并放入写入队列
+    void Seal(const std::string& key, Conv& conv)
+    {
+        if(conv.tail_.empty()){
+            return;
+        }
+        Sealed block = std::make_shared<const std::vector<HistoryEntry>>(std::move(conv.tail_));
+        conv.tail_.clear();
+        conv.tailBytes_ = 0;
+        conv.sealed_.push_back(block);
+        queue_.emplace_back(key, block);
+        dirty_.erase(key);
+        cv_.notify_one();
+    }
+
+    static std::string Encode(const std::vector<HistoryEntry>& entries)
+    {
+        std::string raw;
+        for(auto& e : entries){
+            Util::PutU64(raw, e.stamp_);
+            Util::PutString(raw, e.time_);
+            Util::PutString(raw, e.sender_);
+            Util::PutString(raw, e.body_);
+        }
+        return raw;
+    }
+
+    static bool Decode(const std::string& raw, std::vector<HistoryEntry>& out)
+    {
+        BinReader rd(raw.data(), raw.data() + raw.size());
+        while(rd.cur_ < rd.end_){
+            HistoryEntry e;
+            if(!rd.GetU64(e.stamp_) || !rd.GetString(e.time_) || !rd.GetString(e.sender_) || !rd.GetString(e.body_)){
+                return false;
+            }
+            out.push_back(std::move(e));
+        }
+        return true;
+    }
+
+    static bool ReadAt(int fd, void* buf, size_t n, uint64_t offset)
+    {
+        size_t total = 0;
+        while(total < n){
+            ssize_t s = pread(fd, (char*)buf + total, n - total, offset + total);
+            if(s < 0 && errno == EINTR){
+                continue;
+            }
+            if(s <= 0){
+                return false;
+            }
+            total += s;
+        }
+        return true;
+    }
+
+    //在ioMtx_内调用，从索引文件加载key的块索引
+    //索引文件比数据文件短(写完块之后崩溃)时扫描块头补齐，数据文件末尾不完整的块截掉
+    void Load(const std::string& key)
+    {
+        {
+            std::unique_lock<std::mutex> u_mtx(mtx_);
+            auto it = convs_.find(key);
+            if(it != convs_.end() && it->second.loaded_){
+                return;
+            }
+        }
+        std::vector<Block> blocks;
+        std::string data_path = PathOf(key, ".jhist");
+        std::string index_path = PathOf(key, ".jidx");
+        int fd = open(data_path.c_str(), O_RDWR);
+        if(fd >= 0){
+            struct stat st;
+            uint64_t file_size = (fstat(fd, &st) == 0) ? st.st_size : 0;
+            uint64_t end = 0;
+            int ifd = open(index_path.c_str(), O_RDWR | O_CREAT, 0644);
+            if(ifd >= 0){
+                //索引文件一次读入，每项对应的块都必须完整地在数据文件中
+                struct stat ist;
+                size_t entries = (fstat(ifd, &ist) == 0) ? ist.st_size / sizeof(Block) : 0;
+                blocks.resize(entries);
+                if(entries > 0 && !ReadAt(ifd, blocks.data(), entries * sizeof(Block), 0)){
+                    blocks.clear();
+                }
+                size_t valid = 0;
+                for(;valid < blocks.size() && blocks[valid].offset_ == end && end + blocks[valid].size_ <= file_size;valid++){
+                    end += blocks[valid].size_;
+                }
+                blocks.resize(valid);
+                size_t indexed = blocks.size();
+                std::string repair;
+                BlockHeader h;
+                while(end + sizeof(h) <= file_size && ReadAt(fd, &h, sizeof(h), end) && h.magic_ == MAGIC && end + sizeof(h) + h.comp_ <= file_size){
+                    Block b2{h.first_, h.last_, end, (uint32_t)(sizeof(h) + h.comp_), h.count_};
+                    blocks.push_back(b2);
+                    repair.append((const char*)&b2, sizeof(b2));
+                    end += b2.size_;
+                }
+                if(ftruncate(ifd, indexed * sizeof(Block)) < 0 || lseek(ifd, 0, SEEK_END) < 0 || !Util::WriteAll(ifd, repair)){
+                    LOG(ERROR, std::string("History: repair index error: ")+index_path);
+                }
+                close(ifd);
+            }
+            if(end < file_size){
+                LOG(WARNING, std::string("History: truncate incomplete block: ")+data_path);
+                if(ftruncate(fd, end) < 0){
+                    LOG(ERROR, std::string("History: truncate error: ")+data_path);
+                }
+            }
+            close(fd);
+        }
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        if(fd < 0 && convs_.find(key) == convs_.end()){
+            //没有这个会话，不为查询创建空的会话
+            return;
+        }
+        Conv& conv = convs_[key];
+        conv.index_ = std::move(blocks);
+        conv.loaded_ = true;
+        if(!conv.index_.empty()){
+            conv.last_ = std::max(conv.last_, conv.index_.back().last_);
+        }
+    }
+
+    //在ioMtx_内调用，把一个封好的块压缩之后追加到数据文件和索引文件
+    void WriteBlock(const std::string& key, const Sealed& entries)
+    {
+        Load(key);
+        std::string raw = Encode(*entries);
+        uLongf comp_len = compressBound(raw.size());
+        std::string out(sizeof(BlockHeader) + comp_len, '\0');
+        if(compress2((Bytef*)&out[sizeof(BlockHeader)], &comp_len, (const Bytef*)raw.data(), raw.size(), Z_BEST_SPEED) != Z_OK){
+            LOG(ERROR, "History: compress error");
+            comp_len = 0;
+        }
+        out.resize(sizeof(BlockHeader) + comp_len);
+        BlockHeader h{MAGIC, (uint32_t)entries->size(), entries->front().stamp_, entries->back().stamp_, (uint32_t)raw.size(), (uint32_t)comp_len};
+        memcpy(&out[0], &h, sizeof(h));
+
+        Block b{h.first_, h.last_, 0, (uint32_t)out.size(), h.count_};
+        bool ok = false;
+        std::string data_path = PathOf(key, ".jhist");
+        int fd = open(data_path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if(fd >= 0 && comp_len > 0){
+            off_t end = lseek(fd, 0, SEEK_END);
+            b.offset_ = end;
+            ok = end >= 0 && Util::WriteAll(fd, out);
+        }
+        if(fd >= 0){
+            close(fd);
+        }
+        if(ok){
+            int ifd = open(PathOf(key, ".jidx").c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+            if(ifd < 0 || !Util::WriteAll(ifd, std::string((const char*)&b, sizeof(b)))){
+                //索引缺的项在下次加载时由块头补齐
+                LOG(ERROR, std::string("History: append index error: ")+data_path);
+            }
+            if(ifd >= 0){
+                close(ifd);
+            }
+            blocks_++;
+            rawBytes_ += raw.size();
+            diskBytes_ += out.size();
+            if(sink_){
+                sink_(key, entries);
+            }
+        }
+        else{
+            LOG(ERROR, std::string("History: append block error: ")+data_path);
+        }
+
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        Conv& conv = convs_[key];
+        if(ok){
+            conv.index_.push_back(b);
+        }
+        conv.sealed_.pop_front();
+    }
+
+    //写线程: 写入封好的块，每history_flush_ms把存在太久的当前块封块
+    void WriteLoop()
+    {
+        auto last_check = std::chrono::steady_clock::now();
+        while(true){
+            std::deque<std::pair<std::string, Sealed>> batch;
+            {
+                std::unique_lock<std::mutex> u_mtx(mtx_);
+                cv_.wait_for(u_mtx, std::chrono::milliseconds(flushMs_), [this]{ return !queue_.empty(); });
+                auto now = std::chrono::steady_clock::now();
+                if(now - last_check >= std::chrono::milliseconds(flushMs_)){
+                    last_check = now;
+                    std::vector<std::string> expired;
+                    for(auto& key : dirty_){
+                        if(now - convs_[key].tailSince_ >= std::chrono::milliseconds(flushMs_)){
+                            expired.push_back(key);
+                        }
+                    }
+                    for(auto& key : expired){
+                        Seal(key, convs_[key]);
+                    }
+                }
+                batch.swap(queue_);
+                writing_ = !batch.empty();
+            }
+            if(batch.empty()){
+                continue;
+            }
+            {
+                std::unique_lock<std::mutex> io_mtx(ioMtx_);
+                for(auto& one : batch){
+                    WriteBlock(one.first, one.second);
+                }
+            }
+            std::unique_lock<std::mutex> u_mtx(mtx_);
+            writing_ = false;
+            idleCv_.notify_all();
+        }
+    }
+
+    //读出并解压一个块，失败返回false
+    bool ReadBlock(int fd, const Block& b, std::vector<HistoryEntry>& out)
+    {
+        std::string buf(b.size_, '\0');
+        BlockHeader h;
+        if(b.size_ < sizeof(h) || !ReadAt(fd, &buf[0], b.size_, b.offset_)){
+            return false;
+        }
+        memcpy(&h, buf.data(), sizeof(h));
+        if(h.magic_ != MAGIC){
+            return false;
+        }
+        std::string raw(h.raw_, '\0');
+        uLongf raw_len = h.raw_;
+        if(uncompress((Bytef*)&raw[0], &raw_len, (const Bytef*)buf.data() + sizeof(h), h.comp_) != Z_OK || raw_len != h.raw_){
+            return false;
+        }
+        readBlocks_++;
+        return Decode(raw, out);
+    }
+
+public:
+    History(const History&) = delete;
+    History& operator=(const History&) = delete;
+
+    static History* GetInstance()
+    {
+        static std::mutex mtx;
+        if(phs_ == nullptr){
+            {
+                std::unique_lock<std::mutex> u_mtx(mtx);
+                if(phs_ == nullptr){
+                    phs_ = new History;
+                }
+            }
+        }
+        return phs_;
+    }
+
+    //单聊会话的key，两个用户的顺序无关
+    static std::string PairKey(const std::string& a, const std::string& b)
+    {
+        return (a < b) ? (std::string("u:")+a+std::string("\n")+b) : (std::string("u:")+b+std::string("\n")+a);
+    }
+
+    static std::string GroupKey(const std::string& group)
+    {
+        return std::string("g:")+group;
+    }
+
+    //设置块写入文件之后的回调，用于后台建立搜索索引
+    void SetSink(Sink sink)
+    {
+        std::unique_lock<std::mutex> io_mtx(ioMtx_);
+        sink_ = std::move(sink);
+    }
+
+    //向会话key追加一条消息，只修改内存，返回分配的stamp
+    uint64_t Append(const std::string& key, const std::string& time, const std::string& sender, const std::string& body)
+    {
+        appends_++;
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        Conv& conv = convs_[key];
+        uint64_t stamp = std::max(NowUs(), conv.last_ + 1);
+        conv.last_ = stamp;
+        if(conv.tail_.empty()){
+            conv.tailSince_ = std::chrono::steady_clock::now();
+            dirty_.insert(key);
+        }
+        conv.tail_.push_back(HistoryEntry{stamp, time, sender, body});
+        conv.tailBytes_ += time.size() + sender.size() + body.size();
+        if(conv.tail_.size() >= blockMsgs_ || conv.tailBytes_ >= blockBytes_){
+            Seal(key, conv);
+        }
+        return stamp;
+    }
+
+    //查询会话key中stamp在anchor之前(before为true)或者之后的最多n条消息，按stamp从小到大放入out
+    //before时取离anchor最近的n条；正文累计超过max_bytes时提前结束，至少一条
+    //more表示这个方向上还有更多的消息
+    void Query(const std::string& key, uint64_t anchor, bool before, size_t n, size_t max_bytes, std::vector<HistoryEntry>& out, bool& more)
+    {
+        queries_++;
+        more = false;
+        bool loaded = false;
+        {
+            std::unique_lock<std::mutex> u_mtx(mtx_);
+            auto it = convs_.find(key);
+            loaded = it != convs_.end() && it->second.loaded_;
+        }
+        if(!loaded){
+            std::unique_lock<std::mutex> io_mtx(ioMtx_);
+            Load(key);
+        }
+        auto match = [&](uint64_t stamp){
+            return before ? (stamp < anchor) : (stamp > anchor);
+        };
+        //在锁内只复制需要的内存中的消息和块索引，读文件和解压在锁外
+        std::vector<HistoryEntry> mem;
+        std::vector<Block> blocks;
+        {
+            std::unique_lock<std::mutex> u_mtx(mtx_);
+            auto it = convs_.find(key);
+            if(it == convs_.end()){
+                return;
+            }
+            Conv& conv = it->second;
+            std::vector<const HistoryEntry*> recent; //内存中的消息，按stamp从小到大
+            for(auto& block : conv.sealed_){
+                for(auto& e : *block){
+                    recent.push_back(&e);
+                }
+            }
+            for(auto& e : conv.tail_){
+                recent.push_back(&e);
+            }
+            const auto& index = conv.index_;
+            if(before){
+                for(auto rit = recent.rbegin();rit != recent.rend() && mem.size() <= n;++rit){
+                    if(match((*rit)->stamp_)){
+                        mem.push_back(**rit);
+                    }
+                }
+                //第一个first_ >= anchor的块之前的块都可能有匹配的消息，从后往前取到够数为止
+                //跨过anchor的块只有一部分匹配，不计入个数
+                size_t got = mem.size();
+                size_t i = std::lower_bound(index.begin(), index.end(), anchor, [](const Block& b, uint64_t v){ return b.first_ < v; }) - index.begin();
+                while(i > 0 && got <= n){
+                    i--;
+                    blocks.push_back(index[i]);
+                    got += (index[i].last_ < anchor) ? index[i].count_ : 0;
+                }
+            }
+            else{
+                //第一个last_ > anchor的块开始往后取
+                size_t i = std::upper_bound(index.begin(), index.end(), anchor, [](uint64_t v, const Block& b){ return v < b.last_; }) - index.begin();
+                size_t got = 0;
+                for(;i < index.size() && got <= n;i++){
+                    blocks.push_back(index[i]);
+                    got += (index[i].first_ > anchor) ? index[i].count_ : 0;
+                }
+                for(size_t j = 0;j < recent.size() && got <= n;j++){
+                    if(match(recent[j]->stamp_)){
+                        mem.push_back(*recent[j]);
+                        got++;
+                    }
+                }
+            }
+        }
+
+        //before: mem和blocks都是从新到旧；after: blocks和mem都是从旧到新，blocks在前
+        std::vector<HistoryEntry> picked;
+        size_t bytes = 0;
+        auto take = [&](HistoryEntry& e){
+            if(picked.size() >= n || (bytes >= max_bytes && !picked.empty())){
+                more = true;
+                return false;
+            }
+            bytes += e.body_.size();
+            picked.push_back(std::move(e));
+            return true;
+        };
+        bool full = false;
+        if(before){
+            for(auto& e : mem){
+                if(!take(e)){
+                    full = true;
+                    break;
+                }
+            }
+        }
+        if(!full && !blocks.empty()){
+            int fd = open(PathOf(key, ".jhist").c_str(), O_RDONLY);
+            if(fd < 0){
+                LOG(ERROR, std::string("History: open error, key: ")+key);
+            }
+            for(size_t i = 0;fd >= 0 && i < blocks.size() && !full;i++){
+                std::vector<HistoryEntry> entries;
+                if(!ReadBlock(fd, blocks[i], entries)){
+                    LOG(ERROR, std::string("History: bad block, key: ")+key);
+                    continue;
+                }
+                if(before){
+                    for(auto rit = entries.rbegin();rit != entries.rend();++rit){
+                        if(match(rit->stamp_) && !take(*rit)){
+                            full = true;
+                            break;
+                        }
+                    }
+                }
+                else{
+                    for(auto& e : entries){
+                        if(match(e.stamp_) && !take(e)){
+                            full = true;
+                            break;
+                        }
+                    }
+                }
+            }
+            if(fd >= 0){
+                close(fd);
+            }
+        }
+        if(!before && !full){
+            for(auto& e : mem){
+                if(!take(e)){
+                    break;
+                }
+            }
+        }
+        if(before){
+            std::reverse(picked.begin(), picked.end());
+        }
+        out = std::move(picked);
+    }
+
+    //读出会话key中stamp对应的一条消息，不存在返回false
+    bool Get(const std::string& key, uint64_t stamp, HistoryEntry& out)
+    {
+        std::vector<HistoryEntry> entries;
+        bool more = false;
+        Query(key, stamp + 1, true, 1, SIZE_MAX, entries, more);
+        if(entries.empty() || entries[0].stamp_ != stamp){
+            return false;
+        }
+        out = std::move(entries[0]);
+        return true;
+    }
+
+    //把所有当前块封块并等待写线程全部写完，SIGTERM和热升级交接时调用
+    void Flush()
+    {
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        std::vector<std::string> keys(dirty_.begin(), dirty_.end());
+        for(auto& key : keys){
+            Seal(key, convs_[key]);
+        }
+        idleCv_.wait(u_mtx, [this]{ return queue_.empty() && !writing_; });
+    }
+
+    std::string Stats()
+    {
+        size_t convs = 0, pending = 0;
+        {
+            std::unique_lock<std::mutex> u_mtx(mtx_);
+            convs = convs_.size();
+            pending = queue_.size();
+        }
+        return std::string("history convs=")+std::to_string(convs)
+            +std::string(" appends=")+std::to_string(appends_)
+            +std::string(" blocks=")+std::to_string(blocks_)
+            +std::string(" pending_blocks=")+std::to_string(pending)
+            +std::string(" raw_bytes=")+std::to_string(rawBytes_)
+            +std::string(" disk_bytes=")+std::to_string(diskBytes_)
+            +std::string(" queries=")+std::to_string(queries_)
+            +std::string(" read_blocks=")+std::to_string(readBlocks_);
+    }
+};
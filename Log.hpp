@@ -1,10 +1,25 @@
 #pragma once
 #include <ctime>
+#include <atomic>
 #include <iostream>
 #include <string>
 
 
-#define LOG(level, message) Log(#level, message, __FILE__, __LINE__)
+//低于当前日志级别的日志直接跳过，message表达式也不会被求值
+#define LOG(level, message) do{ if(LogLevelOf(#level) >= LogLevel()) Log(#level, message, __FILE__, __LINE__); }while(0)
+
+//日志级别按首字母区分: INFO < WARNING < ERROR < FATAL
+constexpr int LogLevelOf(const char* level)
+{
+    return level[0] == 'W' ? 1 : level[0] == 'E' ? 2 : level[0] == 'F' ? 3 : 0;
+}
+
+//当前日志级别，所有编译单元共用一个
+inline std::atomic<int>& LogLevel()
+{
+    static std::atomic<int> level(0);
+    return level;
+}
 
 static void Log(std::string level, std::string message, std::string file, int line)
 {
@@ -14,6 +29,6 @@ static void Log(std::string level, std::string message, std::string file, int li
     else if(message[message.size()-1] == '\n'){
         message.resize(message.size()-1);
     }
-    
+
     std::cout << "[" << level << "]" << "[" << time(nullptr) << "]" << "[" << message << "]" << "[" << file << "]" << "[" << line << "]" << std::endl;
-}
\ No newline at end of file
+}
@@ -0,0 +1,158 @@
+#pragma once
+#include <malloc.h>
+#include <unistd.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <type_traits>
+#include <memory_resource>
+#include <cstddef>
+
+//内存统计，按libstdc++的布局估算容器占用的堆内存
+//平时只由持有连接的任务记下缓冲区的大小，其余都在输出运行状态时遍历容器计算
+//  短字符串(不超过15字节)存放在对象内部，不占堆内存
+//  哈希表每个元素单独分配一个节点(next指针+缓存的哈希值+元素)，另有一个桶数组
+//  红黑树每个元素一个节点(三个指针+颜色+元素)
+class MemUsage
+{
+public:
+    static const size_t KEEP = 1 << 16; //清空的缓冲区容量不超过这个值时留着复用，超过时释放
+
+    //s已经清空并且容量超过KEEP时释放，避免收发过一次大报文之后连接一直占着这块内存
+    static void Trim(std::string& s)
+    {
+        if(s.empty() && s.capacity() > KEEP){
+            std::string().swap(s);
+        }
+    }
+
+    template<class A>
+    static size_t Str(const std::basic_string<char, std::char_traits<char>, A>& s)
+    {
+        return s.capacity() > 15 ? s.capacity() + 1 : 0;
+    }
+
+    //以下Deep为容器本身加上其中元素占用的内存，不含最外层对象自身
+    //从Arena分配的容器也按同样的方式估算
+    template<class A>
+    static size_t Deep(const std::basic_string<char, std::char_traits<char>, A>& s)
+    {
+        return Str(s);
+    }
+
+    template<class T>
+    static typename std::enable_if<std::is_arithmetic<T>::value, size_t>::type Deep(const T&)
+    {
+        return 0;
+    }
+
+    template<class A, class B>
+    static size_t Deep(const std::pair<A, B>& p)
+    {
+        return Deep(p.first) + Deep(p.second);
+    }
+
+    template<class T, class A>
+    static size_t Deep(const std::vector<T, A>& v)
+    {
+        size_t n = v.capacity() * sizeof(T);
+        for(auto& e : v){
+            n += Deep(e);
+        }
+        return n;
+    }
+
+    template<class K, class V, class H, class E, class A>
+    static size_t Deep(const std::unordered_map<K, V, H, E, A>& m)
+    {
+        size_t n = Table(m);
+        for(auto& e : m){
+            n += Deep(e);
+        }
+        return n;
+    }
+
+    template<class K, class H, class E>
+    static size_t Deep(const std::unordered_set<K, H, E>& s)
+    {
+        size_t n = Table(s);
+        for(auto& e : s){
+            n += Deep(e);
+        }
+        return n;
+    }
+
+    template<class K, class V>
+    static size_t Deep(const std::map<K, V>& m)
+    {
+        size_t n = m.size() * (sizeof(std::pair<const K, V>) + 4 * sizeof(void*));
+        for(auto& e : m){
+            n += Deep(e);
+        }
+        return n;
+    }
+
+    //哈希表的节点和桶数组，不含元素自己的堆内存
+    template<class M>
+    static size_t Table(const M& m)
+    {
+        return m.size() * (sizeof(typename M::value_type) + 2 * sizeof(void*)) + m.bucket_count() * sizeof(void*);
+    }
+
+    //进程级: malloc当前分配出去的字节数，以及常驻内存，用来对比统计到的部分
+    static std::string Process()
+    {
+        struct mallinfo2 mi = mallinfo2();
+        long pages = 0, rss = 0;
+        FILE* fp = fopen("/proc/self/statm", "r");
+        if(fp != nullptr){
+            if(fscanf(fp, "%ld %ld", &pages, &rss) != 2){
+                rss = 0;
+            }
+            fclose(fp);
+        }
+        return std::string("heap_used=")+std::to_string(mi.uordblks + mi.hblkhd)
+            +std::string(" heap_free=")+std::to_string(mi.fordblks)
+            +std::string(" rss=")+std::to_string(rss * sysconf(_SC_PAGESIZE));
+    }
+};
+
+//单调分配器，分配只移动指针，不单独释放，Release时整体归还
+//开头的INLINE字节就在对象内部，用完之后才向堆申请更大的块，Release之后重新从内部缓冲区开始
+//拷贝时新对象使用自己的缓冲区，不拷贝内容，从旧对象分配的容器需要用新对象的Resource重新构造
+class Arena
+{
+public:
+    static const size_t INLINE = 2048;
+
+private:
+    alignas(std::max_align_t) char buf_[INLINE];
+    std::pmr::monotonic_buffer_resource res_;
+
+public:
+    Arena(): res_(buf_, sizeof(buf_), std::pmr::new_delete_resource())
+    {}
+
+    Arena(const Arena&): Arena()
+    {}
+
+    Arena& operator=(const Arena&)
+    {
+        return *this;
+    }
+
+    std::pmr::memory_resource* Resource()
+    {
+        return &res_;
+    }
+
+    //调用者必须保证从这里分配的容器都已经不再引用这些内存
+    void Release()
+    {
+        res_.release();
+    }
+};
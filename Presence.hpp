@@ -0,0 +1,230 @@
+#pragma once
+#include "Log.hpp"
+#include "Config.hpp"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <algorithm>
+
+class Snapshot;
+
+//在线状态订阅
+//订阅关系按订阅者保存，同时维护反向索引watchers_，一个用户上线下线时只访问订阅了他的人
+//状态变化先记入各订阅者的待通知表，同一个用户在一个窗口内的多次变化只保留最后一次
+//每presence_batch_ms把一个订阅者的所有变化合并成一个通知，大量用户同时重连时每个订阅者每个窗口最多一个通知
+//订阅关系和用户数据一样写入快照和复制日志，重连之后不需要重新订阅
+class Presence
+{
+    friend class Snapshot; //快照在mtx_内直接读写subs_
+
+public:
+    //subscriber，上线的用户，下线的用户
+    typedef std::function<void(const std::string&, const std::vector<std::string>&, const std::vector<std::string>&)> Sink;
+
+private:
+    std::mutex mtx_;
+    std::unordered_map<std::string, std::unordered_set<std::string>> subs_;
+    //key为订阅者，value为其订阅的所有用户
+    std::unordered_map<std::string, std::unordered_set<std::string>> watchers_;
+    //key为被订阅的用户，value为订阅了他的所有用户，可以由subs_推出，不写入快照
+    std::unordered_map<std::string, std::unordered_map<std::string, bool>> pending_;
+    //key为订阅者，value为本窗口内还没有通知的变化，first为用户名，second为是否在线
+
+    size_t links_; //订阅关系总数
+
+    size_t maxSubs_;
+    long long batchMs_;
+    Sink sink_;
+
+    std::atomic<long long> changes_; //发布的上线下线次数
+    std::atomic<long long> notices_; //合并前需要通知的(订阅者, 用户)个数
+    std::atomic<long long> frames_;  //合并后实际发出的通知个数
+
+    static Presence* ppr_;
+
+    Presence(): links_(0), changes_(0), notices_(0), frames_(0)
+    {
+        Config* pc = Config::GetInstance();
+        maxSubs_ = std::max<long long>(1, pc->GetInt("presence_max_subscriptions"));
+        batchMs_ = std::max<long long>(1, pc->GetInt("presence_batch_ms"));
+    }
+
+    void FlushLoop()
+    {
+        while(true){
+            std::this_thread::sleep_for(std::chrono::milliseconds(batchMs_));
+            std::unordered_map<std::string, std::unordered_map<std::string, bool>> batch;
+            {
+                std::unique_lock<std::mutex> u_mtx(mtx_);
+                batch.swap(pending_);
+            }
+            for(auto& sub : batch){
+                std::vector<std::string> on, off;
+                for(auto& change : sub.second){
+                    (change.second ? on : off).push_back(change.first);
+                }
+                frames_++;
+                sink_(sub.first, on, off);
+            }
+        }
+    }
+
+    //在mtx_内调用
+    void Link(const std::string& name, const std::string& target)
+    {
+        if(subs_[name].insert(target).second){
+            watchers_[target].insert(name);
+            links_++;
+        }
+    }
+
+    void Unlink(const std::string& name, const std::string& target)
+    {
+        auto it = subs_.find(name);
+        if(it == subs_.end() || it->second.erase(target) == 0){
+            return;
+        }
+        links_--;
+        if(it->second.empty()){
+            subs_.erase(it);
+        }
+        auto it_w = watchers_.find(target);
+        if(it_w != watchers_.end()){
+            it_w->second.erase(name);
+            if(it_w->second.empty()){
+                watchers_.erase(it_w);
+            }
+        }
+    }
+
+    //由subs_重建watchers_，快照加载之后调用
+    void Rebuild()
+    {
+        watchers_.clear();
+        links_ = 0;
+        for(auto& sub : subs_){
+            for(auto& target : sub.second){
+                watchers_[target].insert(sub.first);
+            }
+            links_ += sub.second.size();
+        }
+    }
+
+public:
+    Presence(const Presence&) = delete;
+    Presence& operator=(const Presence&) = delete;
+
+    static Presence* GetInstance()
+    {
+        static std::mutex mtx;
+        if(ppr_ == nullptr){
+            {
+                std::unique_lock<std::mutex> u_mtx(mtx);
+                if(ppr_ == nullptr){
+                    ppr_ = new Presence;
+                }
+            }
+        }
+        return ppr_;
+    }
+
+    //启动合并通知的线程，sink在该线程中执行
+    void Start(Sink sink)
+    {
+        sink_ = std::move(sink);
+        std::thread(&Presence::FlushLoop, this).detach();
+    }
+
+    //name增加订阅add，取消订阅remove，超过presence_max_subscriptions时不做任何修改并返回false
+    //成功时result为修改后name订阅的所有用户
+    bool Subscribe(const std::string& name, const std::vector<std::string>& add, const std::vector<std::string>& remove, std::vector<std::string>& result)
+    {
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        std::unordered_set<std::string> next;
+        auto it = subs_.find(name);
+        if(it != subs_.end()){
+            next = it->second;
+        }
+        for(auto& target : add){
+            if(target != name){
+                next.insert(target);
+            }
+        }
+        for(auto& target : remove){
+            next.erase(target);
+        }
+        if(next.size() > maxSubs_){
+            return false;
+        }
+        for(auto& target : remove){
+            Unlink(name, target);
+        }
+        for(auto& target : next){
+            Link(name, target);
+        }
+        result.assign(next.begin(), next.end());
+        return true;
+    }
+
+    //把name的订阅整体替换为targets，备机重放复制日志时调用
+    void Set(const std::string& name, const std::vector<std::string>& targets)
+    {
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        auto it = subs_.find(name);
+        if(it != subs_.end()){
+            std::vector<std::string> old(it->second.begin(), it->second.end());
+            for(auto& target : old){
+                Unlink(name, target);
+            }
+        }
+        for(auto& target : targets){
+            Link(name, target);
+        }
+    }
+
+    std::vector<std::string> GetSubscriptions(const std::string& name)
+    {
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        auto it = subs_.find(name);
+        if(it == subs_.end()){
+            return std::vector<std::string>();
+        }
+        return std::vector<std::string>(it->second.begin(), it->second.end());
+    }
+
+    //name上线或者下线，记入所有订阅者的待通知表，下一个窗口统一发出
+    void Publish(const std::string& name, bool online)
+    {
+        changes_++;
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        auto it = watchers_.find(name);
+        if(it == watchers_.end()){
+            return;
+        }
+        for(auto& watcher : it->second){
+            pending_[watcher][name] = online;
+        }
+        notices_ += it->second.size();
+    }
+
+    std::string Stats()
+    {
+        size_t subscribers = 0, subscriptions = 0;
+        {
+            std::unique_lock<std::mutex> u_mtx(mtx_);
+            subscribers = subs_.size();
+            subscriptions = links_;
+        }
+        return std::string("presence subscribers=")+std::to_string(subscribers)
+            +std::string(" subscriptions=")+std::to_string(subscriptions)
+            +std::string(" changes=")+std::to_string(changes_)
+            +std::string(" notices=")+std::to_string(notices_)
+            +std::string(" frames=")+std::to_string(frames_);
+    }
+};
@@ -3,6 +3,17 @@
 #include "Reactor.hpp"
 #include "ThreadPool.hpp"
 #include "Util.hpp"
+#include "Hash.hpp"
+#include "Config.hpp"
+#include "RateLimit.hpp"
+#include "RequestLimit.hpp"
+#include "Cluster.hpp"
+#include "Replica.hpp"
+#include "Presence.hpp"
+#include "History.hpp"
+#include "Search.hpp"
+#include "Codec.hpp"
+#include "Memory.hpp"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -11,8 +22,14 @@
 #include <vector>
 #include <unordered_set>
 #include <unordered_map>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <string_view>
 #include <mutex>
 #include <fstream>
+#include <cstdint>
+#include <chrono>
 
 #define LINE_END "\r\n"
 #define VERSION "JCHAT/1.0"
@@ -21,9 +38,14 @@
 struct ChatMessage
 {
 public:
+    //报头的每一行和headerMap_的节点是每个请求都要分配的小块内存，从连接的Arena分配，响应发出后一次释放
+    //不在连接中的报文(例如通知消息)使用默认的堆分配
+    typedef std::pmr::vector<std::pmr::string> HeaderLines;
+    typedef std::pmr::unordered_map<std::string, std::string> HeaderMap;
+
     //一个报文中的四个部分
     std::string iniLine_;  //初始行
-    std::vector<std::string> headers_; //报头
+    HeaderLines headers_; //报头
     std::string blank_; //空行
     std::string body_;  //正文
 
@@ -33,7 +55,15 @@ public:
     std::string version_;
 
     //解析报头
-    std::unordered_map<std::string, std::string> headerMap_;
+    HeaderMap headerMap_;
+
+    //上传文件时正文的流式哈希，正文每收到一部分就更新一次
+    Sha256 bodyHash_;
+
+    //正文的压缩结果，群发时所有通知共享同一份，只压缩一次；客户端发来的压缩正文也放在这里
+    std::shared_ptr<SharedDeflate> deflated_;
+    //body_已经是发送时的最终形式(例如读出的压缩文件，或者不可压缩的文件内容)，发送时不再尝试压缩
+    bool encoded_ = false;
 
     ChatMessage() = default;
     ~ChatMessage() = default;
@@ -42,13 +72,35 @@ public:
     ChatMessage& operator=(const ChatMessage&) = default;
     ChatMessage& operator=(ChatMessage&&) = default;
     //关键是指定自动生成移动构造和移动拷贝
+    //拷贝构造得到的报文使用默认的堆分配；赋值时各自保留原来的分配器，逐个元素拷贝或移动
+    //注意从Arena分配的报文(连接的recvMessage_和sendMessage_)不能被移动构造到别处，否则会在Arena释放后继续引用其中的内存
+
+    //报头从mr分配
+    explicit ChatMessage(std::pmr::memory_resource* mr): headers_(mr), headerMap_(mr)
+    {}
+
+    //拷贝other，报头从mr分配，增加成员时这里也要拷贝
+    ChatMessage(const ChatMessage& other, std::pmr::memory_resource* mr)
+        : iniLine_(other.iniLine_), headers_(other.headers_, mr), blank_(other.blank_), body_(other.body_)
+        , method_(other.method_), status_(other.status_), version_(other.version_), headerMap_(other.headerMap_, mr)
+        , bodyHash_(other.bodyHash_), deflated_(other.deflated_), encoded_(other.encoded_)
+    {}
 
 public:
-    //解析初始行，从iniLine_得到method_，status_和version_
+    //解析初始行，从iniLine_得到method_，status_和version_，以空白分隔
     void ParseIniLine()
     {
-        std::stringstream ss(iniLine_);
-        ss >> method_ >> status_ >> version_;
+        std::string_view line(iniLine_);
+        std::string* fields[3] = {&method_, &status_, &version_};
+        size_t pos = 0;
+        for(auto f : fields){
+            size_t begin = line.find_first_not_of(" \t\r\n\v\f", pos);
+            if(begin == std::string_view::npos){
+                break;
+            }
+            pos = std::min(line.find_first_of(" \t\r\n\v\f", begin), line.size());
+            f->assign(line.substr(begin, pos - begin));
+        }
 
         //for test
         LOG(INFO, std::string("method: ")+method_);
@@ -57,29 +109,56 @@ public:
     }
 
     //解析报头，从headers_得到headerMap_
+    //和Util::CutString一样按": "切分并忽略空的部分，至少两部分，取前两部分作为名字和值，中间不产生临时字符串
     int ParseHeader()
     {
-        for(auto e : headers_){
-            std::vector<std::string> tv;
-            if(!Util::CutString(e, tv, ": ")){
+        for(auto& e : headers_){
+            std::string_view line(e);
+            std::string_view parts[2];
+            int found = 0;
+            size_t begin = 0;
+            while(found < 2){
+                size_t pos = line.find(": ", begin);
+                std::string_view part = line.substr(begin, pos == std::string_view::npos ? std::string_view::npos : pos - begin);
+                if(!part.empty()){
+                    parts[found++] = part;
+                }
+                if(pos == std::string_view::npos){
+                    break;
+                }
+                begin = pos + 2;
+            }
+            if(found < 2){
                 return -1;
             }
-            headerMap_.insert(std::make_pair(tv[0], tv[1]));
-            LOG(INFO, tv[0]+std::string(": ")+tv[1]);
+            headerMap_.emplace(std::string(parts[0]), std::string(parts[1]));
+            LOG(INFO, std::string(parts[0])+std::string(": ")+std::string(parts[1]));
         }
         return 0;
     }
 
+    //报文占用的堆内存(估算)，用于内存统计；群发共享的压缩结果不计入
+    size_t Bytes() const
+    {
+        return MemUsage::Deep(iniLine_) + MemUsage::Deep(headers_) + MemUsage::Deep(blank_) + MemUsage::Deep(body_)
+            + MemUsage::Deep(method_) + MemUsage::Deep(status_) + MemUsage::Deep(version_) + MemUsage::Deep(headerMap_);
+    }
+
     void Clear()
     {
         method_.clear();
         status_.clear();
         version_.clear();
-        headers_.clear();
         iniLine_.clear();
         body_.clear();
+        MemUsage::Trim(body_);
         blank_.clear();
-        headerMap_.clear();
+        //连同容量一起清掉，之后Arena释放时这两个容器不再引用其中的内存
+        HeaderLines(headers_.get_allocator()).swap(headers_);
+        HeaderMap(headerMap_.get_allocator()).swap(headerMap_);
+        bodyHash_.Reset();
+        deflated_.reset();
+        encoded_ = false;
     }
 };
 
@@ -93,9 +172,27 @@ public:
     }
 };
 
+//分块上传中的一个文件，所有块都直接写到./files/<sha256(FileKey)>.part的对应偏移处
+//收齐之后计算内容哈希，直接rename成blob，不需要再拼接拷贝
+struct PartUpload
+{
+    uint64_t size_;   //文件总大小
+    std::string time_;
+    std::map<uint64_t, uint64_t> ranges_;
+    //已经收到的区间，first为起始偏移，second为结束偏移(不含)，区间之间互不相交也不相邻
+    uint64_t received_; //已经收到的字节数，等于size_时收齐
+    bool done_;         //已经有线程在收尾，保证只收尾一次
+    int writers_;       //正在写入块的请求数，为0时才能收尾或者过期
+    std::chrono::steady_clock::time_point last_; //最后一次收到块的时间
+};
+
+class Snapshot;
+
 //进行应用层的管理内容
 class Chatroom
 {
+    friend class Snapshot; //快照需要在各自的锁内直接读写下面所有容器
+
 private:
     std::mutex usersMtx_;
     std::mutex onlineMtx_;
@@ -105,6 +202,9 @@ private:
     std::mutex groupsMtx_;
     std::mutex oflgroupMtx_;
     std::mutex oflfileMtx_;
+    std::mutex groupLogMtx_;
+    std::mutex fileIndexMtx_;
+    std::mutex partMtx_;
 
     //易错，注意对一下所有对象操作时必须加锁，因为stl容器不能保证线程安全
 
@@ -123,10 +223,16 @@ private:
     std::unordered_map<std::string, std::unordered_map<std::string, int>> offline_;
     //key为用户名，建立该用户到其所有离线消息的映射，value也为一个映射，first为发送者名，second为与first对应的离线消息个数
     //如果是群聊信息，那么first为群聊名称
+
+    std::unordered_map<std::string, uint64_t> offlineRead_;
+    //key为用户名，value为该用户离线消息文件中第一条未读消息的偏移，离线消息分页读出时使用，和offline_使用同一把锁
     
     std::unordered_map<std::string, std::unordered_set<std::string>> groups_;
     //key为群聊名称，value为这个群聊中的所有人
 
+    std::unordered_map<std::string, std::unordered_set<std::string>> memberOf_;
+    //key为用户名，value为该用户所在的所有群聊，由groups_推出，不写入快照，和groups_使用同一把锁
+
     std::unordered_map<std::string, std::unordered_set<std::string>> offlineGroups_;
     //key为用户名，value为该用户离线时创建的包含该用户的群聊名称，需要由此通知该用户
 
@@ -134,6 +240,23 @@ private:
     //key为用户名，value为该用户离线时创建的发送个该用户的文件，first为文件名，second为发送者&时间
     //注意，这里的value一次存了两个信息，即sender_name和time，中间用$分隔
     
+    //群聊消息发给离线成员时，只在该群聊的日志./message/<group>.jgroup中写一份，每个离线成员只记录一个读游标
+    //登录时再从群聊日志中读出该用户的未读消息，写放大与群聊人数无关
+    //群聊日志的文件操作以及下面三个容器都在groupLogMtx_内进行
+    std::unordered_map<std::string, uint64_t> groupLogEnd_;
+    //key为群聊名称，value为该群聊日志当前的长度
+    std::unordered_map<std::string, std::unordered_map<std::string, uint64_t>> groupCursor_;
+    //key为用户名，value中first为群聊名称，second为该用户在这个群聊日志中第一条未读消息的偏移
+    std::unordered_map<std::string, int> groupReaders_;
+    //key为群聊名称，value为在该群聊日志中还有未读消息的用户个数，为0时群聊日志可以清空
+
+    //上传的文件按内容寻址，内容只在./files/<sha256>中存一份，相同内容发给多少人都只占一份磁盘和页缓存
+    std::unordered_map<std::string, std::string> fileIndex_;
+    //key为 sender-peer/file_name，value为文件内容的sha256
+    //文件名只增不删也不覆盖，blob在服务器整个生命周期内保留，因此不维护引用计数
+    std::unordered_map<std::string, PartUpload> parts_;
+    //key为 sender-peer/file_name，value为该文件分块上传的进度，收齐之后删除
+
     //注意细节：unordered_set为哈希表实现，并且默认第二个模板参数为std::hash<T>
     //std::hash<T>是一个类，其中有仿函数方法std::hash<T>(T t)，用来对参数t进行哈希，返回值为size_t类型
     //但是std::hash默认实现的T类型只有常见的例如int，char，std::string等，没有实现std::pair
@@ -219,6 +342,14 @@ public:
         online_.erase(name);
     }
 
+    //name登录时使用的长连接，不在线时返回-1
+    int OnlineSock(const std::string& name)
+    {
+        std::unique_lock<std::mutex> u_mtx(onlineMtx_);
+        auto it = online_.find(name);
+        return it == online_.end() ? -1 : it->second;
+    }
+
     const std::unordered_map<int, std::string>& GetShortSock()
     {
         return shortSock_;
@@ -284,6 +415,60 @@ public:
     {
         std::unique_lock<std::mutex> u_mtx(offlineMtx_);
         offline_.erase(name);
+        offlineRead_.erase(name);
+    }
+
+    //name的离线消息个数的拷贝
+    std::unordered_map<std::string, int> GetOfflineCounts(const std::string& name)
+    {
+        std::unique_lock<std::mutex> u_mtx(offlineMtx_);
+        auto it = offline_.find(name);
+        if(it == offline_.end()){
+            return std::unordered_map<std::string, int>();
+        }
+        return it->second;
+    }
+
+    //分页读出离线消息之后减少对应的个数，减到0的发送者或群聊直接删除
+    void OfflineConsume(const std::string& name, const std::unordered_map<std::string, int>& consumed)
+    {
+        std::unique_lock<std::mutex> u_mtx(offlineMtx_);
+        auto it = offline_.find(name);
+        if(it == offline_.end()){
+            return;
+        }
+        for(auto& c : consumed){
+            auto it_sender = it->second.find(c.first);
+            if(it_sender == it->second.end()){
+                continue;
+            }
+            it_sender->second -= c.second;
+            if(it_sender->second <= 0){
+                it->second.erase(it_sender);
+            }
+        }
+        if(it->second.empty()){
+            offline_.erase(it);
+        }
+    }
+
+    uint64_t GetOfflineRead(const std::string& name)
+    {
+        std::unique_lock<std::mutex> u_mtx(offlineMtx_);
+        auto it = offlineRead_.find(name);
+        return it == offlineRead_.end() ? 0 : it->second;
+    }
+
+    //offset为0表示离线消息文件已经读完
+    void SetOfflineRead(const std::string& name, uint64_t offset)
+    {
+        std::unique_lock<std::mutex> u_mtx(offlineMtx_);
+        if(offset == 0){
+            offlineRead_.erase(name);
+        }
+        else{
+            offlineRead_[name] = offset;
+        }
     }
 
     const std::unordered_map<std::string, std::unordered_set<std::string>>& GetGroups()
@@ -294,13 +479,52 @@ public:
     void GroupsInsert(const std::string& group, const std::unordered_set<std::string>& others)
     {
         std::unique_lock<std::mutex> u_mtx(groupsMtx_);
-        groups_.insert(std::make_pair(group, others));
+        if(groups_.insert(std::make_pair(group, others)).second){
+            for(auto& one : others){
+                memberOf_[one].insert(group);
+            }
+        }
     }
 
     void GroupsErase(const std::string& group)
     {
         std::unique_lock<std::mutex> u_mtx(groupsMtx_);
-        groups_.erase(group);
+        auto it = groups_.find(group);
+        if(it == groups_.end()){
+            return;
+        }
+        for(auto& one : it->second){
+            auto it_m = memberOf_.find(one);
+            if(it_m != memberOf_.end()){
+                it_m->second.erase(group);
+                if(it_m->second.empty()){
+                    memberOf_.erase(it_m);
+                }
+            }
+        }
+        groups_.erase(it);
+    }
+
+    //name所在的所有群聊
+    std::vector<std::string> GroupsOf(const std::string& name)
+    {
+        std::unique_lock<std::mutex> u_mtx(groupsMtx_);
+        auto it = memberOf_.find(name);
+        if(it == memberOf_.end()){
+            return std::vector<std::string>();
+        }
+        return std::vector<std::string>(it->second.begin(), it->second.end());
+    }
+
+    //由groups_重建memberOf_，快照加载之后在groupsMtx_内调用
+    void MemberOfRebuild()
+    {
+        memberOf_.clear();
+        for(auto& group : groups_){
+            for(auto& one : group.second){
+                memberOf_[one].insert(group.first);
+            }
+        }
     }
     
     const std::unordered_map<std::string, std::unordered_set<std::string>>& GetOfflineGroup()
@@ -359,6 +583,377 @@ public:
         std::unique_lock<std::mutex> u_mtx(oflfileMtx_);
         offlineFiles_.erase(name);
     }
+
+    //存储目录由配置message_dir和files_dir决定，启动后不再改变，统一以/结尾
+    static const std::string& MessageDir()
+    {
+        static const std::string dir = WithSlash(Config::GetInstance()->GetString("message_dir"));
+        return dir;
+    }
+
+    static const std::string& FilesDir()
+    {
+        static const std::string dir = WithSlash(Config::GetInstance()->GetString("files_dir"));
+        return dir;
+    }
+
+    static std::string WithSlash(std::string dir)
+    {
+        if(dir.empty() || dir.back() != '/'){
+            dir += "/";
+        }
+        return dir;
+    }
+
+    static std::string BlobPath(const std::string& hash)
+    {
+        std::string path(FilesDir());
+        path += hash;
+        return path;
+    }
+
+    //值得压缩的blob另存一份压缩后的<sha256>.z，对支持deflate的客户端直接发送这一份
+    static std::string DeflatedPath(const std::string& blob_path)
+    {
+        return blob_path + ".z";
+    }
+
+    static std::string FileKey(const std::string& sender, const std::string& peer, const std::string& file_name)
+    {
+        std::string key(sender);
+        key += "-";
+        key += peer;
+        key += "/";
+        key += file_name;
+        return key;
+    }
+
+    //查找文件名对应的内容哈希，first为是否存在
+    std::pair<bool, std::string> FileIndexFind(const std::string& key)
+    {
+        std::unique_lock<std::mutex> u_mtx(fileIndexMtx_);
+        auto it = fileIndex_.find(key);
+        if(it == fileIndex_.end()){
+            return std::make_pair(false, std::string());
+        }
+        return std::make_pair(true, it->second);
+    }
+
+    //建立文件名到内容的引用，文件名已经存在返回false
+    bool FileIndexInsert(const std::string& key, const std::string& hash)
+    {
+        std::unique_lock<std::mutex> u_mtx(fileIndexMtx_);
+        return fileIndex_.insert(std::make_pair(key, hash)).second;
+    }
+
+    static std::string PartPath(const std::string& key)
+    {
+        Sha256 h;
+        h.Update(key);
+        std::string path(FilesDir());
+        path += h.Final();
+        path += ".part";
+        return path;
+    }
+
+    //开始或继续一个分块上传，返回0时可以写入这一块，is_new返回是否为新的上传
+    //返回0之后写入者计数加一，写完必须调用PartAddRange或者PartLeave
+    //同名文件正在上传但大小不同返回-1，已经收齐正在收尾或者已经完成返回-2
+    int PartBegin(const std::string& key, uint64_t size, const std::string& time, bool& is_new)
+    {
+        std::unique_lock<std::mutex> u_mtx(partMtx_);
+        auto it = parts_.find(key);
+        if(it != parts_.end()){
+            if(it->second.done_){
+                return -2;
+            }
+            if(it->second.size_ != size){
+                return -1;
+            }
+            it->second.writers_++;
+            it->second.last_ = std::chrono::steady_clock::now();
+            is_new = false;
+            return 0;
+        }
+        {
+            //收尾时先写文件名索引再删除上传记录，这里在partMtx_内检查索引，收尾之后迟到的块不会再建立.part
+            std::unique_lock<std::mutex> f_mtx(fileIndexMtx_);
+            if(fileIndex_.find(key) != fileIndex_.end()){
+                return -2;
+            }
+        }
+        PartUpload part;
+        part.size_ = size;
+        part.time_ = time;
+        part.received_ = 0;
+        part.done_ = false;
+        part.writers_ = 1;
+        part.last_ = std::chrono::steady_clock::now();
+        parts_.insert(std::make_pair(key, std::move(part)));
+        is_new = true;
+        return 0;
+    }
+
+    //写入失败时退出PartBegin，不记录区间
+    void PartLeave(const std::string& key)
+    {
+        std::unique_lock<std::mutex> u_mtx(partMtx_);
+        auto it = parts_.find(key);
+        if(it != parts_.end()){
+            it->second.writers_--;
+        }
+    }
+
+    //清理空闲超过idle的上传，没有正在写入也没有在收尾的才会被清理，keys返回被清理的上传
+    void PartExpire(std::chrono::seconds idle, std::vector<std::string>& keys)
+    {
+        auto now = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> u_mtx(partMtx_);
+        for(auto it = parts_.begin();it != parts_.end();){
+            if(!it->second.done_ && it->second.writers_ == 0 && now - it->second.last_ >= idle){
+                keys.push_back(it->first);
+                it = parts_.erase(it);
+            }
+            else{
+                ++it;
+            }
+        }
+    }
+
+    //记录收到了[begin, end)，与已有区间合并
+    //ranges返回已收到的区间，格式为 b1-e1,b2-e2；complete返回本次调用是否需要负责收尾
+    bool PartAddRange(const std::string& key, uint64_t begin, uint64_t end, std::string& ranges, bool& complete)
+    {
+        std::unique_lock<std::mutex> u_mtx(partMtx_);
+        auto it = parts_.find(key);
+        if(it == parts_.end()){
+            return false;
+        }
+        PartUpload& part = it->second;
+        part.writers_--;
+        part.last_ = std::chrono::steady_clock::now();
+        if(begin < end){
+            //向前找第一个可能和[begin, end)相交或相邻的区间，之后依次合并
+            auto cur = part.ranges_.upper_bound(begin);
+            if(cur != part.ranges_.begin() && std::prev(cur)->second >= begin){
+                --cur;
+            }
+            while(cur != part.ranges_.end() && cur->first <= end){
+                begin = std::min(begin, cur->first);
+                end = std::max(end, cur->second);
+                part.received_ -= cur->second - cur->first;
+                cur = part.ranges_.erase(cur);
+            }
+            part.ranges_.insert(std::make_pair(begin, end));
+            part.received_ += end - begin;
+        }
+        for(auto& r : part.ranges_){
+            if(!ranges.empty()){
+                ranges += ",";
+            }
+            ranges += std::to_string(r.first);
+            ranges += "-";
+            ranges += std::to_string(r.second);
+        }
+        //还有其他块在写入时由最后一个写完的负责收尾，保证收尾时不会再有写入
+        complete = (part.received_ == part.size_ && part.writers_ == 0 && !part.done_);
+        if(complete){
+            part.done_ = true;
+        }
+        return true;
+    }
+
+    void PartErase(const std::string& key)
+    {
+        std::unique_lock<std::mutex> u_mtx(partMtx_);
+        parts_.erase(key);
+    }
+
+    static std::string MessagePath(const std::string& name)
+    {
+        std::string path(MessageDir());
+        path += name;
+        path += ".jchat";
+        return path;
+    }
+
+    static std::string GroupLogPath(const std::string& group)
+    {
+        std::string path(MessageDir());
+        path += group;
+        path += ".jgroup";
+        return path;
+    }
+
+    //向群聊日志中追加一条消息，record为已经按离线消息格式编码好的内容
+    //members为这条消息的所有离线接收者，还没有读游标的成员游标设置为这条消息的偏移
+    void GroupLogAppend(const std::string& group, const std::string& record, const std::vector<std::string>& members)
+    {
+        std::unique_lock<std::mutex> u_mtx(groupLogMtx_);
+        uint64_t& end = groupLogEnd_[group];
+        std::fstream fapp;
+        fapp.open(GroupLogPath(group), std::ios::app);
+        fapp << record;
+        fapp.close();
+
+        for(auto& member : members){
+            auto& cursors = groupCursor_[member];
+            if(cursors.find(group) == cursors.end()){
+                cursors.insert(std::make_pair(group, end));
+                groupReaders_[group]++;
+            }
+        }
+        end += record.size();
+    }
+
+    //获取name在各个群聊日志中的读游标
+    std::unordered_map<std::string, uint64_t> GetGroupCursors(const std::string& name)
+    {
+        std::unique_lock<std::mutex> u_mtx(groupLogMtx_);
+        auto it = groupCursor_.find(name);
+        if(it == groupCursor_.end()){
+            return std::unordered_map<std::string, uint64_t>();
+        }
+        return it->second;
+    }
+
+    //name在group的群聊日志中是否还有未读消息
+    bool HasGroupCursor(const std::string& name, const std::string& group)
+    {
+        std::unique_lock<std::mutex> u_mtx(groupLogMtx_);
+        auto it = groupCursor_.find(name);
+        return it != groupCursor_.end() && it->second.count(group) > 0;
+    }
+
+    //name在group的群聊日志中读到了offset，读到日志末尾或者done为true时清除读游标
+    //如果该群聊日志已经没有用户有未读消息，直接清空该日志
+    void GroupCursorAdvance(const std::string& name, const std::string& group, uint64_t offset, bool done)
+    {
+        std::unique_lock<std::mutex> u_mtx(groupLogMtx_);
+        auto it = groupCursor_.find(name);
+        if(it == groupCursor_.end()){
+            return;
+        }
+        auto it_cursor = it->second.find(group);
+        if(it_cursor == it->second.end()){
+            return;
+        }
+        if(!done && offset < groupLogEnd_[group]){
+            it_cursor->second = offset;
+            return;
+        }
+        it->second.erase(it_cursor);
+        if(it->second.empty()){
+            groupCursor_.erase(it);
+        }
+        if(--groupReaders_[group] <= 0){
+            groupReaders_.erase(group);
+            groupLogEnd_.erase(group);
+            std::fstream fclear;
+            fclear.open(GroupLogPath(group), std::ios::out);
+            LOG(INFO, std::string("Clear group log: ")+group);
+        }
+    }
+
+    //name已经读完所有群聊日志中的未读消息，清除其读游标
+    //如果某个群聊日志已经没有用户有未读消息，直接清空该日志
+    void GroupCursorsClear(const std::string& name)
+    {
+        std::unique_lock<std::mutex> u_mtx(groupLogMtx_);
+        auto it = groupCursor_.find(name);
+        if(it == groupCursor_.end()){
+            return;
+        }
+        for(auto& cursor : it->second){
+            const std::string& group = cursor.first;
+            if(--groupReaders_[group] <= 0){
+                groupReaders_.erase(group);
+                groupLogEnd_.erase(group);
+                std::fstream fclear;
+                fclear.open(GroupLogPath(group), std::ios::out);
+                LOG(INFO, std::string("Clear group log: ")+group);
+            }
+        }
+        groupCursor_.erase(it);
+    }
+
+    //sock对应的用户名，既不是短连接也不是长连接时返回空串
+    std::string SockUser(int sock)
+    {
+        {
+            std::unique_lock<std::mutex> u_mtx(longSockMtx_);
+            auto it = longSock_.find(sock);
+            if(it != longSock_.end()){
+                return it->second;
+            }
+        }
+        std::unique_lock<std::mutex> u_mtx(shortSockMtx_);
+        auto it = shortSock_.find(sock);
+        return it == shortSock_.end() ? std::string() : it->second;
+    }
+
+    //各个容器占用的堆内存(估算)，用于SIGUSR1时输出，total返回总和
+    //每组容器在自己的锁内遍历，用户很多时需要一些时间，所以只在输出运行状态时调用
+    std::string MemStats(size_t& total)
+    {
+        size_t users = 0, online = 0, socks = 0, offline = 0, groups = 0, notices = 0, group_logs = 0, files = 0;
+        {
+            std::unique_lock<std::mutex> u_mtx(usersMtx_);
+            users = MemUsage::Deep(users_);
+        }
+        {
+            std::unique_lock<std::mutex> u_mtx(onlineMtx_);
+            online = MemUsage::Deep(online_);
+        }
+        {
+            std::unique_lock<std::mutex> u_mtx(shortSockMtx_);
+            socks += MemUsage::Deep(shortSock_);
+        }
+        {
+            std::unique_lock<std::mutex> u_mtx(longSockMtx_);
+            socks += MemUsage::Deep(longSock_);
+        }
+        {
+            std::unique_lock<std::mutex> u_mtx(offlineMtx_);
+            offline = MemUsage::Deep(offline_) + MemUsage::Deep(offlineRead_);
+        }
+        {
+            std::unique_lock<std::mutex> u_mtx(groupsMtx_);
+            groups = MemUsage::Deep(groups_) + MemUsage::Deep(memberOf_);
+        }
+        {
+            std::unique_lock<std::mutex> u_mtx(oflgroupMtx_);
+            notices += MemUsage::Deep(offlineGroups_);
+        }
+        {
+            std::unique_lock<std::mutex> u_mtx(oflfileMtx_);
+            notices += MemUsage::Deep(offlineFiles_);
+        }
+        {
+            std::unique_lock<std::mutex> u_mtx(groupLogMtx_);
+            group_logs = MemUsage::Deep(groupLogEnd_) + MemUsage::Deep(groupCursor_) + MemUsage::Deep(groupReaders_);
+        }
+        {
+            std::unique_lock<std::mutex> u_mtx(fileIndexMtx_);
+            files = MemUsage::Deep(fileIndex_);
+        }
+        {
+            std::unique_lock<std::mutex> u_mtx(partMtx_);
+            files += MemUsage::Table(parts_);
+            for(auto& p : parts_){
+                files += MemUsage::Str(p.first) + MemUsage::Str(p.second.time_) + MemUsage::Deep(p.second.ranges_);
+            }
+        }
+        total = users + online + socks + offline + groups + notices + group_logs + files;
+        return std::string("users=")+std::to_string(users)
+            +std::string(" online=")+std::to_string(online)
+            +std::string(" socks=")+std::to_string(socks)
+            +std::string(" offline=")+std::to_string(offline)
+            +std::string(" groups=")+std::to_string(groups)
+            +std::string(" offline_notices=")+std::to_string(notices)
+            +std::string(" group_logs=")+std::to_string(group_logs)
+            +std::string(" files=")+std::to_string(files);
+    }
 };
 
 class Protocol
@@ -366,7 +961,7 @@ class Protocol
 private:
     static int GetIniLine(Event<ChatMessage>& event);
     static int GetHeader(Event<ChatMessage>& event);
-    static int GetBody(int len, const std::string& in, std::string& out);
+    static int GetBody(size_t len, const std::string& in, std::string& out);
 
     static void SignUp(Event<ChatMessage>& event);
     static void SignIn(Event<ChatMessage>& event);
@@ -375,12 +970,22 @@ private:
     static bool IsUserExist(std::string name);
     static std::pair<bool, std::string> GetPassword(std::string name);
     static bool IsSignIn(std::string name);
+    static bool IsOwner(const std::string& name, int sock);
+    static bool IsPresent(const std::string& name);
+    static std::string OnlineOf(const std::vector<std::string>& names);
+    static void Subscribe(Event<ChatMessage>& event);
 
-    static void BuildMessage(Event<ChatMessage>& event);
+    static void BuildMessage(ChatMessage& msg);
+    static int DecodeBody(Event<ChatMessage>& event);
+    static void EncodeBody(Event<ChatMessage>& event, ChatMessage& msg);
+    static void ShareBody(ChatMessage& msg);
+    static void FrameBody(ClusterFrame& frame, int node, ChatMessage& msg);
+    static bool DecodeFrame(ClusterFrame& frame, std::shared_ptr<SharedDeflate>& deflated);
+    static void StoreDeflated(const std::string& blob_path, const std::string& data);
     static void ClearEvent(Event<ChatMessage>& event);
 
     static bool IsFileExist(const std::string&);
-    static bool ReadFile(const std::string& path, std::vector<std::vector<std::string>>& out, int n);
+    static bool ReadFile(const std::string& path, std::vector<std::vector<std::string>>& out, int n, uint64_t offset = 0, size_t max_bytes = SIZE_MAX, uint64_t* next = nullptr);
     static void AppendFile(const std::string& path, const std::vector<std::string>& in);
     static void ClearFile(const std::string& path);
 
@@ -390,15 +995,41 @@ private:
     static void CreateGroup(Event<ChatMessage>& event);
     static int GroupMessageHandler(Event<ChatMessage>& event, std::vector<std::string>& v_peers);
     static InformMsg<ChatMessage> SendGroupMessage(Event<ChatMessage>& event, std::string member, int& is_offline);
+    static void StoreMessage(Event<ChatMessage>& event, const std::string& peer_name);
+    static void StoreGroupMessage(Event<ChatMessage>& event, const std::vector<std::string>& offline_members);
+    static void StoreOffline(const std::string& time, const std::string& sender_name, const std::string& peer_name, const std::string& body);
+    static void StoreGroupRecord(const std::string& time, const std::string& sender_name, const std::string& group_name, const std::string& body, const std::vector<std::string>& offline_members);
+    static void RelayRemote(Event<ChatMessage>& event, const std::string& peer_name);
+    static void RelayRemoteGroup(Event<ChatMessage>& event, int node, const std::string& members);
 
     static void UploadFile(Event<ChatMessage>& event);
     static void DownloadFile(Event<ChatMessage>& event);
+    static void UploadChunk(Event<ChatMessage>& event);
+    static void DownloadRange(Event<ChatMessage>& event);
+    static void FileInform(Event<ChatMessage>& event, const std::string& sender_name, const std::string& peer_name, const std::string& file_name, const std::string& time, const std::string& file_size);
+
+    static std::string FileOpKey(Event<ChatMessage>& event);
+    static int LaneOf(const std::string& status);
+    static void RejectRequest(Event<ChatMessage>& event, const std::string& status, uint32_t retry_ms);
+    static void DropRequest(Event<ChatMessage>& event, RequestLimiter::Violation v, const std::string& reason);
+    static int ReadOffline(const std::string& name, std::string& body, int& remain, size_t max_msgs, size_t max_bytes);
+    static int ReadOfflinePage(const std::string& name, ChatMessage& msg);
+    static void PullOffline(Event<ChatMessage>& event);
+    static void ClearOffline(const std::string& name);
+    static void PushOffline(const std::string& name, Reactor<ChatMessage>* pr);
+    static void QueryHistory(Event<ChatMessage>& event);
+    static void SearchMessages(Event<ChatMessage>& event);
 
     static void ReqHandler(Event<ChatMessage>& event);
     static void ResHandler(Event<ChatMessage>& events);
 
 public:
-    static void GetPerseMessage(Event<ChatMessage>& event);
+    static int GetPerseMessage(Event<ChatMessage>& event);
 
     static void SendHandler(Event<ChatMessage>& event);
+    static void SendBatchHandler(Event<ChatMessage>& event, std::vector<ChatMessage>& msgs);
+    static void OnClusterFrame(ClusterFrame& frame, Reactor<ChatMessage>* pr);
+    static void ApplyReplica(const ReplicaOp& op);
+    static void PushPresence(const std::string& name, const std::vector<std::string>& on, const std::vector<std::string>& off, Reactor<ChatMessage>* pr);
+    static void ExpireUploads();
 };
\ No newline at end of file
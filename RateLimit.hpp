@@ -0,0 +1,96 @@
+#pragma once
+#include "Log.hpp"
+#include "Config.hpp"
+#include "TokenBucket.hpp"
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <algorithm>
+
+//聊天请求(1xx/2xx)的限速，每个连接一个令牌桶，每个用户一个令牌桶，两个都有令牌才放行
+//在报文解析完成、进入任务队列之前检查，超过限速的请求直接返回405，不占用线程池和群聊转发
+//连接的令牌桶放在Event中，用户的令牌桶放在这里，用户桶只在第一次出现时加锁插入
+class RateLimiter
+{
+private:
+    uint32_t connRate_;  //每个连接每秒的请求数，为0表示不限制
+    uint32_t connBurst_;
+    uint32_t userRate_;  //每个用户每秒的请求数，为0表示不限制
+    uint32_t userBurst_;
+
+    std::mutex userMtx_;
+    std::unordered_map<std::string, std::unique_ptr<TokenBucket>> userBuckets_;
+
+    std::atomic<long long> connRejected_; //因为连接限速拒绝的请求数
+    std::atomic<long long> userRejected_; //因为用户限速拒绝的请求数
+
+    static RateLimiter* prl_;
+
+    RateLimiter(): connRejected_(0), userRejected_(0)
+    {
+        Config* pc = Config::GetInstance();
+        connRate_ = pc->GetInt("rate_conn_per_sec");
+        connBurst_ = std::clamp<long long>(pc->GetInt("rate_conn_burst"), 1, TokenBucket::MAX_BURST);
+        userRate_ = pc->GetInt("rate_user_per_sec");
+        userBurst_ = std::clamp<long long>(pc->GetInt("rate_user_burst"), 1, TokenBucket::MAX_BURST);
+    }
+
+    TokenBucket* UserBucket(const std::string& user)
+    {
+        std::unique_lock<std::mutex> u_mtx(userMtx_);
+        auto& p = userBuckets_[user];
+        if(!p){
+            p.reset(new TokenBucket);
+        }
+        return p.get();
+    }
+
+public:
+    RateLimiter(const RateLimiter&) = delete;
+    RateLimiter& operator=(const RateLimiter&) = delete;
+
+    static RateLimiter* GetInstance()
+    {
+        static std::mutex mtx;
+        if(prl_ == nullptr){
+            {
+                std::unique_lock<std::mutex> u_mtx(mtx);
+                if(prl_ == nullptr){
+                    prl_ = new RateLimiter;
+                }
+            }
+        }
+        return prl_;
+    }
+
+    //conn为该连接的令牌桶，user为请求中的用户名，可以为空
+    //放行返回true；拒绝返回false，retry_ms为建议多久之后重试
+    bool Allow(TokenBucket& conn, const std::string& user, uint32_t& retry_ms)
+    {
+        uint32_t now = TokenBucket::NowMs();
+        if(connRate_ > 0 && !conn.Take(now, connRate_, connBurst_, retry_ms)){
+            connRejected_++;
+            return false;
+        }
+        if(userRate_ > 0 && !user.empty() && !UserBucket(user)->Take(now, userRate_, userBurst_, retry_ms)){
+            userRejected_++;
+            return false;
+        }
+        return true;
+    }
+
+    //当前限速状态，用于SIGUSR1时输出；只有注册过的用户才有令牌桶
+    std::string Stats()
+    {
+        size_t users;
+        {
+            std::unique_lock<std::mutex> u_mtx(userMtx_);
+            users = userBuckets_.size();
+        }
+        return std::string("rate conn_rejected=")+std::to_string(connRejected_)
+            +std::string(" user_rejected=")+std::to_string(userRejected_)
+            +std::string(" user_buckets=")+std::to_string(users);
+    }
+};
@@ -1,16 +1,21 @@
 #pragma once
 #include "Log.hpp"
+#include "TokenBucket.hpp"
+#include "Memory.hpp"
 // #include "ChatMessage.hpp"
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <cassert>
+#include <cerrno>
 #include <iostream>
 #include <string>
 #include <unordered_set>
 #include <unordered_map>
 #include <functional>
-
-#define MAX_NUM 128
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <vector>
 
 template<class T>
 class Reactor;
@@ -29,21 +34,109 @@ public:
     std::function<void(Event<T>&)> sendCallback_;
     std::function<void(Event<T>&)> errorCallback_;
 
-    std::string inbuffer_;  //读缓冲区
+    std::string inbuffer_;  //读缓冲区，只由解析任务访问
     std::string outbuffer_; //写缓冲区
 
+    //reactor线程读到的数据先追加到pending_，再由解析任务移到inbuffer_中
+    //parsing_表示已经有解析任务在线程池中，同一个连接同时只有一个解析任务
+    //handling_表示收完的请求还没有发出响应，此时parsing_保持为true，后面流水线发来的请求等响应发出后再解析，见Handler::Resume
+    //三者都在recvMtx_内操作
+    std::mutex recvMtx_;
+    std::string pending_;
+    bool parsing_;
+    bool handling_;
+
     //修改！！！：可以将Event改成模板类，并且把ChatMessage作为模板参数
     //好处是，recvMessage_的内容实际上和具体的协议有关，而这个Reactor服务器理论上是和协议解耦的
     //如果这里直接放一个ChatMessage类型的成员变量，那么完全起不到解耦的效果
     // ChatMessage recvMessage_;
     // ChatMessage sendMessage_;
+    //arena_为当前请求的解析和响应分配小块内存，T必须可以用std::pmr::memory_resource*构造
+    //由协议层在响应发出、两个报文都清空之后一次释放，见Protocol::ClearEvent
+    Arena arena_;
     T recvMessage_;
     T sendMessage_;
 
+    //发送相关的状态可能同时被reactor线程(写回调)和线程池(发送任务)访问，必须在sendMtx_内操作
+    //包括outbuffer_，events_以及向socket写数据
+    std::mutex sendMtx_;
+    uint32_t events_;     //当前在epoll中监测的事件，用来省掉不必要的EPOLL_CTL_MOD
+    bool sendingInform_;  //outbuffer_中有批量通知报文还没发完，发完后才能解除连接的占用
+    TokenBucket bucket_;  //该连接的请求限速
+
+    //线程池中引用该Event的任务数，最高位为CLOSING表示连接已经关闭，等这些任务结束后再释放Event
+    //任务投递前由Reactor::Hold加一，任务结束时由Reactor::Release减一
+    std::atomic<int> refs_;
+    static constexpr int CLOSING = 1 << 30;
+    std::atomic<int> lane_; //正在接收的报文所属的任务通道(默认1为chat)，由解析线程设置，reactor线程投递解析任务时读取
+    std::atomic<long long> deadline_; //正在接收的报文必须收完的时间(steady毫秒)，0表示没有收到一半的报文，由reactor线程定期检查
+    std::atomic<int> accept_; //对端声明可以接收的正文编码，由协议层根据请求设置，发送时读取
+
+    //inbuffer_和recvMessage_/sendMessage_只由持有连接的任务访问，占用的堆内存由该任务在告一段落时记下，内存统计时读取
+    std::atomic<long long> inBytes_;
+    std::atomic<long long> msgBytes_;
+
 public:
-    Event(int sock = -1, Reactor<T>* pr = nullptr):sock_(sock), pr_(pr)
+    Event(int sock = -1, Reactor<T>* pr = nullptr):sock_(sock), pr_(pr), parsing_(false), handling_(false)
+        ,recvMessage_(arena_.Resource()), sendMessage_(arena_.Resource()), events_(0), sendingInform_(false), refs_(0), lane_(1), deadline_(0), accept_(0), inBytes_(0), msgBytes_(0)
+    {}
+
+    //std::mutex不能拷贝，拷贝时只拷贝数据，新对象使用自己的锁和自己的arena_
+    Event(const Event<T>& ev)
+        :sock_(ev.sock_), pr_(ev.pr_)
+        ,recvCallback_(ev.recvCallback_), sendCallback_(ev.sendCallback_), errorCallback_(ev.errorCallback_)
+        ,inbuffer_(ev.inbuffer_), outbuffer_(ev.outbuffer_), pending_(ev.pending_), parsing_(ev.parsing_), handling_(ev.handling_)
+        ,recvMessage_(ev.recvMessage_, arena_.Resource()), sendMessage_(ev.sendMessage_, arena_.Resource())
+        ,events_(ev.events_), sendingInform_(ev.sendingInform_), bucket_(ev.bucket_), refs_(ev.refs_.load()), lane_(ev.lane_.load()), deadline_(ev.deadline_.load()), accept_(ev.accept_.load())
+        ,inBytes_(ev.inBytes_.load()), msgBytes_(ev.msgBytes_.load())
     {}
 
+    Event<T>& operator=(const Event<T>& ev)
+    {
+        if(this != &ev){
+            sock_ = ev.sock_;
+            pr_ = ev.pr_;
+            recvCallback_ = ev.recvCallback_;
+            sendCallback_ = ev.sendCallback_;
+            errorCallback_ = ev.errorCallback_;
+            inbuffer_ = ev.inbuffer_;
+            pending_ = ev.pending_;
+            parsing_ = ev.parsing_;
+            handling_ = ev.handling_;
+            outbuffer_ = ev.outbuffer_;
+            recvMessage_ = ev.recvMessage_;
+            sendMessage_ = ev.sendMessage_;
+            events_ = ev.events_;
+            sendingInform_ = ev.sendingInform_;
+            bucket_ = ev.bucket_;
+            refs_ = ev.refs_.load();
+            lane_ = ev.lane_.load();
+            deadline_ = ev.deadline_.load();
+            accept_ = ev.accept_.load();
+            inBytes_ = ev.inBytes_.load();
+            msgBytes_ = ev.msgBytes_.load();
+        }
+        return *this;
+    }
+
+    //连接关闭后放回Reactor的对象池之前调用，清掉上一个连接的状态
+    //两个报文重新构造(其中的报头先于arena_释放)，缓冲区清空，容量不超过keep的留给下一个连接复用
+    void Recycle(size_t keep)
+    {
+        recvMessage_ = T(arena_.Resource());
+        sendMessage_ = T(arena_.Resource());
+        arena_.Release();
+        for(std::string* s : {&inbuffer_, &outbuffer_, &pending_}){
+            s->clear();
+            if(s->capacity() > keep){
+                std::string().swap(*s);
+            }
+        }
+        recvCallback_ = nullptr;
+        sendCallback_ = nullptr;
+        errorCallback_ = nullptr;
+    }
+
     //注册回调函数，即给该Event绑定特定的回调函数
     //每次将新的sock加入reactor时，必须设置注册特定的回调函数
 
@@ -75,13 +168,45 @@ public:
 template<class T>
 class Reactor
 {
+public:
+    static const size_t POOL_KEEP = 4096; //放回对象池的Event保留不超过这个容量的缓冲区
+
 private:
+    typedef std::unordered_map<int, Event<T>> EventMap;
     int epfd_; //Reactor模型对应的Epoll模型
-    std::unordered_map<int, Event<T>> eventsMap_; 
+    EventMap eventsMap_; 
     // Reactor模型自己对连接的管理，表示一个socket到其对应的连接事件Event的映射
+    //只有reactor线程插入和删除，插入删除时加mapMtx_写锁；其他线程只能通过Acquire查找，加读锁
+    //reactor线程自己查找时不用加锁
+    std::shared_mutex mapMtx_;
+    //已经关闭的连接在eventsMap_中的节点，连同其中的Event和缓冲区留给新连接复用，省掉每个连接一次几KB的分配
+    //和eventsMap_一样只由reactor线程访问，不需要加锁
+    std::vector<typename EventMap::node_type> freeEvents_;
+    size_t poolMax_; //freeEvents_最多保留的节点数，为0表示不复用
+    std::vector<epoll_event> revents_; //epoll_wait返回的就绪事件，大小即一次最多处理的事件数
+    std::mutex closedMtx_;
+    std::vector<int> closed_; //已经关闭并且最后一个任务已经结束的连接，由reactor线程在下一次派发前释放
+
+    //从eventsMap_中删除并关闭socket，只能在reactor线程中调用
+    void Erase(int sock)
+    {
+        typename EventMap::node_type node;
+        {
+            std::unique_lock<std::shared_mutex> u_mtx(mapMtx_);
+            node = eventsMap_.extract(sock);
+        }
+        if(!node.empty() && freeEvents_.size() < poolMax_){
+            node.mapped().Recycle(POOL_KEEP);
+            freeEvents_.push_back(std::move(node));
+        }
+        //一定要关闭socket
+        close(sock);
+        LOG(INFO, std::string("An event is deleted from Reactor, sock: ")+std::to_string(sock));
+    }
 
 public:
-    Reactor():epfd_(-1)
+    //pool_max为关闭的连接最多保留多少个Event供新连接复用
+    Reactor(int max_num = 128, size_t pool_max = 0):epfd_(-1), poolMax_(pool_max), revents_(max_num)
     {
         //创建一个epoll对象
         epfd_ = epoll_create(256);
@@ -109,6 +234,23 @@ public:
         return it->second;
     }
 
+    const std::unordered_map<int, Event<T>>& GetEvents()
+    {
+        return eventsMap_;
+    }
+
+    //对象池中的Event个数，bytes设为它们占用的堆内存(估算)，只能在reactor线程中调用
+    size_t PooledEvents(size_t& bytes)
+    {
+        bytes = 0;
+        for(auto& node : freeEvents_){
+            const Event<T>& ev = node.mapped();
+            bytes += sizeof(typename EventMap::value_type) + 2 * sizeof(void*)
+                + MemUsage::Str(ev.inbuffer_) + MemUsage::Str(ev.outbuffer_) + MemUsage::Str(ev.pending_);
+        }
+        return freeEvents_.size();
+    }
+
     //将一个事件ev加入到当前Reactor模型中，events为需要监测的事件
     //成功返回false，失败返回true
     bool AddEvent(const Event<T>& ev, uint32_t events)
@@ -122,20 +264,39 @@ public:
             return false;
         }
 
-        //加入eventsMap_
-        eventsMap_.insert(std::make_pair(ev.sock_, ev));
+        //加入eventsMap_，对象池中有节点时复用，Event的赋值保留其中缓冲区的容量
+        typename EventMap::iterator it;
+        if(!freeEvents_.empty()){
+            auto node = std::move(freeEvents_.back());
+            freeEvents_.pop_back();
+            node.key() = ev.sock_;
+            node.mapped() = ev;
+            std::unique_lock<std::shared_mutex> u_mtx(mapMtx_);
+            auto ret = eventsMap_.insert(std::move(node));
+            if(!ret.inserted){
+                freeEvents_.push_back(std::move(ret.node));
+            }
+            it = ret.position;
+        }
+        else{
+            std::unique_lock<std::shared_mutex> u_mtx(mapMtx_);
+            it = eventsMap_.insert(std::make_pair(ev.sock_, ev)).first;
+        }
+        it->second.events_ = events;
 
         LOG(INFO, std::string("An event is added to Reactor, sock: ")+std::to_string(ev.sock_));
         return true;
     }
 
     //将一个Event事件从当前Reactor模型中删除
+    //线程池中还有任务引用该Event时只从Epoll模型中删除，Event和socket等最后一个任务Release时再释放
+    //这样任务不会访问到已经释放的Event，socket也不会在任务结束前被新连接复用
     //成功返回true，失败返回false
     bool DelEvent(int sock)
     {
         //判断是否存在
         auto it = eventsMap_.find(sock);
-        if(it == eventsMap_.end()){
+        if(it == eventsMap_.end() || (it->second.refs_ & Event<T>::CLOSING)){
             LOG(WARNING, "epoll_ctl deleting error: no such socket");
             return false;
         }
@@ -146,45 +307,110 @@ public:
             return false;
         }
 
-        //从eventsMap_中删除
-        eventsMap_.erase(sock);
+        if(it->second.refs_.fetch_or(Event<T>::CLOSING) != 0){
+            //还有任务在引用
+            return true;
+        }
+        Erase(sock);
+        return true;
+    }
 
-        //一定要关闭socket
-        close(sock);
+    //在reactor线程以外查找sock对应的Event并Hold，连接不存在或者已经关闭时返回nullptr
+    //查找和Hold是一个整体: 引用计数在CLOSING被置上之前加一，DelEvent就不会释放这个Event，用完之后必须Release
+    Event<T>* Acquire(int sock)
+    {
+        std::shared_lock<std::shared_mutex> s_mtx(mapMtx_);
+        auto it = eventsMap_.find(sock);
+        if(it == eventsMap_.end()){
+            return nullptr;
+        }
+        Event<T>& event = it->second;
+        int refs = event.refs_.load();
+        do{
+            if(refs & Event<T>::CLOSING){
+                return nullptr;
+            }
+        }while(!event.refs_.compare_exchange_weak(refs, refs + 1));
+        return &event;
+    }
 
-        LOG(INFO, std::string("An event is deleted from Reactor, sock: ")+std::to_string(sock));
-        return true;
-    }   
+    //线程池任务开始引用event，必须在投递任务之前调用
+    void Hold(Event<T>& event)
+    {
+        event.refs_++;
+    }
+
+    //任务不再引用event，连接已经关闭并且这是最后一个任务时，交给reactor线程释放
+    void Release(Event<T>& event)
+    {
+        if(event.refs_.fetch_sub(1) == (Event<T>::CLOSING | 1)){
+            std::unique_lock<std::mutex> u_mtx(closedMtx_);
+            closed_.push_back(event.sock_);
+        }
+    }
     
 
     //用来检测当前socket是否还在reactor模型中，即连接是否还存在，存在返回true，反之false
+    //已经关闭、只是在等任务结束的连接视为不存在，只能在reactor线程中调用，其他线程使用Acquire
     bool isExists(int sock)
     {
         auto it = eventsMap_.find(sock);
-        if(it == eventsMap_.end()){
+        if(it == eventsMap_.end() || (it->second.refs_ & Event<T>::CLOSING)){
             return false;
         }
         return true;
     }
 
-    //使能读写接口
-    void EnableReadWrite(int sock, bool readable, bool writeable)
+    //使能读写接口，调用者需持有该连接的sendMtx_
+    //直接传入Event，避免在线程池中查找eventsMap_(reactor线程可能同时在插入)
+    //如果要监测的事件和当前完全相同则不调用epoll_ctl
+    //ET模式下写事件已经使能说明之前的发送遇到了EAGAIN，之后一定还会有写就绪事件，不需要重新MOD
+    void EnableReadWrite(Event<T>& event, bool readable, bool writeable)
     {
         struct epoll_event ev;
         ev.events = (EPOLLET | (readable ? EPOLLIN : 0) | (writeable ? EPOLLOUT : 0));
-        ev.data.fd = sock;
+        ev.data.fd = event.sock_;
+
+        if(event.events_ == ev.events){
+            return;
+        }
+        event.events_ = ev.events;
 
-        epoll_ctl(epfd_, EPOLL_CTL_MOD, sock, &ev);
+        epoll_ctl(epfd_, EPOLL_CTL_MOD, event.sock_, &ev);
+    }
+
+    //ET模式下回调没有把就绪的内容处理完就主动返回时调用，例如accept达到单次上限
+    //用相同的事件重新EPOLL_CTL_MOD，如果仍然就绪，下一次epoll_wait会再次返回该socket
+    void Rearm(Event<T>& event)
+    {
+        struct epoll_event ev;
+        ev.events = event.events_;
+        ev.data.fd = event.sock_;
+        epoll_ctl(epfd_, EPOLL_CTL_MOD, event.sock_, &ev);
     }
 
     //reactor模型核心：对就绪事件进行监听和派发
     //timeout为希望从就绪队列中等待的时间间隔
     void Dispatcher(int timeout)
     {
+        //先释放任务已经结束的关闭连接
+        std::vector<int> closed;
+        {
+            std::unique_lock<std::mutex> u_mtx(closedMtx_);
+            closed.swap(closed_);
+        }
+        for(int sock : closed){
+            Erase(sock);
+        }
+
         //从就绪队列中获取就绪事件数组
-        epoll_event revents[MAX_NUM];
-        int num = epoll_wait(epfd_, revents, MAX_NUM, timeout);
+        epoll_event* revents = revents_.data();
+        int num = epoll_wait(epfd_, revents, revents_.size(), timeout);
         if(num < 0){
+            if(errno == EINTR){
+                //被信号打断，例如SIGHUP重新加载配置，直接返回由Loop处理
+                return;
+            }
             LOG(ERROR, "epoll_wait error");
             return;
         }
@@ -0,0 +1,566 @@
+#pragma once
+#include "Log.hpp"
+#include "Config.hpp"
+#include "Util.hpp"
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <algorithm>
+
+//复制日志中的一条记录，对应一次对用户数据或者离线消息的修改
+//编码: 负载长度(u32) + 类型(u32) + 主机写入时间(u64，steady毫秒) + 字段个数(u32) + 字段(Util::PutString)
+struct ReplicaOp
+{
+    enum Type : uint32_t
+    {
+        USER = 1,     //注册: name, password
+        MSG,          //单聊离线消息: time, sender, peer, body
+        GMSG,         //群聊离线消息: time, sender, group, body, 离线成员...
+        READ,         //读走了一页离线消息: name, 条数；只有name时表示全部读完
+        GROUP,        //创建群聊: group, 成员...
+        GROUP_NOTICE, //离线成员待通知的群聊: name, group
+        GROUP_SEEN,   //登录时收到了全部群聊通知: name
+        SUBSCRIBE     //修改后的全部订阅: name, 订阅的用户...
+    };
+
+    uint32_t type_;
+    uint64_t time_;
+    std::vector<std::string> fields_;
+
+    //编码后追加到out中
+    void Encode(std::string& out) const
+    {
+        size_t begin = out.size();
+        Util::PutU32(out, 0);
+        Util::PutU32(out, type_);
+        Util::PutU64(out, time_);
+        Util::PutU32(out, fields_.size());
+        for(auto& f : fields_){
+            Util::PutString(out, f);
+        }
+        uint32_t len = out.size() - begin - sizeof(uint32_t);
+        memcpy(&out[begin], &len, sizeof(len));
+    }
+
+    //从一条记录的负载中解码，格式错误返回false
+    bool Decode(const char* data, size_t size)
+    {
+        BinReader rd(data, data + size);
+        uint32_t n = 0;
+        if(!rd.GetU32(type_) || !rd.GetU64(time_) || !rd.GetU32(n)){
+            return false;
+        }
+        fields_.clear();
+        for(uint32_t i = 0;i < n;i++){
+            std::string f;
+            if(!rd.GetString(f)){
+                return false;
+            }
+            fields_.push_back(std::move(f));
+        }
+        return rd.cur_ == rd.end_;
+    }
+};
+
+//主备复制，主机把离线消息和用户数据的修改异步地传给同一台机器上的备机，主机宕机后由备机接管
+//主机把每个修改按顺序追加到复制日志replica_log，备机通过unix socket(replica_listen)从自己日志的末尾开始拉取
+//备机把收到的记录原样追加到自己的复制日志，再调用和主机相同的存储函数重放，所以接管之后备机就是一个带完整日志的主机
+//复制是异步的，主机写完日志就返回，不等备机确认；主机宕机时还没发出的记录会丢失
+//复制日志从数据目录第一次开启复制时开始记录，只覆盖注册、离线消息和群聊，上传的文件不复制
+class Replica
+{
+private:
+    std::string logPath_;
+    std::string listenPath_;  //主机: 等待备机连接的unix socket，为空表示不记录复制日志
+    std::string primaryPath_; //备机: 主机的replica_listen，为空表示不是备机
+    long long takeoverMs_;    //备机: 和主机断开超过这个时间就接管
+
+    int fd_; //复制日志，以O_APPEND打开
+    std::mutex mtx_;
+    std::condition_variable cv_;      //日志变长时通知发送线程和Flush
+    std::condition_variable flushCv_; //有新记录时通知写日志线程
+    uint64_t end_;       //日志文件中完整记录的总字节数
+    std::string buffer_; //主机: 还没写入日志文件的记录，由写日志线程成批写入
+    uint64_t appended_;  //主机: 包括buffer_在内的日志总字节数
+    bool standby_;  //备机模式下日志只由复制线程写入，Append什么都不做
+
+    std::atomic<int> standbys_;        //主机: 连接着的备机个数
+    std::atomic<long long> shipped_;   //主机: 已经发给备机的字节数
+    std::atomic<long long> flushes_;   //主机: 写日志文件的次数，每次写入一批记录
+    std::atomic<long long> ops_;       //备机: 已经重放的记录数
+    std::atomic<long long> lagSum_;    //备机: 追上主机之后，记录从主机写入到备机重放的延迟之和(毫秒)
+    std::atomic<long long> lagCount_;
+    std::atomic<long long> lagMax_;
+    std::atomic<long long> catchupMs_; //备机: 追上连接时主机日志末尾所用的时间，-1表示还没追上
+
+    static Replica* prp_;
+
+    Replica(): fd_(-1), end_(0), appended_(0), standbys_(0), shipped_(0), flushes_(0), ops_(0), lagSum_(0), lagCount_(0), lagMax_(0), catchupMs_(-1)
+    {
+        Config* pc = Config::GetInstance();
+        logPath_ = pc->GetString("replica_log");
+        listenPath_ = pc->GetString("replica_listen");
+        primaryPath_ = pc->GetString("replica_of");
+        takeoverMs_ = std::max<long long>(1, pc->GetInt("replica_takeover_ms"));
+        standby_ = !primaryPath_.empty();
+    }
+
+    static long long NowMs()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static bool SendAll(int sock, const char* data, size_t size)
+    {
+        size_t total = 0;
+        while(total < size){
+            ssize_t s = send(sock, data + total, size - total, MSG_NOSIGNAL);
+            if(s < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                return false;
+            }
+            total += s;
+        }
+        return true;
+    }
+
+    static bool RecvAll(int sock, char* data, size_t size)
+    {
+        size_t total = 0;
+        while(total < size){
+            ssize_t s = recv(sock, data + total, size - total, 0);
+            if(s < 0 && errno == EINTR){
+                continue;
+            }
+            if(s <= 0){
+                return false;
+            }
+            total += s;
+        }
+        return true;
+    }
+
+    static sockaddr_un UnixAddr(const std::string& path)
+    {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+        return addr;
+    }
+
+    //依次处理data中的完整记录，返回处理完的字节数，剩下的是不完整的记录，apply为空时只找出边界
+    //格式错误的记录之后无法再确定边界，和不完整的记录一样留下
+    size_t ForEachOp(const char* data, size_t size, const std::function<void(const ReplicaOp&)>& apply)
+    {
+        size_t pos = 0;
+        ReplicaOp op;
+        while(size - pos >= sizeof(uint32_t)){
+            uint32_t len;
+            memcpy(&len, data + pos, sizeof(len));
+            if(size - pos - sizeof(uint32_t) < len){
+                break;
+            }
+            if(!op.Decode(data + pos + sizeof(uint32_t), len)){
+                LOG(ERROR, std::string("Replica: bad record at ")+std::to_string(pos));
+                break;
+            }
+            if(apply){
+                apply(op);
+                ops_++;
+            }
+            pos += sizeof(uint32_t) + len;
+        }
+        return pos;
+    }
+
+    //打开复制日志并扫描已有的记录，apply不为空时依次重放
+    //最后一条记录不完整(写到一半时宕机)时截掉
+    bool Open(const std::function<void(const ReplicaOp&)>& apply)
+    {
+        size_t slash = logPath_.rfind('/');
+        if(slash != std::string::npos && slash > 0){
+            mkdir(logPath_.substr(0, slash).c_str(), 0777);
+        }
+        fd_ = open(logPath_.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if(fd_ < 0){
+            LOG(FATAL, std::string("Replica: open log error: ")+logPath_);
+            return false;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::string buffer;
+        std::vector<char> chunk(1 << 20);
+        uint64_t offset = 0;
+        uint64_t valid = 0;
+        while(true){
+            ssize_t s = pread(fd_, chunk.data(), chunk.size(), offset);
+            if(s < 0 && errno == EINTR){
+                continue;
+            }
+            if(s <= 0){
+                break;
+            }
+            offset += s;
+            buffer.append(chunk.data(), s);
+            size_t done = ForEachOp(buffer.data(), buffer.size(), apply);
+            valid += done;
+            buffer.erase(0, done);
+        }
+        if(valid < offset){
+            LOG(WARNING, std::string("Replica: truncate incomplete log tail, bytes: ")+std::to_string(offset - valid));
+            if(ftruncate(fd_, valid) < 0){
+                LOG(ERROR, "Replica: truncate error");
+            }
+        }
+        end_ = valid;
+        appended_ = valid;
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        LOG(INFO, std::string("Replica: log opened, bytes: ")+std::to_string(end_)+std::string(", replayed ops: ")+std::to_string(ops_)+std::string(", ms: ")+std::to_string(ms));
+        return true;
+    }
+
+    //备机的离线消息文件完全由复制日志重建，重放之前先删除旧的
+    static void ClearMessageDir()
+    {
+        std::string dir = Config::GetInstance()->GetString("message_dir");
+        DIR* pd = opendir(dir.c_str());
+        if(pd == nullptr){
+            return;
+        }
+        int n = 0;
+        struct dirent* entry;
+        while((entry = readdir(pd)) != nullptr){
+            std::string name(entry->d_name);
+            auto has_suffix = [&name](const std::string& suffix){
+                return name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+            };
+            if(has_suffix(".jchat") || has_suffix(".jgroup")){
+                unlink((dir + "/" + name).c_str());
+                n++;
+            }
+        }
+        closedir(pd);
+        LOG(WARNING, std::string("Replica: standby cleared message files: ")+std::to_string(n));
+    }
+
+    //主机: 给一个备机发送日志，先收到备机已有的字节数，回复当前日志末尾，之后从备机的位置开始一直发送
+    void ShipLoop(int sock)
+    {
+        uint64_t pos = 0;
+        if(!RecvAll(sock, (char*)&pos, sizeof(pos))){
+            close(sock);
+            return;
+        }
+        uint64_t end;
+        {
+            std::unique_lock<std::mutex> u_mtx(mtx_);
+            end = end_;
+        }
+        if(!SendAll(sock, (const char*)&end, sizeof(end)) || pos > end){
+            //备机的日志比主机还长，说明不是同一份日志，由备机报错退出
+            close(sock);
+            return;
+        }
+        standbys_++;
+        LOG(INFO, std::string("Replica: standby attached, from: ")+std::to_string(pos)+std::string(", to: ")+std::to_string(end));
+
+        std::vector<char> chunk(1 << 20);
+        while(true){
+            {
+                std::unique_lock<std::mutex> u_mtx(mtx_);
+                cv_.wait(u_mtx, [this, pos]{ return end_ > pos; });
+                end = end_;
+            }
+            ssize_t s = pread(fd_, chunk.data(), std::min<uint64_t>(chunk.size(), end - pos), pos);
+            if(s < 0 && errno == EINTR){
+                continue;
+            }
+            if(s <= 0 || !SendAll(sock, chunk.data(), s)){
+                break;
+            }
+            pos += s;
+            shipped_ += s;
+        }
+        standbys_--;
+        LOG(WARNING, "Replica: standby detached");
+        close(sock);
+    }
+
+    //主机: 写日志线程，每次把buffer_中积累的记录一次写入日志文件，负载越高每批越大
+    void FlushLoop()
+    {
+        std::string batch;
+        while(true){
+            {
+                std::unique_lock<std::mutex> u_mtx(mtx_);
+                flushCv_.wait(u_mtx, [this]{ return !buffer_.empty(); });
+                batch.swap(buffer_);
+            }
+            if(!Util::WriteAll(fd_, batch)){
+                LOG(ERROR, "Replica: append log error");
+            }
+            flushes_++;
+            {
+                std::unique_lock<std::mutex> u_mtx(mtx_);
+                end_ += batch.size();
+            }
+            cv_.notify_all();
+            batch.clear();
+        }
+    }
+
+    void AcceptLoop(int listen_sock)
+    {
+        while(true){
+            int sock = accept(listen_sock, nullptr, nullptr);
+            if(sock < 0){
+                if(errno == EINTR || errno == ECONNABORTED){
+                    continue;
+                }
+                LOG(ERROR, "Replica: accept error");
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+            std::thread(&Replica::ShipLoop, this, sock).detach();
+        }
+    }
+
+    //备机: 跟随一个主机连接，收到的记录先追加到本地日志再重放
+    //连接断开时返回true，poll返回false(要求退出)时返回false
+    bool Follow(int sock, const std::function<void(const ReplicaOp&)>& apply, const std::function<bool()>& poll)
+    {
+        uint64_t target = 0;
+        if(!SendAll(sock, (const char*)&end_, sizeof(end_)) || !RecvAll(sock, (char*)&target, sizeof(target))){
+            return true;
+        }
+        if(target < end_){
+            LOG(FATAL, std::string("Replica: local log is longer than the primary's, local: ")+std::to_string(end_)+std::string(", primary: ")+std::to_string(target));
+            exit(1);
+        }
+        LOG(INFO, std::string("Replica: following primary, from: ")+std::to_string(end_)+std::string(", to: ")+std::to_string(target));
+        auto start = std::chrono::steady_clock::now();
+        uint64_t from = end_;
+        catchupMs_ = -1;
+        if(target == end_){
+            catchupMs_ = 0;
+        }
+
+        //主机空闲时也要定期调用poll
+        timeval tv{0, 100 * 1000};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        std::string buffer;
+        std::vector<char> chunk(1 << 20);
+        long long last_poll = NowMs();
+        while(true){
+            if(NowMs() - last_poll >= 100){
+                last_poll = NowMs();
+                if(!poll()){
+                    return false;
+                }
+            }
+            ssize_t s = recv(sock, chunk.data(), chunk.size(), 0);
+            if(s < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)){
+                continue;
+            }
+            if(s <= 0){
+                return true;
+            }
+            buffer.append(chunk.data(), s);
+
+            //先找出完整记录的边界，整段写入本地日志，再逐条重放
+            size_t done = ForEachOp(buffer.data(), buffer.size(), nullptr);
+            if(done == 0){
+                continue;
+            }
+            if(!Util::WriteAll(fd_, std::string(buffer.data(), done))){
+                LOG(FATAL, "Replica: write local log error");
+                exit(1);
+            }
+            bool live = (catchupMs_ >= 0);
+            ForEachOp(buffer.data(), done, [this, &apply, live](const ReplicaOp& op){
+                apply(op);
+                if(live){
+                    long long lag = std::max<long long>(0, NowMs() - (long long)op.time_);
+                    lagSum_ += lag;
+                    lagCount_++;
+                    if(lag > lagMax_){
+                        lagMax_ = lag;
+                    }
+                }
+            });
+            buffer.erase(0, done);
+            {
+                std::unique_lock<std::mutex> u_mtx(mtx_);
+                end_ += done;
+            }
+
+            if(catchupMs_ < 0 && end_ >= target){
+                long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+                catchupMs_ = ms;
+                LOG(INFO, std::string("Replica: caught up, bytes: ")+std::to_string(end_ - from)+std::string(", ms: ")+std::to_string(ms));
+            }
+        }
+    }
+
+public:
+    Replica(const Replica&) = delete;
+    Replica& operator=(const Replica&) = delete;
+
+    static Replica* GetInstance()
+    {
+        static std::mutex mtx;
+        if(prp_ == nullptr){
+            {
+                std::unique_lock<std::mutex> u_mtx(mtx);
+                if(prp_ == nullptr){
+                    prp_ = new Replica;
+                }
+            }
+        }
+        return prp_;
+    }
+
+    bool IsStandby()
+    {
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        return standby_;
+    }
+
+    //主机: 打开复制日志并开始接受备机连接，没有配置replica_listen时什么都不做
+    //备机接管之后也调用，继续记录复制日志，配置了replica_listen时新的备机可以跟随它
+    void Start()
+    {
+        if(fd_ < 0){
+            if(listenPath_.empty()){
+                return;
+            }
+            if(!Open(nullptr)){
+                exit(1);
+            }
+        }
+        std::thread(&Replica::FlushLoop, this).detach();
+        if(listenPath_.empty()){
+            return;
+        }
+        int listen_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr = UnixAddr(listenPath_);
+        unlink(listenPath_.c_str());
+        if(listen_sock < 0 || bind(listen_sock, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_sock, 8) < 0){
+            LOG(FATAL, std::string("Replica: unix socket error: ")+listenPath_);
+            exit(1);
+        }
+        LOG(INFO, std::string("Replica: primary listening on ")+listenPath_);
+        std::thread(&Replica::AcceptLoop, this, listen_sock).detach();
+    }
+
+    //备机: 重放本地日志，然后跟随主机，直到和主机断开超过replica_takeover_ms才返回true，之后由调用者接管服务
+    //启动后从来没有连上过主机时一直等待，防止主机启动慢时两边同时服务
+    //等待期间至少每100ms调用一次poll，poll返回false时不接管，直接返回false
+    bool RunStandby(const std::function<void(const ReplicaOp&)>& apply, const std::function<bool()>& poll)
+    {
+        ClearMessageDir();
+        if(!Open(apply)){
+            exit(1);
+        }
+        bool followed = false;
+        long long lost = NowMs();
+        long long retry_ms = std::min<long long>(100, takeoverMs_);
+        while(true){
+            int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un addr = UnixAddr(primaryPath_);
+            if(sock >= 0 && connect(sock, (sockaddr*)&addr, sizeof(addr)) == 0){
+                followed = true;
+                bool keep = Follow(sock, apply, poll);
+                close(sock);
+                if(!keep){
+                    return false;
+                }
+                lost = NowMs();
+                LOG(WARNING, "Replica: connection to primary lost");
+                continue;
+            }
+            if(sock >= 0){
+                close(sock);
+            }
+            if(followed && NowMs() - lost >= takeoverMs_){
+                break;
+            }
+            if(!poll()){
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(retry_ms));
+        }
+        LOG(WARNING, std::string("Replica: primary is gone, taking over, log bytes: ")+std::to_string(end_));
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        standby_ = false;
+        appended_ = end_;
+        return true;
+    }
+
+    //主机: 把一次修改追加到复制日志，没有开启复制或者是备机时什么都不做
+    //调用者要保证同一个用户的修改按发生的顺序调用，例如在该用户离线消息文件对应的磁盘线程中
+    void Append(uint32_t type, std::vector<std::string> fields)
+    {
+        if(fd_ < 0){
+            return;
+        }
+        ReplicaOp op;
+        op.type_ = type;
+        op.time_ = NowMs();
+        op.fields_ = std::move(fields);
+        std::string record;
+        op.Encode(record);
+
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        if(standby_){
+            return;
+        }
+        buffer_ += record;
+        appended_ += record.size();
+        flushCv_.notify_one();
+    }
+
+    //等待已经Append的记录全部写入日志文件，退出进程之前调用
+    void Flush()
+    {
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        if(fd_ < 0 || standby_){
+            return;
+        }
+        cv_.wait_for(u_mtx, std::chrono::seconds(5), [this]{ return end_ >= appended_; });
+    }
+
+    std::string Stats()
+    {
+        long long count = lagCount_;
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        return std::string("replica role=")+(standby_ ? "standby" : (fd_ < 0 ? "off" : "primary"))
+            +std::string(" log_bytes=")+std::to_string(end_)
+            +std::string(" standbys=")+std::to_string(standbys_)
+            +std::string(" shipped=")+std::to_string(shipped_)
+            +std::string(" flushes=")+std::to_string(flushes_)
+            +std::string(" ops=")+std::to_string(ops_)
+            +std::string(" catchup_ms=")+std::to_string(catchupMs_)
+            +std::string(" lag_avg_ms=")+std::to_string(count > 0 ? lagSum_ / count : 0)
+            +std::string(" lag_max_ms=")+std::to_string(lagMax_);
+    }
+};
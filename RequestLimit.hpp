@@ -0,0 +1,117 @@
+#pragma once
+#include "Log.hpp"
+#include "Config.hpp"
+#include "ThreadPool.hpp"
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+//请求报文的大小限制和接收期限，防止少数恶意客户端占满内存和线程
+//初始行、报头行数和报头字节数超限，正文长度超过该操作码所在通道的上限，或者报文格式错误，都返回407并关闭连接
+//每个报文从收到第一个字节开始计时，超过期限还没收完由reactor线程直接关闭连接(慢速攻击)
+//正文较长时按body_min_rate放宽期限，大文件上传不会被误杀
+class RequestLimiter
+{
+private:
+    size_t maxIniLine_;        //初始行最大字节数，不包括\r\n
+    size_t maxHeaders_;        //报头最多行数
+    size_t maxHeaderBytes_;    //报头总字节数，包括每行的\r\n
+    uint64_t maxBody_[LANE_NUM]; //各通道正文的最大字节数
+    long long deadlineMs_;     //报文接收期限，0表示不限制
+    long long bodyMinRate_;    //正文最低接收速率，字节/秒
+
+    std::atomic<long long> tooLong_;   //初始行或者报头超限
+    std::atomic<long long> tooLarge_;  //正文超限
+    std::atomic<long long> malformed_; //格式错误
+    std::atomic<long long> timeouts_;  //超过接收期限
+
+    static RequestLimiter* prq_;
+
+    RequestLimiter(): tooLong_(0), tooLarge_(0), malformed_(0), timeouts_(0)
+    {
+        Config* pc = Config::GetInstance();
+        maxIniLine_ = pc->GetInt("max_iniline_bytes");
+        maxHeaders_ = pc->GetInt("max_header_count");
+        maxHeaderBytes_ = pc->GetInt("max_header_bytes");
+        maxBody_[LANE_CONTROL] = pc->GetInt("max_body_control");
+        maxBody_[LANE_CHAT] = pc->GetInt("max_body_chat");
+        maxBody_[LANE_BULK] = pc->GetInt("max_body_bulk");
+        deadlineMs_ = pc->GetInt("request_deadline_ms");
+        bodyMinRate_ = std::max<long long>(1, pc->GetInt("body_min_rate"));
+    }
+
+public:
+    enum Violation
+    {
+        TOO_LONG = 0,
+        TOO_LARGE = 1,
+        MALFORMED = 2
+    };
+
+    RequestLimiter(const RequestLimiter&) = delete;
+    RequestLimiter& operator=(const RequestLimiter&) = delete;
+
+    static RequestLimiter* GetInstance()
+    {
+        static std::mutex mtx;
+        if(prq_ == nullptr){
+            {
+                std::unique_lock<std::mutex> u_mtx(mtx);
+                if(prq_ == nullptr){
+                    prq_ = new RequestLimiter;
+                }
+            }
+        }
+        return prq_;
+    }
+
+    static long long NowMs()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    size_t MaxIniLine() const { return maxIniLine_; }
+    size_t MaxHeaders() const { return maxHeaders_; }
+    size_t MaxHeaderBytes() const { return maxHeaderBytes_; }
+    uint64_t MaxBody(int lane) const { return maxBody_[lane]; }
+
+    //新报文的接收期限，不限制时返回0
+    long long Deadline() const
+    {
+        return deadlineMs_ > 0 ? NowMs() + deadlineMs_ : 0;
+    }
+
+    //报头收完后按正文长度延长的期限
+    long long BodyExtraMs(uint64_t content_len) const
+    {
+        return (long long)(content_len * 1000 / bodyMinRate_);
+    }
+
+    void CountViolation(Violation v)
+    {
+        if(v == TOO_LONG){
+            tooLong_++;
+        }
+        else if(v == TOO_LARGE){
+            tooLarge_++;
+        }
+        else{
+            malformed_++;
+        }
+    }
+
+    void CountTimeout()
+    {
+        timeouts_++;
+    }
+
+    std::string Stats()
+    {
+        return std::string("request too_long=")+std::to_string(tooLong_)
+            +std::string(" too_large=")+std::to_string(tooLarge_)
+            +std::string(" malformed=")+std::to_string(malformed_)
+            +std::string(" timeouts=")+std::to_string(timeouts_);
+    }
+};
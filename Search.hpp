@@ -0,0 +1,1090 @@
+#pragma once
+#include "Log.hpp"
+#include "Config.hpp"
+#include "Util.hpp"
+#include "History.hpp"
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cctype>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+
+//倒排索引的一个段，写完之后不再修改
+//文件布局: 词典区 + 倒排表区 + 稀疏索引区 + 尾部
+//词典按key排序，key为 词 + '\0' + 会话编号(4字节大端)，每项为key、倒排表在倒排表区内的偏移、字节数和条数
+//倒排表为该会话中含有这个词的所有消息的stamp，从小到大按差值变长编码
+//稀疏索引每隔SPARSE项记录一次key和该项在词典区的偏移，加载时读入内存，查找时二分之后只读一小段词典
+//[lo_, hi_]为段的序号范围，刷出的段lo_等于hi_，合并得到的段覆盖所有输入段的范围
+class SearchSegment
+{
+public:
+    struct Footer
+    {
+        uint32_t magic_;
+        uint32_t level_;    //合并的层数，刷出的段为0
+        uint64_t lo_;
+        uint64_t hi_;
+        uint64_t keys_;     //词典项数
+        uint64_t postOff_;  //倒排表区的偏移，也是词典区的长度
+        uint64_t sparseOff_; //稀疏索引区的偏移
+    };
+
+    //词典中的一项，磁盘上存为：与上一个key相同的前缀长度、剩余部分、倒排表字节数、条数，都用变长整数
+    //倒排表和词典顺序相同，偏移由字节数累加得到；每SPARSE项重新开始一次前缀压缩，并记入稀疏索引
+    struct Entry
+    {
+        std::string key_;
+        uint64_t off_;   //相对倒排表区
+        uint32_t bytes_;
+        uint32_t count_;
+    };
+
+    static const uint32_t MAGIC = 0x5347534a; //"JSGS"
+    static const size_t SPARSE = 64;
+
+    std::string path_;
+    int fd_;
+    Footer footer_;
+    uint64_t size_;
+    //稀疏索引的一项：该项的完整key、在词典区和倒排表区的偏移
+    struct Restart
+    {
+        std::string key_;
+        uint64_t dictOff_;
+        uint64_t postOff_;
+    };
+    std::vector<Restart> sparse_;
+
+    SearchSegment(): fd_(-1), size_(0)
+    {}
+
+    ~SearchSegment()
+    {
+        if(fd_ >= 0){
+            close(fd_);
+        }
+    }
+
+    static void PutVarint(std::string& out, uint64_t v)
+    {
+        while(v >= 0x80){
+            out += (char)((v & 0x7f) | 0x80);
+            v >>= 7;
+        }
+        out += (char)v;
+    }
+
+    static bool GetVarint(const char*& cur, const char* end, uint64_t& v)
+    {
+        v = 0;
+        for(int shift = 0;cur < end && shift < 64;shift += 7){
+            unsigned char c = *cur++;
+            v |= (uint64_t)(c & 0x7f) << shift;
+            if((c & 0x80) == 0){
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //stamps从小到大，编码后追加到out
+    static void EncodePostings(const std::vector<uint64_t>& stamps, std::string& out)
+    {
+        uint64_t prev = 0;
+        for(auto s : stamps){
+            PutVarint(out, s - prev);
+            prev = s;
+        }
+    }
+
+    static void DecodePostings(const char* cur, const char* end, std::vector<uint64_t>& out)
+    {
+        uint64_t prev = 0, delta = 0;
+        while(cur < end && GetVarint(cur, end, delta)){
+            prev += delta;
+            out.push_back(prev);
+        }
+    }
+
+    static void EncodeEntry(std::string& out, const std::string& prev, const std::string& key, uint32_t bytes, uint32_t count)
+    {
+        size_t shared = 0;
+        size_t limit = std::min(prev.size(), key.size());
+        while(shared < limit && prev[shared] == key[shared]){
+            shared++;
+        }
+        PutVarint(out, shared);
+        PutVarint(out, key.size() - shared);
+        out.append(key, shared, std::string::npos);
+        PutVarint(out, bytes);
+        PutVarint(out, count);
+    }
+
+    //e中保存上一项，解出下一项覆盖它；剩余数据不足一项时返回false，e不变
+    static bool DecodeEntry(const char*& cur, const char* end, Entry& e)
+    {
+        const char* p = cur;
+        uint64_t shared = 0, len = 0, bytes = 0, count = 0;
+        if(!GetVarint(p, end, shared) || !GetVarint(p, end, len) || shared > e.key_.size() || len > (uint64_t)(end - p)){
+            return false;
+        }
+        const char* suffix = p;
+        p += len;
+        if(!GetVarint(p, end, bytes) || !GetVarint(p, end, count)){
+            return false;
+        }
+        e.key_.resize(shared);
+        e.key_.append(suffix, len);
+        e.off_ += e.bytes_;
+        e.bytes_ = bytes;
+        e.count_ = count;
+        cur = p;
+        return true;
+    }
+
+    static bool ReadAt(int fd, std::string& buf, size_t n, uint64_t offset)
+    {
+        buf.resize(n);
+        size_t total = 0;
+        while(total < n){
+            ssize_t s = pread(fd, &buf[total], n - total, offset + total);
+            if(s < 0 && errno == EINTR){
+                continue;
+            }
+            if(s <= 0){
+                return false;
+            }
+            total += s;
+        }
+        return true;
+    }
+
+    //打开段文件并读入尾部和稀疏索引，失败返回nullptr
+    static std::shared_ptr<SearchSegment> Open(const std::string& path)
+    {
+        auto seg = std::make_shared<SearchSegment>();
+        seg->path_ = path;
+        seg->fd_ = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if(seg->fd_ < 0 || fstat(seg->fd_, &st) < 0 || (uint64_t)st.st_size < sizeof(Footer)){
+            return nullptr;
+        }
+        seg->size_ = st.st_size;
+        std::string buf;
+        if(!ReadAt(seg->fd_, buf, sizeof(Footer), seg->size_ - sizeof(Footer))){
+            return nullptr;
+        }
+        memcpy(&seg->footer_, buf.data(), sizeof(Footer));
+        const Footer& f = seg->footer_;
+        if(f.magic_ != MAGIC || f.postOff_ > f.sparseOff_ || f.sparseOff_ > seg->size_ - sizeof(Footer)){
+            return nullptr;
+        }
+        if(!ReadAt(seg->fd_, buf, seg->size_ - sizeof(Footer) - f.sparseOff_, f.sparseOff_)){
+            return nullptr;
+        }
+        BinReader rd(buf.data(), buf.data() + buf.size());
+        while(rd.cur_ < rd.end_){
+            Restart r;
+            if(!rd.GetString(r.key_) || !rd.GetU64(r.dictOff_) || !rd.GetU64(r.postOff_)){
+                return nullptr;
+            }
+            seg->sparse_.push_back(std::move(r));
+        }
+        return seg;
+    }
+
+    //查找key的倒排表，追加到out；chunk和chunk_off缓存上一次读出的词典段，同一个词的相邻会话通常落在同一段
+    void Lookup(const std::string& key, std::vector<uint64_t>& out, std::string& chunk, uint64_t& chunk_off) const
+    {
+        auto it = std::upper_bound(sparse_.begin(), sparse_.end(), key, [](const std::string& k, const Restart& r){ return k < r.key_; });
+        if(it == sparse_.begin()){
+            return;
+        }
+        uint64_t end = (it == sparse_.end()) ? footer_.postOff_ : it->dictOff_;
+        --it;
+        if(chunk_off != it->dictOff_ || chunk.empty()){
+            chunk_off = it->dictOff_;
+            if(!ReadAt(fd_, chunk, end - it->dictOff_, it->dictOff_)){
+                chunk.clear();
+                return;
+            }
+        }
+        const char* cur = chunk.data();
+        const char* stop = chunk.data() + chunk.size();
+        Entry e{"", it->postOff_, 0, 0};
+        while(cur < stop && DecodeEntry(cur, stop, e)){
+            if(e.key_ == key){
+                std::string post;
+                if(ReadAt(fd_, post, e.bytes_, footer_.postOff_ + e.off_)){
+                    DecodePostings(post.data(), post.data() + post.size(), out);
+                }
+                return;
+            }
+            if(key < e.key_){
+                return;
+            }
+        }
+    }
+
+    //按顺序遍历词典，合并时使用
+    class Cursor
+    {
+    private:
+        const SearchSegment* seg_;
+        uint64_t next_;   //下一次读词典的偏移
+        std::string buf_;
+        size_t pos_;
+        std::string post_;   //倒排表区中从postOff_开始的一段，倒排表和词典的顺序相同，顺序读即可
+        uint64_t postOff_;
+
+    public:
+        explicit Cursor(const SearchSegment* seg): seg_(seg), next_(0), pos_(0), postOff_(0)
+        {}
+
+        //e须为上一次Next的结果，第一次调用时为空的Entry
+        bool Next(Entry& e)
+        {
+            while(true){
+                if(pos_ < buf_.size()){
+                    const char* cur = buf_.data() + pos_;
+                    if(DecodeEntry(cur, buf_.data() + buf_.size(), e)){
+                        pos_ = cur - buf_.data();
+                        return true;
+                    }
+                }
+                //剩下的不足一项，和下一段拼起来再解
+                if(next_ >= seg_->footer_.postOff_){
+                    return false;
+                }
+                std::string more;
+                size_t n = std::min<uint64_t>(1 << 20, seg_->footer_.postOff_ - next_);
+                if(!ReadAt(seg_->fd_, more, n, next_)){
+                    return false;
+                }
+                next_ += n;
+                buf_ = buf_.substr(pos_) + more;
+                pos_ = 0;
+            }
+        }
+
+        void Postings(const Entry& e, std::vector<uint64_t>& out)
+        {
+            if(e.off_ < postOff_ || e.off_ + e.bytes_ > postOff_ + post_.size()){
+                uint64_t total = seg_->footer_.sparseOff_ - seg_->footer_.postOff_;
+                size_t n = std::min<uint64_t>(std::max<uint64_t>(1 << 20, e.bytes_), total - std::min(total, e.off_));
+                postOff_ = e.off_;
+                if(n < e.bytes_ || !ReadAt(seg_->fd_, post_, n, seg_->footer_.postOff_ + e.off_)){
+                    post_.clear();
+                    return;
+                }
+            }
+            const char* begin = post_.data() + (e.off_ - postOff_);
+            DecodePostings(begin, begin + e.bytes_, out);
+        }
+    };
+};
+
+//按key顺序写一个段，先写到path.tmp，Finish时改名
+//词典直接写入段文件，倒排表先写入path.post，最后接在词典后面
+class SegmentWriter
+{
+private:
+    std::string path_;
+    int fd_;
+    int postFd_;
+    std::string dict_;
+    std::string post_;
+    std::string sparse_;
+    std::string prev_;   //上一个key，用于前缀压缩
+    uint64_t dictBytes_; //词典总字节数，包括还在dict_中的部分
+    uint64_t postBytes_; //倒排表总字节数，包括还在post_中的部分
+    uint64_t keys_;
+    bool ok_;
+
+    void Spill(int fd, std::string& buf, size_t limit)
+    {
+        if(buf.size() >= limit){
+            ok_ = ok_ && Util::WriteAll(fd, buf);
+            buf.clear();
+        }
+    }
+
+public:
+    explicit SegmentWriter(const std::string& path): path_(path), dictBytes_(0), postBytes_(0), keys_(0), ok_(true)
+    {
+        fd_ = open((path + ".tmp").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        postFd_ = open((path + ".post").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        ok_ = fd_ >= 0 && postFd_ >= 0;
+    }
+
+    ~SegmentWriter()
+    {
+        if(fd_ >= 0){
+            close(fd_);
+        }
+        if(postFd_ >= 0){
+            close(postFd_);
+        }
+        unlink((path_ + ".post").c_str());
+        unlink((path_ + ".tmp").c_str());
+    }
+
+    uint64_t Keys()
+    {
+        return keys_;
+    }
+
+    //key必须严格递增，stamps从小到大
+    void Add(const std::string& key, const std::vector<uint64_t>& stamps)
+    {
+        if(stamps.empty()){
+            return;
+        }
+        size_t before = post_.size();
+        SearchSegment::EncodePostings(stamps, post_);
+        uint32_t bytes = post_.size() - before;
+        if(keys_ % SearchSegment::SPARSE == 0){
+            Util::PutString(sparse_, key);
+            Util::PutU64(sparse_, dictBytes_);
+            Util::PutU64(sparse_, postBytes_);
+            prev_.clear();
+        }
+        size_t dict_before = dict_.size();
+        SearchSegment::EncodeEntry(dict_, prev_, key, bytes, stamps.size());
+        prev_ = key;
+        dictBytes_ += dict_.size() - dict_before;
+        postBytes_ += bytes;
+        keys_++;
+        Spill(fd_, dict_, 1 << 20);
+        Spill(postFd_, post_, 1 << 20);
+    }
+
+    //写完倒排表、稀疏索引和尾部，改名为path，成功返回true
+    bool Finish(uint32_t level, uint64_t lo, uint64_t hi)
+    {
+        ok_ = ok_ && Util::WriteAll(fd_, dict_) && Util::WriteAll(postFd_, post_);
+        dict_.clear();
+        post_.clear();
+        //倒排表接在词典后面
+        char buf[1 << 16];
+        ssize_t n = 0;
+        if(ok_ && lseek(postFd_, 0, SEEK_SET) == 0){
+            while((n = read(postFd_, buf, sizeof(buf))) > 0){
+                if(!Util::WriteAll(fd_, std::string(buf, n))){
+                    ok_ = false;
+                    break;
+                }
+            }
+        }
+        ok_ = ok_ && n == 0;
+        SearchSegment::Footer f{SearchSegment::MAGIC, level, lo, hi, keys_, dictBytes_, dictBytes_ + postBytes_};
+        ok_ = ok_ && Util::WriteAll(fd_, sparse_) && Util::WriteAll(fd_, std::string((const char*)&f, sizeof(f)));
+        ok_ = ok_ && fsync(fd_) == 0 && rename((path_ + ".tmp").c_str(), path_.c_str()) == 0;
+        return ok_;
+    }
+};
+
+//消息正文的全文搜索
+//后台的索引线程从History接收写入文件的块，把正文切成词，按(词, 会话)记录消息的stamp，先放在内存表中
+//内存表满search_segment_postings条之后写成一个段文件，同一层的段满search_merge_factor个就合并成上一层的一个段
+//查询时只查调用者参与的会话: 对每个会话按词查各段和内存表，求交集之后按stamp从新到旧取结果，代价和全站消息量无关
+//会话key第一次出现时追加到convs.log，编号为出现的顺序；每写出一个段，把各会话已经写入段的最大stamp记入state
+//重启时从state记录的位置向History补建索引，崩溃时还在内存表中的部分不会丢失
+class Search
+{
+private:
+    typedef std::unordered_map<std::string, std::vector<uint64_t>> MemTable;
+
+    std::mutex mtx_; //保护下面的内存表、段列表和会话表
+    std::condition_variable cv_;     //有新的块时通知索引线程
+    std::condition_variable idleCv_; //索引线程处理完一批时通知Flush
+    std::deque<std::pair<std::string, History::Sealed>> queue_;
+    bool busy_;
+    bool flushReq_;
+
+    MemTable mem_;
+    std::shared_ptr<const MemTable> imm_; //正在写成段的内存表，写完之前仍然可以查询
+    size_t memPostings_;
+    std::vector<std::shared_ptr<SearchSegment>> segments_; //按序号从旧到新
+    uint64_t nextSeq_;
+
+    std::vector<std::string> convKeys_;                  //编号到会话key
+    std::unordered_map<std::string, uint32_t> convIds_;  //会话key到编号
+    std::unordered_map<std::string, std::vector<uint32_t>> pairs_; //用户名到他参与的所有单聊会话
+    std::vector<uint64_t> indexed_;   //每个会话已经进入内存表的最大stamp
+    std::vector<uint64_t> persisted_; //每个会话已经写入段的最大stamp，和state文件一致
+
+    std::string dir_;
+    size_t segPostings_;
+    size_t mergeFactor_;
+    int convLog_;
+
+    std::atomic<long long> docs_;     //已经索引的消息条数
+    std::atomic<long long> postings_; //已经写入内存表的倒排项数
+    std::atomic<long long> flushes_;  //写出的段数
+    std::atomic<long long> merges_;   //合并次数
+    std::atomic<long long> queries_;
+
+    static Search* psr_;
+
+    Search(): busy_(false), flushReq_(false), memPostings_(0), nextSeq_(1), convLog_(-1), docs_(0), postings_(0), flushes_(0), merges_(0), queries_(0)
+    {
+        Config* pc = Config::GetInstance();
+        dir_ = pc->GetString("search_dir");
+        if(dir_.empty() || dir_.back() != '/'){
+            dir_ += '/';
+        }
+        segPostings_ = std::max<long long>(1, pc->GetInt("search_segment_postings"));
+        mergeFactor_ = std::max<long long>(2, pc->GetInt("search_merge_factor"));
+    }
+
+    static bool IsCJK(uint32_t cp)
+    {
+        return (cp >= 0x3040 && cp <= 0x30ff) || (cp >= 0x3400 && cp <= 0x4dbf) || (cp >= 0x4e00 && cp <= 0x9fff)
+            || (cp >= 0xac00 && cp <= 0xd7af) || (cp >= 0xf900 && cp <= 0xfaff);
+    }
+
+    //标点、符号和表情作为分隔符
+    static bool IsSeparator(uint32_t cp)
+    {
+        if(cp < 0x80){
+            return !isalnum(cp);
+        }
+        return (cp >= 0x2000 && cp <= 0x2bff) || (cp >= 0x3000 && cp <= 0x303f) || (cp >= 0xfe30 && cp <= 0xfe4f)
+            || (cp >= 0xff00 && cp <= 0xff0f) || (cp >= 0xff1a && cp <= 0xff20) || (cp >= 0xff3b && cp <= 0xff40)
+            || (cp >= 0xff5b && cp <= 0xff65) || cp >= 0x1f000;
+    }
+
+    static std::string Key(const std::string& term, uint32_t conv)
+    {
+        std::string key(term);
+        key += '\0';
+        for(int shift = 24;shift >= 0;shift -= 8){
+            key += (char)((conv >> shift) & 0xff);
+        }
+        return key;
+    }
+
+    //在mtx_内调用，返回会话key的编号，第一次出现时分配编号并追加到convs.log
+    uint32_t Intern(const std::string& key)
+    {
+        auto it = convIds_.find(key);
+        if(it != convIds_.end()){
+            return it->second;
+        }
+        uint32_t id = convKeys_.size();
+        AddConv(key);
+        if(convLog_ >= 0){
+            std::string rec;
+            Util::PutString(rec, key);
+            if(!Util::WriteAll(convLog_, rec)){
+                LOG(ERROR, "Search: append convs.log error");
+            }
+        }
+        return id;
+    }
+
+    //在mtx_内调用
+    void AddConv(const std::string& key)
+    {
+        uint32_t id = convKeys_.size();
+        convKeys_.push_back(key);
+        convIds_[key] = id;
+        indexed_.push_back(0);
+        persisted_.push_back(0);
+        //单聊会话的key为 u:用户\n用户
+        if(key.compare(0, 2, "u:") == 0){
+            size_t pos = key.find('\n');
+            if(pos != std::string::npos){
+                pairs_[key.substr(2, pos - 2)].push_back(id);
+                pairs_[key.substr(pos + 1)].push_back(id);
+            }
+        }
+    }
+
+    std::string SegmentPath(uint64_t lo, uint64_t hi)
+    {
+        return dir_ + std::string("seg-") + std::to_string(lo) + std::string("-") + std::to_string(hi) + std::string(".jseg");
+    }
+
+    //加载convs.log、state和所有段，被合并过的段(序号范围被其他段覆盖)是合并完成之前崩溃留下的，直接删除
+    void Load()
+    {
+        mkdir(dir_.c_str(), 0777);
+        std::string log_path = dir_ + "convs.log";
+        std::string data;
+        int fd = open(log_path.c_str(), O_RDONLY);
+        if(fd >= 0){
+            struct stat st;
+            if(fstat(fd, &st) == 0 && !SearchSegment::ReadAt(fd, data, st.st_size, 0)){
+                data.clear();
+            }
+            close(fd);
+        }
+        BinReader rd(data.data(), data.data() + data.size());
+        std::string key;
+        size_t valid = 0;
+        while(rd.cur_ < rd.end_ && rd.GetString(key)){
+            AddConv(key);
+            valid = rd.cur_ - data.data();
+        }
+        convLog_ = open(log_path.c_str(), O_WRONLY | O_CREAT, 0644);
+        //末尾不完整的记录截掉
+        if(convLog_ < 0 || ftruncate(convLog_, valid) < 0 || lseek(convLog_, 0, SEEK_END) < 0){
+            LOG(ERROR, "Search: open convs.log error");
+        }
+
+        fd = open((dir_ + "state").c_str(), O_RDONLY);
+        if(fd >= 0){
+            struct stat st;
+            if(fstat(fd, &st) == 0 && SearchSegment::ReadAt(fd, data, st.st_size, 0)){
+                BinReader rs(data.data(), data.data() + data.size());
+                uint32_t id = 0;
+                uint64_t stamp = 0;
+                while(rs.GetU32(id) && rs.GetU64(stamp)){
+                    if(id < persisted_.size()){
+                        persisted_[id] = indexed_[id] = stamp;
+                    }
+                }
+            }
+            close(fd);
+        }
+
+        std::vector<std::shared_ptr<SearchSegment>> segs;
+        DIR* dir = opendir(dir_.c_str());
+        if(dir != nullptr){
+            struct dirent* ent;
+            while((ent = readdir(dir)) != nullptr){
+                std::string name(ent->d_name);
+                if(name.size() > 5 && name.compare(name.size() - 5, 5, ".jseg") == 0){
+                    auto seg = SearchSegment::Open(dir_ + name);
+                    if(seg == nullptr){
+                        LOG(WARNING, std::string("Search: bad segment ")+name);
+                        continue;
+                    }
+                    segs.push_back(seg);
+                }
+                else if(name.size() > 4 && (name.compare(name.size() - 4, 4, ".tmp") == 0 || name.compare(name.size() - 5, 5, ".post") == 0)){
+                    unlink((dir_ + name).c_str());
+                }
+            }
+            closedir(dir);
+        }
+        std::sort(segs.begin(), segs.end(), [](const std::shared_ptr<SearchSegment>& a, const std::shared_ptr<SearchSegment>& b){
+            return a->footer_.lo_ != b->footer_.lo_ ? a->footer_.lo_ < b->footer_.lo_ : a->footer_.hi_ > b->footer_.hi_;
+        });
+        for(auto& seg : segs){
+            if(!segments_.empty() && seg->footer_.hi_ <= segments_.back()->footer_.hi_){
+                unlink(seg->path_.c_str());
+                continue;
+            }
+            segments_.push_back(seg);
+            nextSeq_ = seg->footer_.hi_ + 1;
+        }
+    }
+
+    //把消息切成词，ASCII字母数字按词切分并转为小写，中日韩文字按相邻两个字切分，只有一个字时单独成词
+    //其他非ASCII字符作为词的一部分；每个词最多64字节，结果去重
+    static void Tokenize(const std::string& text, std::vector<std::string>& terms)
+    {
+        std::string word;
+        std::vector<std::string> run; //连续的中日韩文字，每个元素为一个字的UTF-8编码
+        auto end_word = [&]{
+            if(!word.empty()){
+                terms.push_back(word.substr(0, 64));
+                word.clear();
+            }
+        };
+        auto end_run = [&]{
+            if(run.size() == 1){
+                terms.push_back(run[0]);
+            }
+            for(size_t i = 0;i + 1 < run.size();i++){
+                terms.push_back(run[i] + run[i + 1]);
+            }
+            run.clear();
+        };
+        size_t i = 0;
+        while(i < text.size()){
+            unsigned char c = text[i];
+            uint32_t cp = c;
+            size_t len = 1;
+            if(c >= 0xf0){
+                len = 4;
+                cp = c & 0x07;
+            }
+            else if(c >= 0xe0){
+                len = 3;
+                cp = c & 0x0f;
+            }
+            else if(c >= 0xc0){
+                len = 2;
+                cp = c & 0x1f;
+            }
+            else if(c >= 0x80){
+                //不合法的UTF-8作为分隔符
+                cp = ' ';
+            }
+            if(i + len > text.size()){
+                break;
+            }
+            for(size_t j = 1;j < len;j++){
+                cp = (cp << 6) | (text[i + j] & 0x3f);
+            }
+            if(IsCJK(cp)){
+                end_word();
+                run.push_back(text.substr(i, len));
+            }
+            else if(IsSeparator(cp)){
+                end_word();
+                end_run();
+            }
+            else{
+                end_run();
+                if(len == 1){
+                    word += (char)tolower(c);
+                }
+                else{
+                    word.append(text, i, len);
+                }
+            }
+            i += len;
+        }
+        end_word();
+        end_run();
+        std::sort(terms.begin(), terms.end());
+        terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+    }
+
+    //把一个块的消息加入内存表，在索引线程中调用
+    void IndexBlock(const std::string& key, const std::vector<HistoryEntry>& entries)
+    {
+        std::vector<std::pair<uint64_t, std::vector<std::string>>> docs;
+        for(auto& e : entries){
+            docs.emplace_back(e.stamp_, std::vector<std::string>());
+            Tokenize(e.body_, docs.back().second);
+        }
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        uint32_t conv = Intern(key);
+        for(auto& doc : docs){
+            //补建索引和新写入的块可能重叠，已经索引过的跳过
+            if(doc.first <= indexed_[conv]){
+                continue;
+            }
+            indexed_[conv] = doc.first;
+            for(auto& term : doc.second){
+                mem_[Key(term, conv)].push_back(doc.first);
+            }
+            memPostings_ += doc.second.size();
+            postings_ += doc.second.size();
+            docs_++;
+        }
+    }
+
+    //把内存表写成一个段，写完之后记录各会话已经写入段的位置
+    void FlushMem()
+    {
+        std::vector<uint64_t> watermark;
+        std::shared_ptr<const MemTable> table;
+        uint64_t seq = 0;
+        {
+            std::unique_lock<std::mutex> u_mtx(mtx_);
+            if(mem_.empty()){
+                return;
+            }
+            imm_ = std::make_shared<const MemTable>(std::move(mem_));
+            table = imm_;
+            mem_.clear();
+            memPostings_ = 0;
+            watermark = indexed_;
+            seq = nextSeq_++;
+        }
+        std::vector<const std::pair<const std::string, std::vector<uint64_t>>*> sorted;
+        for(auto& one : *table){
+            sorted.push_back(&one);
+        }
+        std::sort(sorted.begin(), sorted.end(), [](const std::pair<const std::string, std::vector<uint64_t>>* a, const std::pair<const std::string, std::vector<uint64_t>>* b){
+            return a->first < b->first;
+        });
+        std::string path = SegmentPath(seq, seq);
+        std::shared_ptr<SearchSegment> seg;
+        {
+            SegmentWriter writer(path);
+            for(auto p : sorted){
+                writer.Add(p->first, p->second);
+            }
+            if(writer.Finish(0, seq, seq)){
+                seg = SearchSegment::Open(path);
+            }
+        }
+        if(seg == nullptr){
+            //写失败时内存表保留在imm_中，仍然可以查询，不推进state
+            LOG(ERROR, std::string("Search: write segment error: ")+path);
+            return;
+        }
+        flushes_++;
+        {
+            std::unique_lock<std::mutex> u_mtx(mtx_);
+            segments_.push_back(seg);
+            imm_.reset();
+        }
+        SaveState(watermark);
+        Merge();
+    }
+
+    //记录各会话已经写入段的最大stamp，先写临时文件再改名
+    void SaveState(const std::vector<uint64_t>& watermark)
+    {
+        std::string data;
+        for(uint32_t id = 0;id < watermark.size();id++){
+            if(watermark[id] > 0){
+                Util::PutU32(data, id);
+                Util::PutU64(data, watermark[id]);
+            }
+        }
+        std::string tmp = dir_ + "state.tmp";
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool ok = fd >= 0 && Util::WriteAll(fd, data) && fsync(fd) == 0;
+        if(fd >= 0){
+            close(fd);
+        }
+        if(!ok || rename(tmp.c_str(), (dir_ + "state").c_str()) < 0){
+            LOG(ERROR, "Search: save state error");
+            return;
+        }
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        for(size_t id = 0;id < watermark.size();id++){
+            persisted_[id] = watermark[id];
+        }
+    }
+
+    //最新的段中同一层的段满mergeFactor_个时合并成上一层的一个段，合并后的段可能继续触发上一层的合并
+    void Merge()
+    {
+        while(true){
+            std::vector<std::shared_ptr<SearchSegment>> inputs;
+            {
+                std::unique_lock<std::mutex> u_mtx(mtx_);
+                if(segments_.empty()){
+                    return;
+                }
+                uint32_t level = segments_.back()->footer_.level_;
+                size_t n = 0;
+                while(n < segments_.size() && segments_[segments_.size() - 1 - n]->footer_.level_ == level){
+                    n++;
+                }
+                if(n < mergeFactor_){
+                    return;
+                }
+                inputs.assign(segments_.end() - n, segments_.end());
+            }
+            uint64_t lo = inputs.front()->footer_.lo_, hi = inputs.back()->footer_.hi_;
+            std::string path = SegmentPath(lo, hi);
+            std::shared_ptr<SearchSegment> merged;
+            {
+                //多路归并各段的词典，同一个key的倒排表按段的顺序拼接
+                SegmentWriter writer(path);
+                std::vector<SearchSegment::Cursor> cursors;
+                std::vector<SearchSegment::Entry> heads(inputs.size());
+                std::vector<bool> alive(inputs.size());
+                for(size_t i = 0;i < inputs.size();i++){
+                    cursors.emplace_back(inputs[i].get());
+                    alive[i] = cursors[i].Next(heads[i]);
+                }
+                while(true){
+                    const std::string* min_key = nullptr;
+                    for(size_t i = 0;i < inputs.size();i++){
+                        if(alive[i] && (min_key == nullptr || heads[i].key_ < *min_key)){
+                            min_key = &heads[i].key_;
+                        }
+                    }
+                    if(min_key == nullptr){
+                        break;
+                    }
+                    std::string key = *min_key;
+                    std::vector<uint64_t> stamps;
+                    for(size_t i = 0;i < inputs.size();i++){
+                        if(alive[i] && heads[i].key_ == key){
+                            cursors[i].Postings(heads[i], stamps);
+                            alive[i] = cursors[i].Next(heads[i]);
+                        }
+                    }
+                    std::sort(stamps.begin(), stamps.end());
+                    stamps.erase(std::unique(stamps.begin(), stamps.end()), stamps.end());
+                    writer.Add(key, stamps);
+                }
+                if(writer.Finish(inputs.back()->footer_.level_ + 1, lo, hi)){
+                    merged = SearchSegment::Open(path);
+                }
+            }
+            if(merged == nullptr){
+                LOG(ERROR, std::string("Search: merge error: ")+path);
+                return;
+            }
+            merges_++;
+            {
+                std::unique_lock<std::mutex> u_mtx(mtx_);
+                segments_.erase(segments_.end() - inputs.size(), segments_.end());
+                segments_.push_back(merged);
+            }
+            //正在查询的请求持有段的fd，删除文件不影响它们读完
+            for(auto& seg : inputs){
+                unlink(seg->path_.c_str());
+            }
+        }
+    }
+
+    //从state记录的位置向History补建索引，覆盖上次退出时还在内存表中或者还没有写入段的消息
+    void CatchUp()
+    {
+        std::vector<std::pair<std::string, uint64_t>> todo;
+        {
+            std::unique_lock<std::mutex> u_mtx(mtx_);
+            for(size_t id = 0;id < convKeys_.size();id++){
+                todo.emplace_back(convKeys_[id], indexed_[id]);
+            }
+        }
+        long long before = docs_;
+        for(auto& one : todo){
+            uint64_t anchor = one.second;
+            bool more = true;
+            while(more){
+                std::vector<HistoryEntry> entries;
+                History::GetInstance()->Query(one.first, anchor, false, 1000, SIZE_MAX, entries, more);
+                if(entries.empty()){
+                    break;
+                }
+                anchor = entries.back().stamp_;
+                IndexBlock(one.first, entries);
+            }
+        }
+        if(docs_ > before){
+            LOG(INFO, std::string("Search: caught up ")+std::to_string(docs_ - before)+std::string(" messages from history"));
+        }
+    }
+
+    void IndexLoop()
+    {
+        CatchUp();
+        while(true){
+            std::deque<std::pair<std::string, History::Sealed>> batch;
+            bool flush = false;
+            {
+                std::unique_lock<std::mutex> u_mtx(mtx_);
+                busy_ = false;
+                idleCv_.notify_all();
+                cv_.wait(u_mtx, [this]{ return !queue_.empty() || flushReq_; });
+                batch.swap(queue_);
+                flush = flushReq_ && batch.empty();
+                busy_ = true;
+            }
+            //索引线程落后时一批可能有很多块，每个块之后都检查内存表是否已满
+            for(auto& one : batch){
+                IndexBlock(one.first, *one.second);
+                bool full = false;
+                {
+                    std::unique_lock<std::mutex> u_mtx(mtx_);
+                    full = memPostings_ >= segPostings_;
+                }
+                if(full){
+                    FlushMem();
+                }
+            }
+            if(flush){
+                FlushMem();
+            }
+            if(flush){
+                std::unique_lock<std::mutex> u_mtx(mtx_);
+                flushReq_ = false;
+            }
+        }
+    }
+
+    //在mtx_内调用，收集key在内存表中的倒排项
+    void MemPostings(const std::string& key, std::vector<uint64_t>& out)
+    {
+        if(imm_ != nullptr){
+            auto it = imm_->find(key);
+            if(it != imm_->end()){
+                out.insert(out.end(), it->second.begin(), it->second.end());
+            }
+        }
+        auto it = mem_.find(key);
+        if(it != mem_.end()){
+            out.insert(out.end(), it->second.begin(), it->second.end());
+        }
+    }
+
+public:
+    Search(const Search&) = delete;
+    Search& operator=(const Search&) = delete;
+
+    static Search* GetInstance()
+    {
+        static std::mutex mtx;
+        if(psr_ == nullptr){
+            {
+                std::unique_lock<std::mutex> u_mtx(mtx);
+                if(psr_ == nullptr){
+                    psr_ = new Search;
+                }
+            }
+        }
+        return psr_;
+    }
+
+    //加载索引，接收History写入文件的块，启动索引线程
+    void Start()
+    {
+        Load();
+        History::GetInstance()->SetSink([this](const std::string& key, const History::Sealed& entries){
+            std::unique_lock<std::mutex> u_mtx(mtx_);
+            queue_.emplace_back(key, entries);
+            cv_.notify_one();
+        });
+        std::thread(&Search::IndexLoop, this).detach();
+    }
+
+    //name参与的所有单聊会话的key
+    std::vector<std::string> PairKeys(const std::string& name)
+    {
+        std::vector<std::string> keys;
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        auto it = pairs_.find(name);
+        if(it != pairs_.end()){
+            for(auto id : it->second){
+                keys.push_back(convKeys_[id]);
+            }
+        }
+        return keys;
+    }
+
+    //在keys这些会话中查找同时含有query中所有词的消息，取stamp小于anchor的最新n条，按stamp从新到旧放入hits
+    //first为会话key，second为stamp；more表示还有更早的结果；query切不出词时返回false
+    bool Query(const std::vector<std::string>& keys, const std::string& query, uint64_t anchor, size_t n, std::vector<std::pair<std::string, uint64_t>>& hits, bool& more)
+    {
+        queries_++;
+        more = false;
+        std::vector<std::string> terms;
+        Tokenize(query, terms);
+        if(terms.empty()){
+            return false;
+        }
+        //在锁内取段列表和内存表中的倒排项，读段文件在锁外
+        std::vector<std::shared_ptr<SearchSegment>> segs;
+        std::vector<std::pair<uint32_t, const std::string*>> convs;
+        std::unordered_map<std::string, std::vector<uint64_t>> mem;
+        {
+            std::unique_lock<std::mutex> u_mtx(mtx_);
+            segs = segments_;
+            for(auto& key : keys){
+                auto it = convIds_.find(key);
+                if(it == convIds_.end()){
+                    continue;
+                }
+                convs.emplace_back(it->second, &key);
+                for(auto& term : terms){
+                    std::string k = Key(term, it->second);
+                    std::vector<uint64_t> v;
+                    MemPostings(k, v);
+                    if(!v.empty()){
+                        mem[k] = std::move(v);
+                    }
+                }
+            }
+        }
+        //按会话编号排序，同一个词的相邻会话在词典中也相邻，可以复用读出的词典段
+        std::sort(convs.begin(), convs.end());
+        std::vector<std::pair<uint64_t, const std::string*>> found;
+        std::vector<std::string> chunks(segs.size() * terms.size());
+        std::vector<uint64_t> chunk_offs(segs.size() * terms.size(), UINT64_MAX);
+        for(auto& conv : convs){
+            std::vector<uint64_t> acc;
+            for(size_t t = 0;t < terms.size();t++){
+                std::string k = Key(terms[t], conv.first);
+                std::vector<uint64_t> list;
+                for(size_t s = 0;s < segs.size();s++){
+                    segs[s]->Lookup(k, list, chunks[s * terms.size() + t], chunk_offs[s * terms.size() + t]);
+                }
+                auto it = mem.find(k);
+                if(it != mem.end()){
+                    list.insert(list.end(), it->second.begin(), it->second.end());
+                }
+                std::sort(list.begin(), list.end());
+                list.erase(std::unique(list.begin(), list.end()), list.end());
+                if(t == 0){
+                    acc.swap(list);
+                }
+                else{
+                    std::vector<uint64_t> both;
+                    std::set_intersection(acc.begin(), acc.end(), list.begin(), list.end(), std::back_inserter(both));
+                    acc.swap(both);
+                }
+                if(acc.empty()){
+                    break;
+                }
+            }
+            //每个会话最多取n+1条，多出的一条用于判断more
+            size_t taken = 0;
+            for(auto rit = acc.rbegin();rit != acc.rend() && taken <= n;++rit){
+                if(*rit < anchor){
+                    found.emplace_back(*rit, conv.second);
+                    taken++;
+                }
+            }
+        }
+        std::sort(found.begin(), found.end(), [](const std::pair<uint64_t, const std::string*>& a, const std::pair<uint64_t, const std::string*>& b){
+            return a.first > b.first;
+        });
+        if(found.size() > n){
+            more = true;
+            found.resize(n);
+        }
+        for(auto& one : found){
+            hits.emplace_back(*one.second, one.first);
+        }
+        return true;
+    }
+
+    //等待索引线程处理完已经收到的块，并把内存表写成段，SIGTERM和热升级交接时在History::Flush之后调用
+    void Flush()
+    {
+        std::unique_lock<std::mutex> u_mtx(mtx_);
+        flushReq_ = true;
+        cv_.notify_one();
+        idleCv_.wait(u_mtx, [this]{ return !flushReq_ && queue_.empty() && !busy_; });
+    }
+
+    std::string Stats()
+    {
+        size_t segs = 0, mem = 0, convs = 0;
+        {
+            std::unique_lock<std::mutex> u_mtx(mtx_);
+            segs = segments_.size();
+            mem = memPostings_;
+            convs = convKeys_.size();
+        }
+        return std::string("search convs=")+std::to_string(convs)
+            +std::string(" docs=")+std::to_string(docs_)
+            +std::string(" postings=")+std::to_string(postings_)
+            +std::string(" mem_postings=")+std::to_string(mem)
+            +std::string(" segments=")+std::to_string(segs)
+            +std::string(" flushes=")+std::to_string(flushes_)
+            +std::string(" merges=")+std::to_string(merges_)
+            +std::string(" queries=")+std::to_string(queries_);
+    }
+};
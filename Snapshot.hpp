@@ -0,0 +1,740 @@
+#pragma once
+#include "Log.hpp"
+#include "Protocol.hpp"
+#include "Util.hpp"
+#include "Config.hpp"
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <algorithm>
+#include <fstream>
+
+#define SNAPSHOT_SHARDS 8    //每个容器被切分成的段数，加载时各段可以并行解码
+#define SNAPSHOT_MAGIC "JCSNAP01"
+
+//Chatroom状态快照
+//文件格式: magic(8字节) + 段数(u32) + 段表{类型(u32), 偏移(u64), 长度(u64)} + 各段数据
+//每段数据: 元素个数(u32) + 元素，字符串统一编码为 长度(u32) + 内容
+//同一个容器被哈希切分成SNAPSHOT_SHARDS段，加载时用mmap映射文件，多个线程各自解码一段，最后再合并
+class Snapshot
+{
+private:
+    enum SectionType : uint32_t
+    {
+        USERS = 1,
+        OFFLINE,
+        GROUPS,
+        OFFLINE_GROUPS,
+        OFFLINE_FILES,
+        GROUP_LOG_END,
+        GROUP_CURSORS,
+        FILE_INDEX,
+        PARTS,
+        SUBSCRIPTIONS,
+        OFFLINE_READ
+    };
+
+    struct Section
+    {
+        uint32_t type_;
+        uint64_t offset_;
+        uint64_t len_;
+    };
+
+    //将一个容器切分为SNAPSHOT_SHARDS段编码，put_value负责编码value部分
+    template<class Map, class F>
+    static void EncodeMap(uint32_t type, const Map& m, F put_value, std::vector<std::pair<uint32_t, std::string>>& sections)
+    {
+        std::hash<std::string> h;
+        std::vector<std::string> shards(SNAPSHOT_SHARDS);
+        std::vector<uint32_t> counts(SNAPSHOT_SHARDS, 0);
+        for(auto& e : m){
+            int i = h(e.first) % SNAPSHOT_SHARDS;
+            Util::PutString(shards[i], e.first);
+            put_value(shards[i], e.second);
+            counts[i]++;
+        }
+        for(int i = 0;i < SNAPSHOT_SHARDS;i++){
+            std::string data;
+            Util::PutU32(data, counts[i]);
+            data += shards[i];
+            sections.push_back(std::make_pair(type, std::move(data)));
+        }
+    }
+
+    //解码一段数据到map中，get_value负责解码value部分
+    template<class Map, class F>
+    static bool DecodeMap(BinReader& rd, Map& m, F get_value)
+    {
+        uint32_t n = 0;
+        //每个元素至少有4字节的key长度，元素个数超过剩余长度能容纳的上限说明数据损坏，不能按它reserve
+        if(!rd.GetU32(n) || n > rd.Remain() / sizeof(uint32_t)){
+            rd.bad_ = true;
+            return false;
+        }
+        m.reserve(n);
+        for(uint32_t i = 0;i < n;i++){
+            std::string key;
+            typename Map::mapped_type value;
+            if(!rd.GetString(key) || !get_value(rd, value)){
+                return false;
+            }
+            m.emplace(std::move(key), std::move(value));
+        }
+        return !rd.bad_;
+    }
+
+    static void PutStringSet(std::string& out, const std::unordered_set<std::string>& set)
+    {
+        Util::PutU32(out, set.size());
+        for(auto& s : set){
+            Util::PutString(out, s);
+        }
+    }
+
+    static bool GetStringSet(BinReader& rd, std::unordered_set<std::string>& set)
+    {
+        uint32_t n = 0;
+        if(!rd.GetU32(n) || n > rd.Remain() / sizeof(uint32_t)){
+            rd.bad_ = true;
+            return false;
+        }
+        set.reserve(n);
+        for(uint32_t i = 0;i < n;i++){
+            std::string s;
+            if(!rd.GetString(s)){
+                return false;
+            }
+            set.insert(std::move(s));
+        }
+        return true;
+    }
+
+    //从offset处数出离线消息文件中每个发送者的消息条数，解析方式和Protocol::ReadFile一致
+    static std::unordered_map<std::string, int> CountOffline(const std::string& path, uint64_t offset)
+    {
+        std::unordered_map<std::string, int> counts;
+        std::ifstream fread(path);
+        fread.seekg(offset);
+        std::string line[4], data;
+        while(true){
+            bool ok = true;
+            for(int j = 0;j < 4 && ok;j++){
+                ok = (bool)std::getline(fread, line[j]);
+            }
+            if(!ok){
+                break;
+            }
+            int len = std::atoi(line[3].c_str());
+            while(std::getline(fread, data)){
+                len -= data.size() + 1;
+                if(len <= 0){
+                    break;
+                }
+            }
+            counts[line[1]]++;
+        }
+        return counts;
+    }
+
+    //清除所有成员在group日志中的读游标以及对应的离线计数，调用者需持有offlineMtx_和groupLogMtx_
+    static void DropGroupLog(Chatroom* pc, const std::string& group)
+    {
+        for(auto it = pc->groupCursor_.begin();it != pc->groupCursor_.end();){
+            if(it->second.erase(group) > 0){
+                auto it_offline = pc->offline_.find(it->first);
+                if(it_offline != pc->offline_.end()){
+                    it_offline->second.erase(group);
+                    if(it_offline->second.empty()){
+                        pc->offline_.erase(it_offline);
+                    }
+                }
+            }
+            it = it->second.empty() ? pc->groupCursor_.erase(it) : std::next(it);
+        }
+        pc->groupReaders_.erase(group);
+        pc->groupLogEnd_.erase(group);
+    }
+
+    //快照只记录了写快照那一刻的状态，之后崩溃的话离线消息文件和群聊日志可能比记录的长，或者已经被清空
+    //群聊日志截断到记录的末尾；比记录的短说明写快照之后所有读者都读完并清空了日志，同时清除读游标
+    //单聊消息先追加到文件再计数，以文件为准，从第一条未读消息处重新数出每个发送者的条数
+    //在Load合并完各容器之后调用
+    static void Reconcile(Chatroom* pc)
+    {
+        std::scoped_lock s_mtx(pc->offlineMtx_, pc->groupLogMtx_);
+        std::unordered_set<std::string> chats, group_logs;
+        DIR* pd = opendir(Chatroom::MessageDir().c_str());
+        if(pd != nullptr){
+            struct dirent* entry;
+            while((entry = readdir(pd)) != nullptr){
+                std::string name(entry->d_name);
+                auto strip = [&name](const std::string& suffix, std::unordered_set<std::string>& out){
+                    if(name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0){
+                        out.insert(name.substr(0, name.size() - suffix.size()));
+                    }
+                };
+                strip(".jchat", chats);
+                strip(".jgroup", group_logs);
+            }
+            closedir(pd);
+        }
+
+        size_t n_logs = 0, n_chats = 0;
+        for(auto& log_end : pc->groupLogEnd_){
+            group_logs.insert(log_end.first);
+        }
+        for(auto& group : group_logs){
+            std::string path = Chatroom::GroupLogPath(group);
+            struct stat st;
+            uint64_t size = (stat(path.c_str(), &st) == 0) ? st.st_size : 0;
+            auto it = pc->groupLogEnd_.find(group);
+            uint64_t end = (it == pc->groupLogEnd_.end()) ? 0 : it->second;
+            if(size == end){
+                continue;
+            }
+            if(size < end){
+                DropGroupLog(pc, group);
+                end = 0;
+            }
+            truncate(path.c_str(), end);
+            n_logs++;
+            LOG(WARNING, std::string("Group log does not match snapshot, truncated to ")+std::to_string(end)+std::string(": ")+path);
+        }
+
+        for(auto& user : pc->offline_){
+            chats.insert(user.first);
+        }
+        for(auto& name : chats){
+            std::string path = Chatroom::MessagePath(name);
+            struct stat st;
+            uint64_t size = (stat(path.c_str(), &st) == 0) ? st.st_size : 0;
+            auto it_read = pc->offlineRead_.find(name);
+            uint64_t offset = 0;
+            if(it_read != pc->offlineRead_.end()){
+                if(it_read->second <= size){
+                    offset = it_read->second;
+                }
+                else{
+                    //文件在写快照之后被读完清空过
+                    pc->offlineRead_.erase(it_read);
+                }
+            }
+            std::unordered_map<std::string, int> personal;
+            if(size > offset){
+                personal = CountOffline(path, offset);
+            }
+
+            //群聊的计数保留，其余的都是单聊计数，换成从文件中数出的
+            auto it_cursor = pc->groupCursor_.find(name);
+            std::unordered_map<std::string, int> counts;
+            auto it_offline = pc->offline_.find(name);
+            if(it_offline != pc->offline_.end()){
+                for(auto& spec_sender : it_offline->second){
+                    if(it_cursor != pc->groupCursor_.end() && it_cursor->second.count(spec_sender.first) > 0){
+                        counts.insert(spec_sender);
+                    }
+                }
+            }
+            counts.merge(personal);
+            if(it_offline != pc->offline_.end() && it_offline->second == counts){
+                continue;
+            }
+            if(it_offline == pc->offline_.end() && counts.empty()){
+                continue;
+            }
+            n_chats++;
+            if(counts.empty()){
+                pc->offline_.erase(name);
+            }
+            else{
+                pc->offline_[name] = std::move(counts);
+            }
+        }
+        if(n_logs > 0 || n_chats > 0){
+            LOG(WARNING, std::string("Snapshot reconciled with message files, group logs: ")+std::to_string(n_logs)+std::string(", offline users: ")+std::to_string(n_chats));
+        }
+    }
+
+public:
+    //将整个Chatroom写入path，先写临时文件再rename，保证任何时候path都是一个完整的快照
+    //成功返回true，失败返回false
+    static bool Save(const std::string& path = Config::GetInstance()->GetString("snapshot_path"))
+    {
+        auto start = std::chrono::steady_clock::now();
+        Chatroom* pc = Chatroom::GetInstance();
+
+        //所有容器在同一时刻拷贝，各容器之间互相引用(例如群聊日志长度和读游标)，分别加锁拷贝会得到不同时刻的状态
+        //编码在锁外完成，业务线程只在拷贝期间被阻塞
+        std::unordered_map<std::string, std::string> users;
+        std::unordered_map<std::string, std::unordered_map<std::string, int>> offline;
+        std::unordered_map<std::string, uint64_t> offline_read;
+        std::unordered_map<std::string, std::unordered_set<std::string>> groups;
+        std::unordered_map<std::string, std::unordered_set<std::string>> offline_groups;
+        std::unordered_map<std::string, std::unordered_set<std::pair<std::string, std::string>, PairHash>> offline_files;
+        std::unordered_map<std::string, uint64_t> group_log_end;
+        std::unordered_map<std::string, std::unordered_map<std::string, uint64_t>> group_cursors;
+        std::unordered_map<std::string, std::string> file_index;
+        std::unordered_map<std::string, PartUpload> parts;
+        std::unordered_map<std::string, std::unordered_set<std::string>> subscriptions;
+        {
+            //std::scoped_lock一次锁住全部互斥量并避免死锁，与业务代码加锁的顺序无关
+            Presence* pp = Presence::GetInstance();
+            std::scoped_lock s_mtx(pc->usersMtx_, pc->offlineMtx_, pc->groupsMtx_, pc->oflgroupMtx_, pc->oflfileMtx_,
+                                   pc->groupLogMtx_, pc->fileIndexMtx_, pc->partMtx_, pp->mtx_);
+            users = pc->users_;
+            offline = pc->offline_;
+            offline_read = pc->offlineRead_;
+            groups = pc->groups_;
+            offline_groups = pc->offlineGroups_;
+            offline_files = pc->offlineFiles_;
+            group_log_end = pc->groupLogEnd_;
+            group_cursors = pc->groupCursor_;
+            file_index = pc->fileIndex_;
+            parts = pc->parts_;
+            subscriptions = pp->subs_;
+        }
+
+        std::vector<std::pair<uint32_t, std::string>> sections;
+        EncodeMap(USERS, users, [](std::string& out, const std::string& pw){
+            Util::PutString(out, pw);
+        }, sections);
+        EncodeMap(OFFLINE, offline, [](std::string& out, const std::unordered_map<std::string, int>& senders){
+            Util::PutU32(out, senders.size());
+            for(auto& s : senders){
+                Util::PutString(out, s.first);
+                Util::PutU32(out, s.second);
+            }
+        }, sections);
+        EncodeMap(OFFLINE_READ, offline_read, [](std::string& out, uint64_t offset){
+            Util::PutU64(out, offset);
+        }, sections);
+        EncodeMap(GROUPS, groups, PutStringSet, sections);
+        EncodeMap(OFFLINE_GROUPS, offline_groups, PutStringSet, sections);
+        EncodeMap(OFFLINE_FILES, offline_files, [](std::string& out, const std::unordered_set<std::pair<std::string, std::string>, PairHash>& files){
+            Util::PutU32(out, files.size());
+            for(auto& f : files){
+                Util::PutString(out, f.first);
+                Util::PutString(out, f.second);
+            }
+        }, sections);
+        EncodeMap(GROUP_LOG_END, group_log_end, [](std::string& out, uint64_t end){
+            Util::PutU64(out, end);
+        }, sections);
+        EncodeMap(GROUP_CURSORS, group_cursors, [](std::string& out, const std::unordered_map<std::string, uint64_t>& cursors){
+            Util::PutU32(out, cursors.size());
+            for(auto& c : cursors){
+                Util::PutString(out, c.first);
+                Util::PutU64(out, c.second);
+            }
+        }, sections);
+        EncodeMap(FILE_INDEX, file_index, [](std::string& out, const std::string& hash){
+            Util::PutString(out, hash);
+        }, sections);
+        EncodeMap(PARTS, parts, [](std::string& out, const PartUpload& part){
+            Util::PutU64(out, part.size_);
+            Util::PutString(out, part.time_);
+            Util::PutU32(out, part.ranges_.size());
+            for(auto& r : part.ranges_){
+                Util::PutU64(out, r.first);
+                Util::PutU64(out, r.second);
+            }
+        }, sections);
+        EncodeMap(SUBSCRIPTIONS, subscriptions, PutStringSet, sections);
+
+        //文件头和段表
+        std::string head(SNAPSHOT_MAGIC);
+        Util::PutU32(head, sections.size());
+        uint64_t offset = head.size() + sections.size() * (sizeof(uint32_t) + 2 * sizeof(uint64_t));
+        for(auto& s : sections){
+            Util::PutU32(head, s.first);
+            Util::PutU64(head, offset);
+            Util::PutU64(head, s.second.size());
+            offset += s.second.size();
+        }
+
+        std::string tmp_path = path + ".tmp";
+        int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0){
+            LOG(ERROR, std::string("Snapshot open error: ")+tmp_path);
+            return false;
+        }
+        bool ok = Util::WriteAll(fd, head);
+        for(auto& s : sections){
+            ok = ok && Util::WriteAll(fd, s.second);
+        }
+        ok = ok && (fsync(fd) == 0);
+        close(fd);
+        if(!ok || rename(tmp_path.c_str(), path.c_str()) < 0){
+            LOG(ERROR, std::string("Snapshot write error: ")+path);
+            unlink(tmp_path.c_str());
+            return false;
+        }
+
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        LOG(INFO, std::string("Snapshot saved, users: ")+std::to_string(users.size())+std::string(", groups: ")+std::to_string(groups.size())+std::string(", bytes: ")+std::to_string(offset)+std::string(", ms: ")+std::to_string(ms));
+        return true;
+    }
+
+    //从path恢复Chatroom，文件不存在或格式错误返回false，此时Chatroom保持原样
+    static bool Load(const std::string& path = Config::GetInstance()->GetString("snapshot_path"))
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0){
+            LOG(INFO, std::string("No snapshot to restore: ")+path);
+            return false;
+        }
+        struct stat st;
+        if(fstat(fd, &st) < 0 || st.st_size == 0){
+            close(fd);
+            return false;
+        }
+        size_t size = st.st_size;
+        void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(addr == MAP_FAILED){
+            LOG(ERROR, std::string("Snapshot mmap error: ")+path);
+            return false;
+        }
+        madvise(addr, size, MADV_WILLNEED);
+        const char* base = (const char*)addr;
+
+        //读取文件头和段表
+        BinReader rd(base, base + size);
+        std::vector<Section> table;
+        uint32_t num = 0;
+        bool ok = size >= strlen(SNAPSHOT_MAGIC) && memcmp(base, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC)) == 0;
+        if(ok){
+            rd.cur_ += strlen(SNAPSHOT_MAGIC);
+            ok = rd.GetU32(num);
+        }
+        for(uint32_t i = 0;ok && i < num;i++){
+            Section sec;
+            ok = rd.GetU32(sec.type_) && rd.GetU64(sec.offset_) && rd.GetU64(sec.len_) && sec.offset_ <= size && sec.len_ <= size - sec.offset_;
+            table.push_back(sec);
+        }
+        if(!ok){
+            munmap(addr, size);
+            LOG(ERROR, std::string("Snapshot is corrupted: ")+path);
+            return false;
+        }
+
+        //每一段都解码到独立的局部容器中，各段之间没有共享，可以完全并行
+        size_t n_users = 0, n_offline = 0, n_groups = 0, n_oflgroups = 0, n_oflfiles = 0, n_logend = 0, n_cursors = 0, n_files = 0, n_parts = 0, n_subs = 0, n_oflread = 0;
+        for(auto& sec : table){
+            n_users += (sec.type_ == USERS);
+            n_offline += (sec.type_ == OFFLINE);
+            n_groups += (sec.type_ == GROUPS);
+            n_oflgroups += (sec.type_ == OFFLINE_GROUPS);
+            n_oflfiles += (sec.type_ == OFFLINE_FILES);
+            n_logend += (sec.type_ == GROUP_LOG_END);
+            n_cursors += (sec.type_ == GROUP_CURSORS);
+            n_files += (sec.type_ == FILE_INDEX);
+            n_parts += (sec.type_ == PARTS);
+            n_subs += (sec.type_ == SUBSCRIPTIONS);
+            n_oflread += (sec.type_ == OFFLINE_READ);
+        }
+        std::vector<std::unordered_map<std::string, std::string>> users(n_users);
+        std::vector<std::unordered_map<std::string, std::unordered_map<std::string, int>>> offline(n_offline);
+        std::vector<std::unordered_map<std::string, std::unordered_set<std::string>>> groups(n_groups);
+        std::vector<std::unordered_map<std::string, std::unordered_set<std::string>>> offline_groups(n_oflgroups);
+        std::vector<std::unordered_map<std::string, std::unordered_set<std::pair<std::string, std::string>, PairHash>>> offline_files(n_oflfiles);
+        std::vector<std::unordered_map<std::string, uint64_t>> group_log_end(n_logend);
+        std::vector<std::unordered_map<std::string, std::unordered_map<std::string, uint64_t>>> group_cursors(n_cursors);
+        std::vector<std::unordered_map<std::string, std::string>> file_index(n_files);
+        std::vector<std::unordered_map<std::string, PartUpload>> parts(n_parts);
+        std::vector<std::unordered_map<std::string, std::unordered_set<std::string>>> subscriptions(n_subs);
+        std::vector<std::unordered_map<std::string, uint64_t>> offline_read(n_oflread);
+
+        std::vector<std::function<bool()>> jobs;
+        size_t i_users = 0, i_offline = 0, i_groups = 0, i_oflgroups = 0, i_oflfiles = 0, i_logend = 0, i_cursors = 0, i_files = 0, i_parts = 0, i_subs = 0, i_oflread = 0;
+        for(auto& sec : table){
+            const char* begin = base + sec.offset_;
+            const char* end = begin + sec.len_;
+            switch(sec.type_){
+                case USERS:{
+                    auto& m = users[i_users++];
+                    jobs.push_back([begin, end, &m]{
+                        BinReader r(begin, end);
+                        return DecodeMap(r, m, [](BinReader& r, std::string& pw){
+                            return r.GetString(pw);
+                        });
+                    });
+                    break;
+                }
+                case OFFLINE:{
+                    auto& m = offline[i_offline++];
+                    jobs.push_back([begin, end, &m]{
+                        BinReader r(begin, end);
+                        return DecodeMap(r, m, [](BinReader& r, std::unordered_map<std::string, int>& senders){
+                            uint32_t n = 0;
+                            if(!r.GetU32(n)){
+                                return false;
+                            }
+                            for(uint32_t i = 0;i < n;i++){
+                                std::string sender;
+                                uint32_t count = 0;
+                                if(!r.GetString(sender) || !r.GetU32(count)){
+                                    return false;
+                                }
+                                senders.emplace(std::move(sender), (int)count);
+                            }
+                            return true;
+                        });
+                    });
+                    break;
+                }
+                case GROUPS:{
+                    auto& m = groups[i_groups++];
+                    jobs.push_back([begin, end, &m]{
+                        BinReader r(begin, end);
+                        return DecodeMap(r, m, GetStringSet);
+                    });
+                    break;
+                }
+                case OFFLINE_GROUPS:{
+                    auto& m = offline_groups[i_oflgroups++];
+                    jobs.push_back([begin, end, &m]{
+                        BinReader r(begin, end);
+                        return DecodeMap(r, m, GetStringSet);
+                    });
+                    break;
+                }
+                case OFFLINE_FILES:{
+                    auto& m = offline_files[i_oflfiles++];
+                    jobs.push_back([begin, end, &m]{
+                        BinReader r(begin, end);
+                        return DecodeMap(r, m, [](BinReader& r, std::unordered_set<std::pair<std::string, std::string>, PairHash>& files){
+                            uint32_t n = 0;
+                            if(!r.GetU32(n)){
+                                return false;
+                            }
+                            for(uint32_t i = 0;i < n;i++){
+                                std::string file_name, sender_time;
+                                if(!r.GetString(file_name) || !r.GetString(sender_time)){
+                                    return false;
+                                }
+                                files.insert(std::make_pair(std::move(file_name), std::move(sender_time)));
+                            }
+                            return true;
+                        });
+                    });
+                    break;
+                }
+                case GROUP_LOG_END:{
+                    auto& m = group_log_end[i_logend++];
+                    jobs.push_back([begin, end, &m]{
+                        BinReader r(begin, end);
+                        return DecodeMap(r, m, [](BinReader& r, uint64_t& end){
+                            return r.GetU64(end);
+                        });
+                    });
+                    break;
+                }
+                case GROUP_CURSORS:{
+                    auto& m = group_cursors[i_cursors++];
+                    jobs.push_back([begin, end, &m]{
+                        BinReader r(begin, end);
+                        return DecodeMap(r, m, [](BinReader& r, std::unordered_map<std::string, uint64_t>& cursors){
+                            uint32_t n = 0;
+                            if(!r.GetU32(n)){
+                                return false;
+                            }
+                            for(uint32_t i = 0;i < n;i++){
+                                std::string group;
+                                uint64_t offset = 0;
+                                if(!r.GetString(group) || !r.GetU64(offset)){
+                                    return false;
+                                }
+                                cursors.emplace(std::move(group), offset);
+                            }
+                            return true;
+                        });
+                    });
+                    break;
+                }
+                case FILE_INDEX:{
+                    auto& m = file_index[i_files++];
+                    jobs.push_back([begin, end, &m]{
+                        BinReader r(begin, end);
+                        return DecodeMap(r, m, [](BinReader& r, std::string& hash){
+                            return r.GetString(hash);
+                        });
+                    });
+                    break;
+                }
+                case PARTS:{
+                    //收尾标记不写入快照，恢复后收到下一块或查询时会重新检查是否收齐
+                    auto& m = parts[i_parts++];
+                    jobs.push_back([begin, end, &m]{
+                        BinReader r(begin, end);
+                        return DecodeMap(r, m, [](BinReader& r, PartUpload& part){
+                            uint32_t n = 0;
+                            if(!r.GetU64(part.size_) || !r.GetString(part.time_) || !r.GetU32(n)){
+                                return false;
+                            }
+                            part.received_ = 0;
+                            part.done_ = false;
+                            part.writers_ = 0;
+                            part.last_ = std::chrono::steady_clock::now();
+                            for(uint32_t i = 0;i < n;i++){
+                                uint64_t b = 0, e = 0;
+                                if(!r.GetU64(b) || !r.GetU64(e)){
+                                    return false;
+                                }
+                                part.ranges_.emplace(b, e);
+                                part.received_ += e - b;
+                            }
+                            return true;
+                        });
+                    });
+                    break;
+                }
+                case OFFLINE_READ:{
+                    auto& m = offline_read[i_oflread++];
+                    jobs.push_back([begin, end, &m]{
+                        BinReader r(begin, end);
+                        return DecodeMap(r, m, [](BinReader& r, uint64_t& offset){
+                            return r.GetU64(offset);
+                        });
+                    });
+                    break;
+                }
+                case SUBSCRIPTIONS:{
+                    auto& m = subscriptions[i_subs++];
+                    jobs.push_back([begin, end, &m]{
+                        BinReader r(begin, end);
+                        return DecodeMap(r, m, GetStringSet);
+                    });
+                    break;
+                }
+                default:{
+                    //不认识的段直接跳过，便于以后增加新的段
+                    break;
+                }
+            }
+        }
+
+        std::atomic<size_t> next(0);
+        std::atomic<bool> all_ok(true);
+        int thread_num = std::max(1, std::min((int)std::thread::hardware_concurrency(), (int)jobs.size()));
+        std::vector<std::thread> decoders;
+        for(int i = 0;i < thread_num;i++){
+            decoders.emplace_back([&]{
+                size_t j;
+                while((j = next++) < jobs.size()){
+                    if(!jobs[j]()){
+                        all_ok = false;
+                    }
+                }
+            });
+        }
+        for(auto& t : decoders){
+            t.join();
+        }
+        munmap(addr, size);
+
+        if(!all_ok){
+            LOG(ERROR, std::string("Snapshot is corrupted: ")+path);
+            return false;
+        }
+
+        //合并各段，unordered_map::merge直接转移节点，不会重新分配
+        Chatroom* pc = Chatroom::GetInstance();
+        size_t user_num = 0, group_num = 0;
+        {
+            std::unique_lock<std::mutex> u_mtx(pc->usersMtx_);
+            for(auto& m : users){
+                pc->users_.merge(m);
+            }
+            user_num = pc->users_.size();
+        }
+        {
+            std::unique_lock<std::mutex> u_mtx(pc->offlineMtx_);
+            for(auto& m : offline){
+                pc->offline_.merge(m);
+            }
+            for(auto& m : offline_read){
+                pc->offlineRead_.merge(m);
+            }
+        }
+        {
+            std::unique_lock<std::mutex> u_mtx(pc->groupsMtx_);
+            for(auto& m : groups){
+                pc->groups_.merge(m);
+            }
+            pc->MemberOfRebuild();
+            group_num = pc->groups_.size();
+        }
+        {
+            std::unique_lock<std::mutex> u_mtx(pc->oflgroupMtx_);
+            for(auto& m : offline_groups){
+                pc->offlineGroups_.merge(m);
+            }
+        }
+        {
+            std::unique_lock<std::mutex> u_mtx(pc->oflfileMtx_);
+            for(auto& m : offline_files){
+                pc->offlineFiles_.merge(m);
+            }
+        }
+        {
+            //groupReaders_可以由读游标推出，不需要写入快照
+            std::unique_lock<std::mutex> u_mtx(pc->groupLogMtx_);
+            for(auto& m : group_log_end){
+                pc->groupLogEnd_.merge(m);
+            }
+            for(auto& m : group_cursors){
+                pc->groupCursor_.merge(m);
+            }
+            pc->groupReaders_.clear();
+            for(auto& member : pc->groupCursor_){
+                for(auto& cursor : member.second){
+                    pc->groupReaders_[cursor.first]++;
+                }
+            }
+        }
+        {
+            std::unique_lock<std::mutex> u_mtx(pc->fileIndexMtx_);
+            for(auto& m : file_index){
+                pc->fileIndex_.merge(m);
+            }
+        }
+        {
+            std::unique_lock<std::mutex> u_mtx(pc->partMtx_);
+            for(auto& m : parts){
+                pc->parts_.merge(m);
+            }
+        }
+        Reconcile(pc);
+        {
+            //watchers_由订阅关系推出
+            Presence* pp = Presence::GetInstance();
+            std::unique_lock<std::mutex> u_mtx(pp->mtx_);
+            for(auto& m : subscriptions){
+                pp->subs_.merge(m);
+            }
+            pp->Rebuild();
+        }
+
+        //恢复耗时即服务器从启动到可以服务的时间
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        LOG(INFO, std::string("Snapshot restored, users: ")+std::to_string(user_num)+std::string(", groups: ")+std::to_string(group_num)+std::string(", threads: ")+std::to_string(thread_num)+std::string(", ms: ")+std::to_string(ms));
+        return true;
+    }
+};
\ No newline at end of file
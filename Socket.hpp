@@ -3,16 +3,15 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
+#include <arpa/inet.h>
 #include <strings.h>
 #include <iostream>
-
+#include <string>
 
 class Sock
 {
-private:
-    static const int backlog = 5;
-
 public:
     //socket创建监听套接字
     //参数opt为0，则默认会进入TIME_WAIT状态；opt不为0，则不进入TIME_WAIT状态
@@ -33,14 +32,17 @@ public:
         return listen_sock;
     }
 
-    //bind绑定端口和IP，成功返回0，失败返回-1
-    static int Bind(int listen_sock, uint16_t port)
+    //bind绑定端口和IP，ip为空时绑定所有地址，成功返回0，失败返回-1
+    static int Bind(int listen_sock, uint16_t port, const std::string& ip = std::string())
     {
         sockaddr_in local;
         bzero(&local, sizeof(local));
         local.sin_family = AF_INET;
         local.sin_port = htons(port);
         local.sin_addr.s_addr = INADDR_ANY;
+        if(!ip.empty() && inet_pton(AF_INET, ip.c_str(), &local.sin_addr) != 1){
+            return -1;
+        }
 
         if(bind(listen_sock, (sockaddr*)&local, sizeof(local)) < 0){
             return -1;
@@ -49,7 +51,8 @@ public:
     }
 
     //listen监听。成功返回0，失败返回-1
-    static int Listen(int listen_sock)
+    //backlog太小时，重启后大量客户端同时重连会让accept队列溢出，客户端要等SYN重传，耗时以秒计
+    static int Listen(int listen_sock, int backlog)
     {
         if(listen(listen_sock, backlog) < 0){
             return -1;
@@ -57,6 +60,19 @@ public:
         return 0;
     }
 
+    //客户端连接后总是先发送请求，连接上没有数据时不必唤醒accept
+    //secs为等待数据的最长时间，超时后内核仍会把连接交给accept
+    static int SetDeferAccept(int listen_sock, int secs)
+    {
+        return setsockopt(listen_sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof(secs));
+    }
+
+    //开启TCP Fast Open，支持的客户端重连时可以在SYN中直接携带第一个请求
+    static int SetFastOpen(int listen_sock, int qlen)
+    {
+        return setsockopt(listen_sock, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+    }
+
     static void SetNonBlock(int sock)
     {
         int fl = fcntl(sock, F_GETFL);
@@ -2,17 +2,16 @@
 #include "Socket.hpp"
 #include "pthread.h"
 #include "Log.hpp"
+#include "Config.hpp"
 #include <mutex>
 
-#define PORT 8081
-
 class TcpServer
 {
 private:
     uint16_t port_;
     static TcpServer* pt_;
 
-    TcpServer(uint16_t port = PORT):port_(port){}
+    TcpServer(uint16_t port):port_(port){}
 public: 
     TcpServer(const TcpServer&) = delete;
     TcpServer& operator=(const TcpServer&) = delete;
@@ -38,7 +37,17 @@ public:
         int listen_sock = Sock::Socket(1);
         Sock::SetNonBlock(listen_sock);   //使用ET模式，需要设置非阻塞模式
         Sock::Bind(listen_sock, port_);
-        Sock::Listen(listen_sock);
+        //TCP_DEFER_ACCEPT: 连接上有数据到达才交给accept；TCP_FASTOPEN: 重连时可以在SYN中携带第一个请求
+        Config* pc = Config::GetInstance();
+        int defer_secs = pc->GetInt("defer_accept_secs");
+        int fastopen_qlen = pc->GetInt("fastopen_qlen");
+        if(defer_secs > 0 && Sock::SetDeferAccept(listen_sock, defer_secs) < 0){
+            LOG(WARNING, "TCP_DEFER_ACCEPT is not supported");
+        }
+        if(fastopen_qlen > 0 && Sock::SetFastOpen(listen_sock, fastopen_qlen) < 0){
+            LOG(WARNING, "TCP_FASTOPEN is not supported");
+        }
+        Sock::Listen(listen_sock, pc->GetInt("listen_backlog"));
 
         return listen_sock;
     }
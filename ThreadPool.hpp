@@ -1,6 +1,7 @@
 #pragma once
 #include "Log.hpp"
 #include "Reactor.hpp"
+#include "Config.hpp"
 #include <iostream>
 #include <thread>
 #include <future>
@@ -11,10 +12,24 @@
 #include <functional>
 #include <vector>
 #include <queue>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <string>
 
 using Task = std::function<void()>;
-#define THREAD_NUM 8
-#define MESSAGE_THREAD_NUM 2
+using Clock = std::chrono::steady_clock;
+
+//任务按优先级分为三个通道，分别排队
+//REQ报文按操作码分类，见Protocol::LaneOf
+enum TaskLane
+{
+    LANE_CONTROL = 0, //0xx 注册，登录，退出
+    LANE_CHAT = 1,    //1xx/2xx 单聊，群聊，以及通知消息的发送，不指定通道的任务默认在这里
+    LANE_BULK = 2,    //3xx 文件传输，以及快照等后台任务
+    LANE_NUM = 3
+};
 
 //InformMsg为一种消息类型，对应的线程池不仅可以构建任务队列，也可以构建消息队列
 template<class T> //这里的T就是ChatMessage
@@ -45,116 +60,454 @@ class ThreadPool
 {
 private:
     std::atomic<bool> run_; //线程池运行为true，反之为false
+    std::atomic<bool> msgRun_; //消息线程运行为true，Stop时先于run_停止
+    std::atomic<int> busy_; //正在执行任务的线程数
 
     //任务队列相关
+    struct QueuedTask
+    {
+        Task task_;
+        Clock::time_point enqueue_; //入队时间，用于统计排队时延
+    };
+    //每个通道一个任务队列，按权重轮流出队，每出队一个任务消耗一个额度，所有通道额度用完后重新发放
+    //队首任务等待超过lane_starve_ms的通道优先出队，防止低优先级通道饿死
+    //bulk通道同时执行的任务数不超过线程数的lane_bulk_max_pct，保证总有线程留给登录和聊天
+    struct Lane
+    {
+        std::deque<QueuedTask> queue_;
+        int weight_;
+        int credit_;          //本轮剩余的出队额度
+        int running_;         //正在执行的任务数
+        long long waitSumUs_; //本周期出队任务的排队时延之和
+        long long waitCount_;
+        long long lastWaitUs_; //最近一个周期的平均排队时延
+    };
     std::vector<std::thread> workers; //线程池
-    std::queue<Task> taskQueue_; //任务队列
+    Lane lanes_[LANE_NUM];
+    size_t queued_; //所有通道排队的任务总数
+    int cursor_;    //轮转到的通道
+    int bulkMaxPct_;
+    long long starveUs_;
     std::mutex taskMtx_;
     std::condition_variable taskCv_;
+    int workerNum_; //当前处理任务的线程数
+    int targetNum_; //期望的线程数，小于workerNum_时多出来的线程处理完手头任务后退出
+    std::vector<std::thread::id> exited_; //已经退出还没有join的线程
+
+    //弹性伸缩相关，以下统计均由taskMtx_保护
+    //Adjust每隔一个周期根据这一周期的排队时延和线程利用率决定增减线程
+    int minNum_; //线程数下限
+    int maxNum_; //线程数上限
+    std::unordered_map<std::thread::id, Clock::time_point> running_; //每个线程开始执行当前任务的时间，空闲时为Clock::time_point()，线程退出时删除
+    long long waitSumUs_;   //本周期出队任务的排队时延之和
+    long long waitMaxUs_;   //本周期最大排队时延
+    long long waitCount_;   //本周期出队的任务数
+    long long busyUs_;      //本周期已经执行完的任务耗时之和
+    Clock::time_point lastAdjust_;
+    long long tasksTotal_;  //累计执行的任务数
+    long long grows_;       //累计扩容次数
+    long long shrinks_;     //累计缩容次数
+    std::string lastDecision_; //最近一次伸缩的原因
+    long long lastWaitUs_;  //最近一个周期的平均排队时延
+    long long lastWaitMaxUs_; //最近一个周期的最大排队时延
+    int lastUtil_;          //最近一个周期的线程利用率，百分比
+    int lastBlocked_;       //最近一个周期被长任务占住的线程数
+
+    //过载保护，按CoDel的思路观察control和chat通道任务的排队时延(bulk通道有并发上限，排队是正常的)
+    //排队时延持续interval都高于target时进入过载状态，出现一次低于target或者队列排空时退出
+    //过载期间新连接直接关闭，新的chat和bulk请求返回406，登录时不读离线消息而是延后推送
+    std::atomic<bool> overloaded_;
+    long long codelTargetUs_;
+    long long codelIntervalUs_;
+    bool aboveTarget_;               //排队时延是否一直高于target
+    Clock::time_point aboveSince_;   //从什么时候开始高于target
+    std::vector<Task> deferred_;     //过载期间延后的非关键任务，退出过载后放入bulk通道
+    long long overloadTimes_;        //累计进入过载的次数
+    std::atomic<long long> shedConns_;    //过载时关闭的新连接数
+    std::atomic<long long> shedRequests_; //过载时拒绝的请求数
+    long long deferredTotal_;        //累计延后的任务数
 
     //通知消息队列相关
     //消息队列的意义在于，确保给同一个连接发送消息时不会出现同时发送导致混乱的问题
     std::vector<std::thread> msgWorkers;
-    std::queue<InformMsg<T>> msgQueue_;
+    std::unordered_map<int, std::vector<InformMsg<T>>> msgQueue_; //key为连接socket，value为发给该连接的消息
+    std::deque<int> readySocks_; //有消息待发送的连接，由消息线程依次调度
     std::mutex msgMtx_;
     std::condition_variable msgCv_;
     std::unordered_map<int, bool> isOccupied_;
     //key为一个连接socket，value为该连接目前是否被占用
 
+    //通知消息的对象池，以下都由msgMtx_保护
+    //连接的消息取走或者连接关闭后，msgQueue_中的节点连同队列的容量留给下一个有消息的连接
+    //批量发送任务用完的batch清空后放回freeBatches_，容量留给下一批
+    typedef std::unordered_map<int, std::vector<InformMsg<T>>> MsgQueueMap;
+    std::vector<typename MsgQueueMap::node_type> freeQueues_;
+    std::vector<std::shared_ptr<std::vector<T>>> freeBatches_;
+    size_t poolMax_; //两个池各自最多保留的个数
+    static const size_t QUEUE_KEEP = 64; //放回池中的队列和batch最多保留这么多个报文的容量
+
     static ThreadPool<T, P>* ptp_;
 
-    ThreadPool(int num = THREAD_NUM): run_(true)
+    //通道中有任务并且允许再执行一个，调用者需持有taskMtx_
+    bool Runnable(int lane)
     {
-        //构造函数中直接启动num个线程
-        for(int i = 0;i < num;i++){
-            workers.emplace_back(std::thread([this]{
-                //线程循环去任务队列取任务并执行，没有任务则等待，任务做完继续去
-                while(run_){
-                    Task task;
-
-                    {
-                        std::unique_lock<std::mutex> u_mtx(taskMtx_); //取任务必须加锁
-                        taskCv_.wait(u_mtx, [this]{
-                            //只有当任务队列为空才等待，当线程池运行停止，则停止等待
-                            //意义在于防止线程池析构而还有线程在等待
-                            return !run_ || !taskQueue_.empty();
-                        });
-                        if(!run_ && taskQueue_.empty()){
-                            //停止运行且保证任务处理完，则直接返回
-                            return;
-                        }
-
-                        task = move(taskQueue_.front());
-                        taskQueue_.pop();
-                        LOG(INFO, "Pop a task from task_queue");
+        if(lanes_[lane].queue_.empty()){
+            return false;
+        }
+        if(lane == LANE_BULK){
+            return lanes_[lane].running_ < std::max(1, workerNum_ * bulkMaxPct_ / 100);
+        }
+        return true;
+    }
+
+    //选出下一个出队的通道，没有可以执行的任务返回-1，调用者需持有taskMtx_
+    int PickLane(Clock::time_point now)
+    {
+        //饥饿保护: 等待超时的通道中队首最老的先出队
+        int oldest = -1;
+        for(int i = 0;i < LANE_NUM;i++){
+            if(!Runnable(i) || now - lanes_[i].queue_.front().enqueue_ < std::chrono::microseconds(starveUs_)){
+                continue;
+            }
+            if(oldest == -1 || lanes_[i].queue_.front().enqueue_ < lanes_[oldest].queue_.front().enqueue_){
+                oldest = i;
+            }
+        }
+        if(oldest != -1){
+            return oldest;
+        }
+
+        //加权轮转
+        for(int round = 0;round < 2;round++){
+            for(int i = 0;i < LANE_NUM;i++){
+                int lane = (cursor_ + i) % LANE_NUM;
+                if(Runnable(lane) && lanes_[lane].credit_ > 0){
+                    if(--lanes_[lane].credit_ == 0){
+                        cursor_ = (lane + 1) % LANE_NUM;
                     }
+                    return lane;
+                }
+            }
+            for(auto& l : lanes_){
+                l.credit_ = l.weight_;
+            }
+        }
+        return -1;
+    }
 
-                    //执行任务
-                    task();
+    bool HasRunnable()
+    {
+        for(int i = 0;i < LANE_NUM;i++){
+            if(Runnable(i)){
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //所有通道中等待最久的任务已经等了多久，调用者需持有taskMtx_
+    long long HeadWaitUs(Clock::time_point now)
+    {
+        long long head_wait = 0;
+        for(auto& l : lanes_){
+            if(!l.queue_.empty()){
+                head_wait = std::max(head_wait, (long long)std::chrono::duration_cast<std::chrono::microseconds>(now - l.queue_.front().enqueue_).count());
+            }
+        }
+        return head_wait;
+    }
+
+    //control和chat通道都没有排队的任务，调用者需持有taskMtx_
+    bool InteractiveEmpty()
+    {
+        return lanes_[LANE_CONTROL].queue_.empty() && lanes_[LANE_CHAT].queue_.empty();
+    }
+
+    //出队一个control或chat任务时更新过载状态，wait为它的排队时延，调用者需持有taskMtx_
+    void CodelUpdate(Clock::time_point now, long long wait)
+    {
+        if(codelTargetUs_ <= 0){
+            //codel_target_ms为0表示关闭过载保护
+            return;
+        }
+        if(wait < codelTargetUs_ || InteractiveEmpty()){
+            aboveTarget_ = false;
+            if(overloaded_){
+                overloaded_ = false;
+                LOG(WARNING, "Overload cleared");
+            }
+            return;
+        }
+        if(!aboveTarget_){
+            aboveTarget_ = true;
+            aboveSince_ = now;
+        }
+        else if(!overloaded_ && now - aboveSince_ >= std::chrono::microseconds(codelIntervalUs_)){
+            overloaded_ = true;
+            overloadTimes_++;
+            LOG(WARNING, std::string("Overloaded, queue wait: ")+std::to_string(wait)+std::string("us"));
+        }
+    }
+
+    //退出过载后把延后的任务放入bulk通道，调用者需持有taskMtx_
+    void ReleaseDeferred()
+    {
+        if(overloaded_ || deferred_.empty()){
+            return;
+        }
+        Clock::time_point now = Clock::now();
+        for(auto& t : deferred_){
+            lanes_[LANE_BULK].queue_.push_back(QueuedTask{std::move(t), now});
+            queued_++;
+        }
+        deferred_.clear();
+        taskCv_.notify_all();
+    }
+
+    //启动一个处理任务的线程，调用者需持有taskMtx_
+    void AddWorker()
+    {
+        workerNum_++;
+        workers.emplace_back(std::thread([this]{
+            //线程循环去任务队列取任务并执行，没有任务则等待，任务做完继续去
+            bool has_run = false;
+            int lane = LANE_CHAT;
+            Clock::time_point start;
+            while(true){
+                Task task;
+
+                {
+                    std::unique_lock<std::mutex> u_mtx(taskMtx_); //取任务必须加锁
+                    if(has_run){
+                        //上一个任务的耗时在这里记账，不用为此单独加一次锁
+                        has_run = false;
+                        busyUs_ += std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+                        //不删除，留着给下一个任务使用，省掉每个任务一次节点分配
+                        running_[std::this_thread::get_id()] = Clock::time_point();
+                        lanes_[lane].running_--;
+                    }
+                    taskCv_.wait(u_mtx, [this]{
+                        //只有当没有可以执行的任务才等待，线程池停止并且任务都已取走时停止等待
+                        //停止时剩下受并发上限限制的bulk任务仍然等着由正在执行bulk任务的线程处理，不空转
+                        return (!run_ && queued_ == 0) || HasRunnable() || workerNum_ > targetNum_;
+                    });
+                    if(!run_ && queued_ == 0){
+                        //停止运行且保证任务处理完，则直接返回
+                        return;
+                    }
+                    if(workerNum_ > targetNum_){
+                        //线程池缩小，当前线程退出，由Resize负责join
+                        workerNum_--;
+                        running_.erase(std::this_thread::get_id());
+                        exited_.push_back(std::this_thread::get_id());
+                        return;
+                    }
+
+                    start = Clock::now();
+                    lane = PickLane(start);
+                    if(lane == -1){
+                        //停止运行时剩下的bulk任务由正在执行bulk任务的线程处理
+                        lane = LANE_CHAT;
+                        continue;
+                    }
+                    Lane& l = lanes_[lane];
+                    long long wait = std::chrono::duration_cast<std::chrono::microseconds>(start - l.queue_.front().enqueue_).count();
+                    l.waitSumUs_ += wait;
+                    l.waitCount_++;
+                    l.running_++;
+                    waitSumUs_ += wait;
+                    waitMaxUs_ = std::max(waitMaxUs_, wait);
+                    waitCount_++;
+                    tasksTotal_++;
+                    running_[std::this_thread::get_id()] = start;
+                    has_run = true;
+
+                    task = move(l.queue_.front().task_);
+                    l.queue_.pop_front();
+                    queued_--;
+                    busy_++;
+                    if(!run_ && queued_ == 0){
+                        //最后一个任务被取走，叫醒等待的线程退出
+                        taskCv_.notify_all();
+                    }
+                    if(lane != LANE_BULK){
+                        //在出队之后更新，队列刚好排空时立即退出过载
+                        CodelUpdate(start, wait);
+                    }
+                    LOG(INFO, "Pop a task from task_queue");
+                }
+
+                //执行任务
+                task();
+                busy_--;
+            }
+        }));
+    }
+
+    //为sock建立消息队列，优先复用池中的节点，调用者需持有msgMtx_
+    typename MsgQueueMap::iterator NewQueue(int sock)
+    {
+        if(freeQueues_.empty()){
+            return msgQueue_.emplace(sock, std::vector<InformMsg<T>>()).first;
+        }
+        auto node = std::move(freeQueues_.back());
+        freeQueues_.pop_back();
+        node.key() = sock;
+        return msgQueue_.insert(std::move(node)).position;
+    }
+
+    //从msgQueue_中删除it，节点清空后放回池中，调用者需持有msgMtx_
+    void RecycleQueue(typename MsgQueueMap::iterator it)
+    {
+        auto node = msgQueue_.extract(it);
+        if(freeQueues_.size() >= poolMax_){
+            return;
+        }
+        node.mapped().clear();
+        if(node.mapped().capacity() > QUEUE_KEEP){
+            std::vector<InformMsg<T>>().swap(node.mapped());
+        }
+        freeQueues_.push_back(std::move(node));
+    }
+
+    //取一个空的batch，调用者需持有msgMtx_
+    std::shared_ptr<std::vector<T>> TakeBatch()
+    {
+        if(freeBatches_.empty()){
+            return std::make_shared<std::vector<T>>();
+        }
+        auto batch = std::move(freeBatches_.back());
+        freeBatches_.pop_back();
+        return batch;
+    }
+
+    //批量发送任务结束后归还batch，报文在加锁之前就析构
+    void GiveBatch(const std::shared_ptr<std::vector<T>>& batch)
+    {
+        batch->clear();
+        if(batch->capacity() > QUEUE_KEEP){
+            std::vector<T>().swap(*batch);
+        }
+        std::unique_lock<std::mutex> u_mtx(msgMtx_);
+        if(freeBatches_.size() < poolMax_){
+            freeBatches_.push_back(batch);
+        }
+    }
+
+    //把期望线程数改为num，并回收已经退出的线程
+    void Retarget(int num, const std::string& reason)
+    {
+        std::vector<std::thread> finished;
+        int old_num;
+        {
+            std::unique_lock<std::mutex> u_mtx(taskMtx_);
+            old_num = targetNum_;
+            targetNum_ = num;
+            while(workerNum_ < targetNum_){
+                AddWorker();
+            }
+            //之前已经退出的线程在这里回收
+            for(auto it = workers.begin();it != workers.end();){
+                if(std::find(exited_.begin(), exited_.end(), it->get_id()) != exited_.end()){
+                    finished.push_back(std::move(*it));
+                    it = workers.erase(it);
                 }
-            }));
+                else{
+                    ++it;
+                }
+            }
+            exited_.clear();
+            if(old_num != num){
+                lastDecision_ = std::to_string(old_num)+std::string("->")+std::to_string(num)+std::string(" ")+reason;
+            }
+        }
+        taskCv_.notify_all();
+        for(auto& t : finished){
+            t.join();
+        }
+        if(old_num != num){
+            LOG(INFO, std::string("Thread pool resized: ")+std::to_string(old_num)+std::string("->")+std::to_string(num)+std::string(", ")+reason);
+        }
+    }
+
+    ThreadPool(int num, int msg_num, int min_num, int max_num, const int weights[LANE_NUM], int bulk_max_pct, long long starve_us,
+               long long codel_target_us, long long codel_interval_us, size_t pool_max)
+        : run_(true), msgRun_(true), busy_(0), queued_(0), cursor_(0), bulkMaxPct_(bulk_max_pct), starveUs_(starve_us),
+          workerNum_(0), targetNum_(num), minNum_(min_num), maxNum_(max_num),
+          waitSumUs_(0), waitMaxUs_(0), waitCount_(0), busyUs_(0), lastAdjust_(Clock::now()),
+          tasksTotal_(0), grows_(0), shrinks_(0), lastWaitUs_(0), lastWaitMaxUs_(0), lastUtil_(0), lastBlocked_(0),
+          overloaded_(false), codelTargetUs_(codel_target_us), codelIntervalUs_(codel_interval_us), aboveTarget_(false),
+          overloadTimes_(0), shedConns_(0), shedRequests_(0), deferredTotal_(0), poolMax_(pool_max)
+    {
+        for(int i = 0;i < LANE_NUM;i++){
+            lanes_[i].weight_ = std::max(1, weights[i]);
+            lanes_[i].credit_ = lanes_[i].weight_;
+            lanes_[i].running_ = 0;
+            lanes_[i].waitSumUs_ = 0;
+            lanes_[i].waitCount_ = 0;
+            lanes_[i].lastWaitUs_ = 0;
+        }
+
+        //构造函数中直接启动num个线程
+        {
+            std::unique_lock<std::mutex> u_mtx(taskMtx_);
+            for(int i = 0;i < num;i++){
+                AddWorker();
+            }
         }
 
-        //构造MESSAGE_THREAD_NUM个线程专门用来管理通知消息队列
-        for(int i = 0;i < MESSAGE_THREAD_NUM;i++){
+        //构造msg_num个线程专门用来管理通知消息队列
+        //消息按连接分别排队，连接空闲时一次取走该连接所有待发送的消息，合并成一个发送任务
+        //连接被占用期间到达的消息继续在该连接的队列中累积，等SetCurrSockFalse时再重新调度
+        for(int i = 0;i < msg_num;i++){
             msgWorkers.emplace_back([this]{
-                while(run_){
-                    //从消息队列中取消息，并且使用下面消息调度算法(提高性能需要改进算法！！！)
-                    {
-                        //这里逻辑和task_queue类似，从队列中取即可
-                        std::unique_lock<std::mutex> u_mtx(msgMtx_);
-                        msgCv_.wait(u_mtx, [this]{
-                            return !run_ || !msgQueue_.empty(); 
-                        });
-                        if(!run_ && taskQueue_.empty()){
-                            //停止运行且保证任务处理完，则直接返回
-                            return;
-                        }
-
-                        InformMsg<T> im = std::move(msgQueue_.front());
-                        msgQueue_.pop();
-
-                        //判断当前socket是否正在被占用
-                        int sock = im.sock_;
-                        auto it = isOccupied_.find(sock);
-                        if(it == isOccupied_.end()){
-                            //此时还没有socket在isOccupied中管理，也没有被占用
-                            isOccupied_.insert(std::make_pair(sock, false));
-                        }
-
-                        it = isOccupied_.find(sock); //此时一定能找到
-                        if(it->second){
-                            //socket被占用，当前消息调度算法设置为: 
-                            //(1)如果当前队列长度为0(说明没有其他消息)，
-                            //   那么消息插入队列尾部，当前线程休眠1毫秒，继续循环
-                            //   休眠的意义是防止当前线程一直循环处理这一个被占用的连接的消息，浪费系统资源
-                            if(msgQueue_.size() == 0){
-                                msgQueue_.push(std::move(im));
-                                //注意等待一毫秒的时候还要释放当前锁，其他消息处理线程还能进来
-                                //因为这一毫秒时间内原来被占用的长连接可能就空闲了，这时其他线程还能处理
-                                //或者这一毫秒时间其他消息任务进来，其他线程就会执行(2)逻辑
-                                msgCv_.wait_for(u_mtx, std::chrono::milliseconds(1));
-                            }
-                            //(2)如果当前队列长度大于0(说明还有其他消息)，
-                            //   那么消息插入队列尾部，当前线程继续执行，不休眠
-                            else{
-                                msgQueue_.push(std::move(im));
-                            }
-                            
-                        }
-                        else{
-                            //socket没被占用
-                            //直接构建发送任务，交给线程池任务队列
-                            it->second = true; //设置其被占用
-
-                            Event<T>& send_ev = im.pr_->GetEvent(sock);
-                            send_ev.sendMessage_ = std::move(im.message_);
-                            Task task([&send_ev]{
-                                P::SendHandler(send_ev);
-                            });
-                            ThreadPool<T, P>::GetInstance()->AddTask(task);
-                        }
+                while(true){
+                    std::unique_lock<std::mutex> u_mtx(msgMtx_);
+                    msgCv_.wait(u_mtx, [this]{
+                        return !msgRun_ || !readySocks_.empty(); 
+                    });
+                    if(!msgRun_ && readySocks_.empty()){
+                        return;
+                    }
+
+                    int sock = readySocks_.front();
+                    readySocks_.pop_front();
+                    auto it_msg = msgQueue_.find(sock);
+                    if(it_msg == msgQueue_.end()){
+                        //这个连接的消息已经被其他线程取走
+                        continue;
                     }
+
+                    //判断当前socket是否正在被占用
+                    bool& occupied = isOccupied_[sock];
+                    if(occupied){
+                        //被占用时不在这里空转，SetCurrSockFalse会重新把它放入readySocks_
+                        continue;
+                    }
+
+                    //socket没被占用，取走该连接所有的消息，构建一个批量发送任务
+                    Reactor<T>* pr = it_msg->second.front().pr_;
+                    auto batch = TakeBatch();
+                    batch->reserve(it_msg->second.size());
+                    for(auto& im : it_msg->second){
+                        batch->push_back(std::move(im.message_));
+                    }
+                    RecycleQueue(it_msg);
+
+                    //消息线程不能直接读eventsMap_，Acquire在Reactor的读锁内查找并Hold
+                    Event<T>* pev = pr->Acquire(sock);
+                    if(pev == nullptr){
+                        //连接已经关闭，消息直接丢弃
+                        continue;
+                    }
+                    occupied = true; //设置其被占用
+
+                    Event<T>& send_ev = *pev;
+                    ThreadPool<T, P>::GetInstance()->AddTask([&send_ev, batch]{
+                        P::SendBatchHandler(send_ev, *batch);
+                        send_ev.pr_->Release(send_ev);
+                        ThreadPool<T, P>::GetInstance()->GiveBatch(batch);
+                    });
                 }
             });
         }
@@ -165,14 +518,23 @@ public:
     ThreadPool(const ThreadPool&) = delete;
     ThreadPool& operator=(const ThreadPool&) = delete;
 
-    static ThreadPool* GetInstance(int num = THREAD_NUM)
+    //第一次调用时按配置创建线程池
+    static ThreadPool* GetInstance()
     {
         static std::mutex mtx;
         if(ptp_ == nullptr){
             {
                 std::unique_lock<std::mutex> u_mtx(mtx);
                 if(ptp_ == nullptr){
-                    ptp_ = new ThreadPool(THREAD_NUM);
+                    Config* pc = Config::GetInstance();
+                    int min_num = std::max(1, (int)pc->GetInt("thread_min"));
+                    int max_num = std::max(min_num, (int)pc->GetInt("thread_max"));
+                    int num = std::min(max_num, std::max(min_num, (int)pc->GetInt("thread_num")));
+                    int weights[LANE_NUM] = {(int)pc->GetInt("lane_control_weight"), (int)pc->GetInt("lane_chat_weight"), (int)pc->GetInt("lane_bulk_weight")};
+                    ptp_ = new ThreadPool(num, pc->GetInt("message_thread_num"), min_num, max_num, weights,
+                                          pc->GetInt("lane_bulk_max_pct"), pc->GetInt("lane_starve_ms") * 1000,
+                                          pc->GetInt("codel_target_ms") * 1000, pc->GetInt("codel_interval_ms") * 1000,
+                                          std::max<long long>(0, pc->GetInt("conn_pool_size")));
                 }
             }
         }
@@ -181,6 +543,20 @@ public:
 
     ~ThreadPool()
     {
+        Stop();
+    }
+
+    //停止线程池，只能在主线程中调用
+    //消息线程会向任务队列添加发送任务，所以先停消息线程，再停处理任务的线程，两者都处理完已经排队的部分才退出
+    void Stop()
+    {
+        msgRun_ = false;
+        msgCv_.notify_all();
+        for(auto& t : msgWorkers){
+            if(t.joinable()){
+                t.join();
+            }
+        }
         run_ = false;
         taskCv_.notify_all();
         for(auto& t : workers){
@@ -190,18 +566,229 @@ public:
         }
     }
 
+    //调整处理任务的线程数，增加时直接启动新线程，减少时多出来的线程处理完手头任务后自行退出
+    //num会被限制在[thread_min, thread_max]之内，之后仍由Adjust自动伸缩
+    void Resize(int num)
+    {
+        Retarget(std::min(maxNum_, std::max(minNum_, num)), "config reload");
+    }
+
+    //由主循环定期调用，根据上一个周期的统计自动伸缩
+    //  排队时延(平均值或者队首任务已经等待的时间)超过pool_grow_wait_ms: 扩容，
+    //    其中被长任务(超过pool_block_ms)占住的线程视为不可用，一次补足
+    //  利用率低于pool_shrink_util且队列为空、没有线程被占住: 每个周期缩容一个线程
+    void Adjust(long long grow_wait_us, int shrink_util, long long block_us)
+    {
+        int num;
+        std::string reason;
+        {
+            std::unique_lock<std::mutex> u_mtx(taskMtx_);
+            Clock::time_point now = Clock::now();
+            long long interval = std::chrono::duration_cast<std::chrono::microseconds>(now - lastAdjust_).count();
+            if(interval <= 0){
+                return;
+            }
+
+            //还没执行完的任务按本周期内已经运行的时间计入利用率
+            long long busy = busyUs_;
+            int blocked = 0;
+            for(auto& r : running_){
+                if(r.second == Clock::time_point()){
+                    //空闲
+                    continue;
+                }
+                long long ran = std::chrono::duration_cast<std::chrono::microseconds>(now - r.second).count();
+                busy += std::min(ran, interval);
+                if(ran > block_us){
+                    blocked++;
+                }
+            }
+            long long head_wait = HeadWaitUs(now);
+            long long avg_wait = waitCount_ > 0 ? waitSumUs_ / waitCount_ : 0;
+            int util = (int)(busy * 100 / (interval * std::max(workerNum_, 1)));
+
+            lastWaitUs_ = avg_wait;
+            lastWaitMaxUs_ = std::max(waitMaxUs_, head_wait);
+            lastUtil_ = util;
+            lastBlocked_ = blocked;
+            waitSumUs_ = 0;
+            waitMaxUs_ = 0;
+            waitCount_ = 0;
+            busyUs_ = 0;
+            lastAdjust_ = now;
+
+            //没有任务出队时CodelUpdate不会被调用，队列已经排空就在这里退出过载
+            if(overloaded_ && InteractiveEmpty()){
+                aboveTarget_ = false;
+                overloaded_ = false;
+                LOG(WARNING, "Overload cleared");
+            }
+            ReleaseDeferred();
+            for(auto& l : lanes_){
+                l.lastWaitUs_ = l.waitCount_ > 0 ? l.waitSumUs_ / l.waitCount_ : 0;
+                l.waitSumUs_ = 0;
+                l.waitCount_ = 0;
+            }
+
+            num = targetNum_;
+            if((avg_wait > grow_wait_us || head_wait > grow_wait_us) && targetNum_ < maxNum_){
+                num = std::min(maxNum_, targetNum_ + std::max(1, blocked));
+                grows_++;
+                reason = std::string("queue wait ")+std::to_string(std::max(avg_wait, head_wait))+std::string("us, blocked ")+std::to_string(blocked);
+            }
+            else if(util < shrink_util && queued_ == 0 && blocked == 0 && targetNum_ > minNum_){
+                num = targetNum_ - 1;
+                shrinks_++;
+                reason = std::string("utilization ")+std::to_string(util)+std::string("%");
+            }
+            if(num == targetNum_){
+                return;
+            }
+        }
+        Retarget(num, reason);
+    }
+
+    //当前线程池状态，用于SIGUSR1时输出
+    std::string Stats()
+    {
+        std::unique_lock<std::mutex> u_mtx(taskMtx_);
+        static const char* names[LANE_NUM] = {"control", "chat", "bulk"};
+        std::string lanes;
+        for(int i = 0;i < LANE_NUM;i++){
+            lanes += std::string(" ")+names[i]+std::string("={queued=")+std::to_string(lanes_[i].queue_.size())
+                +std::string(" running=")+std::to_string(lanes_[i].running_)
+                +std::string(" wait_avg_us=")+std::to_string(lanes_[i].lastWaitUs_)+std::string("}");
+        }
+        return std::string("pool workers=")+std::to_string(workerNum_)
+            +std::string(" target=")+std::to_string(targetNum_)
+            +std::string(" range=[")+std::to_string(minNum_)+std::string(",")+std::to_string(maxNum_)+std::string("]")
+            +std::string(" busy=")+std::to_string(busy_)
+            +std::string(" queued=")+std::to_string(queued_)
+            +std::string(" wait_avg_us=")+std::to_string(lastWaitUs_)
+            +std::string(" wait_max_us=")+std::to_string(lastWaitMaxUs_)
+            +std::string(" util=")+std::to_string(lastUtil_)+std::string("%")
+            +std::string(" blocked=")+std::to_string(lastBlocked_)
+            +std::string(" tasks=")+std::to_string(tasksTotal_)
+            +std::string(" grows=")+std::to_string(grows_)
+            +std::string(" shrinks=")+std::to_string(shrinks_)
+            +std::string(" last=\"")+lastDecision_+std::string("\"")
+            +std::string(" overloaded=")+std::to_string(overloaded_ ? 1 : 0)
+            +std::string(" overload_times=")+std::to_string(overloadTimes_)
+            +std::string(" shed_conns=")+std::to_string(shedConns_)
+            +std::string(" shed_requests=")+std::to_string(shedRequests_)
+            +std::string(" deferred=")+std::to_string(deferred_.size())
+            +std::string(" deferred_total=")+std::to_string(deferredTotal_)
+            +lanes;
+    }
+
+    //是否处于过载状态，不加锁
+    bool IsOverloaded()
+    {
+        return overloaded_;
+    }
+
+    //记录一次过载时关闭的连接或者拒绝的请求
+    void CountShed(bool conn)
+    {
+        if(conn){
+            shedConns_++;
+        }
+        else{
+            shedRequests_++;
+        }
+    }
+
+    //过载时延后执行非关键任务，退出过载后放入bulk通道；没有过载时直接放入bulk通道
+    void AddDeferred(Task task)
+    {
+        std::unique_lock<std::mutex> u_mtx(taskMtx_);
+        deferred_.push_back(std::move(task));
+        deferredTotal_++;
+        ReleaseDeferred();
+    }
+
+    //连接的发送缓冲区已经清空，如果期间又有消息到达，重新调度该连接
     void SetCurrSockFalse(int sock)
+    {
+        {
+            std::unique_lock<std::mutex> u_mtx(msgMtx_);
+            auto it = isOccupied_.find(sock);
+            if(it != isOccupied_.end()){
+                it->second = false;
+            }
+            //如果没找到，就不用管
+            if(msgQueue_.find(sock) == msgQueue_.end()){
+                return;
+            }
+            readySocks_.push_back(sock);
+        }
+        msgCv_.notify_one();
+    }
+
+    //连接关闭时清除该连接的占用状态和未发送的消息，防止socket被复用后状态错乱
+    //close在同一把锁内执行，用于把连接从reactor中删除
+    void EraseSock(int sock, const Task& close = Task())
     {
         std::unique_lock<std::mutex> u_mtx(msgMtx_);
-        auto it = isOccupied_.find(sock);
-        if(it != isOccupied_.end()){
-            it->second = false;
+        isOccupied_.erase(sock);
+        auto it = msgQueue_.find(sock);
+        if(it != msgQueue_.end()){
+            RecycleQueue(it);
         }
-        //如果没找到，就不用管
+        if(close){
+            close();
+        }
+    }
+
+    //每个连接排队等待发送的通知消息占用的堆内存(估算)，用于内存统计，返回排队的消息总数
+    size_t QueuedBytes(std::unordered_map<int, size_t>& per_sock)
+    {
+        std::unique_lock<std::mutex> u_mtx(msgMtx_);
+        size_t count = 0;
+        for(auto& q : msgQueue_){
+            size_t bytes = q.second.capacity() * sizeof(InformMsg<T>);
+            for(auto& im : q.second){
+                bytes += im.message_.Bytes();
+            }
+            per_sock[q.first] = bytes;
+            count += q.second.size();
+        }
+        return count;
     }
 
+    //通知消息对象池中的队列和batch个数，bytes设为它们占用的堆内存(估算)
+    size_t PooledBytes(size_t& bytes)
+    {
+        std::unique_lock<std::mutex> u_mtx(msgMtx_);
+        bytes = 0;
+        for(auto& node : freeQueues_){
+            bytes += sizeof(typename MsgQueueMap::value_type) + 2 * sizeof(void*) + node.mapped().capacity() * sizeof(InformMsg<T>);
+        }
+        for(auto& batch : freeBatches_){
+            bytes += sizeof(std::vector<T>) + 2 * sizeof(void*) + batch->capacity() * sizeof(T);
+        }
+        return freeQueues_.size() + freeBatches_.size();
+    }
+
+    //任务队列和消息队列都为空，并且没有线程正在执行任务，返回true
+    bool IsIdle()
+    {
+        //加锁顺序必须和消息线程一致: 先msgMtx_再taskMtx_
+        std::unique_lock<std::mutex> u_msg(msgMtx_);
+        std::unique_lock<std::mutex> u_task(taskMtx_);
+        return queued_ == 0 && msgQueue_.empty() && readySocks_.empty() && busy_ == 0;
+    }
+
+    //加入默认的chat通道
     template<class F, class ... Args>
     auto AddTask(F&& f, Args&&... args) ->std::future<decltype(f(args...))>
+    {
+        return AddTaskTo(LANE_CHAT, std::forward<F>(f), std::forward<Args>(args)...);
+    }
+
+    //加入指定的通道，lane为TaskLane
+    template<class F, class ... Args>
+    auto AddTaskTo(int lane, F&& f, Args&&... args) ->std::future<decltype(f(args...))>
     {
         using RetType = decltype(f(args...)); //f函数返回值
         auto ptask = std::make_shared<std::packaged_task<RetType()>>(std::bind(std::forward<F>(f), std::forward<Args>(args)...)); //task是一个智能指针
@@ -210,9 +797,10 @@ public:
         {
             //加入任务队列
             std::unique_lock<std::mutex> u_lock(taskMtx_);
-            taskQueue_.emplace([ptask]() {
+            lanes_[lane].queue_.push_back(QueuedTask{[ptask]() {
 				(*ptask)();
-			});
+			}, Clock::now()});
+            queued_++;
         }
 
         taskCv_.notify_one(); //唤醒一个线程
@@ -225,7 +813,23 @@ public:
     {   
         {
             std::unique_lock<std::mutex> u_lock(msgMtx_);
-            msgQueue_.push(std::move(t)); //直接移动
+            int sock = t.sock_;
+            auto it_msg = msgQueue_.find(sock);
+            if(it_msg == msgQueue_.end()){
+                it_msg = NewQueue(sock);
+            }
+            auto& q = it_msg->second;
+            q.push_back(std::move(t)); //直接移动
+            if(q.size() > 1){
+                //该连接已经在等待调度，消息会和之前的合并发送
+                return;
+            }
+            auto it = isOccupied_.find(sock);
+            if(it != isOccupied_.end() && it->second){
+                //被占用，等SetCurrSockFalse再调度
+                return;
+            }
+            readySocks_.push_back(sock);
         }
         msgCv_.notify_one();
         LOG(INFO, "Push a informing message to message_queue");
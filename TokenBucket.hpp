@@ -0,0 +1,64 @@
+#pragma once
+#include <time.h>
+#include <cstdint>
+#include <atomic>
+#include <algorithm>
+
+//令牌桶，状态压缩在一个64位原子变量里，取令牌时用CAS完成补充和扣减，不需要加锁
+//高32位为上次补充的时间(毫秒)，低32位为剩余令牌数乘以1000，这样每毫秒补充的令牌不会因为取整丢失
+//时间取粗粒度的单调时钟，精度为几毫秒，但是调用开销很小
+class TokenBucket
+{
+private:
+    std::atomic<uint64_t> state_; //为0表示还没用过，第一次使用时桶是满的
+
+public:
+    //令牌数乘以1000之后要放进低32位，桶的容量不能超过这个值，否则会溢出到时间的高32位
+    static constexpr uint32_t MAX_BURST = UINT32_MAX / 1000;
+
+    TokenBucket():state_(0)
+    {}
+
+    TokenBucket(const TokenBucket& tb):state_(tb.state_.load(std::memory_order_relaxed))
+    {}
+
+    TokenBucket& operator=(const TokenBucket& tb)
+    {
+        state_.store(tb.state_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        return *this;
+    }
+
+    static uint32_t NowMs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+    }
+
+    //取一个令牌，rate为每秒补充的令牌数，burst为桶的容量
+    //没有令牌时返回false，wait_ms为还需要等待多久才会有一个令牌
+    bool Take(uint32_t now, uint32_t rate, uint32_t burst, uint32_t& wait_ms)
+    {
+        uint64_t cap = (uint64_t)burst * 1000;
+        uint64_t old = state_.load(std::memory_order_relaxed);
+        while(true){
+            uint64_t tokens = cap;
+            if(old != 0){
+                uint32_t last = (uint32_t)(old >> 32);
+                //时间回绕时按无符号相减仍然正确
+                tokens = std::min(cap, (old & 0xffffffff) + (uint64_t)(uint32_t)(now - last) * rate);
+            }
+            if(tokens < 1000){
+                wait_ms = rate > 0 ? (uint32_t)((1000 - tokens + rate - 1) / rate) : 1000;
+                return false;
+            }
+            uint64_t fresh = ((uint64_t)now << 32) | (tokens - 1000);
+            if(fresh == 0){
+                fresh = 1;
+            }
+            if(state_.compare_exchange_weak(old, fresh, std::memory_order_relaxed)){
+                return true;
+            }
+        }
+    }
+};
@@ -0,0 +1,348 @@
+#pragma once
+#include "Reactor.hpp"
+#include "Handler.hpp"
+#include "Acceptor.hpp"
+#include "Protocol.hpp"
+#include "ThreadPool.hpp"
+#include "DiskIO.hpp"
+#include "Snapshot.hpp"
+#include "Util.hpp"
+#include "Config.hpp"
+#include "Log.hpp"
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#define UPGRADE_BATCH 128     //每次sendmsg最多携带的fd个数
+
+//热升级：旧进程把listen_sock和所有客户端连接通过Unix域套接字(SCM_RIGHTS)交给新进程
+//(1)新进程以 --upgrade 启动，在配置upgrade_path指定的Unix域套接字上等待旧进程
+//(2)向旧进程发送SIGUSR2，旧进程停止accept，等线程池空闲后写快照，然后把所有连接交给新进程并退出
+//(3)新进程收到所有连接后加载快照，恢复online_等连接相关映射，之后正常进入事件循环
+//每一批数据: 头部{fd个数(u32), 负载长度(u64)}和fd一起由sendmsg发送，之后紧跟负载
+//负载中每个fd对应一条记录: 连接类型(u32) + 未处理的输入(string) + 待发送的输出(string) + 用户名(string)
+//连接类型的低8位为ConnType，之后为该连接可以接收的正文编码(Event::accept_)，旧版本发来的高位都是0
+//fd个数为0的批次表示交接结束
+class Upgrade
+{
+private:
+    enum ConnType : uint32_t
+    {
+        LISTEN = 0,
+        NONE,  //还没有注册/登录的连接
+        SHORT, //短连接
+        LONG   //登录时的长连接
+    };
+
+    static const size_t HEAD_SIZE = sizeof(uint32_t) + sizeof(uint64_t);
+
+    static bool ReadAll(int fd, char* buf, size_t len)
+    {
+        size_t total = 0;
+        while(total < len){
+            ssize_t s = recv(fd, buf+total, len-total, 0);
+            if(s > 0){
+                total += s;
+            }
+            else if(s < 0 && errno == EINTR){
+                continue;
+            }
+            else{
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //发送一批fd及其负载
+    static bool SendBatch(int unix_sock, const std::vector<int>& fds, const std::string& payload)
+    {
+        std::string head;
+        Util::PutU32(head, fds.size());
+        Util::PutU64(head, payload.size());
+
+        iovec iov;
+        iov.iov_base = (void*)head.c_str();
+        iov.iov_len = head.size();
+
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * UPGRADE_BATCH));
+        if(!fds.empty()){
+            msg.msg_control = control.data();
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+            memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+        }
+
+        while(sendmsg(unix_sock, &msg, 0) < 0){
+            if(errno != EINTR){
+                return false;
+            }
+        }
+        return Util::WriteAll(unix_sock, payload);
+    }
+
+    //接收一批fd及其负载，连接关闭或出错返回false
+    static bool RecvBatch(int unix_sock, std::vector<int>& fds, std::string& payload)
+    {
+        char head[HEAD_SIZE];
+        iovec iov;
+        iov.iov_base = head;
+        iov.iov_len = sizeof(head);
+
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * UPGRADE_BATCH));
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+
+        ssize_t s;
+        while((s = recvmsg(unix_sock, &msg, MSG_WAITALL)) < 0 && errno == EINTR){}
+        if(s != (ssize_t)sizeof(head)){
+            return false;
+        }
+
+        fds.clear();
+        for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);cmsg != nullptr;cmsg = CMSG_NXTHDR(&msg, cmsg)){
+            if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+                int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                fds.resize(n);
+                memcpy(fds.data(), CMSG_DATA(cmsg), sizeof(int) * n);
+            }
+        }
+
+        BinReader rd(head, head + sizeof(head));
+        uint32_t count = 0;
+        uint64_t len = 0;
+        rd.GetU32(count);
+        rd.GetU64(len);
+        if(count != fds.size()){
+            return false;
+        }
+        payload.resize(len);
+        return ReadAll(unix_sock, &payload[0], len);
+    }
+
+    //把已经读入但还没处理完的请求还原成原始字节，新进程重新解析即可
+    static std::string PendingInput(const Event<ChatMessage>& ev)
+    {
+        std::string raw;
+        const ChatMessage& msg = ev.recvMessage_;
+        if(msg.iniLine_.size() != 0){
+            raw += msg.iniLine_;
+            raw += LINE_END;
+            for(auto& h : msg.headers_){
+                raw += h;
+                raw += LINE_END;
+            }
+            raw += msg.blank_;
+            raw += msg.body_;
+        }
+        raw += ev.inbuffer_;
+        raw += ev.pending_;
+        return raw;
+    }
+
+public:
+    //旧进程调用，把listen_sock和所有连接交给新进程
+    //成功返回true，此时旧进程应直接退出；没有新进程在等待或交接失败返回false，旧进程继续服务
+    static bool HandOff(Reactor<ChatMessage>* pr, int listen_sock)
+    {
+        int unix_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        std::string path = Config::GetInstance()->GetString("upgrade_path");
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+        if(unix_sock < 0 || connect(unix_sock, (sockaddr*)&addr, sizeof(addr)) < 0){
+            LOG(WARNING, "Upgrade: no new process is waiting");
+            if(unix_sock >= 0){
+                close(unix_sock);
+            }
+            return false;
+        }
+        auto start = std::chrono::steady_clock::now();
+
+        //停止accept，并且继续派发事件直到线程池手头的任务全部处理完
+        //这样每个连接的状态只剩下inbuffer_中未处理的输入和outbuffer_中待发送的输出
+        pr->EnableReadWrite(pr->GetEvent(listen_sock), false, false);
+        auto deadline = start + std::chrono::milliseconds(Config::GetInstance()->GetInt("upgrade_drain_ms"));
+        //先确认磁盘线程空闲，其完成回调都已经交给了ThreadPool，再确认ThreadPool空闲
+        while(!(DiskExecutor<ChatMessage, Protocol>::GetInstance()->IsIdle() && ThreadPool<ChatMessage, Protocol>::GetInstance()->IsIdle()) && std::chrono::steady_clock::now() < deadline){
+            pr->Dispatcher(10);
+        }
+
+        //用户、群聊和离线信息通过快照交给新进程，复制日志要在新进程打开之前写完
+        Snapshot::Save();
+        Replica::GetInstance()->Flush();
+        History::GetInstance()->Flush();
+        Search::GetInstance()->Flush();
+
+        const auto& short_sock = Chatroom::GetInstance()->GetShortSock();
+        const auto& long_sock = Chatroom::GetInstance()->GetLongSock();
+        std::vector<int> fds;
+        std::string payload;
+        size_t conn_num = 0;
+        bool ok = true;
+        for(auto& e : pr->GetEvents()){
+            int sock = e.first;
+            const Event<ChatMessage>& ev = e.second;
+            if(!pr->isExists(sock)){
+                //已经关闭，只是在等任务结束
+                continue;
+            }
+            uint32_t type = NONE;
+            std::string name;
+            auto it_short = short_sock.find(sock);
+            auto it_long = long_sock.find(sock);
+            if(sock == listen_sock){
+                type = LISTEN;
+            }
+            else if(it_long != long_sock.end()){
+                type = LONG;
+                name = it_long->second;
+            }
+            else if(it_short != short_sock.end()){
+                type = SHORT;
+                name = it_short->second;
+            }
+
+            fds.push_back(sock);
+            Util::PutU32(payload, type | ((uint32_t)ev.accept_.load() << 8));
+            Util::PutString(payload, type == LISTEN ? std::string() : PendingInput(ev));
+            Util::PutString(payload, ev.outbuffer_);
+            Util::PutString(payload, name);
+            conn_num++;
+
+            if(fds.size() == UPGRADE_BATCH){
+                ok = ok && SendBatch(unix_sock, fds, payload);
+                fds.clear();
+                payload.clear();
+            }
+        }
+        if(!fds.empty()){
+            ok = ok && SendBatch(unix_sock, fds, payload);
+        }
+        fds.clear();
+        payload.clear();
+        ok = ok && SendBatch(unix_sock, fds, payload); //结束标志
+        close(unix_sock);
+
+        if(!ok){
+            LOG(ERROR, "Upgrade: hand off error");
+            pr->EnableReadWrite(pr->GetEvent(listen_sock), true, false);
+            return false;
+        }
+
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        LOG(INFO, std::string("Upgrade: handed off sockets: ")+std::to_string(conn_num)+std::string(", ms: ")+std::to_string(ms));
+        return true;
+    }
+
+    //新进程调用，在upgrade_path上等待旧进程交接
+    //所有连接被注册到pr中，返回接收到的listen_sock，失败返回-1
+    static int Receive(Reactor<ChatMessage>* pr)
+    {
+        int server = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        std::string path = Config::GetInstance()->GetString("upgrade_path");
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+        unlink(path.c_str());
+        if(server < 0 || bind(server, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(server, 1) < 0){
+            LOG(FATAL, "Upgrade: unix socket error");
+            return -1;
+        }
+        LOG(INFO, std::string("Upgrade: waiting for the old process on ")+path);
+
+        int unix_sock = accept(server, nullptr, nullptr);
+        close(server);
+        unlink(path.c_str());
+        if(unix_sock < 0){
+            LOG(FATAL, "Upgrade: accept error");
+            return -1;
+        }
+
+        int listen_sock = -1;
+        std::vector<int> pending; //还有未处理输入的连接，等快照加载完再交给线程池
+        std::vector<int> fds;
+        std::string payload;
+        while(true){
+            if(!RecvBatch(unix_sock, fds, payload)){
+                LOG(FATAL, "Upgrade: receive error");
+                close(unix_sock);
+                return -1;
+            }
+            if(fds.empty()){
+                break;
+            }
+
+            BinReader rd(payload.c_str(), payload.c_str() + payload.size());
+            for(int sock : fds){
+                uint32_t type = NONE;
+                std::string in, out, name;
+                if(!rd.GetU32(type) || !rd.GetString(in) || !rd.GetString(out) || !rd.GetString(name)){
+                    LOG(FATAL, "Upgrade: corrupted payload");
+                    close(unix_sock);
+                    return -1;
+                }
+
+                Event<ChatMessage> ev(sock, pr);
+                ev.accept_ = type >> 8;
+                type &= 0xff;
+                if(type == LISTEN){
+                    listen_sock = sock;
+                    ev.RegisterRecv(Acceptor::Accept);
+                    pr->AddEvent(ev, EPOLLIN | EPOLLET);
+                    continue;
+                }
+
+                ev.RegisterRecv(Handler::Receiver);
+                ev.RegisterSend(Handler::Sender);
+                ev.RegisterError(Handler::Errorer);
+                ev.pending_ = std::move(in);
+                ev.outbuffer_ = std::move(out);
+                pr->AddEvent(ev, EPOLLIN | EPOLLET | (ev.outbuffer_.empty() ? (uint32_t)0 : (uint32_t)EPOLLOUT));
+
+                if(type == SHORT){
+                    Chatroom::GetInstance()->ShortSockInsert(sock, name);
+                }
+                else if(type == LONG){
+                    Chatroom::GetInstance()->OnlineInsert(name, sock);
+                    Cluster::GetInstance()->SetOnline(name, true);
+                    Chatroom::GetInstance()->LongSockInsert(sock, name);
+                }
+                if(!ev.pending_.empty()){
+                    pending.push_back(sock);
+                }
+            }
+        }
+        close(unix_sock);
+
+        //旧进程在交接前写好了快照
+        Snapshot::Load();
+
+        for(int sock : pending){
+            Handler::Deliver(pr->GetEvent(sock), std::string());
+        }
+
+        LOG(INFO, std::string("Upgrade: received sockets, listen_sock: ")+std::to_string(listen_sock));
+        return listen_sock;
+    }
+};
@@ -1,8 +1,64 @@
 #pragma once
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <vector>
 
+//二进制解码游标，所有读取都做越界检查，出错则置bad_
+//编码对应Util::PutU32/PutU64/PutString
+struct BinReader
+{
+    const char* cur_;
+    const char* end_;
+    bool bad_;
+
+    BinReader(const char* begin, const char* end):cur_(begin), end_(end), bad_(false)
+    {}
+
+    //剩余未读的字节数
+    size_t Remain() const
+    {
+        return end_ - cur_;
+    }
+
+    bool GetU32(uint32_t& v)
+    {
+        if(bad_ || end_ - cur_ < (long)sizeof(v)){
+            bad_ = true;
+            return false;
+        }
+        memcpy(&v, cur_, sizeof(v));
+        cur_ += sizeof(v);
+        return true;
+    }
+
+    bool GetU64(uint64_t& v)
+    {
+        if(bad_ || end_ - cur_ < (long)sizeof(v)){
+            bad_ = true;
+            return false;
+        }
+        memcpy(&v, cur_, sizeof(v));
+        cur_ += sizeof(v);
+        return true;
+    }
+
+    bool GetString(std::string& s)
+    {
+        uint32_t len = 0;
+        if(!GetU32(len) || end_ - cur_ < (long)len){
+            bad_ = true;
+            return false;
+        }
+        s.assign(cur_, len);
+        cur_ += len;
+        return true;
+    }
+};
+
 class Util
 {
 public:
@@ -15,7 +71,8 @@ public:
             return -1;
         }
         else{
-            out = in.substr(0, pos+2);
+            //assign可以复用out已有的容量
+            out.assign(in, 0, pos+2);
             return out.size();
         }
     }
@@ -44,4 +101,38 @@ public:
         }
         return true;
     }
+
+    //二进制编码，按本机字节序直接写入，只用于本机的快照和进程间传递
+    static void PutU32(std::string& out, uint32_t v)
+    {
+        out.append((const char*)&v, sizeof(v));
+    }
+
+    static void PutU64(std::string& out, uint64_t v)
+    {
+        out.append((const char*)&v, sizeof(v));
+    }
+
+    static void PutString(std::string& out, const std::string& s)
+    {
+        PutU32(out, s.size());
+        out += s;
+    }
+
+    //将data全部写入fd，成功返回true，失败返回false
+    static bool WriteAll(int fd, const std::string& data)
+    {
+        size_t total = 0;
+        while(total < data.size()){
+            ssize_t s = write(fd, data.c_str()+total, data.size()-total);
+            if(s < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                return false;
+            }
+            total += s;
+        }
+        return true;
+    }
 };
\ No newline at end of file
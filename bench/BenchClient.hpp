@@ -0,0 +1,246 @@
+#pragma once
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <unordered_map>
+
+//基准测试程序共用的最小客户端，只依赖系统调用，不链接服务器的代码
+//报文格式与服务器相同: 首行 "REQ 110 JCHAT/1.0"，若干 "Key: Value" 头部，空行，Content-Length字节的正文
+
+typedef std::vector<std::pair<std::string, std::string>> BenchHeaders;
+
+struct BenchMsg
+{
+    std::string method_;  //REQ/RES/INF
+    std::string status_;
+    std::unordered_map<std::string, std::string> headers_;
+    std::string body_;
+
+    std::string Header(const std::string& key) const
+    {
+        auto it = headers_.find(key);
+        return it == headers_.end() ? std::string() : it->second;
+    }
+};
+
+class BenchConn
+{
+private:
+    int sock_;
+    std::string buf_;  //已经读到但还没有组成完整报文的数据
+
+public:
+    BenchConn():sock_(-1)
+    {}
+
+    ~BenchConn()
+    {
+        Close();
+    }
+
+    BenchConn(const BenchConn&) = delete;
+    BenchConn& operator=(const BenchConn&) = delete;
+
+    bool Connect(uint16_t port, const std::string& ip = "127.0.0.1")
+    {
+        Close();
+        sock_ = socket(AF_INET, SOCK_STREAM, 0);
+        if(sock_ < 0){
+            return false;
+        }
+        int one = 1;
+        setsockopt(sock_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        inet_pton(AF_INET, ip.c_str(), &addr.sin_addr);
+        if(connect(sock_, (struct sockaddr*)&addr, sizeof(addr)) < 0){
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close()
+    {
+        if(sock_ >= 0){
+            close(sock_);
+            sock_ = -1;
+        }
+        buf_.clear();
+    }
+
+    int Sock() const
+    {
+        return sock_;
+    }
+
+    static std::string Frame(const std::string& status, const BenchHeaders& headers, const std::string& body = std::string())
+    {
+        std::string out("REQ ");
+        out += status;
+        out += " JCHAT/1.0\r\n";
+        for(auto& h : headers){
+            out += h.first;
+            out += ": ";
+            out += h.second;
+            out += "\r\n";
+        }
+        out += "Content-Length: ";
+        out += std::to_string(body.size());
+        out += "\r\n\r\n";
+        out += body;
+        return out;
+    }
+
+    bool Send(const std::string& data)
+    {
+        size_t done = 0;
+        while(done < data.size()){
+            ssize_t n = send(sock_, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+            if(n < 0 && errno == EINTR){
+                continue;
+            }
+            if(n <= 0){
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    //读出一条完整的报文，连接关闭或出错返回false
+    bool Recv(BenchMsg& msg)
+    {
+        size_t end;
+        while((end = buf_.find("\r\n\r\n")) == std::string::npos){
+            if(!Fill()){
+                return false;
+            }
+        }
+        msg.headers_.clear();
+        size_t pos = buf_.find("\r\n");
+        std::string ini(buf_, 0, pos);
+        size_t sp1 = ini.find(' ');
+        size_t sp2 = ini.find(' ', sp1 + 1);
+        msg.method_.assign(ini, 0, sp1);
+        msg.status_.assign(ini, sp1 + 1, sp2 - sp1 - 1);
+        while(pos < end){
+            size_t next = buf_.find("\r\n", pos + 2);
+            size_t colon = buf_.find(": ", pos + 2);
+            if(colon != std::string::npos && colon < next){
+                msg.headers_[buf_.substr(pos + 2, colon - pos - 2)] = buf_.substr(colon + 2, next - colon - 2);
+            }
+            pos = next;
+        }
+        size_t len = strtoull(msg.Header("Content-Length").c_str(), nullptr, 10);
+        end += 4;
+        while(buf_.size() < end + len){
+            if(!Fill()){
+                return false;
+            }
+        }
+        msg.body_.assign(buf_, end, len);
+        buf_.erase(0, end + len);
+        return true;
+    }
+
+    //发送一个请求并等待它的响应，中间收到的通知报文被跳过
+    bool Request(const std::string& status, const BenchHeaders& headers, const std::string& body, BenchMsg& res)
+    {
+        if(!Send(Frame(status, headers, body))){
+            return false;
+        }
+        while(Recv(res)){
+            if(res.method_ == "RES"){
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    bool Fill()
+    {
+        char tmp[65536];
+        ssize_t n;
+        do{
+            n = recv(sock_, tmp, sizeof(tmp), 0);
+        }while(n < 0 && errno == EINTR);
+        if(n <= 0){
+            return false;
+        }
+        buf_.append(tmp, n);
+        return true;
+    }
+};
+
+class Bench
+{
+public:
+    static double NowMs()
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    //p取0到1，v会被排序
+    static double Percentile(std::vector<double>& v, double p)
+    {
+        if(v.empty()){
+            return 0;
+        }
+        std::sort(v.begin(), v.end());
+        size_t i = (size_t)(p * (v.size() - 1));
+        return v[i];
+    }
+
+    //每次运行使用不同的用户名后缀，重复运行时不会和已注册的用户冲突
+    static std::string Tag()
+    {
+        return std::to_string((long)(NowMs() * 1000) % 100000000);
+    }
+
+    //并发连接数较多时把文件描述符上限提到硬上限
+    static void RaiseFdLimit()
+    {
+        struct rlimit rl;
+        if(getrlimit(RLIMIT_NOFILE, &rl) == 0){
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rl);
+        }
+    }
+
+    static int Arg(int argc, char* argv[], int i, int def)
+    {
+        return argc > i ? atoi(argv[i]) : def;
+    }
+
+    //注册用户，已经存在也视为成功
+    static bool SignUp(BenchConn& conn, const std::string& user)
+    {
+        BenchMsg res;
+        return conn.Request("010", {{"User", user}, {"Password", "p"}}, "", res) && res.status_ == "011";
+    }
+
+    static bool SignIn(BenchConn& conn, const std::string& user)
+    {
+        BenchMsg res;
+        return conn.Request("020", {{"User", user}, {"Password", "p"}}, "", res) && res.Header("Return") == "right";
+    }
+};
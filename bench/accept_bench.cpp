@@ -0,0 +1,98 @@
+//建立连接的基准测试
+//用法: ./bench/accept_bench [port=8081] [burst=2000] [secs=3] [procs=4]
+//1. 一次性发起burst个非阻塞connect，统计每个连接完成三次握手的时间的p50/p99/max
+//   backlog太小时多出来的SYN被丢弃，客户端要等1秒、3秒重传，p99会跳到秒级
+//2. procs个进程各自循环 connect + close，持续secs秒，输出每秒建立的连接数
+#include "BenchClient.hpp"
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+
+static void Burst(uint16_t port, int n)
+{
+    int epfd = epoll_create1(0);
+    std::vector<int> socks;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    double start = Bench::NowMs();
+    for(int i = 0;i < n;i++){
+        int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if(sock < 0){
+            perror("socket");
+            break;
+        }
+        connect(sock, (struct sockaddr*)&addr, sizeof(addr));
+        struct epoll_event ev;
+        ev.events = EPOLLOUT;
+        ev.data.fd = sock;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev);
+        socks.push_back(sock);
+    }
+    std::vector<double> done;
+    struct epoll_event evs[256];
+    while(done.size() < socks.size()){
+        int k = epoll_wait(epfd, evs, 256, 10000);
+        if(k <= 0){
+            break;
+        }
+        double now = Bench::NowMs() - start;
+        for(int i = 0;i < k;i++){
+            epoll_ctl(epfd, EPOLL_CTL_DEL, evs[i].data.fd, nullptr);
+            done.push_back(now);
+        }
+    }
+    for(int sock : socks){
+        close(sock);
+    }
+    close(epfd);
+    size_t got = done.size();
+    double p50 = Bench::Percentile(done, 0.5), p99 = Bench::Percentile(done, 0.99), max = done.empty() ? 0 : done.back();
+    printf("burst %d connected %zu p50/p99/max ms: %.1f %.1f %.1f\n", n, got, p50, p99, max);
+}
+
+static void Churn(uint16_t port, int secs, int procs)
+{
+    int fds[2];
+    if(pipe(fds) < 0){
+        perror("pipe");
+        return;
+    }
+    for(int p = 0;p < procs;p++){
+        if(fork() == 0){
+            close(fds[0]);
+            long n = 0;
+            double end = Bench::NowMs() + secs * 1000.0;
+            BenchConn conn;
+            while(Bench::NowMs() < end){
+                if(conn.Connect(port)){
+                    n++;
+                }
+                conn.Close();
+            }
+            write(fds[1], &n, sizeof(n));
+            _exit(0);
+        }
+    }
+    close(fds[1]);
+    long total = 0, n = 0;
+    while(read(fds[0], &n, sizeof(n)) == sizeof(n)){
+        total += n;
+    }
+    close(fds[0]);
+    while(wait(nullptr) > 0);
+    printf("churn procs %d connect+close/s: %ld\n", procs, total / secs);
+}
+
+int main(int argc, char* argv[])
+{
+    uint16_t port = Bench::Arg(argc, argv, 1, 8081);
+    Bench::RaiseFdLimit();
+    Burst(port, Bench::Arg(argc, argv, 2, 2000));
+    sleep(1);
+    Churn(port, Bench::Arg(argc, argv, 3, 3), Bench::Arg(argc, argv, 4, 4));
+    return 0;
+}
@@ -0,0 +1,68 @@
+// LD_PRELOAD的malloc计数器，进程退出时把分配和释放的次数写到环境变量ALLOC_OUT指定的文件
+// 用法: ALLOC_OUT=/tmp/allocs LD_PRELOAD=./bench/alloc_count.so ./server ...
+// 服务器收到SIGTERM正常退出时写出，两次不同负载量的运行相减即可得到每个请求的分配次数
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+extern void* __libc_malloc(size_t);
+extern void* __libc_calloc(size_t, size_t);
+extern void* __libc_realloc(void*, size_t);
+extern void* __libc_memalign(size_t, size_t);
+extern void __libc_free(void*);
+
+static atomic_long n_alloc, n_free;
+
+void* malloc(size_t s)
+{
+    atomic_fetch_add_explicit(&n_alloc, 1, memory_order_relaxed);
+    return __libc_malloc(s);
+}
+
+void* calloc(size_t n, size_t s)
+{
+    atomic_fetch_add_explicit(&n_alloc, 1, memory_order_relaxed);
+    return __libc_calloc(n, s);
+}
+
+void* realloc(void* p, size_t s)
+{
+    atomic_fetch_add_explicit(&n_alloc, 1, memory_order_relaxed);
+    return __libc_realloc(p, s);
+}
+
+void free(void* p)
+{
+    if(p){
+        atomic_fetch_add_explicit(&n_free, 1, memory_order_relaxed);
+    }
+    __libc_free(p);
+}
+
+int posix_memalign(void** out, size_t align, size_t s)
+{
+    atomic_fetch_add_explicit(&n_alloc, 1, memory_order_relaxed);
+    *out = __libc_memalign(align, s);
+    return *out ? 0 : 12;
+}
+
+void* aligned_alloc(size_t align, size_t s)
+{
+    atomic_fetch_add_explicit(&n_alloc, 1, memory_order_relaxed);
+    return __libc_memalign(align, s);
+}
+
+__attribute__((destructor)) static void Dump(void)
+{
+    const char* path = getenv("ALLOC_OUT");
+    if(path == NULL){
+        return;
+    }
+    FILE* f = fopen(path, "w");
+    if(f == NULL){
+        return;
+    }
+    fprintf(f, "%ld %ld\n", (long)n_alloc, (long)n_free);
+    fclose(f);
+}
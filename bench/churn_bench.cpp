@@ -0,0 +1,61 @@
+//连接抖动的基准测试
+//用法: ./bench/churn_bench [port=8081] [cycles=2000]
+//每个周期 建立连接、登录(020)、给在线的B发一条私聊(110)、关闭连接，输出每秒完成的周期数
+//配合bench/alloc_count.so统计服务器每个周期的分配次数: 分别用两个不同的cycles各跑一次，分配次数之差除以周期数之差
+#include "BenchClient.hpp"
+#include <thread>
+
+int main(int argc, char* argv[])
+{
+    uint16_t port = Bench::Arg(argc, argv, 1, 8081);
+    long n = Bench::Arg(argc, argv, 2, 2000);
+
+    std::string tag = Bench::Tag();
+    std::vector<std::string> users;
+    std::string b = "cb" + tag;
+    BenchConn ctl, lb;
+    if(!ctl.Connect(port) || !lb.Connect(port)){
+        fprintf(stderr, "connect failed\n");
+        return 1;
+    }
+    for(int i = 0;i < 50;i++){
+        users.push_back("cu" + std::to_string(i) + "_" + tag);
+        Bench::SignUp(ctl, users.back());
+    }
+    Bench::SignUp(ctl, b);
+    ctl.Close();
+    if(!Bench::SignIn(lb, b)){
+        fprintf(stderr, "sign in failed\n");
+        return 1;
+    }
+
+    long got = 0;
+    std::thread drain([&]{
+        BenchMsg msg;
+        while(got < n && lb.Recv(msg)){
+            got += (msg.method_ == "INF" && msg.status_ == "150");
+        }
+    });
+    std::string body("hello there, see you at the meeting tomorrow\n");
+    double start = Bench::NowMs();
+    long done = 0;
+    for(long i = 0;i < n;i++){
+        const std::string& user = users[i % users.size()];
+        BenchConn conn;
+        BenchMsg res;
+        if(!conn.Connect(port) || !Bench::SignIn(conn, user)
+           || !conn.Request("110", {{"User", user}, {"Peer", b}, {"Time", "t" + std::to_string(i)}}, body, res) || res.status_ != "111"){
+            fprintf(stderr, "cycle %ld failed\n", i);
+            break;
+        }
+        done++;
+    }
+    if(done < n){
+        //提前结束时不再等剩下的通知
+        shutdown(lb.Sock(), SHUT_RDWR);
+    }
+    drain.join();
+    double ms = Bench::NowMs() - start;
+    printf("cycles %ld informed %ld cycles/s %.0f\n", done, got, done * 1000.0 / ms);
+    return 0;
+}
@@ -0,0 +1,118 @@
+//集群转发吞吐的基准测试
+//用法: ./bench/cluster_bench [port=8081] [users=24] [secs=5] [window=1]
+//从port所在的节点注册users个用户，收到408时按Node头部到所属节点注册，每个用户一个进程登录到自己的节点
+//每个用户保持window个私聊(110)在途，对象随机，统计每秒收到的111响应数
+//单节点和多节点都用同一个port作为入口，比较不同节点数下的总吞吐
+#include "BenchClient.hpp"
+#include <sys/wait.h>
+#include <set>
+
+//返回用户所属节点的端口，失败返回0
+static uint16_t Home(uint16_t port, const std::string& user)
+{
+    BenchConn conn;
+    BenchMsg res;
+    if(!conn.Connect(port) || !conn.Request("010", {{"User", user}, {"Password", "p"}}, "", res)){
+        return 0;
+    }
+    if(res.status_ != "408"){
+        return port;
+    }
+    std::string node = res.Header("Node");
+    size_t colon = node.rfind(':');
+    if(colon == std::string::npos){
+        return 0;
+    }
+    uint16_t home = atoi(node.c_str() + colon + 1);
+    if(!conn.Connect(home, node.substr(0, colon)) || !conn.Request("010", {{"User", user}, {"Password", "p"}}, "", res)){
+        return 0;
+    }
+    return home;
+}
+
+//子进程: 返回 first为111的个数，second为其他响应的个数
+static std::pair<long, long> Worker(uint16_t home, const std::string& user, const std::vector<std::string>& users, int secs, int window)
+{
+    std::pair<long, long> count(0, 0);
+    BenchConn conn;
+    if(!conn.Connect(home) || !Bench::SignIn(conn, user)){
+        return count;
+    }
+    //等其他用户都登录，在线状态也同步到其他节点
+    usleep(500 * 1000);
+    std::string body(64, 'x');
+    int inflight = 0;
+    BenchMsg msg;
+    double end = Bench::NowMs() + secs * 1000.0;
+    while(Bench::NowMs() < end){
+        while(inflight < window){
+            const std::string& peer = users[rand() % users.size()];
+            if(!conn.Send(BenchConn::Frame("110", {{"User", user}, {"Peer", peer}, {"Time", "t"}}, body))){
+                return count;
+            }
+            inflight++;
+        }
+        //私聊通知(INF)也从这个连接收到，只统计响应
+        if(!conn.Recv(msg)){
+            return count;
+        }
+        if(msg.method_ == "RES"){
+            inflight--;
+            if(msg.status_ == "111"){
+                count.first++;
+            }
+            else{
+                count.second++;
+            }
+        }
+    }
+    return count;
+}
+
+int main(int argc, char* argv[])
+{
+    uint16_t port = Bench::Arg(argc, argv, 1, 8081);
+    int n = Bench::Arg(argc, argv, 2, 24);
+    int secs = Bench::Arg(argc, argv, 3, 5);
+    int window = Bench::Arg(argc, argv, 4, 1);
+
+    std::string tag = Bench::Tag();
+    std::vector<std::string> users;
+    std::vector<uint16_t> homes;
+    std::set<uint16_t> nodes;
+    for(int i = 0;i < n;i++){
+        users.push_back("b" + std::to_string(i) + "_" + tag);
+        homes.push_back(Home(port, users.back()));
+        if(homes.back() == 0){
+            fprintf(stderr, "sign up failed: %s\n", users.back().c_str());
+            return 1;
+        }
+        nodes.insert(homes.back());
+    }
+
+    int fds[2];
+    if(pipe(fds) < 0){
+        perror("pipe");
+        return 1;
+    }
+    for(int i = 0;i < n;i++){
+        if(fork() == 0){
+            close(fds[0]);
+            srand(getpid());
+            std::pair<long, long> count = Worker(homes[i], users[i], users, secs, window);
+            write(fds[1], &count, sizeof(count));
+            _exit(0);
+        }
+    }
+    close(fds[1]);
+    long ok = 0, other = 0;
+    std::pair<long, long> count;
+    while(read(fds[0], &count, sizeof(count)) == sizeof(count)){
+        ok += count.first;
+        other += count.second;
+    }
+    close(fds[0]);
+    while(wait(nullptr) > 0);
+    printf("nodes %zu users %d window %d msgs/s %.0f non111 %ld\n", nodes.size(), n, window, (double)ok / secs, other);
+    return 0;
+}
@@ -0,0 +1,109 @@
+//混合负载的基准测试: 后台进程不停上传和下载大文件，前台测量登录和聊天转发的时延
+//用法: ./bench/mixed_bench [port=8081] [procs=8] [samples=300] [file_mb=8]
+//procs个后台进程一半上传(310)、一半下载(330)，前台串行做samples次 登录(020) 和 私聊(110)并等对方收到
+//输出登录和聊天时延的p50/p99，procs为0时即空载的时延
+//要让线程池成为瓶颈，服务器用 --thread_num=2 --thread_min=2 --thread_max=2 启动
+#include "BenchClient.hpp"
+#include <signal.h>
+#include <sys/wait.h>
+
+static void Upload(uint16_t port, const std::string& user, const std::string& peer, std::string data)
+{
+    BenchConn conn;
+    if(!conn.Connect(port)){
+        _exit(1);
+    }
+    BenchMsg res;
+    for(int i = 0;;i++){
+        data.back() = (char)i;
+        if(!conn.Request("310", {{"User", user}, {"Peer", peer}, {"Time", "t"}, {"File-Name", "bg" + std::to_string(i)}}, data, res)){
+            _exit(1);
+        }
+    }
+}
+
+static void Download(uint16_t port, const std::string& user, const std::string& sender)
+{
+    BenchConn conn;
+    if(!conn.Connect(port)){
+        _exit(1);
+    }
+    BenchMsg res;
+    while(conn.Request("330", {{"User", user}, {"Sender", sender}, {"File-Name", "dl.bin"}}, "", res));
+    _exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    uint16_t port = Bench::Arg(argc, argv, 1, 8081);
+    int procs = Bench::Arg(argc, argv, 2, 8);
+    int samples = Bench::Arg(argc, argv, 3, 300);
+    size_t file_size = (size_t)Bench::Arg(argc, argv, 4, 8) << 20;
+
+    std::string tag = Bench::Tag();
+    std::string a = "ma" + tag, b = "mb" + tag, u = "mu" + tag;
+    BenchConn ctl, la, lb, lu;
+    if(!ctl.Connect(port) || !la.Connect(port) || !lb.Connect(port) || !lu.Connect(port)){
+        fprintf(stderr, "connect failed\n");
+        return 1;
+    }
+    Bench::SignUp(ctl, a);
+    Bench::SignUp(ctl, b);
+    Bench::SignUp(ctl, u);
+    if(!Bench::SignIn(la, a) || !Bench::SignIn(lb, b) || !Bench::SignIn(lu, u)){
+        fprintf(stderr, "sign in failed\n");
+        return 1;
+    }
+
+    std::string data(file_size, 0);
+    srand(time(nullptr));
+    for(auto& c : data){
+        c = (char)rand();
+    }
+    BenchMsg res;
+    BenchConn up;
+    if(!up.Connect(port) || !up.Request("310", {{"User", u}, {"Peer", a}, {"Time", "t"}, {"File-Name", "dl.bin"}}, data, res)){
+        fprintf(stderr, "upload failed\n");
+        return 1;
+    }
+
+    //后台负载放在单独的进程中，和前台的测量互不干扰
+    std::vector<pid_t> children;
+    for(int i = 0;i < procs;i++){
+        pid_t pid = fork();
+        if(pid == 0){
+            if(i % 2 == 0){
+                Upload(port, u, a, data);
+            }
+            else{
+                Download(port, a, u);
+            }
+        }
+        children.push_back(pid);
+    }
+    sleep(1);
+
+    std::vector<double> sign_in, chat;
+    BenchMsg inform;
+    for(int i = 0;i < samples;i++){
+        double start = Bench::NowMs();
+        if(!ctl.Request("020", {{"User", b}, {"Password", "p"}}, "", res)){
+            break;
+        }
+        sign_in.push_back(Bench::NowMs() - start);
+
+        start = Bench::NowMs();
+        if(!ctl.Request("110", {{"User", a}, {"Peer", b}, {"Time", "t"}}, "x\n", res) || !lb.Recv(inform)){
+            break;
+        }
+        chat.push_back(Bench::NowMs() - start);
+    }
+    for(pid_t pid : children){
+        kill(pid, SIGTERM);
+    }
+    while(wait(nullptr) > 0);
+
+    printf("bg %d samples %zu signin p50/p99 ms %.2f/%.2f chat p50/p99 ms %.2f/%.2f\n", procs, chat.size(),
+           Bench::Percentile(sign_in, 0.5), Bench::Percentile(sign_in, 0.99), Bench::Percentile(chat, 0.5), Bench::Percentile(chat, 0.99));
+    return 0;
+}
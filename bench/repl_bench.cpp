@@ -0,0 +1,84 @@
+//离线消息写入吞吐的基准测试，用来比较打开和关闭复制时主机的开销
+//用法: ./bench/repl_bench [port=8081] [senders=8] [secs=5] [window=32]
+//senders个进程各自登录，流水线地保持window个私聊(110)在途，对象是50个不在线的用户，每条消息都要写离线存储和复制日志
+//输出每秒写入的消息数；分别对 不带replica_listen 和 带replica_listen并接了备机 的主机运行一次
+//复制延迟和追赶速度由服务器统计: 结束后向备机发SIGUSR1，日志中 "replica role=standby" 一行的
+//lag_avg_ms/lag_max_ms为写入到备机重放的延迟，catchup_ms为新启动的备机追上主机所用的时间
+#include "BenchClient.hpp"
+#include <sys/wait.h>
+
+static long Sender(uint16_t port, const std::string& user, const std::string& tag, int secs, int window)
+{
+    BenchConn conn;
+    if(!conn.Connect(port) || !Bench::SignIn(conn, user)){
+        return 0;
+    }
+    std::string body(100, 'x');
+    long sent = 0, done = 0;
+    BenchMsg msg;
+    double end = Bench::NowMs() + secs * 1000.0;
+    while(Bench::NowMs() < end){
+        while(sent - done < window){
+            std::string peer = "o" + std::to_string(sent % 50) + "_" + tag;
+            if(!conn.Send(BenchConn::Frame("110", {{"User", user}, {"Peer", peer}, {"Time", "t"}}, body))){
+                return done;
+            }
+            sent++;
+        }
+        if(!conn.Recv(msg)){
+            return done;
+        }
+        done += (msg.method_ == "RES");
+    }
+    //等在途的消息都写完再统计
+    while(done < sent && conn.Recv(msg)){
+        done += (msg.method_ == "RES");
+    }
+    return done;
+}
+
+int main(int argc, char* argv[])
+{
+    uint16_t port = Bench::Arg(argc, argv, 1, 8081);
+    int senders = Bench::Arg(argc, argv, 2, 8);
+    int secs = Bench::Arg(argc, argv, 3, 5);
+    int window = Bench::Arg(argc, argv, 4, 32);
+
+    std::string tag = Bench::Tag();
+    BenchConn ctl;
+    if(!ctl.Connect(port)){
+        fprintf(stderr, "connect failed\n");
+        return 1;
+    }
+    for(int i = 0;i < senders;i++){
+        Bench::SignUp(ctl, "s" + std::to_string(i) + "_" + tag);
+    }
+    for(int i = 0;i < 50;i++){
+        Bench::SignUp(ctl, "o" + std::to_string(i) + "_" + tag);
+    }
+
+    int fds[2];
+    if(pipe(fds) < 0){
+        perror("pipe");
+        return 1;
+    }
+    double start = Bench::NowMs();
+    for(int i = 0;i < senders;i++){
+        if(fork() == 0){
+            close(fds[0]);
+            long done = Sender(port, "s" + std::to_string(i) + "_" + tag, tag, secs, window);
+            write(fds[1], &done, sizeof(done));
+            _exit(0);
+        }
+    }
+    close(fds[1]);
+    long total = 0, done = 0;
+    while(read(fds[0], &done, sizeof(done)) == sizeof(done)){
+        total += done;
+    }
+    close(fds[0]);
+    while(wait(nullptr) > 0);
+    double ms = Bench::NowMs() - start;
+    printf("senders %d window %d msgs %ld msgs/s %.0f\n", senders, window, total, total * 1000.0 / ms);
+    return 0;
+}
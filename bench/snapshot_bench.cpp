@@ -0,0 +1,64 @@
+//快照保存与恢复的基准测试
+//用法: ./bench/snapshot_bench save <用户数> [path]   生成用户数规模的Chatroom并保存快照
+//      ./bench/snapshot_bench load [path]           在新进程中恢复快照，输出恢复耗时
+//恢复必须在另一个进程里做，Load把快照合并进已有的容器，同一进程里key都已存在，测不到真实的插入开销
+#include "Snapshot.hpp"
+#include "Config.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <unordered_set>
+
+static double MsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+//每个用户一个密码、一条文件名索引，每10个用户一个群聊
+static void Populate(int users)
+{
+    Chatroom* pc = Chatroom::GetInstance();
+    for(int i = 0;i < users;i++){
+        std::string name = "user" + std::to_string(i);
+        pc->UsersInsert(name, "password" + std::to_string(i));
+        pc->FileIndexInsert(name + "-peer/file", std::string(64, 'a' + i % 26));
+    }
+    for(int g = 0;g + 10 <= users;g += 10){
+        std::unordered_set<std::string> members;
+        for(int i = g;i < g + 10;i++){
+            members.insert("user" + std::to_string(i));
+        }
+        pc->GroupsInsert("group" + std::to_string(g / 10), members);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    Config::GetInstance()->Init(argc, argv);
+    if(argc >= 3 && strcmp(argv[1], "save") == 0){
+        int users = atoi(argv[2]);
+        std::string path = (argc >= 4 && strncmp(argv[3], "--", 2) != 0) ? argv[3] : "/tmp/bench.snap";
+        Populate(users);
+        auto start = std::chrono::steady_clock::now();
+        if(!Snapshot::Save(path)){
+            fprintf(stderr, "save failed: %s\n", path.c_str());
+            return 1;
+        }
+        printf("save users=%d ms=%.1f\n", users, MsSince(start));
+        return 0;
+    }
+    if(argc >= 2 && strcmp(argv[1], "load") == 0){
+        std::string path = (argc >= 3 && strncmp(argv[2], "--", 2) != 0) ? argv[2] : "/tmp/bench.snap";
+        auto start = std::chrono::steady_clock::now();
+        if(!Snapshot::Load(path)){
+            fprintf(stderr, "load failed: %s\n", path.c_str());
+            return 1;
+        }
+        printf("load users=%zu groups=%zu ms=%.1f\n", Chatroom::GetInstance()->GetUsers().size(), Chatroom::GetInstance()->GetGroups().size(), MsSince(start));
+        return 0;
+    }
+    fprintf(stderr, "usage: %s save <users> [path] | load [path]\n", argv[0]);
+    return 2;
+}
@@ -0,0 +1,55 @@
+//私聊转发吞吐的基准测试
+//用法: ./bench/tput_bench [port=8081] [msgs=20000]
+//A和B都在线，A以200条为一批流水线地发送msgs条私聊(110)给B，等A收齐111、B收齐通知(INF 150)后输出每秒转发的消息数
+//配合bench/alloc_count.so统计服务器每条消息的分配次数: 分别用两个不同的msgs各跑一次，分配次数之差除以消息数之差
+#include "BenchClient.hpp"
+#include <thread>
+
+//读到count条method status报文为止，返回实际读到的条数
+static long Drain(BenchConn& conn, const std::string& method, const std::string& status, long count)
+{
+    long got = 0;
+    BenchMsg msg;
+    while(got < count && conn.Recv(msg)){
+        got += (msg.method_ == method && msg.status_ == status);
+    }
+    return got;
+}
+
+int main(int argc, char* argv[])
+{
+    uint16_t port = Bench::Arg(argc, argv, 1, 8081);
+    long n = Bench::Arg(argc, argv, 2, 20000);
+
+    std::string tag = Bench::Tag();
+    std::string a = "ta" + tag, b = "tb" + tag;
+    BenchConn ctl, la, lb;
+    if(!ctl.Connect(port) || !la.Connect(port) || !lb.Connect(port)){
+        fprintf(stderr, "connect failed\n");
+        return 1;
+    }
+    Bench::SignUp(ctl, a);
+    Bench::SignUp(ctl, b);
+    if(!Bench::SignIn(la, a) || !Bench::SignIn(lb, b)){
+        fprintf(stderr, "sign in failed\n");
+        return 1;
+    }
+
+    std::string one = BenchConn::Frame("110", {{"User", a}, {"Peer", b}, {"Time", "t"}}, "hello there, see you at the meeting tomorrow with the report\n");
+    std::string batch;
+    for(int i = 0;i < 200;i++){
+        batch += one;
+    }
+    long got_res = 0, got_inf = 0;
+    double start = Bench::NowMs();
+    std::thread res_thread([&]{ got_res = Drain(la, "RES", "111", n); });
+    std::thread inf_thread([&]{ got_inf = Drain(lb, "INF", "150", n); });
+    for(long i = 0;i < n;i += 200){
+        la.Send(i + 200 <= n ? batch : std::string(batch, 0, one.size() * (n - i)));
+    }
+    res_thread.join();
+    inf_thread.join();
+    double ms = Bench::NowMs() - start;
+    printf("msgs %ld res %ld inf %ld msgs/s %.0f\n", n, got_res, got_inf, n * 1000.0 / ms);
+    return 0;
+}
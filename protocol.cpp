@@ -1,4 +1,6 @@
 #include "Protocol.hpp"
+#include "Handler.hpp"
+#include "DiskIO.hpp"
 
 
 //获取初始行，自动去除结尾\r\n
@@ -19,36 +21,34 @@ int Protocol::GetIniLine(Event<ChatMessage>& event)
 //粘包返回-1；正常则返回读取到的报头总大小，包括\r\n与空行大小；如果读到空行；返回-2
 int Protocol::GetHeader(Event<ChatMessage>& event)
 {
-    std::string tem_string;
-    int ret = Util::Readline(event.inbuffer_, tem_string);
-    if(ret == -1){
+    size_t pos = event.inbuffer_.find(LINE_END);
+    if(pos == std::string::npos){
         //没有读到\r\n，出现粘包问题，直接返回
         return -1;
     }
-    if(tem_string == "\r\n"){
+    if(pos == 0){
         //如果读到空行，返回-2
-        event.recvMessage_.blank_ = "\r\n";
+        event.recvMessage_.blank_ = LINE_END;
         return -2;
     }
-    //如果是正常的一行，那么就加入headers_中
-    tem_string.resize(tem_string.size()-2);
-    event.recvMessage_.headers_.push_back(tem_string);
-    LOG(INFO, tem_string);
-    return ret;
+    //如果是正常的一行，那么就加入headers_中，直接在Arena中构造，不经过临时字符串
+    auto& line = event.recvMessage_.headers_.emplace_back(event.inbuffer_.data(), pos);
+    LOG(INFO, std::string(line));
+    return pos + 2;
 }
 
 //获取正文数据
 //如果读完数据，返回0；没有读完数据，即in已经空了，返回-1
-int Protocol::GetBody(int len, const std::string& in, std::string& out)
+int Protocol::GetBody(size_t len, const std::string& in, std::string& out)
 {
     if(in.size() >= len){
         //保证一定能读完数据，直接从in中读n个
-        out += in.substr(0, len);
+        out.append(in, 0, len);
         return 0;
     }
     else{
         //不能读完数据
-        out += in.substr(0);
+        out += in;
         return -1;
     }
 }
@@ -96,6 +96,7 @@ void Protocol::SignUp(Event<ChatMessage>& event)
 
     //插入到users中
     Chatroom::GetInstance()->UsersInsert(name, password);
+    Replica::GetInstance()->Append(ReplicaOp::USER, {name, password});
 
     LOG(INFO, std::string("Sign up, name: ")+name+std::string(", password: ")+password);
 }
@@ -145,6 +146,8 @@ void Protocol::SignIn(Event<ChatMessage>& event)
     if(it3 == online.end()){
         //如果还没登录
         Chatroom::GetInstance()->OnlineInsert(name, event.sock_);
+        Cluster::GetInstance()->SetOnline(name, true);
+        Presence::GetInstance()->Publish(name, true);
 
         //设置长连接
         Chatroom::GetInstance()->LongSockInsert(event.sock_, name);
@@ -180,6 +183,14 @@ void Protocol::SignIn(Event<ChatMessage>& event)
             event.sendMessage_.headerMap_.insert(std::make_pair("Group", tem));
 
             Chatroom::GetInstance()->OfflineGroupClear(name);
+            Replica::GetInstance()->Append(ReplicaOp::GROUP_SEEN, {name});
+        }
+
+        //订阅的用户中当前在线的，之后的变化由040通知，格式:
+        //Online: jason zjx ...\r\n
+        std::string online_subs = OnlineOf(Presence::GetInstance()->GetSubscriptions(name));
+        if(!online_subs.empty()){
+            event.sendMessage_.headerMap_.insert(std::make_pair("Online", online_subs));
         }
 
         //如果该用户有发送文件的离线信息，离线信息会作为登录确认报文的内容
@@ -202,48 +213,23 @@ void Protocol::SignIn(Event<ChatMessage>& event)
             Chatroom::GetInstance()->OfflineFilesErase(name);
         }
 
-        //如果该用户有离线信息，离线信息会作为登录确认报文的内容
+        //如果该用户有离线信息，第一页离线信息会作为登录确认报文的内容，剩下的由客户端用050请求分页读取
+        //过载时先不读离线消息，登录确认中只给出有离线消息，退出过载后再用050通知推送第一页
         const auto& offline = Chatroom::GetInstance()->GetOffline();
-        auto it_offline = offline.find(name);
-        if(it_offline != offline.end()){
-            //说明有离线信息
-            const auto& sender_map = it_offline->second;
-            int sender_num = sender_map.size(); //sender个数
-            int offline_msg_num = 0;
-            auto& body = event.sendMessage_.body_;
-            for(auto& spec_sender : sender_map){
-                //把所有sender都遍历一遍
-                std::string path("./message/");
-                path += name;
-                path += ".jchat";
-                
-                std::vector<std::vector<std::string>> out;
-                ReadFile(path, out, spec_sender.second);
-                for(auto& spec_msg : out){
-                    //一个sender的一个特定信息
-                    body += "time: ";
-                    body += spec_msg[0];
-                    body += LINE_END;
-                    body += "sender: ";
-                    body += spec_msg[1];
-                    body += LINE_END;
-                    body += "receiver: ";
-                    body += spec_msg[2];
-                    body += LINE_END;
-                    body += "len: ";
-                    body += spec_msg[3];
-                    body += LINE_END;
-                    body += spec_msg[4];
-                    body += LINE_END;
-
-                    offline_msg_num++;
-                }
-
-                ClearFile(path);
+        if(offline.find(name) != offline.end()){
+            if(ThreadPool<ChatMessage, Protocol>::GetInstance()->IsOverloaded()){
+                event.sendMessage_.headerMap_.insert(std::make_pair("Offline-Deferred", "1"));
+                Reactor<ChatMessage>* pr = event.pr_;
+                ThreadPool<ChatMessage, Protocol>::GetInstance()->AddDeferred([name, pr]{
+                    DiskExecutor<ChatMessage, Protocol>::GetInstance()->Submit(Chatroom::MessagePath(name), [name, pr]{
+                        PushOffline(name, pr);
+                    });
+                });
+                LOG(INFO, std::string("Defer offline messages, name: ")+name);
+            }
+            else{
+                ReadOfflinePage(name, event.sendMessage_);
             }
-            event.sendMessage_.headerMap_.at("Content-Length") = std::to_string(body.size());
-            event.sendMessage_.headerMap_.insert(std::make_pair("Offline", std::to_string(offline_msg_num)));
-            Chatroom::GetInstance()->OfflineClear(name);
         }
 
         LOG(INFO, std::string("One user is signing in, name: ")+name);
@@ -257,6 +243,397 @@ void Protocol::SignIn(Event<ChatMessage>& event)
     }
 }
 
+//读出name的一页离线消息，按登录确认报文正文的格式追加到body中，最多max_msgs条，正文达到max_bytes时提前结束
+//先读单聊消息，再按群聊名称的顺序读各个群聊日志，备机按相同的条数重放时读到的是同样的消息
+//读过的部分推进读游标并减少离线消息个数，某个文件读完时清除对应的离线记录
+//返回读出的消息条数，remain为还没有读出的条数，调用者需在key为MessagePath(name)的磁盘线程中执行
+int Protocol::ReadOffline(const std::string& name, std::string& body, int& remain, size_t max_msgs, size_t max_bytes)
+{
+    remain = 0;
+    auto counts = Chatroom::GetInstance()->GetOfflineCounts(name);
+    if(counts.empty()){
+        return 0;
+    }
+    //说明有离线信息
+    //群聊消息从各个群聊日志中该用户的读游标处开始读，单聊消息全部在该用户自己的文件中
+    auto cursors = Chatroom::GetInstance()->GetGroupCursors(name);
+    std::map<std::string, int> group_nums;
+    int personal_num = 0;
+    int total = 0;
+    for(auto& spec_sender : counts){
+        total += spec_sender.second;
+        if(cursors.find(spec_sender.first) != cursors.end()){
+            group_nums[spec_sender.first] = spec_sender.second;
+        }
+        else{
+            personal_num += spec_sender.second;
+        }
+    }
+
+    std::vector<std::vector<std::string>> out;
+    std::unordered_map<std::string, int> consumed; //每个发送者或群聊读出的条数
+    size_t bytes = 0;
+    //从path的offset处读出这一部分的num条消息，本页放不下时只读一部分，next为读完之后的偏移
+    //返回1表示全部读完，0表示还有剩余，-1表示文件比记录的个数短，剩下的个数已经没有对应的消息
+    auto read_part = [&](const std::string& path, int num, uint64_t offset, uint64_t& next){
+        size_t want = std::min<size_t>(num, max_msgs - out.size());
+        size_t base = out.size();
+        ReadFile(path, out, want, offset, max_bytes - bytes, &next);
+        size_t got = out.size() - base;
+        for(size_t i = base;i < out.size();i++){
+            bytes += out[i][4].size();
+        }
+        if(got < want && bytes < max_bytes){
+            LOG(WARNING, std::string("Offline file is shorter than expected: ")+path);
+            return -1;
+        }
+        return (int)got == num ? 1 : 0;
+    };
+
+    if(personal_num > 0){
+        std::string path = Chatroom::MessagePath(name);
+        uint64_t next = 0;
+        size_t base = out.size();
+        int ret = read_part(path, personal_num, Chatroom::GetInstance()->GetOfflineRead(name), next);
+        if(ret != 0){
+            for(auto& spec_sender : counts){
+                if(cursors.find(spec_sender.first) == cursors.end()){
+                    consumed[spec_sender.first] = spec_sender.second;
+                }
+            }
+            ClearFile(path);
+            Chatroom::GetInstance()->SetOfflineRead(name, 0);
+        }
+        else{
+            for(size_t i = base;i < out.size();i++){
+                consumed[out[i][1]]++;
+            }
+            Chatroom::GetInstance()->SetOfflineRead(name, next);
+        }
+    }
+    for(auto& group : group_nums){
+        if(out.size() >= max_msgs || bytes >= max_bytes){
+            break;
+        }
+        uint64_t next = 0;
+        size_t base = out.size();
+        int ret = read_part(Chatroom::GroupLogPath(group.first), group.second, cursors.at(group.first), next);
+        consumed[group.first] = (ret != 0) ? group.second : (int)(out.size() - base);
+        //正常读完时由GroupCursorAdvance比较日志末尾决定是否清除读游标，读完之后可能又追加了该用户的消息
+        Chatroom::GetInstance()->GroupCursorAdvance(name, group.first, next, ret < 0);
+    }
+
+    int offline_msg_num = 0;
+    for(auto& spec_msg : out){
+        //一个sender的一个特定信息
+        body += "time: ";
+        body += spec_msg[0];
+        body += LINE_END;
+        body += "sender: ";
+        body += spec_msg[1];
+        body += LINE_END;
+        body += "receiver: ";
+        body += spec_msg[2];
+        body += LINE_END;
+        body += "len: ";
+        body += spec_msg[3];
+        body += LINE_END;
+        body += spec_msg[4];
+        body += LINE_END;
+
+        offline_msg_num++;
+    }
+
+    int num = 0;
+    for(auto& c : consumed){
+        num += c.second;
+    }
+    Chatroom::GetInstance()->OfflineConsume(name, consumed);
+    remain = std::max(0, total - num);
+    Replica::GetInstance()->Append(ReplicaOp::READ, {name, std::to_string(offline_msg_num)});
+    return offline_msg_num;
+}
+
+//读出name的一页离线消息放入msg的正文，并设置Content-Length
+//Offline为本页的条数，Offline-Remain为还没有读出的条数，用050请求继续读，返回本页的条数
+int Protocol::ReadOfflinePage(const std::string& name, ChatMessage& msg)
+{
+    static const size_t page_msgs = std::max<long long>(1, Config::GetInstance()->GetInt("offline_page_msgs"));
+    static const size_t page_bytes = std::max<long long>(1, Config::GetInstance()->GetInt("offline_page_bytes"));
+    int remain = 0;
+    int offline_msg_num = ReadOffline(name, msg.body_, remain, page_msgs, page_bytes);
+    msg.headerMap_["Content-Length"] = std::to_string(msg.body_.size());
+    msg.headerMap_.insert(std::make_pair("Offline", std::to_string(offline_msg_num)));
+    if(remain > 0){
+        msg.headerMap_.insert(std::make_pair("Offline-Remain", std::to_string(remain)));
+    }
+    return offline_msg_num;
+}
+
+//分页读取离线消息，响应报文的格式和登录确认中的离线消息相同
+void Protocol::PullOffline(Event<ChatMessage>& event)
+{
+    auto it_user = event.recvMessage_.headerMap_.find("User");
+    if(it_user == event.recvMessage_.headerMap_.end()){
+        event.sendMessage_.status_ = "401";
+
+        LOG(WARNING, "Wrong formation");
+        return;
+    }
+    std::string name = it_user->second;
+    if(!IsOwner(name, event.sock_)){
+        event.sendMessage_.status_ = "403";
+
+        LOG(WARNING, std::string("Not signed in on this connection: ")+name);
+        return;
+    }
+    int offline_msg_num = ReadOfflinePage(name, event.sendMessage_);
+    LOG(INFO, std::string("Pull offline messages, name: ")+name+std::string(", num: ")+std::to_string(offline_msg_num));
+}
+
+//查询一个会话的历史，Peer和Group二选一，群聊只有成员可以查询
+//After给出时取stamp大于After的Count条，否则取stamp小于Before的Count条，都没给出时取最新的Count条
+//正文的格式和离线消息相同，每条前面多一行stamp，History为条数，History-More表示这个方向上还有更多消息
+void Protocol::QueryHistory(Event<ChatMessage>& event)
+{
+    static const size_t query_max = std::max<long long>(1, Config::GetInstance()->GetInt("history_query_max"));
+    static const size_t query_bytes = std::max<long long>(1, Config::GetInstance()->GetInt("history_query_bytes"));
+    auto& header_map = event.recvMessage_.headerMap_;
+    auto it_user = header_map.find("User");
+    auto it_peer = header_map.find("Peer");
+    auto it_group = header_map.find("Group");
+    if(it_user == header_map.end() || (it_peer == header_map.end()) == (it_group == header_map.end())){
+        event.sendMessage_.status_ = "401";
+
+        LOG(WARNING, "Wrong formation");
+        return;
+    }
+    std::string name = it_user->second;
+    if(!IsOwner(name, event.sock_)){
+        event.sendMessage_.status_ = "403";
+
+        LOG(WARNING, std::string("Not signed in on this connection: ")+name);
+        return;
+    }
+
+    std::string key;
+    if(it_group != header_map.end()){
+        const auto& groups = Chatroom::GetInstance()->GetGroups();
+        auto it_groups = groups.find(it_group->second);
+        if(it_groups == groups.end() || it_groups->second.find(name) == it_groups->second.end()){
+            event.sendMessage_.headerMap_.at("Return") = "wrong";
+            event.sendMessage_.headerMap_.insert(std::make_pair("Wrong", (it_groups == groups.end()) ? "no_such_group" : "not_member"));
+
+            LOG(WARNING, "Query history of a group not joined");
+            return;
+        }
+        key = History::GroupKey(it_group->second);
+    }
+    else{
+        key = History::PairKey(name, it_peer->second);
+    }
+
+    size_t count = query_max;
+    auto it_count = header_map.find("Count");
+    if(it_count != header_map.end()){
+        count = std::min<size_t>(query_max, std::max(1LL, std::atoll(it_count->second.c_str())));
+    }
+    auto it_after = header_map.find("After");
+    auto it_before = header_map.find("Before");
+    bool before = (it_after == header_map.end());
+    uint64_t anchor = UINT64_MAX;
+    if(!before){
+        anchor = std::strtoull(it_after->second.c_str(), nullptr, 10);
+    }
+    else if(it_before != header_map.end()){
+        anchor = std::strtoull(it_before->second.c_str(), nullptr, 10);
+    }
+
+    std::vector<HistoryEntry> entries;
+    bool more = false;
+    History::GetInstance()->Query(key, anchor, before, count, query_bytes, entries, more);
+
+    std::string& body = event.sendMessage_.body_;
+    for(auto& e : entries){
+        body += "stamp: ";
+        body += std::to_string(e.stamp_);
+        body += LINE_END;
+        body += "time: ";
+        body += e.time_;
+        body += LINE_END;
+        body += "sender: ";
+        body += e.sender_;
+        body += LINE_END;
+        body += "receiver: ";
+        if(it_group != header_map.end()){
+            body += it_group->second;
+        }
+        else{
+            body += (e.sender_ == name) ? it_peer->second : name;
+        }
+        body += LINE_END;
+        body += "len: ";
+        body += std::to_string(e.body_.size());
+        body += LINE_END;
+        body += e.body_;
+        body += LINE_END;
+    }
+    event.sendMessage_.headerMap_["Content-Length"] = std::to_string(body.size());
+    event.sendMessage_.headerMap_.insert(std::make_pair("History", std::to_string(entries.size())));
+    if(more){
+        event.sendMessage_.headerMap_.insert(std::make_pair("History-More", "1"));
+    }
+    LOG(INFO, std::string("Query history, name: ")+name+std::string(", num: ")+std::to_string(entries.size()));
+}
+
+//在自己参与的会话中搜索同时含有Keywords中所有词的消息，Peer或Group给出时只搜索这一个会话
+//结果按stamp从新到旧，Before给出时只取更早的消息；每条的格式和120响应相同，stamp之后多一行chat，单聊为peer，群聊为group
+//Search为条数，Search-More表示还有更早的结果
+void Protocol::SearchMessages(Event<ChatMessage>& event)
+{
+    static const size_t max_results = std::max<long long>(1, Config::GetInstance()->GetInt("search_max_results"));
+    auto& header_map = event.recvMessage_.headerMap_;
+    auto it_user = header_map.find("User");
+    auto it_keywords = header_map.find("Keywords");
+    auto it_peer = header_map.find("Peer");
+    auto it_group = header_map.find("Group");
+    if(it_user == header_map.end() || it_keywords == header_map.end() || (it_peer != header_map.end() && it_group != header_map.end())){
+        event.sendMessage_.status_ = "401";
+
+        LOG(WARNING, "Wrong formation");
+        return;
+    }
+    std::string name = it_user->second;
+    if(!IsOwner(name, event.sock_)){
+        event.sendMessage_.status_ = "403";
+
+        LOG(WARNING, std::string("Not signed in on this connection: ")+name);
+        return;
+    }
+
+    //搜索范围: 自己参与的单聊会话和所在的群聊
+    std::vector<std::string> keys;
+    if(it_peer != header_map.end()){
+        keys.push_back(History::PairKey(name, it_peer->second));
+    }
+    else if(it_group != header_map.end()){
+        const auto& groups = Chatroom::GetInstance()->GetGroups();
+        auto it_groups = groups.find(it_group->second);
+        if(it_groups == groups.end() || it_groups->second.find(name) == it_groups->second.end()){
+            event.sendMessage_.headerMap_.at("Return") = "wrong";
+            event.sendMessage_.headerMap_.insert(std::make_pair("Wrong", (it_groups == groups.end()) ? "no_such_group" : "not_member"));
+
+            LOG(WARNING, "Search a group not joined");
+            return;
+        }
+        keys.push_back(History::GroupKey(it_group->second));
+    }
+    else{
+        keys = Search::GetInstance()->PairKeys(name);
+        for(auto& group : Chatroom::GetInstance()->GroupsOf(name)){
+            keys.push_back(History::GroupKey(group));
+        }
+    }
+
+    size_t count = max_results;
+    auto it_count = header_map.find("Count");
+    if(it_count != header_map.end()){
+        count = std::min<size_t>(max_results, std::max(1LL, std::atoll(it_count->second.c_str())));
+    }
+    uint64_t anchor = UINT64_MAX;
+    auto it_before = header_map.find("Before");
+    if(it_before != header_map.end()){
+        anchor = std::strtoull(it_before->second.c_str(), nullptr, 10);
+    }
+
+    std::vector<std::pair<std::string, uint64_t>> hits;
+    bool more = false;
+    if(!Search::GetInstance()->Query(keys, it_keywords->second, anchor, count, hits, more)){
+        event.sendMessage_.headerMap_.at("Return") = "wrong";
+        event.sendMessage_.headerMap_.insert(std::make_pair("Wrong", "no_keywords"));
+
+        LOG(WARNING, "No keywords");
+        return;
+    }
+
+    //命中的消息从历史中读出正文
+    std::string& body = event.sendMessage_.body_;
+    int num = 0;
+    for(auto& hit : hits){
+        HistoryEntry e;
+        if(!History::GetInstance()->Get(hit.first, hit.second, e)){
+            continue;
+        }
+        bool group = hit.first.compare(0, 2, "g:") == 0;
+        std::string receiver;
+        if(group){
+            receiver = hit.first.substr(2);
+        }
+        else{
+            //单聊会话的key为 u:用户\n用户，接收者为发送者之外的那个
+            size_t pos = hit.first.find('\n');
+            std::string a = hit.first.substr(2, pos - 2), b = hit.first.substr(pos + 1);
+            receiver = (e.sender_ == a) ? b : a;
+        }
+        body += "stamp: ";
+        body += std::to_string(e.stamp_);
+        body += LINE_END;
+        body += "chat: ";
+        body += group ? "group" : "peer";
+        body += LINE_END;
+        body += "time: ";
+        body += e.time_;
+        body += LINE_END;
+        body += "sender: ";
+        body += e.sender_;
+        body += LINE_END;
+        body += "receiver: ";
+        body += receiver;
+        body += LINE_END;
+        body += "len: ";
+        body += std::to_string(e.body_.size());
+        body += LINE_END;
+        body += e.body_;
+        body += LINE_END;
+        num++;
+    }
+    event.sendMessage_.headerMap_["Content-Length"] = std::to_string(body.size());
+    event.sendMessage_.headerMap_.insert(std::make_pair("Search", std::to_string(num)));
+    if(more){
+        event.sendMessage_.headerMap_.insert(std::make_pair("Search-More", "1"));
+    }
+    LOG(INFO, std::string("Search messages, name: ")+name+std::string(", num: ")+std::to_string(num));
+}
+
+//清除name的离线消息文件、群聊读游标和离线消息个数，备机重放分页之前的READ记录时调用
+void Protocol::ClearOffline(const std::string& name)
+{
+    ClearFile(Chatroom::MessagePath(name));
+    Chatroom::GetInstance()->GroupCursorsClear(name);
+    Chatroom::GetInstance()->OfflineClear(name);
+}
+
+//过载时延后的离线消息，退出过载后用050通知把第一页推送给已经登录的用户
+//用户已经下线则什么都不做，离线消息留到下次登录
+void Protocol::PushOffline(const std::string& name, Reactor<ChatMessage>* pr)
+{
+    //在延后任务或磁盘任务中调用，必须加锁查找online_
+    int sock = Chatroom::GetInstance()->OnlineSock(name);
+    if(sock < 0){
+        return;
+    }
+    InformMsg<ChatMessage> im(sock, pr);
+    int offline_msg_num = ReadOfflinePage(name, im.message_);
+    if(offline_msg_num == 0){
+        return;
+    }
+    im.message_.method_ = "INF";
+    im.message_.status_ = "050";
+    im.message_.version_ = VERSION;
+    ThreadPool<ChatMessage, Protocol>::GetInstance()->AddMessage(std::move(im));
+    LOG(INFO, std::string("Push deferred offline messages, name: ")+name+std::string(", num: ")+std::to_string(offline_msg_num));
+}
+
 //登出
 void Protocol::SignOut(Event<ChatMessage>& event)
 {
@@ -293,6 +670,8 @@ void Protocol::SignOut(Event<ChatMessage>& event)
 
     //本身就在线，那么删除在线状态
     Chatroom::GetInstance()->OnlineErase(name);
+    Cluster::GetInstance()->SetOnline(name, false);
+    Presence::GetInstance()->Publish(name, false);
     //这里删除了，底层关闭登录长连接的时候就不会删除
 
     //删除长连接映射
@@ -333,45 +712,297 @@ bool Protocol::IsSignIn(std::string name)
     return true;
 }
 
+//name已经登录，并且sock就是它登录时使用的长连接
+//只涉及name自己数据的请求(拉取离线消息、查询历史、搜索)用它校验，只带User报头不能读取别人的数据
+bool Protocol::IsOwner(const std::string& name, int sock)
+{
+    return Chatroom::GetInstance()->OnlineSock(name) == sock;
+}
+
+//name是否在线，其他节点的用户按集群广播的在线状态判断
+bool Protocol::IsPresent(const std::string& name)
+{
+    if(!Cluster::GetInstance()->IsLocal(name)){
+        return Cluster::GetInstance()->IsOnline(name);
+    }
+    return IsSignIn(name);
+}
+
+//names中在线的用户，以空格分隔
+std::string Protocol::OnlineOf(const std::vector<std::string>& names)
+{
+    std::string online;
+    for(auto& name : names){
+        if(IsPresent(name)){
+            online += name;
+            online += " ";
+        }
+    }
+    if(!online.empty()){
+        online.pop_back();
+    }
+    return online;
+}
+
+//订阅和取消订阅其他用户的在线状态，格式:
+//Subscribe: jason zjx ...\r\n
+//Unsubscribe: jack ...\r\n
+//响应中的Online为修改后订阅的用户中当前在线的
+void Protocol::Subscribe(Event<ChatMessage>& event)
+{
+    auto& header_map = event.recvMessage_.headerMap_;
+    auto it_user = header_map.find("User");
+    if(it_user == header_map.end()){
+        event.sendMessage_.headerMap_.erase("Return");
+        event.sendMessage_.status_ = "401";
+
+        LOG(WARNING, "Wrong formation");
+        return;
+    }
+    std::string name = it_user->second;
+    //只有name登录的连接可以修改name的订阅，否则任何连接都能替别人订阅并得知谁在线
+    if(!IsOwner(name, event.sock_)){
+        event.sendMessage_.headerMap_.erase("Return");
+        event.sendMessage_.status_ = "403";
+
+        LOG(WARNING, std::string("Not signed in on this connection: ")+name);
+        return;
+    }
+
+    std::vector<std::string> add, remove;
+    auto it_sub = header_map.find("Subscribe");
+    if(it_sub != header_map.end()){
+        Util::CutString(it_sub->second, add, " ");
+    }
+    auto it_unsub = header_map.find("Unsubscribe");
+    if(it_unsub != header_map.end()){
+        Util::CutString(it_unsub->second, remove, " ");
+    }
+    //属于其他节点的用户由所属节点检查，这里不检查
+    for(auto& target : add){
+        if(Cluster::GetInstance()->IsLocal(target) && !IsUserExist(target)){
+            event.sendMessage_.headerMap_.erase("Return");
+            event.sendMessage_.status_ = "402";
+
+            LOG(WARNING, std::string("No such user, name: ")+target);
+            return;
+        }
+    }
+
+    std::vector<std::string> result;
+    if(!Presence::GetInstance()->Subscribe(name, add, remove, result)){
+        event.sendMessage_.headerMap_.at("Return") = "wrong";
+        event.sendMessage_.headerMap_.insert(std::make_pair("Wrong", "too_many"));
+
+        LOG(WARNING, std::string("Too many subscriptions, name: ")+name);
+        return;
+    }
+    std::vector<std::string> fields(1, name);
+    fields.insert(fields.end(), result.begin(), result.end());
+    Replica::GetInstance()->Append(ReplicaOp::SUBSCRIBE, std::move(fields));
+
+    std::string online = OnlineOf(result);
+    if(!online.empty()){
+        event.sendMessage_.headerMap_.insert(std::make_pair("Online", online));
+    }
+    LOG(INFO, std::string("Subscribe, name: ")+name+std::string(", num: ")+std::to_string(result.size()));
+}
+
+//把一个窗口内订阅的用户的在线状态变化合并成一个040通知发给name，格式:
+//Online: jason ...\r\n
+//Offline: zjx ...\r\n
+//name不在线时直接丢弃，下次登录时确认报文中会带上当前在线的订阅用户
+void Protocol::PushPresence(const std::string& name, const std::vector<std::string>& on, const std::vector<std::string>& off, Reactor<ChatMessage>* pr)
+{
+    //在在线状态线程中调用，业务线程同时在修改online_，必须加锁查找
+    int sock = Chatroom::GetInstance()->OnlineSock(name);
+    if(sock < 0){
+        return;
+    }
+    InformMsg<ChatMessage> im(sock, pr);
+    im.message_.method_ = "INF";
+    im.message_.status_ = "040";
+    im.message_.version_ = VERSION;
+    std::string tem;
+    for(auto& one : on){
+        tem += one;
+        tem += " ";
+    }
+    if(!tem.empty()){
+        tem.pop_back();
+        im.message_.headerMap_.insert(std::make_pair("Online", tem));
+        tem.clear();
+    }
+    for(auto& one : off){
+        tem += one;
+        tem += " ";
+    }
+    if(!tem.empty()){
+        tem.pop_back();
+        im.message_.headerMap_.insert(std::make_pair("Offline", tem));
+    }
+    im.message_.headerMap_.insert(std::make_pair("Content-Length", "0"));
+    ThreadPool<ChatMessage, Protocol>::GetInstance()->AddMessage(std::move(im));
+}
+
 //构建报文
-void Protocol::BuildMessage(Event<ChatMessage>& event)
+void Protocol::BuildMessage(ChatMessage& msg)
 {
-    auto& ini_line = event.sendMessage_.iniLine_;
-    auto& headers = event.sendMessage_.headers_;
-    auto& blank = event.sendMessage_.blank_;
+    auto& ini_line = msg.iniLine_;
+    auto& headers = msg.headers_;
+    auto& blank = msg.blank_;
     blank = LINE_END;
 
     //构建初始行
-    ini_line += event.sendMessage_.method_;
+    ini_line += msg.method_;
     ini_line += ' ';
-    ini_line += event.sendMessage_.status_;
+    ini_line += msg.status_;
     ini_line += ' ';
-    ini_line += event.sendMessage_.version_;
+    ini_line += msg.version_;
     ini_line += LINE_END;
 
     LOG(INFO, std::string("iniLine: ")+ini_line);
 
-    //构建报头
-    for(auto p : event.sendMessage_.headerMap_){
-        std::string tmp;
-        tmp += p.first;
-        tmp += ": ";
-        tmp += p.second;
-        tmp += LINE_END;
-        headers.push_back(tmp);
-
-        LOG(INFO, std::string("Res headrs: ")+tmp);
+    //构建报头，每一行直接在headers_的分配器中拼接
+    headers.reserve(headers.size() + msg.headerMap_.size());
+    for(auto& p : msg.headerMap_){
+        auto& line = headers.emplace_back();
+        line.reserve(p.first.size() + p.second.size() + 4);
+        line += p.first;
+        line += ": ";
+        line += p.second;
+        line += LINE_END;
+
+        LOG(INFO, std::string("Res headrs: ")+std::string(line));
     }
 
     //body已经被设置好，此时只需要发送即可
 }
 
-//清空event的inbuffer,recvMessage,sendMessage
+//请求正文带Content-Encoding时先解压，之后的处理函数看到的都是原文，Content-Length也改为原文的长度
+//压缩的原文放入deflated_，转发和保存文件时直接使用；返回-1表示编码不支持或者解压失败
+int Protocol::DecodeBody(Event<ChatMessage>& event)
+{
+    ChatMessage& msg = event.recvMessage_;
+    auto it = msg.headerMap_.find("Content-Encoding");
+    if(it == msg.headerMap_.end()){
+        return 0;
+    }
+    std::string encoding = it->second;
+    msg.headerMap_.erase(it);
+    if(encoding == "identity"){
+        return 0;
+    }
+    if(encoding != "deflate"){
+        return -1;
+    }
+    std::string raw;
+    if(!Codec::GetInstance()->Inflate(msg.body_.data(), msg.body_.size(), RequestLimiter::GetInstance()->MaxBody(event.lane_), raw)){
+        return -1;
+    }
+    msg.deflated_ = std::make_shared<SharedDeflate>(std::move(msg.body_));
+    msg.body_ = std::move(raw);
+    msg.headerMap_["Content-Length"] = std::to_string(msg.body_.size());
+    if(msg.status_ == "310"){
+        //压缩上传的文件没有边收边算哈希，解压之后按原文计算
+        msg.bodyHash_.Update(msg.body_);
+    }
+    return 0;
+}
+
+//连接声明过可以接收deflate时，较大的正文压缩后发送
+//群发的通知共享同一个deflated_，无论发给多少个连接都只压缩一次
+void Protocol::EncodeBody(Event<ChatMessage>& event, ChatMessage& msg)
+{
+    if(msg.encoded_ || msg.body_.empty() || (event.accept_ & Codec::DEFLATE) == 0){
+        return;
+    }
+    Codec* pcd = Codec::GetInstance();
+    if(msg.deflated_ == nullptr){
+        if(!pcd->Wants(msg.body_.size())){
+            return;
+        }
+        msg.deflated_ = std::make_shared<SharedDeflate>();
+    }
+    const std::string* packed = msg.deflated_->Get(msg.body_);
+    if(packed == nullptr){
+        return;
+    }
+    pcd->CountSent(msg.body_.size(), packed->size());
+    msg.body_ = *packed;
+    msg.headerMap_["Content-Encoding"] = "deflate";
+    msg.headerMap_["Content-Length"] = std::to_string(msg.body_.size());
+}
+
+//群发之前为正文准备一个共享的压缩结果，需要压缩的连接或节点第一次用到时才压缩
+void Protocol::ShareBody(ChatMessage& msg)
+{
+    if(msg.deflated_ == nullptr && Codec::GetInstance()->Wants(msg.body_.size())){
+        msg.deflated_ = std::make_shared<SharedDeflate>();
+    }
+}
+
+//转发给其他节点的正文，对方节点能解压时使用共享的压缩结果
+void Protocol::FrameBody(ClusterFrame& frame, int node, ChatMessage& msg)
+{
+    const std::string* packed = nullptr;
+    if(msg.deflated_ != nullptr && Cluster::GetInstance()->Accepts(node, Codec::DEFLATE)){
+        packed = msg.deflated_->Get(msg.body_);
+    }
+    if(packed == nullptr){
+        frame.body_ = msg.body_;
+        return;
+    }
+    frame.body_ = *packed;
+    frame.fields_["Encoding"] = "deflate";
+}
+
+//其他节点发来的压缩正文先解压，压缩的原文放入deflated用于本节点的通知，失败返回false
+bool Protocol::DecodeFrame(ClusterFrame& frame, std::shared_ptr<SharedDeflate>& deflated)
+{
+    if(frame.Get("Encoding") != "deflate"){
+        return true;
+    }
+    std::string raw;
+    if(!Codec::GetInstance()->Inflate(frame.body_.data(), frame.body_.size(), RequestLimiter::GetInstance()->MaxBody(LANE_CHAT), raw)){
+        return false;
+    }
+    deflated = std::make_shared<SharedDeflate>(std::move(frame.body_));
+    frame.body_ = std::move(raw);
+    return true;
+}
+
+//把压缩后的blob写入<sha256>.z，先写临时文件再rename，失败时只是少了压缩的副本，下载时发送原文
+void Protocol::StoreDeflated(const std::string& blob_path, const std::string& data)
+{
+    static std::atomic<uint64_t> seq(0);
+    std::string path = Chatroom::DeflatedPath(blob_path);
+    std::string tmp_path(path);
+    tmp_path += ".tmp";
+    tmp_path += std::to_string(seq++);
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = (fd >= 0 && Util::WriteAll(fd, data));
+    if(fd >= 0){
+        close(fd);
+    }
+    if(!ok || rename(tmp_path.c_str(), path.c_str()) < 0){
+        unlink(tmp_path.c_str());
+        LOG(WARNING, std::string("Write deflated blob error: ")+path);
+    }
+}
+
+//清空event的recvMessage,sendMessage
+//inbuffer中剩下的是客户端流水线发来的下一个请求，不能清除
 void Protocol::ClearEvent(Event<ChatMessage>& event)
 {
-    event.inbuffer_.clear();
     event.recvMessage_.Clear();
     event.sendMessage_.Clear();
+    //两个报文都已经不再引用arena_中的内存，当前请求分配的所有报头一次释放
+    event.arena_.Release();
+    //请求处理完毕，此时解析暂停，inbuffer_也不会被修改
+    MemUsage::Trim(event.inbuffer_);
+    event.inBytes_ = MemUsage::Str(event.inbuffer_);
+    event.msgBytes_ = event.recvMessage_.Bytes() + event.sendMessage_.Bytes();
 }
 
 //判断文件是否存在
@@ -384,9 +1015,10 @@ bool Protocol::IsFileExist(const std::string& path)
     return false;
 }
 
-//将文件内容按time，sender，receiver，data格式全部读入out中，一共n个记录
+//从文件的offset处开始，将文件内容按time，sender，receiver，data格式读入out中，最多n个记录，追加在out原有内容之后
 //其中前三个部分没有\n，后三个部分有\n
-bool Protocol::ReadFile(const std::string& path, std::vector<std::vector<std::string>>& out, int n)
+//读出的正文总长度达到max_bytes时提前结束，next不为空时设置为读完之后的偏移
+bool Protocol::ReadFile(const std::string& path, std::vector<std::vector<std::string>>& out, int n, uint64_t offset, size_t max_bytes, uint64_t* next)
 {
     if(!IsFileExist(path)){
         return false;
@@ -394,30 +1026,43 @@ bool Protocol::ReadFile(const std::string& path, std::vector<std::vector<std::st
 
     std::fstream fread;
     fread.open(path, std::ios::in);
-
-    out.resize(n);
-
-    for(int i = 0;i < n;i++){
-        out[i].resize(5);
-        std::getline(fread, out[i][0]);
-        std::getline(fread, out[i][1]);
-        std::getline(fread, out[i][2]);
-        std::getline(fread, out[i][3]);
+    fread.seekg(offset);
+
+    //读到的正文总长度达到max_bytes时提前结束，但至少读一条；读到文件末尾时也结束
+    //pos跟踪已经读过的字节数，结束后通过next返回
+    uint64_t pos = offset;
+    size_t bytes = 0;
+    for(int i = 0;i < n && bytes < max_bytes;i++){
+        std::vector<std::string> msg(5);
+        bool ok = true;
+        for(int j = 0;j < 4 && ok;j++){
+            ok = (bool)std::getline(fread, msg[j]);
+            pos += msg[j].size() + (fread.eof() ? 0 : 1);
+        }
+        if(!ok){
+            break;
+        }
         //没有读\n
-        int len = std::atoi(out[i][3].c_str());
+        int len = std::atoi(msg[3].c_str());
 
         std::string data;
         while(std::getline(fread, data)){
+            pos += data.size() + (fread.eof() ? 0 : 1);
             data += "\n";
-            out[i][4] += data;
+            msg[4] += data;
             len -= data.size();
             if(len <= 0){
                 break;
             }
         };
+        bytes += msg[4].size();
+        out.push_back(std::move(msg));
     }
 
     fread.close();
+    if(next != nullptr){
+        *next = pos;
+    }
     return true;
 }
 
@@ -478,7 +1123,11 @@ int Protocol::MessageHandler(Event<ChatMessage>& event, std::vector<std::string>
     Util::CutString(peers, v_peers, " ");
     //判断peer用户是否存在
     //为了方便起见，只要有一个接收peer不存在，直接返回402报文
+    //属于其他节点的用户不在本节点的users_中，由所属节点检查
     for(auto peer : v_peers){
+        if(!Cluster::GetInstance()->IsLocal(peer)){
+            continue;
+        }
         auto it = Chatroom::GetInstance()->GetUsers().find(peer);
         if(it == Chatroom::GetInstance()->GetUsers().end()){
             //用户不存在，返回402报文
@@ -509,30 +1158,7 @@ InformMsg<ChatMessage> Protocol::SendMessage(Event<ChatMessage>& event, std::str
 
     auto it_online = Chatroom::GetInstance()->GetOnline().find(peer_name);
     if(it_online == Chatroom::GetInstance()->GetOnline().end()){
-        //对方不在线
-        //把消息存在文件中
-        Chatroom::GetInstance()->OfflineInsert(peer_name, sender_name);
-        
-        //文件名: peer_name.jchat
-        std::string path;
-        path += "./message/";
-        path += peer_name;
-        path += ".jchat";
-
-        //追加新的消息进入文件
-        std::vector<std::string> in;
-        in.resize(5);
-        in[0] += time;
-        in[0] += "\n";
-        in[1] += sender_name;
-        in[1] += "\n";
-        in[2] += peer_name;
-        in[2] += "\n";
-        in[3] += it_content_len->second;
-        in[3] += "\n";
-        in[4] += event.recvMessage_.body_;
-        AppendFile(path, in);
-
+        //对方不在线，消息由ReqHandler交给磁盘线程写入文件
         //构建响应报文  
         event.sendMessage_.headerMap_.insert(std::make_pair("Return", "right")) ;
         is_offline = 1;
@@ -544,7 +1170,6 @@ InformMsg<ChatMessage> Protocol::SendMessage(Event<ChatMessage>& event, std::str
         im.sock_ = peer_sock;
         im.pr_ = event.pr_;
 
-        Event<ChatMessage>& send_ev = event.pr_->GetEvent(peer_sock);
 
         im.message_.method_ = "INF";
         im.message_.status_ = "150";
@@ -554,6 +1179,7 @@ InformMsg<ChatMessage> Protocol::SendMessage(Event<ChatMessage>& event, std::str
         im.message_.headerMap_.insert(std::make_pair("Sender", sender_name));
         im.message_.headerMap_.insert(std::make_pair("Receiver", peer_name));
         im.message_.body_ = event.recvMessage_.body_;
+        im.message_.deflated_ = event.recvMessage_.deflated_;
         im.message_.headerMap_.insert(std::make_pair("Content-Length", std::to_string(im.message_.body_.size())));
 
         //构建成功响应
@@ -612,6 +1238,9 @@ void Protocol::CreateGroup(Event<ChatMessage>& event)
     //判断用户是否存在
     //为了方便起见，只要有一个不存在，直接返回402报文
     for(auto one : v_others){
+        if(!Cluster::GetInstance()->IsLocal(one)){
+            continue;
+        }
         auto it = Chatroom::GetInstance()->GetUsers().find(one);
         if(it == Chatroom::GetInstance()->GetUsers().end()){
             //用户不存在，返回402报文
@@ -630,16 +1259,37 @@ void Protocol::CreateGroup(Event<ChatMessage>& event)
 
     //服务器上增加该群聊信息
     Chatroom::GetInstance()->GroupsInsert(group_name, group_set);
+    {
+        std::vector<std::string> fields(1, group_name);
+        fields.insert(fields.end(), group_set.begin(), group_set.end());
+        Replica::GetInstance()->Append(ReplicaOp::GROUP, std::move(fields));
+    }
 
     LOG(INFO, std::string("Create a group: ")+group_name);
 
+    //群聊信息同步给其他节点，由各成员所属的节点通知
+    if(Cluster::GetInstance()->Enabled()){
+        ClusterFrame frame("GRP");
+        frame.fields_["Group"] = group_name;
+        frame.fields_["Others"] = others;
+        for(auto& one : v_others){
+            frame.body_ += one;
+            frame.body_ += ' ';
+        }
+        Cluster::GetInstance()->Broadcast(frame);
+    }
+
     v_others.pop_back();
     //给其他人通知
     for(auto one : v_others){
+        if(!Cluster::GetInstance()->IsLocal(one)){
+            continue;
+        }
         auto it_online = Chatroom::GetInstance()->GetOnline().find(one);
         if(it_online == Chatroom::GetInstance()->GetOnline().end()){
             //如果不在线，将需要通知的信息加入offlineGroups_中
             Chatroom::GetInstance()->OfflineGroupInsert(one, group_name);
+            Replica::GetInstance()->Append(ReplicaOp::GROUP_NOTICE, {one, group_name});
 
         }
         else{
@@ -649,7 +1299,6 @@ void Protocol::CreateGroup(Event<ChatMessage>& event)
             im.sock_ = peer_sock;
             im.pr_ = event.pr_;
 
-            Event<ChatMessage>& send_ev = event.pr_->GetEvent(peer_sock);
 
             im.message_.method_ = "INF";
             im.message_.status_ = "250";
@@ -728,29 +1377,7 @@ InformMsg<ChatMessage> Protocol::SendGroupMessage(Event<ChatMessage>& event, std
     auto it_online = Chatroom::GetInstance()->GetOnline().find(member);
     if(it_online == Chatroom::GetInstance()->GetOnline().end()){
         //对方不在线
-        //把消息存在文件中
-        Chatroom::GetInstance()->OfflineInsert(member, group_name);
-        
-        //文件名: member.jchat
-        std::string path;
-        path += "./message/";
-        path += member;
-        path += ".jchat";
-
-        //追加新的消息进入文件
-        std::vector<std::string> in;
-        in.resize(5);
-        in[0] += time;
-        in[0] += "\n";
-        in[1] += sender_name;
-        in[1] += "\n";
-        in[2] += group_name;
-        in[2] += "\n";
-        in[3] += it_content_len->second;
-        in[3] += "\n";
-        in[4] += event.recvMessage_.body_;
-        AppendFile(path, in);
-
+        //消息由StoreGroupMessage在群聊日志中统一写一份，并记录离线消息个数
         //构建响应报文  
         event.sendMessage_.headerMap_.insert(std::make_pair("Return", "right")) ;
         is_offline = 1;
@@ -762,7 +1389,6 @@ InformMsg<ChatMessage> Protocol::SendGroupMessage(Event<ChatMessage>& event, std
         im.sock_ = member_sock;
         im.pr_ = event.pr_;
 
-        Event<ChatMessage>& send_ev = event.pr_->GetEvent(member_sock);
 
         im.message_.method_ = "INF";
         im.message_.status_ = "252";
@@ -772,6 +1398,7 @@ InformMsg<ChatMessage> Protocol::SendGroupMessage(Event<ChatMessage>& event, std
         im.message_.headerMap_.insert(std::make_pair("Sender", sender_name));
         im.message_.headerMap_.insert(std::make_pair("Group", group_name));
         im.message_.body_ = event.recvMessage_.body_;
+        im.message_.deflated_ = event.recvMessage_.deflated_;
         im.message_.headerMap_.insert(std::make_pair("Content-Length", std::to_string(im.message_.body_.size())));
 
         event.sendMessage_.headerMap_.insert(std::make_pair("Return", "right"));
@@ -783,6 +1410,349 @@ InformMsg<ChatMessage> Protocol::SendGroupMessage(Event<ChatMessage>& event, std
     }    
 }
 
+//将一条单聊消息追加到离线接收者peer_name的文件中，在磁盘线程中执行
+//先写文件再增加离线消息个数，保证登录时看到的个数一定能在文件中读到
+void Protocol::StoreMessage(Event<ChatMessage>& event, const std::string& peer_name)
+{
+    auto& header_map = event.recvMessage_.headerMap_;
+    StoreOffline(header_map.at("Time"), header_map.at("User"), peer_name, event.recvMessage_.body_);
+}
+
+//StoreMessage的实现，其他节点转发过来的消息也由这里落盘
+void Protocol::StoreOffline(const std::string& time, const std::string& sender_name, const std::string& peer_name, const std::string& body)
+{
+    std::vector<std::string> in;
+    in.resize(5);
+    in[0] += time;
+    in[0] += "\n";
+    in[1] += sender_name;
+    in[1] += "\n";
+    in[2] += peer_name;
+    in[2] += "\n";
+    in[3] += std::to_string(body.size());
+    in[3] += "\n";
+    in[4] += body;
+    AppendFile(Chatroom::MessagePath(peer_name), in);
+
+    Chatroom::GetInstance()->OfflineInsert(peer_name, sender_name);
+    Replica::GetInstance()->Append(ReplicaOp::MSG, {time, sender_name, peer_name, body});
+}
+
+//把一条单聊消息转发给peer_name所属的节点
+void Protocol::RelayRemote(Event<ChatMessage>& event, const std::string& peer_name)
+{
+    auto& header_map = event.recvMessage_.headerMap_;
+    ClusterFrame frame("MSG");
+    frame.fields_["Time"] = header_map.at("Time");
+    frame.fields_["Sender"] = header_map.at("User");
+    frame.fields_["Receiver"] = peer_name;
+    int node = Cluster::GetInstance()->OwnerOf(peer_name);
+    FrameBody(frame, node, event.recvMessage_);
+    Cluster::GetInstance()->Send(node, frame);
+    event.sendMessage_.headerMap_.insert(std::make_pair("Return", "right"));
+}
+
+//把一条群聊消息转发给node，members为该节点上的所有成员，以空格分隔
+void Protocol::RelayRemoteGroup(Event<ChatMessage>& event, int node, const std::string& members)
+{
+    auto& header_map = event.recvMessage_.headerMap_;
+    ClusterFrame frame("GMSG");
+    frame.fields_["Time"] = header_map.at("Time");
+    frame.fields_["Sender"] = header_map.at("User");
+    frame.fields_["Group"] = header_map.at("Group");
+    frame.fields_["Members"] = members;
+    FrameBody(frame, node, event.recvMessage_);
+    Cluster::GetInstance()->Send(node, frame);
+}
+
+//处理其他节点转发过来的帧，在该节点链路的接收线程中执行，只做通知入队和提交磁盘操作，不阻塞
+void Protocol::OnClusterFrame(ClusterFrame& frame, Reactor<ChatMessage>* pr)
+{
+    Chatroom* pc = Chatroom::GetInstance();
+    std::shared_ptr<SharedDeflate> deflated;
+    if((frame.type_ == "MSG" || frame.type_ == "GMSG") && !DecodeFrame(frame, deflated)){
+        LOG(WARNING, std::string("Cluster: bad encoded body in ")+frame.type_);
+        return;
+    }
+    if(frame.type_ == "MSG"){
+        std::string time = frame.Get("Time");
+        std::string sender_name = frame.Get("Sender");
+        std::string peer_name = frame.Get("Receiver");
+        if(!IsUserExist(peer_name)){
+            LOG(WARNING, std::string("Cluster: no such user, name: ")+peer_name);
+            return;
+        }
+        //接收者所属的节点也保存一份这个会话的历史
+        History::GetInstance()->Append(History::PairKey(sender_name, peer_name), time, sender_name, frame.body_);
+        //集群接收线程不持有online_的锁，必须用加锁的OnlineSock查找
+        int sock = pc->OnlineSock(peer_name);
+        if(sock < 0){
+            std::string body = std::move(frame.body_);
+            DiskExecutor<ChatMessage, Protocol>::GetInstance()->Submit(Chatroom::MessagePath(peer_name), [time, sender_name, peer_name, body]{
+                StoreOffline(time, sender_name, peer_name, body);
+            });
+            return;
+        }
+        InformMsg<ChatMessage> im(sock, pr);
+        im.message_.method_ = "INF";
+        im.message_.status_ = "150";
+        im.message_.version_ = VERSION;
+        im.message_.headerMap_.insert(std::make_pair("Time", time));
+        im.message_.headerMap_.insert(std::make_pair("Sender", sender_name));
+        im.message_.headerMap_.insert(std::make_pair("Receiver", peer_name));
+        im.message_.body_ = std::move(frame.body_);
+        im.message_.deflated_ = deflated;
+        im.message_.headerMap_.insert(std::make_pair("Content-Length", std::to_string(im.message_.body_.size())));
+        ThreadPool<ChatMessage, Protocol>::GetInstance()->AddMessage(std::move(im));
+    }
+    else if(frame.type_ == "GMSG"){
+        std::string time = frame.Get("Time");
+        std::string sender_name = frame.Get("Sender");
+        std::string group_name = frame.Get("Group");
+        std::vector<std::string> members;
+        Util::CutString(frame.Get("Members"), members, " ");
+        History::GetInstance()->Append(History::GroupKey(group_name), time, sender_name, frame.body_);
+        std::vector<std::string> offline_members;
+        for(auto& member : members){
+            if(member.empty()){
+                continue;
+            }
+            int sock = pc->OnlineSock(member);
+            if(sock < 0 || pc->HasGroupCursor(member, group_name)){
+                offline_members.push_back(member);
+                continue;
+            }
+            InformMsg<ChatMessage> im(sock, pr);
+            im.message_.method_ = "INF";
+            im.message_.status_ = "252";
+            im.message_.version_ = VERSION;
+            im.message_.headerMap_.insert(std::make_pair("Time", time));
+            im.message_.headerMap_.insert(std::make_pair("Sender", sender_name));
+            im.message_.headerMap_.insert(std::make_pair("Group", group_name));
+            im.message_.body_ = frame.body_;
+            im.message_.deflated_ = deflated;
+            im.message_.headerMap_.insert(std::make_pair("Content-Length", std::to_string(im.message_.body_.size())));
+            ThreadPool<ChatMessage, Protocol>::GetInstance()->AddMessage(std::move(im));
+        }
+        if(!offline_members.empty()){
+            std::string body = std::move(frame.body_);
+            DiskExecutor<ChatMessage, Protocol>::GetInstance()->Submit(Chatroom::GroupLogPath(group_name), [time, sender_name, group_name, body, offline_members]{
+                StoreGroupRecord(time, sender_name, group_name, body, offline_members);
+            });
+        }
+    }
+    else if(frame.type_ == "GRP"){
+        std::string group_name = frame.Get("Group");
+        std::vector<std::string> members;
+        Util::CutString(frame.body_, members, " ");
+        std::unordered_set<std::string> group_set;
+        for(auto& one : members){
+            if(!one.empty()){
+                group_set.insert(one);
+            }
+        }
+        pc->GroupsInsert(group_name, group_set);
+        {
+            std::vector<std::string> fields(1, group_name);
+            fields.insert(fields.end(), group_set.begin(), group_set.end());
+            Replica::GetInstance()->Append(ReplicaOp::GROUP, std::move(fields));
+        }
+
+        //通知本节点的成员，最后一个为创建者
+        if(!members.empty() && members.back().empty()){
+            members.pop_back();
+        }
+        if(!members.empty()){
+            members.pop_back();
+        }
+        for(auto& one : members){
+            if(!Cluster::GetInstance()->IsLocal(one) || !IsUserExist(one)){
+                continue;
+            }
+            int sock = pc->OnlineSock(one);
+            if(sock < 0){
+                pc->OfflineGroupInsert(one, group_name);
+                Replica::GetInstance()->Append(ReplicaOp::GROUP_NOTICE, {one, group_name});
+                continue;
+            }
+            InformMsg<ChatMessage> im(sock, pr);
+            im.message_.method_ = "INF";
+            im.message_.status_ = "250";
+            im.message_.version_ = VERSION;
+            im.message_.headerMap_.insert(std::make_pair("Group", group_name));
+            im.message_.headerMap_.insert(std::make_pair("Content-Length", "0"));
+            im.message_.headerMap_.insert(std::make_pair("Others", frame.Get("Others")));
+            ThreadPool<ChatMessage, Protocol>::GetInstance()->AddMessage(std::move(im));
+        }
+    }
+    else{
+        LOG(WARNING, std::string("Cluster: unknown frame ")+frame.type_);
+    }
+}
+
+//备机重放复制日志中的一条记录，调用和主机相同的存储函数
+//只在备机接管之前的复制线程中调用，此时还没有客户端请求，不需要经过磁盘线程
+void Protocol::ApplyReplica(const ReplicaOp& op)
+{
+    const auto& f = op.fields_;
+    Chatroom* pc = Chatroom::GetInstance();
+    switch(op.type_){
+        case ReplicaOp::USER:{
+            if(f.size() == 2){
+                pc->UsersInsert(f[0], f[1]);
+                return;
+            }
+            break;
+        }
+        case ReplicaOp::MSG:{
+            if(f.size() == 4){
+                StoreOffline(f[0], f[1], f[2], f[3]);
+                return;
+            }
+            break;
+        }
+        case ReplicaOp::GMSG:{
+            if(f.size() >= 4){
+                std::vector<std::string> members(f.begin() + 4, f.end());
+                StoreGroupRecord(f[0], f[1], f[2], f[3], members);
+                return;
+            }
+            break;
+        }
+        case ReplicaOp::READ:{
+            //只有name的是分页之前的记录，表示全部读完
+            if(f.size() == 1){
+                ClearOffline(f[0]);
+                return;
+            }
+            if(f.size() == 2){
+                std::string body;
+                int remain = 0;
+                ReadOffline(f[0], body, remain, std::atoll(f[1].c_str()), SIZE_MAX);
+                return;
+            }
+            break;
+        }
+        case ReplicaOp::GROUP:{
+            if(f.size() >= 1){
+                pc->GroupsInsert(f[0], std::unordered_set<std::string>(f.begin() + 1, f.end()));
+                return;
+            }
+            break;
+        }
+        case ReplicaOp::GROUP_NOTICE:{
+            if(f.size() == 2){
+                pc->OfflineGroupInsert(f[0], f[1]);
+                return;
+            }
+            break;
+        }
+        case ReplicaOp::GROUP_SEEN:{
+            if(f.size() == 1){
+                pc->OfflineGroupClear(f[0]);
+                return;
+            }
+            break;
+        }
+        case ReplicaOp::SUBSCRIBE:{
+            if(f.size() >= 1){
+                Presence::GetInstance()->Set(f[0], std::vector<std::string>(f.begin() + 1, f.end()));
+                return;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    LOG(WARNING, std::string("Replica: bad op, type: ")+std::to_string(op.type_));
+}
+
+//文件传输请求在磁盘线程中的key，按连接区分，多个连接并行传输时分散到不同的磁盘线程
+std::string Protocol::FileOpKey(Event<ChatMessage>& event)
+{
+    std::string key("sock:");
+    key += std::to_string(event.sock_);
+    return key;
+}
+
+//不进入任务队列，直接在当前线程返回错误响应，例如405表示请求超过限速
+//retry_ms大于0时带上Retry-After报头，单位为毫秒
+void Protocol::RejectRequest(Event<ChatMessage>& event, const std::string& status, uint32_t retry_ms)
+{
+    event.sendMessage_.version_ = VERSION;
+    event.sendMessage_.method_ = "RES";
+    event.sendMessage_.status_ = status;
+    event.sendMessage_.headerMap_.insert(std::make_pair("Content-Length", "0"));
+    if(retry_ms > 0){
+        event.sendMessage_.headerMap_.insert(std::make_pair("Retry-After", std::to_string(retry_ms)));
+    }
+    SendHandler(event);
+}
+
+//请求超过大小限制或者格式错误，返回407后关闭连接
+//连接上后面的数据已经无法确定报文边界，只能丢弃，关闭两个方向后reactor会收到挂断事件，由Errorer释放连接
+void Protocol::DropRequest(Event<ChatMessage>& event, RequestLimiter::Violation v, const std::string& reason)
+{
+    LOG(WARNING, std::string("Drop request, sock: ")+std::to_string(event.sock_)+std::string(", ")+reason);
+    RequestLimiter::GetInstance()->CountViolation(v);
+    event.deadline_ = 0;
+    {
+        std::unique_lock<std::mutex> u_mtx(event.recvMtx_);
+        event.pending_.clear();
+    }
+    event.inbuffer_.clear();
+    RejectRequest(event, "407", 0);
+    shutdown(event.sock_, SHUT_RDWR);
+}
+
+//按操作码的第一位决定任务通道: 0xx为control，3xx为bulk，其余为chat
+int Protocol::LaneOf(const std::string& status)
+{
+    if(status.empty()){
+        return LANE_CHAT;
+    }
+    if(status[0] == '0'){
+        return LANE_CONTROL;
+    }
+    if(status[0] == '3'){
+        return LANE_BULK;
+    }
+    return LANE_CHAT;
+}
+
+//将一条群聊消息写入群聊日志，offline_members为这条消息的所有离线成员
+//无论多少个成员离线，消息都只写一次
+void Protocol::StoreGroupMessage(Event<ChatMessage>& event, const std::vector<std::string>& offline_members)
+{
+    auto& header_map = event.recvMessage_.headerMap_;
+    StoreGroupRecord(header_map.at("Time"), header_map.at("User"), header_map.at("Group"), event.recvMessage_.body_, offline_members);
+}
+
+//StoreGroupMessage的实现，其他节点转发过来的群聊消息也由这里落盘
+void Protocol::StoreGroupRecord(const std::string& time, const std::string& sender_name, const std::string& group_name, const std::string& body, const std::vector<std::string>& offline_members)
+{
+    std::string record;
+    record += time;
+    record += "\n";
+    record += sender_name;
+    record += "\n";
+    record += group_name;
+    record += "\n";
+    record += std::to_string(body.size());
+    record += "\n";
+    record += body;
+
+    //先写日志并设置读游标，再增加离线消息个数，保证登录时看到的个数一定有对应的读游标
+    Chatroom::GetInstance()->GroupLogAppend(group_name, record, offline_members);
+    for(auto& member : offline_members){
+        Chatroom::GetInstance()->OfflineInsert(member, group_name);
+    }
+
+    std::vector<std::string> fields{time, sender_name, group_name, body};
+    fields.insert(fields.end(), offline_members.begin(), offline_members.end());
+    Replica::GetInstance()->Append(ReplicaOp::GMSG, std::move(fields));
+}
+
 void Protocol::UploadFile(Event<ChatMessage>& event)
 {
     auto& header_map = event.recvMessage_.headerMap_;
@@ -803,8 +1773,6 @@ void Protocol::UploadFile(Event<ChatMessage>& event)
     std::string peer_name = it_peer->second;
     std::string time = it_time->second;
     std::string file_name = it_file_name->second;
-    int file_len = std::atoi(it_content_len->second.c_str());
-    //注意，这里用int类型来接收文件大小，可能不够，为了简单先这么写
     const std::string& body = event.recvMessage_.body_;
 
     //判断是否登录
@@ -816,36 +1784,65 @@ void Protocol::UploadFile(Event<ChatMessage>& event)
         return;
     }
 
-    //创建新的文件，将文件内容写入新创建的文件
-    //需要先在./files目录下创建名称为 sender_name-receiver_name 的目录，之后在该目录中存储新创建的文件
+    //文件按内容寻址存储：内容写入./files/<sha256>，sender-peer/file_name只是指向内容的一个名字
+    //相同内容无论发给多少人都只写一次，也不需要再为每一对用户创建目录
+    std::string key = Chatroom::FileKey(sender_name, peer_name, file_name);
+    std::string legacy_path(Chatroom::FilesDir());
+    legacy_path += key;
+    if(Chatroom::GetInstance()->FileIndexFind(key).first || IsFileExist(legacy_path)){
+        //如果当前文件和之前的文件重名，则返回“文件名重复”响应报文
+        event.sendMessage_.headerMap_.at("Return") = "wrong";
+        event.sendMessage_.headerMap_.insert(std::make_pair("Wrong", "dup_file_name"));
 
-    //先创建目录
-    std::string new_dir("./files/");
-    new_dir += sender_name;
-    new_dir += "-";
-    new_dir += peer_name;
-    if(!IsFileExist(new_dir)){
-        mkdir(new_dir.c_str(), 0777); //这里默认设置权限为0777，并且为了方便起见后面代码中不删除它
+        LOG(WARNING, "Dup_file_name");
+        return;
     }
-    
-    //如果当前文件和目录中的文件重名，则返回“文件名重复”响应报文
-    std::string path(new_dir);
-    path += "/";
-    path += file_name;
-    if(IsFileExist(path)){
+
+    std::string hash = event.recvMessage_.bodyHash_.Final();
+    std::string blob_path = Chatroom::BlobPath(hash);
+    if(!IsFileExist(blob_path)){
+        //内容还不存在，先写临时文件再rename，并发上传相同内容时也不会读到写了一半的文件
+        std::string tmp_path(blob_path);
+        tmp_path += ".tmp";
+        tmp_path += std::to_string(event.sock_);
+        std::fstream fout;
+        fout.open(tmp_path, std::ios::out | std::ios::binary | std::ios::trunc);
+        fout << body;
+        fout.close();
+        if(fout.fail() || rename(tmp_path.c_str(), blob_path.c_str()) < 0){
+            unlink(tmp_path.c_str());
+            event.sendMessage_.headerMap_.at("Return") = "wrong";
+            event.sendMessage_.headerMap_.insert(std::make_pair("Wrong", "write_file"));
+
+            LOG(ERROR, std::string("Write blob error: ")+blob_path);
+            return;
+        }
+    }
+    //值得压缩的内容另存一份压缩后的，客户端本来就压缩上传时直接保存收到的正文，不再重新压缩
+    if(!IsFileExist(Chatroom::DeflatedPath(blob_path))){
+        ShareBody(event.recvMessage_);
+        const std::string* packed = (event.recvMessage_.deflated_ == nullptr) ? nullptr : event.recvMessage_.deflated_->Get(body);
+        if(packed != nullptr){
+            StoreDeflated(blob_path, *packed);
+        }
+    }
+
+    if(!Chatroom::GetInstance()->FileIndexInsert(key, hash)){
+        //并发上传同名文件，后到的返回重名
         event.sendMessage_.headerMap_.at("Return") = "wrong";
         event.sendMessage_.headerMap_.insert(std::make_pair("Wrong", "dup_file_name"));
 
         LOG(WARING, "Dup_file_name");
         return;
     }
+    LOG(INFO, std::string("Store file: ")+key+std::string(", blob: ")+hash);
 
-    //不重复，则创建该文件，并且向文件中写入内容
-    std::fstream fapp;
-    fapp.open(path, std::ios::app);
-    fapp << body;
-    fapp.close();
+    FileInform(event, sender_name, peer_name, file_name, time, it_content_len->second);
+}
 
+//文件收齐之后通知接收者，接收者不在线则记录到离线文件中
+void Protocol::FileInform(Event<ChatMessage>& event, const std::string& sender_name, const std::string& peer_name, const std::string& file_name, const std::string& time, const std::string& file_size)
+{
     //注意，为了简单起见只给一个人发送文件，如果要给多个人发，代码逻辑和群发消息完全一样
     //函数返回send_ev，在ReqHandler中循环继续处理，分别构建任务
     //这里只给一个人发，因此直接在这里建立任务即可，逻辑和创建群聊类似
@@ -861,7 +1858,6 @@ void Protocol::UploadFile(Event<ChatMessage>& event)
         im.sock_ = peer_sock;
         im.pr_ = event.pr_;
 
-        Event<ChatMessage>& send_ev = event.pr_->GetEvent(peer_sock);
 
         im.message_.method_ = "INF";
         im.message_.status_ = "320";
@@ -871,7 +1867,7 @@ void Protocol::UploadFile(Event<ChatMessage>& event)
         im.message_.headerMap_.insert(std::make_pair("Content-Length", "0"));
         im.message_.headerMap_.insert(std::make_pair("Sender", sender_name));
         im.message_.headerMap_.insert(std::make_pair("File-Name", file_name));
-        im.message_.headerMap_.insert(std::make_pair("File-Size", std::to_string(file_len)));
+        im.message_.headerMap_.insert(std::make_pair("File-Size", file_size));
         
         //加入消息队列
         ThreadPool<ChatMessage, Protocol>::GetInstance()->AddMessage(std::move(im));
@@ -912,13 +1908,17 @@ void Protocol::DownloadFile(Event<ChatMessage>& event)
     }
 
     //构建下载响应
-    //读文件
-    std::string path("./files/");
-    path += sender_name;
-    path += "-";
-    path += receiver_name;
-    path += "/";
-    path += file_name;
+    //先按文件名找到内容哈希再读内容；找不到时兼容按旧的 ./files/sender-receiver/file_name 存储的文件
+    std::string key = Chatroom::FileKey(sender_name, receiver_name, file_name);
+    std::string path;
+    auto found = Chatroom::GetInstance()->FileIndexFind(key);
+    if(found.first){
+        path = Chatroom::BlobPath(found.second);
+    }
+    else{
+        path = Chatroom::FilesDir();
+        path += key;
+    }
 
     if(!IsFileExist(path)){
         event.sendMessage_.headerMap_.insert(std::make_pair("Wrong", "no_such_file"));
@@ -927,6 +1927,14 @@ void Protocol::DownloadFile(Event<ChatMessage>& event)
         return;
     }
 
+    //支持deflate的连接直接发送保存时压缩好的副本；没有副本说明不值得压缩，发送时也不再尝试
+    event.sendMessage_.encoded_ = true;
+    std::string deflated_path = Chatroom::DeflatedPath(path);
+    if((event.accept_ & Codec::DEFLATE) != 0 && IsFileExist(deflated_path)){
+        path = deflated_path;
+        event.sendMessage_.headerMap_.insert(std::make_pair("Content-Encoding", "deflate"));
+    }
+
     std::fstream fread;
     fread.open(path, std::ios::in);
     std::stringstream ss;
@@ -939,9 +1947,320 @@ void Protocol::DownloadFile(Event<ChatMessage>& event)
     LOG(INFO, std::string("Download file, file_name: ")+file_name);
 }
 
+//分块上传：每块带有File-Size和Offset，正文即为[Offset, Offset+Content-Length)的内容
+//各块可以乱序、重复、分散在多个连接上并行发送，服务器记录已收到的区间并在响应的Ranges中返回
+//断线之后客户端发一个Content-Length为0的块即可查询已收到的区间，只补发缺少的部分
+void Protocol::UploadChunk(Event<ChatMessage>& event)
+{
+    auto& header_map = event.recvMessage_.headerMap_;
+    auto it_user = header_map.find("User");
+    auto it_peer = header_map.find("Peer");
+    auto it_time = header_map.find("Time");
+    auto it_file_name = header_map.find("File-Name");
+    auto it_file_size = header_map.find("File-Size");
+    auto it_offset = header_map.find("Offset");
+    if(it_user == header_map.end() || it_peer == header_map.end() || it_time == header_map.end() || it_file_name == header_map.end() || it_file_size == header_map.end() || it_offset == header_map.end()){
+        event.sendMessage_.status_ = "401";
+
+        LOG(WARNING, "Wrong formation");
+        return;
+    }
+
+    std::string sender_name = it_user->second;
+    std::string peer_name = it_peer->second;
+    std::string file_name = it_file_name->second;
+    uint64_t file_size = std::strtoull(it_file_size->second.c_str(), nullptr, 10);
+    uint64_t offset = std::strtoull(it_offset->second.c_str(), nullptr, 10);
+    const std::string& body = event.recvMessage_.body_;
+
+    if(!IsSignIn(sender_name)){
+        event.sendMessage_.status_ = "403";
+
+        LOG(WARNING, "Not sign in");
+        return;
+    }
+
+    static const uint64_t chunk_max = Config::GetInstance()->GetInt("file_chunk_max");
+    if(body.size() > chunk_max || offset > file_size || body.size() > file_size - offset){
+        event.sendMessage_.headerMap_.at("Return") = "wrong";
+        event.sendMessage_.headerMap_.insert(std::make_pair("Wrong", "bad_range"));
+
+        LOG(WARNING, "Bad chunk range");
+        return;
+    }
+
+    //第一块会把.part扩展到File-Size，不限制的话客户端可以让服务器建立任意大的稀疏文件
+    static const uint64_t size_max = Config::GetInstance()->GetInt("file_size_max");
+    if(file_size > size_max){
+        event.sendMessage_.headerMap_.at("Return") = "wrong";
+        event.sendMessage_.headerMap_.insert(std::make_pair("Wrong", "too_large"));
+
+        LOG(WARNING, std::string("Chunked file too large: ")+it_file_size->second);
+        return;
+    }
+
+    std::string key = Chatroom::FileKey(sender_name, peer_name, file_name);
+    if(Chatroom::GetInstance()->FileIndexFind(key).first){
+        event.sendMessage_.headerMap_.at("Return") = "wrong";
+        event.sendMessage_.headerMap_.insert(std::make_pair("Wrong", "dup_file_name"));
+
+        LOG(WARNING, "Dup_file_name");
+        return;
+    }
+
+    bool is_new = false;
+    int begin = Chatroom::GetInstance()->PartBegin(key, file_size, it_time->second, is_new);
+    if(begin == -1){
+        event.sendMessage_.headerMap_.at("Return") = "wrong";
+        event.sendMessage_.headerMap_.insert(std::make_pair("Wrong", "size_mismatch"));
+
+        LOG(WARNING, "Chunk file size mismatch");
+        return;
+    }
+    if(begin == -2){
+        //已经收齐的上传不再接收重复的块，否则会在收尾之后重新建立一个没人清理的.part
+        event.sendMessage_.headerMap_.at("Return") = "wrong";
+        event.sendMessage_.headerMap_.insert(std::make_pair("Wrong", "completed"));
+
+        LOG(WARNING, std::string("Chunk after upload completed: ")+key);
+        return;
+    }
+
+    //每块直接pwrite到最终文件的对应偏移处，多个连接并行写不同区间互不影响
+    //只有新的上传才建立文件，继续上传时.part不存在说明已经过期被清理
+    std::string part_path = Chatroom::PartPath(key);
+    int fd = open(part_path.c_str(), is_new ? (O_WRONLY | O_CREAT) : O_WRONLY, 0644);
+    if(fd < 0){
+        Chatroom::GetInstance()->PartLeave(key);
+        event.sendMessage_.headerMap_.at("Return") = "wrong";
+        event.sendMessage_.headerMap_.insert(std::make_pair("Wrong", "write_file"));
+
+        LOG(ERROR, std::string("Open part file error: ")+part_path);
+        return;
+    }
+    bool ok = true;
+    if(is_new){
+        //第一块到达时把文件扩展到最终大小，之后各块只是填洞
+        ok = (ftruncate(fd, file_size) == 0);
+    }
+    size_t written = 0;
+    while(ok && written < body.size()){
+        ssize_t n = pwrite(fd, body.data() + written, body.size() - written, offset + written);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            ok = false;
+            break;
+        }
+        written += n;
+    }
+    close(fd);
+    if(!ok){
+        Chatroom::GetInstance()->PartLeave(key);
+        event.sendMessage_.headerMap_.at("Return") = "wrong";
+        event.sendMessage_.headerMap_.insert(std::make_pair("Wrong", "write_file"));
+
+        LOG(ERROR, std::string("Write part file error: ")+part_path);
+        return;
+    }
+
+    //块写入之后才记录区间，保证记录为已收到的区间一定已经在文件中
+    std::string ranges;
+    bool complete = false;
+    Chatroom::GetInstance()->PartAddRange(key, offset, offset + body.size(), ranges, complete);
+    event.sendMessage_.headerMap_.insert(std::make_pair("Ranges", ranges));
+    if(!complete){
+        event.sendMessage_.headerMap_.insert(std::make_pair("Complete", "no"));
+        return;
+    }
+
+    //收齐之后顺序读一遍计算内容哈希，然后直接rename成blob，文件内容不再拷贝
+    //同一遍读的过程中压缩到<part>.z，开头压不下来就放弃，值得压缩时和blob一起改名为<sha256>.z
+    Sha256 h;
+    std::string deflated_part = Chatroom::DeflatedPath(part_path);
+    DeflateStream zs;
+    int zfd = -1;
+    if(Codec::GetInstance()->Wants(file_size)){
+        zfd = open(deflated_part.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    fd = open(part_path.c_str(), O_RDONLY);
+    ok = (fd >= 0);
+    if(ok){
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        std::string buffer(1 << 16, '\0');
+        std::string packed;
+        uint64_t total = 0;
+        while(true){
+            ssize_t n = read(fd, &buffer[0], buffer.size());
+            if(n < 0 && errno == EINTR){
+                continue;
+            }
+            if(n < 0){
+                ok = false;
+            }
+            if(n <= 0){
+                break;
+            }
+            h.Update(buffer.data(), n);
+            total += n;
+            if(zfd >= 0 && zs.Ok()){
+                zs.Update(buffer.data(), n, packed, total == file_size);
+                if(packed.size() >= (1 << 20) || total == file_size){
+                    if(!Util::WriteAll(zfd, packed)){
+                        close(zfd);
+                        zfd = -1;
+                    }
+                    packed.clear();
+                }
+            }
+        }
+        close(fd);
+    }
+    bool keep_deflated = false;
+    if(zfd >= 0){
+        keep_deflated = ok && zs.Ok();
+        close(zfd);
+    }
+    std::string hash = h.Final();
+    std::string blob_path = Chatroom::BlobPath(hash);
+    if(ok){
+        if(IsFileExist(blob_path)){
+            //相同内容已经存在，直接引用已有的blob
+            unlink(part_path.c_str());
+        }
+        else{
+            ok = (rename(part_path.c_str(), blob_path.c_str()) == 0);
+        }
+    }
+    bool moved = false;
+    if(ok && keep_deflated && !IsFileExist(Chatroom::DeflatedPath(blob_path))){
+        moved = (rename(deflated_part.c_str(), Chatroom::DeflatedPath(blob_path).c_str()) == 0);
+    }
+    if(!moved){
+        unlink(deflated_part.c_str());
+    }
+    //先写文件名索引再删除上传记录，中间到达的块会被PartBegin拒绝
+    bool indexed = ok && Chatroom::GetInstance()->FileIndexInsert(key, hash);
+    Chatroom::GetInstance()->PartErase(key);
+    if(!indexed){
+        unlink(part_path.c_str());
+        event.sendMessage_.headerMap_.at("Return") = "wrong";
+        event.sendMessage_.headerMap_.insert(std::make_pair("Wrong", ok ? "dup_file_name" : "write_file"));
+
+        LOG(ERROR, std::string("Finish chunked file error: ")+key);
+        return;
+    }
+    event.sendMessage_.headerMap_.insert(std::make_pair("Complete", "yes"));
+    LOG(INFO, std::string("Store chunked file: ")+key+std::string(", blob: ")+hash);
+
+    FileInform(event, sender_name, peer_name, file_name, it_time->second, std::to_string(file_size));
+}
+
+//清理空闲超过file_part_idle_s的分块上传，删除上传记录和.part文件，由服务器主循环定期交给线程池执行
+void Protocol::ExpireUploads()
+{
+    static const long long idle = Config::GetInstance()->GetInt("file_part_idle_s");
+    if(idle <= 0){
+        return;
+    }
+    std::vector<std::string> keys;
+    Chatroom::GetInstance()->PartExpire(std::chrono::seconds(idle), keys);
+    for(auto& key : keys){
+        std::string part_path = Chatroom::PartPath(key);
+        unlink(part_path.c_str());
+        unlink(Chatroom::DeflatedPath(part_path).c_str());
+        LOG(INFO, std::string("Expire idle chunked upload: ")+key);
+    }
+}
+
+//分段下载：返回文件[Offset, Offset+Length)的内容，Length缺省或过大时按配置file_chunk_max截断
+//响应的File-Size为文件总大小，客户端可以据此并行或断点续传地下载其余部分
+void Protocol::DownloadRange(Event<ChatMessage>& event)
+{
+    auto& header_map = event.recvMessage_.headerMap_;
+    auto it_user = header_map.find("User");
+    auto it_sender = header_map.find("Sender");
+    auto it_file_name = header_map.find("File-Name");
+    auto it_offset = header_map.find("Offset");
+    auto it_length = header_map.find("Length");
+    if(it_user == header_map.end() || it_sender == header_map.end() || it_file_name == header_map.end() || it_offset == header_map.end()){
+        event.sendMessage_.status_ = "401";
+
+        LOG(WARNING, "Wrong formation");
+        return;
+    }
+
+    std::string receiver_name = it_user->second;
+    if(!IsSignIn(receiver_name)){
+        event.sendMessage_.status_ = "403";
+
+        LOG(WARNING, "Not sign in");
+        return;
+    }
+
+    std::string key = Chatroom::FileKey(it_sender->second, receiver_name, it_file_name->second);
+    std::string path;
+    auto found = Chatroom::GetInstance()->FileIndexFind(key);
+    if(found.first){
+        path = Chatroom::BlobPath(found.second);
+    }
+    else{
+        path = Chatroom::FilesDir();
+        path += key;
+    }
+
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) < 0){
+        if(fd >= 0){
+            close(fd);
+        }
+        event.sendMessage_.headerMap_.insert(std::make_pair("Wrong", "no_such_file"));
+
+        LOG(WARNING, "No such file");
+        return;
+    }
+
+    uint64_t file_size = st.st_size;
+    uint64_t offset = std::strtoull(it_offset->second.c_str(), nullptr, 10);
+    static const uint64_t chunk_max = Config::GetInstance()->GetInt("file_chunk_max");
+    uint64_t length = chunk_max;
+    if(it_length != header_map.end()){
+        length = std::min(length, (uint64_t)std::strtoull(it_length->second.c_str(), nullptr, 10));
+    }
+    offset = std::min(offset, file_size);
+    length = std::min(length, file_size - offset);
+
+    std::string& body = event.sendMessage_.body_;
+    body.resize(length);
+    size_t got = 0;
+    while(got < length){
+        ssize_t n = pread(fd, &body[got], length - got, offset + got);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+    body.resize(got);
+    //分段下载不能直接使用压缩的副本，只有保存时判断为值得压缩的文件才在发送时压缩这一段
+    event.sendMessage_.encoded_ = !IsFileExist(Chatroom::DeflatedPath(path));
+
+    event.sendMessage_.headerMap_.insert(std::make_pair("File-Size", std::to_string(file_size)));
+    event.sendMessage_.headerMap_.insert(std::make_pair("Offset", std::to_string(offset)));
+    event.sendMessage_.headerMap_.at("Content-Length") = std::to_string(body.size());
+
+    LOG(INFO, std::string("Download range, file: ")+key+std::string(", offset: ")+std::to_string(offset)+std::string(", length: ")+std::to_string(got));
+}
+
 //获取和解析请求报文的初始行，报头并且获取正文
 //之后建立新的任务，加入任务队列
-void Protocol::GetPerseMessage(Event<ChatMessage>& event)
+//返回0表示报文还没收完；返回1表示报文已经交给处理任务或者连接将被关闭，解析暂停；返回2表示报文已经在当前线程中拒绝，可以继续解析后面的数据
+int Protocol::GetPerseMessage(Event<ChatMessage>& event)
 {
     //在这里进行应用层业务处理的第一步：分解报文，处理粘包问题，并构建任务，交给线程池处理
     //粘包问题的解决：
@@ -959,28 +2278,57 @@ void Protocol::GetPerseMessage(Event<ChatMessage>& event)
     //(3)读取数据时，根据header中的Content-Length字段进行判断，没有数据就不读，有数据再读
     //   有数据时，必须保证读完数据长度个字节数据，如果没读完，则退出下次继续读，这时要清理inbuffer
     
+    //(4)每一部分都有大小限制，超过限制或者格式错误时返回407并关闭连接，不再缓存后面的数据
+    //   报文从第一个字节开始计时，超过期限还没收完由reactor线程关闭连接，见Handler::ExpireRequests
+    RequestLimiter* prq = RequestLimiter::GetInstance();
+    if(event.deadline_ == 0 && !event.inbuffer_.empty()){
+        event.deadline_ = prq->Deadline();
+    }
+
     //读初始行，将初始行中\n去除
     int ret = 0;
     if(event.recvMessage_.iniLine_.size() == 0){
         ret = GetIniLine(event);
         if(ret == -1){
-            //粘包直接退出不处理
-            return;
+            //粘包直接退出不处理，但是没有\r\n的部分已经超过限制时不再等待
+            if(event.inbuffer_.size() > prq->MaxIniLine() + 2){
+                DropRequest(event, RequestLimiter::TOO_LONG, "init line too long");
+                return 1;
+            }
+            return 0;
         }
         event.inbuffer_.erase(0, ret);
+        if(event.recvMessage_.iniLine_.size() > prq->MaxIniLine()){
+            DropRequest(event, RequestLimiter::TOO_LONG, "init line too long");
+            return 1;
+        }
     }
     
     //读报头，将报头每行的\n去除
     if((event.recvMessage_.iniLine_.size() != 0) && (event.recvMessage_.blank_.size() == 0)){
+        //已经读到的报头字节数，包括每行的\r\n
+        size_t header_bytes = 0;
+        for(auto& h : event.recvMessage_.headers_){
+            header_bytes += h.size() + 2;
+        }
         while(true){
             ret = GetHeader(event);
             if(ret == -1){
                 //说明一行都没读完，直接返回
-                return;
+                if(header_bytes + event.inbuffer_.size() > prq->MaxHeaderBytes() + 2){
+                    DropRequest(event, RequestLimiter::TOO_LONG, "header too long");
+                    return 1;
+                }
+                return 0;
             }
             else if(ret >= 0){
                 //说明只读到一行，继续循环
                 event.inbuffer_.erase(0, ret);
+                header_bytes += ret;
+                if(event.recvMessage_.headers_.size() > prq->MaxHeaders() || header_bytes > prq->MaxHeaderBytes()){
+                    DropRequest(event, RequestLimiter::TOO_LONG, "too many headers");
+                    return 1;
+                }
             }
             else{
                 //说明读到空行，报头读取完毕，继续进行逻辑
@@ -994,15 +2342,53 @@ void Protocol::GetPerseMessage(Event<ChatMessage>& event)
         // ParseIniLine(event.recvMessage_);
         // ParseHeader(event.recvMessage_);
         event.recvMessage_.ParseIniLine();
-        event.recvMessage_.ParseHeader();   
+        if(event.recvMessage_.method_.empty() || event.recvMessage_.ParseHeader() < 0){
+            DropRequest(event, RequestLimiter::MALFORMED, "bad header");
+            return 1;
+        }
+        //之后这个报文的解析任务按操作码进入对应的通道，例如上传文件的正文在bulk通道中接收和计算哈希
+        int lane = LaneOf(event.recvMessage_.status_);
+        event.lane_ = lane;
+
+        //没有Content-Length时按没有正文处理，之后的处理函数都可以直接取这个报头
+        auto& header_map = event.recvMessage_.headerMap_;
+        //客户端可以在任意请求中声明能够接收的正文编码，对之后发往这个连接的所有报文有效
+        auto it_accept = header_map.find("Accept-Encoding");
+        if(it_accept != header_map.end()){
+            event.accept_ = Codec::Parse(it_accept->second);
+        }
+        auto it_len = header_map.find("Content-Length");
+        if(it_len == header_map.end()){
+            header_map.insert(std::make_pair("Content-Length", "0"));
+        }
+        else{
+            const std::string& len_str = it_len->second;
+            if(len_str.empty() || len_str.size() > 19 || len_str.find_first_not_of("0123456789") != std::string::npos){
+                DropRequest(event, RequestLimiter::MALFORMED, "bad Content-Length");
+                return 1;
+            }
+            uint64_t content_len = std::strtoull(len_str.c_str(), nullptr, 10);
+            if(content_len > prq->MaxBody(lane)){
+                DropRequest(event, RequestLimiter::TOO_LARGE, std::string("body too large: ")+len_str);
+                return 1;
+            }
+            if(event.deadline_ != 0){
+                event.deadline_ += prq->BodyExtraMs(content_len);
+            }
+        }
     }
     
     //读取正文，先判断大小，再判断是否继续读
     if((event.recvMessage_.blank_.size() != 0) && (event.recvMessage_.iniLine_.size() != 0) && (event.recvMessage_.method_.size() != 0)){  
-        int content_len = atoi(event.recvMessage_.headerMap_.at("Content-Length").c_str());
+        uint64_t content_len = std::strtoull(event.recvMessage_.headerMap_.at("Content-Length").c_str(), nullptr, 10);
         if(content_len > 0 && event.recvMessage_.body_.size() < content_len){
-            int len = content_len - event.recvMessage_.body_.size();
+            size_t len = content_len - event.recvMessage_.body_.size();
+            size_t old_size = event.recvMessage_.body_.size();
             ret = GetBody(len, event.inbuffer_, event.recvMessage_.body_);
+            if(event.recvMessage_.status_ == "310" && event.recvMessage_.headerMap_.count("Content-Encoding") == 0){
+                //上传文件的正文边收边算哈希，收完时哈希也就算完了
+                event.recvMessage_.bodyHash_.Update(event.recvMessage_.body_.data() + old_size, event.recvMessage_.body_.size() - old_size);
+            }
             if(ret == 0){
                 //读完数据，清理inbuffer
                 event.inbuffer_.erase(0, len);
@@ -1016,26 +2402,73 @@ void Protocol::GetPerseMessage(Event<ChatMessage>& event)
     }
 
     //保证上面都处理好了，再进行下一步任务
-    if((event.recvMessage_.blank_.size() != 0) && (event.recvMessage_.iniLine_.size() != 0) && (event.recvMessage_.method_.size() != 0) && (event.recvMessage_.body_.size() == atoi(event.recvMessage_.headerMap_.at("Content-Length").c_str()))){ 
+    if((event.recvMessage_.blank_.size() != 0) && (event.recvMessage_.iniLine_.size() != 0) && (event.recvMessage_.method_.size() != 0) && (event.recvMessage_.body_.size() == std::strtoull(event.recvMessage_.headerMap_.at("Content-Length").c_str(), nullptr, 10))){ 
         //如果收到Req报文，构建ReqHandler任务；如果收到Res报文，构建ResHandler任务
         //将任务push到任务队列中，再退出
+        event.deadline_ = 0;
+        if(DecodeBody(event) < 0){
+            //报文边界没有问题，只拒绝这一个请求
+            LOG(WARNING, std::string("Bad Content-Encoding, sock: ")+std::to_string(event.sock_));
+            RejectRequest(event, "401", 0);
+            return 2;
+        }
         if(event.recvMessage_.method_ == "REQ"){
+            int lane = LaneOf(event.recvMessage_.status_);
+            if(lane != LANE_CONTROL && ThreadPool<ChatMessage, Protocol>::GetInstance()->IsOverloaded()){
+                //过载时只接受注册登录退出，其他请求直接返回406，客户端过一个CoDel周期后重试
+                static const uint32_t retry_ms = Config::GetInstance()->GetInt("codel_interval_ms");
+                ThreadPool<ChatMessage, Protocol>::GetInstance()->CountShed(false);
+                RejectRequest(event, "406", retry_ms);
+                return 2;
+            }
+            if(lane == LANE_CHAT){
+                //聊天请求先检查连接和用户的令牌桶，超过限速直接返回405
+                //用户桶按这个连接登录的用户计，不信任请求中的User头部，否则可以冒用别人的名字耗尽别人的令牌
+                std::string user = Chatroom::GetInstance()->SockUser(event.sock_);
+                if(user == SIGN_UP_NAME){
+                    //只注册过的连接没有登录用户，只受连接的令牌桶限制
+                    user.clear();
+                }
+                uint32_t retry_ms = 0;
+                if(!RateLimiter::GetInstance()->Allow(event.bucket_, user, retry_ms)){
+                    LOG(INFO, std::string("Rate limited, sock: ")+std::to_string(event.sock_)+std::string(", user: ")+user);
+                    RejectRequest(event, "405", retry_ms);
+                    return 2;
+                }
+            }
+            //交给处理任务之后不能再访问event，处理任务发出响应时可能已经开始解析下一个请求
+            {
+                std::unique_lock<std::mutex> u_mtx(event.recvMtx_);
+                event.handling_ = true;
+            }
+            event.pr_->Hold(event);
             Task task([&event]{
                 ReqHandler(event);
+                event.pr_->Release(event);
             });
-            ThreadPool<ChatMessage, Protocol>::GetInstance()->AddTask(task);
+            ThreadPool<ChatMessage, Protocol>::GetInstance()->AddTaskTo(lane, task);
+            return 1;
         }
         else if(event.recvMessage_.method_ == "RES"){
+            {
+                std::unique_lock<std::mutex> u_mtx(event.recvMtx_);
+                event.handling_ = true;
+            }
+            event.pr_->Hold(event);
             Task task([&event]{
                 ResHandler(event);
+                event.pr_->Release(event);
             });
             ThreadPool<ChatMessage, Protocol>::GetInstance()->AddTask(task);        
+            return 1;
         }
         else{
-            LOG(ERROR, "Wrong method");
-            //差错处理，返回错误报文
+            //差错处理，无法确定后面报文的边界，返回407并关闭连接
+            DropRequest(event, RequestLimiter::MALFORMED, "wrong method");
+            return 1;
         }
     }
+    return 0;
 }
 
 
@@ -1049,10 +2482,21 @@ void Protocol::ReqHandler(Event<ChatMessage>& event)
     event.sendMessage_.headerMap_.insert(std::make_pair("Content-Length", "0"));
 
     auto& status = event.recvMessage_.status_;
+    //响应和本请求在同一个通道发送
+    int lane = LaneOf(status);
+    //本次请求需要的阻塞文件操作，first为操作的key，相同key的操作在同一个磁盘线程上按顺序执行
+    std::vector<std::pair<std::string, Task>> disk_ops;
     switch(status[0]){
         //基础管理功能
         case '0':{
-            if(status == "010"){
+            auto it_owner = event.recvMessage_.headerMap_.find("User");
+            if(it_owner != event.recvMessage_.headerMap_.end() && !Cluster::GetInstance()->IsLocal(it_owner->second)){
+                //集群模式下用户只能在所属节点注册和登录，返回408并告诉客户端所属节点的地址
+                event.sendMessage_.method_ = "RES";
+                event.sendMessage_.status_ = "408";
+                event.sendMessage_.headerMap_.insert(std::make_pair("Node", Cluster::GetInstance()->Address(Cluster::GetInstance()->OwnerOf(it_owner->second))));
+            }
+            else if(status == "010"){
                 //申请注册
                 event.sendMessage_.method_ = "RES";
                 event.sendMessage_.status_ = "011";
@@ -1065,7 +2509,12 @@ void Protocol::ReqHandler(Event<ChatMessage>& event)
                 event.sendMessage_.method_ = "RES";
                 event.sendMessage_.status_ = "021";
                 event.sendMessage_.headerMap_.insert(std::make_pair("Return", "right"));
-                SignIn(event);
+                //登录要读取并清空离线消息文件，和写入该用户离线消息的操作使用同一个key，保证先写完再读
+                auto it_user = event.recvMessage_.headerMap_.find("User");
+                std::string name = (it_user == event.recvMessage_.headerMap_.end()) ? std::string() : it_user->second;
+                disk_ops.emplace_back(Chatroom::MessagePath(name), [&event]{
+                    SignIn(event);
+                });
             }
             else if(status == "030"){
                 //用户退出
@@ -1074,16 +2523,34 @@ void Protocol::ReqHandler(Event<ChatMessage>& event)
                 event.sendMessage_.headerMap_.insert(std::make_pair("Return", "right"));
                 SignOut(event);
             }
+            else if(status == "050"){
+                //分页读取离线消息，和写入该用户离线消息的操作使用同一个key
+                event.sendMessage_.method_ = "RES";
+                event.sendMessage_.status_ = "051";
+                auto it_user = event.recvMessage_.headerMap_.find("User");
+                std::string name = (it_user == event.recvMessage_.headerMap_.end()) ? std::string() : it_user->second;
+                disk_ops.emplace_back(Chatroom::MessagePath(name), [&event]{
+                    PullOffline(event);
+                });
+            }
+            else if(status == "040"){
+                //订阅在线状态
+                event.sendMessage_.method_ = "RES";
+                event.sendMessage_.status_ = "041";
+                event.sendMessage_.headerMap_.insert(std::make_pair("Return", "right"));
+                Subscribe(event);
+            }
             else{
                 event.sendMessage_.method_ = "RES";
                 event.sendMessage_.status_ = "401";
             }
 
-            //建立发送Res报文任务并加入任务队列
-            Task task([&event]{
+            //文件操作交给磁盘线程，全部完成之后再发送响应；没有文件操作时直接发送
+            event.pr_->Hold(event);
+            DiskExecutor<ChatMessage, Protocol>::GetInstance()->Submit(std::move(disk_ops), [&event]{
                 SendHandler(event);
-            });
-            ThreadPool<ChatMessage, Protocol>::GetInstance()->AddTask(task);
+                event.pr_->Release(event);
+            }, lane);
             break;
         }
         //消息相关
@@ -1096,26 +2563,78 @@ void Protocol::ReqHandler(Event<ChatMessage>& event)
                 int ret = MessageHandler(event, v_peers);
                 if(ret == 0){
                     //直接发送一个或多个通知报文转发消息
+                    auto& header_map = event.recvMessage_.headerMap_;
+                    ShareBody(event.recvMessage_);
                     int size = v_peers.size();
                     for(int i = 0;i < size;i++){
+                        //每个peer是一个单聊会话，先记入历史，只修改内存
+                        History::GetInstance()->Append(History::PairKey(header_map.at("User"), v_peers[i]), header_map.at("Time"), header_map.at("User"), event.recvMessage_.body_);
                         //多个peer，就转发多次
+                        if(!Cluster::GetInstance()->IsLocal(v_peers[i])){
+                            //属于其他节点的peer交给所属节点通知或者写离线消息
+                            RelayRemote(event, v_peers[i]);
+                            continue;
+                        }
                         int is_offline;
                         InformMsg<ChatMessage> im = SendMessage(event, v_peers[i], is_offline);
                         if(is_offline == 0){
                             ThreadPool<ChatMessage, Protocol>::GetInstance()->AddMessage(std::move(im));
                         }
+                        else{
+                            //离线消息写入该peer自己的文件
+                            std::string peer = v_peers[i];
+                            disk_ops.emplace_back(Chatroom::MessagePath(peer), [&event, peer]{
+                                StoreMessage(event, peer);
+                            });
+                        }
                     }
                 }
             }
+            else if(status == "120"){
+                //查询会话历史，读文件和解压在磁盘线程中执行
+                event.sendMessage_.method_ = "RES";
+                auto it_user = event.recvMessage_.headerMap_.find("User");
+                if(it_user == event.recvMessage_.headerMap_.end()){
+                    //缺少User直接返回401，不能用[]插入一个空的User再交给磁盘线程
+                    event.sendMessage_.status_ = "401";
+
+                    LOG(WARNING, "Wrong formation");
+                }
+                else{
+                    event.sendMessage_.status_ = "121";
+                    event.sendMessage_.headerMap_.insert(std::make_pair("Return", "right"));
+                    disk_ops.emplace_back(std::string("history:")+it_user->second, [&event]{
+                        QueryHistory(event);
+                    });
+                }
+            }
+            else if(status == "130"){
+                //全文搜索，读索引和历史都在磁盘线程中执行
+                event.sendMessage_.method_ = "RES";
+                auto it_user = event.recvMessage_.headerMap_.find("User");
+                if(it_user == event.recvMessage_.headerMap_.end()){
+                    event.sendMessage_.status_ = "401";
+
+                    LOG(WARNING, "Wrong formation");
+                }
+                else{
+                    event.sendMessage_.status_ = "131";
+                    event.sendMessage_.headerMap_.insert(std::make_pair("Return", "right"));
+                    disk_ops.emplace_back(std::string("history:")+it_user->second, [&event]{
+                        SearchMessages(event);
+                    });
+                }
+            }
             else{
                 event.sendMessage_.method_ = "RES";
                 event.sendMessage_.status_ = "401";
             }
-            //无论什么情况，都要发送响应
-            Task task([&event]{
+            //文件操作交给磁盘线程，全部完成之后再发送响应；没有文件操作时直接发送
+            event.pr_->Hold(event);
+            DiskExecutor<ChatMessage, Protocol>::GetInstance()->Submit(std::move(disk_ops), [&event]{
                 SendHandler(event);
-            });
-            ThreadPool<ChatMessage, Protocol>::GetInstance()->AddTask(task);
+                event.pr_->Release(event);
+            }, lane);
             break;
         }
         //群聊相关
@@ -1133,15 +2652,44 @@ void Protocol::ReqHandler(Event<ChatMessage>& event)
                 std::vector<std::string> v_members;
                 int ret = GroupMessageHandler(event, v_members);
                 if(ret == 0){
+                    //整个群聊是一个会话，历史只记一份
+                    auto& header_map = event.recvMessage_.headerMap_;
+                    ShareBody(event.recvMessage_);
+                    History::GetInstance()->Append(History::GroupKey(header_map.at("Group")), header_map.at("Time"), header_map.at("User"), event.recvMessage_.body_);
                     //直接发送一个或多个通知报文转发消息
+                    std::vector<std::string> offline_members;
+                    std::map<int, std::string> remote_members; //其他节点的成员，按所属节点合并成一帧
                     int size = v_members.size();
                     for(int i = 0;i < size;i++){
                         //多个组员，就转发多次
+                        int owner = Cluster::GetInstance()->OwnerOf(v_members[i]);
+                        if(owner != Cluster::GetInstance()->Self()){
+                            remote_members[owner] += v_members[i];
+                            remote_members[owner] += ' ';
+                            continue;
+                        }
+                        if(Chatroom::GetInstance()->HasGroupCursor(v_members[i], event.recvMessage_.headerMap_.at("Group"))){
+                            //还在分页读该群聊离线消息的成员，新消息也写入群聊日志，读出时顺序不乱
+                            offline_members.push_back(v_members[i]);
+                            continue;
+                        }
                         int is_offline;
                         InformMsg<ChatMessage> im = SendGroupMessage(event, v_members[i], is_offline);
                         if(is_offline == 0){
                             ThreadPool<ChatMessage, Protocol>::GetInstance()->AddMessage(std::move(im));
                         }
+                        else{
+                            offline_members.push_back(v_members[i]);
+                        }
+                    }
+                    for(auto& rm : remote_members){
+                        RelayRemoteGroup(event, rm.first, rm.second);
+                    }
+                    //所有离线成员共用群聊日志中的一份
+                    if(!offline_members.empty()){
+                        disk_ops.emplace_back(Chatroom::GroupLogPath(event.recvMessage_.headerMap_.at("Group")), [&event, offline_members]{
+                            StoreGroupMessage(event, offline_members);
+                        });
                     }
                 }                
             }
@@ -1150,10 +2698,12 @@ void Protocol::ReqHandler(Event<ChatMessage>& event)
                 event.sendMessage_.status_ = "401";             
             }
 
-            Task task([&event]{
+            //文件操作交给磁盘线程，全部完成之后再发送响应；没有文件操作时直接发送
+            event.pr_->Hold(event);
+            DiskExecutor<ChatMessage, Protocol>::GetInstance()->Submit(std::move(disk_ops), [&event]{
                 SendHandler(event);
-            });
-            ThreadPool<ChatMessage, Protocol>::GetInstance()->AddTask(task);   
+                event.pr_->Release(event);
+            }, lane);
             break;
         }
         //文件相关
@@ -1163,22 +2713,45 @@ void Protocol::ReqHandler(Event<ChatMessage>& event)
                 event.sendMessage_.method_ = "RES";
                 event.sendMessage_.status_ = "311";
                 event.sendMessage_.headerMap_.insert(std::make_pair("Return", "right"));
-                UploadFile(event);
+                disk_ops.emplace_back(FileOpKey(event), [&event]{
+                    UploadFile(event);
+                });
             }
             else if(status == "330"){
                 //接收文件请求
                 event.sendMessage_.method_ = "RES";
                 event.sendMessage_.status_ = "331";
-                DownloadFile(event);
+                disk_ops.emplace_back(FileOpKey(event), [&event]{
+                    DownloadFile(event);
+                });
+            }
+            else if(status == "340"){
+                //分块上传文件请求
+                event.sendMessage_.method_ = "RES";
+                event.sendMessage_.status_ = "341";
+                event.sendMessage_.headerMap_.insert(std::make_pair("Return", "right"));
+                disk_ops.emplace_back(FileOpKey(event), [&event]{
+                    UploadChunk(event);
+                });
+            }
+            else if(status == "350"){
+                //分段下载文件请求
+                event.sendMessage_.method_ = "RES";
+                event.sendMessage_.status_ = "351";
+                disk_ops.emplace_back(FileOpKey(event), [&event]{
+                    DownloadRange(event);
+                });
             }
             else{
                 event.sendMessage_.method_ = "RES";
                 event.sendMessage_.status_ = "401";
             }
-            Task task([&event]{
+            //文件操作交给磁盘线程，全部完成之后再发送响应；没有文件操作时直接发送
+            event.pr_->Hold(event);
+            DiskExecutor<ChatMessage, Protocol>::GetInstance()->Submit(std::move(disk_ops), [&event]{
                 SendHandler(event);
-            });
-            ThreadPool<ChatMessage, Protocol>::GetInstance()->AddTask(task);
+                event.pr_->Release(event);
+            }, lane);
             break;
         }
         default:{
@@ -1195,6 +2768,7 @@ void Protocol::ResHandler(Event<ChatMessage>& event)
 
     ClearEvent(event);
     LOG(INFO, "ResHandler");
+    Handler::Resume(event);
 }
 
 
@@ -1202,20 +2776,65 @@ void Protocol::SendHandler(Event<ChatMessage>& event)
 {
     LOG(INFO, "Send response");
 
-    //构建响应报文
-    BuildMessage(event);
-
-    //发送响应报文，只需要将内容放入outbuffer，并且设置写使能即可
-    event.outbuffer_ += event.sendMessage_.iniLine_;
+    //构建响应报文，先算出总长度，拼接时只分配一次
+    EncodeBody(event, event.sendMessage_);
+    BuildMessage(event.sendMessage_);
+    size_t frame_size = event.sendMessage_.iniLine_.size() + event.sendMessage_.blank_.size() + event.sendMessage_.body_.size();
     for(auto& s : event.sendMessage_.headers_){
-        event.outbuffer_ += s;
+        frame_size += s.size();
     }
-    event.outbuffer_ += event.sendMessage_.blank_;
-    event.outbuffer_ += event.sendMessage_.body_;
-
-    (event.pr_)->EnableReadWrite(event.sock_, true, true);
+    std::string frame;
+    frame.reserve(frame_size);
+    frame += event.sendMessage_.iniLine_;
+    for(auto& s : event.sendMessage_.headers_){
+        frame += s;
+    }
+    frame += event.sendMessage_.blank_;
+    frame += event.sendMessage_.body_;
 
     //清除event内容，只留下outbuffer，其内容会在发送时清除
-    //保证等到下一次接收时，event除了sock_和pr_，其他都是空的
+    //保证等到解析下一个请求时，event除了sock_、pr_和inbuffer_，其他都是空的
+    //调用者都持有event的引用，响应发出后对端关闭连接，event也要等引用释放后才删除
     ClearEvent(event);
+
+    //发送响应报文，先在当前线程直接发送，没发完的部分放入outbuffer并设置写使能
+    std::vector<std::string> frames(1, std::move(frame));
+    Handler::SendFrames(event, frames);
+
+    //响应已经放入发送顺序中，可以开始解析同一连接上的下一个请求
+    Handler::Resume(event);
+}
+
+//批量发送通知报文，msgs为同一个连接上所有待发送的通知
+//所有报文合并成一次writev，能直接发完就不需要再使能写事件
+void Protocol::SendBatchHandler(Event<ChatMessage>& event, std::vector<ChatMessage>& msgs)
+{
+    LOG(INFO, std::string("Send informing messages: ")+std::to_string(msgs.size()));
+
+    //报文在每个线程一份的frames中拼接，发送之后清空，字符串的容量留给下一批
+    thread_local std::vector<std::string> frames;
+    frames.resize(msgs.size());
+    for(size_t i = 0;i < msgs.size();i++){
+        ChatMessage& msg = msgs[i];
+        EncodeBody(event, msg);
+        BuildMessage(msg);
+        std::string& frame = frames[i];
+        frame += msg.iniLine_;
+        for(auto& s : msg.headers_){
+            frame += s;
+        }
+        frame += msg.blank_;
+        frame += msg.body_;
+    }
+
+    int ret = Handler::SendFrames(event, frames, true);
+    for(auto& frame : frames){
+        frame.clear();
+        MemUsage::Trim(frame);
+    }
+    if(ret == 1){
+        //已经全部发完，连接不再被占用
+        ThreadPool<ChatMessage, Protocol>::GetInstance()->SetCurrSockFalse(event.sock_);
+    }
+    //ret == 0时等写事件就绪由Sender发送剩下的部分，ret == -1时由reactor检测到异常后关闭连接
 }
\ No newline at end of file
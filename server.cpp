@@ -1,9 +1,22 @@
 #include "ChatroomServer.hpp"
+#include "Config.hpp"
+#include <cstring>
 
-int main()
+int main(int argc, char* argv[])
 {
-    ChatroomServer* p = new ChatroomServer(8081);
+    //先读取配置文件和命令行中的 --key=value，之后所有模块都从Config中取配置
+    Config::GetInstance()->Init(argc, argv);
+
+    //./server --upgrade 表示热升级启动，从正在运行的旧进程接收连接
+    bool upgrade = false;
+    for(int i = 1;i < argc;i++){
+        if(strcmp(argv[i], "--upgrade") == 0){
+            upgrade = true;
+        }
+    }
+
+    ChatroomServer* p = new ChatroomServer(Config::GetInstance()->GetInt("port"), upgrade);
     p->Loop();
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,6 +1,8 @@
 #include "TCPServer.hpp"
 #include "ThreadPool.hpp"
 #include "Protocol.hpp"
+#include "ChatroomServer.hpp"
+#include "DiskIO.hpp"
 
 TcpServer* TcpServer::pt_ = nullptr;
 
@@ -8,4 +10,31 @@ template<>
 ThreadPool<ChatMessage, Protocol>* ThreadPool<ChatMessage, Protocol>::ptp_ = nullptr;
 //注意语法，这里的定义是显示定义，<>中直接放类型，前面还要加template<>
 
-Chatroom* Chatroom::pc_ = nullptr;
\ No newline at end of file
+template<>
+DiskExecutor<ChatMessage, Protocol>* DiskExecutor<ChatMessage, Protocol>::pde_ = nullptr;
+
+Chatroom* Chatroom::pc_ = nullptr;
+
+Config* Config::pc_ = nullptr;
+
+RateLimiter* RateLimiter::prl_ = nullptr;
+
+RequestLimiter* RequestLimiter::prq_ = nullptr;
+
+Cluster* Cluster::pcl_ = nullptr;
+
+Replica* Replica::prp_ = nullptr;
+
+Presence* Presence::ppr_ = nullptr;
+
+History* History::phs_ = nullptr;
+
+Search* Search::psr_ = nullptr;
+
+Codec* Codec::pcd_ = nullptr;
+
+volatile sig_atomic_t ChatroomServer::stop_ = 0;
+volatile sig_atomic_t ChatroomServer::handoff_ = 0;
+volatile sig_atomic_t ChatroomServer::reload_ = 0;
+volatile sig_atomic_t ChatroomServer::dump_ = 0;
+std::atomic<bool> ChatroomServer::saving_(false);